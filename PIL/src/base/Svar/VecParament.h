@@ -52,7 +52,7 @@ public:
             iss>>x;
             push_back(x);
         }
-
+        return true;
     }
 
     std::string toString()
@@ -0,0 +1,226 @@
+#ifndef BLOCKINGQUEUE_H
+#define BLOCKINGQUEUE_H
+
+#include <deque>
+#include <sys/time.h>
+#include <pthread.h>
+
+namespace pi {
+
+/** A bounded queue for one or more producers and consumers.
+
+    Consumers sleep on a condition variable and are woken up as soon as an
+    item is pushed, instead of polling. What happens when a producer pushes
+    into a full queue is decided by the policy:
+
+    - Block            the producer waits until there is room
+    - DropOldest       the oldest item is dropped (lowest latency)
+    - DropNewest       the pushed item is dropped
+    - KeyFramePriority the oldest item not flagged as key is dropped, a
+                       non-key item is dropped itself when all queued items
+                       are keys, a key item waits until there is room
+
+    Every item lost because of the policy is counted by dropped().
+*/
+template <typename T>
+class BlockingQueue
+{
+public:
+    enum Policy{Block=0,DropOldest=1,DropNewest=2,KeyFramePriority=3};
+
+    BlockingQueue(size_t capacity=20,Policy policy=DropOldest)
+        :_capacity(capacity?capacity:1),_policy(policy),_closed(false),
+          _dropped(0),_droppedKeys(0)
+    {
+        pthread_mutex_init(&_mutex,NULL);
+        pthread_cond_init(&_notEmpty,NULL);
+        pthread_cond_init(&_notFull,NULL);
+    }
+
+    ~BlockingQueue()
+    {
+        close();
+        pthread_cond_destroy(&_notFull);
+        pthread_cond_destroy(&_notEmpty);
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    void setCapacity(size_t capacity)
+    {
+        Lock lock(this);
+        _capacity=capacity?capacity:1;
+        pthread_cond_broadcast(&_notFull);
+    }
+
+    void setPolicy(Policy policy)
+    {
+        Lock lock(this);
+        _policy=policy;
+        pthread_cond_broadcast(&_notFull);
+    }
+
+    /// Return false if the item was dropped or the queue is closed
+    bool push(const T& item,bool key=false)
+    {
+        Lock lock(this);
+        while(!_closed&&_items.size()>=_capacity)
+        {
+            if(_policy==DropOldest)
+            {
+                dropAt(0);
+            }
+            else if(_policy==DropNewest)
+            {
+                _dropped++;
+                if(key) _droppedKeys++;
+                return false;
+            }
+            else if(_policy==KeyFramePriority)
+            {
+                size_t i=0;
+                while(i<_keys.size()&&_keys[i]) i++;
+                if(i<_keys.size()) dropAt(i);
+                else if(!key)
+                {
+                    _dropped++;
+                    return false;
+                }
+                else pthread_cond_wait(&_notFull,&_mutex);
+            }
+            else pthread_cond_wait(&_notFull,&_mutex);
+        }
+        if(_closed) return false;
+
+        _items.push_back(item);
+        _keys.push_back(key);
+        pthread_cond_signal(&_notEmpty);
+        return true;
+    }
+
+    /// Wait at most timeoutMs (forever if <0) for an item, false if none
+    bool pop(T& item,int timeoutMs=-1)
+    {
+        Lock lock(this);
+        if(!waitNotEmpty(timeoutMs)) return false;
+
+        item=_items.front();
+        _items.pop_front();
+        _keys.pop_front();
+        pthread_cond_signal(&_notFull);
+        return true;
+    }
+
+    /// Take all queued items at once, waits like pop()
+    bool popAll(std::deque<T>& items,int timeoutMs=-1)
+    {
+        Lock lock(this);
+        if(!waitNotEmpty(timeoutMs)) return false;
+
+        items.swap(_items);
+        _items.clear();
+        _keys.clear();
+        pthread_cond_broadcast(&_notFull);
+        return true;
+    }
+
+    /// Replace the content, ignores the capacity and the policy
+    void reset(const std::deque<T>& items)
+    {
+        Lock lock(this);
+        _items=items;
+        _keys.assign(items.size(),true);
+        _closed=false;
+        pthread_cond_broadcast(&_notEmpty);
+        pthread_cond_broadcast(&_notFull);
+    }
+
+    void clear()
+    {
+        Lock lock(this);
+        _items.clear();
+        _keys.clear();
+        pthread_cond_broadcast(&_notFull);
+    }
+
+    /// Wake up and reject everyone blocked on the queue, items left can still be popped
+    void close()
+    {
+        Lock lock(this);
+        _closed=true;
+        pthread_cond_broadcast(&_notEmpty);
+        pthread_cond_broadcast(&_notFull);
+    }
+
+    /// A copy of the queued items
+    std::deque<T> items()
+    {
+        Lock lock(this);
+        return _items;
+    }
+
+    size_t size()
+    {
+        Lock lock(this);
+        return _items.size();
+    }
+
+    size_t capacity()    {Lock lock(this);return _capacity;}
+    Policy policy()      {Lock lock(this);return _policy;}
+    bool   closed()      {Lock lock(this);return _closed;}
+    size_t dropped()     {Lock lock(this);return _dropped;}
+    size_t droppedKeys() {Lock lock(this);return _droppedKeys;}
+
+private:
+    BlockingQueue(const BlockingQueue&);
+    BlockingQueue& operator=(const BlockingQueue&);
+
+    struct Lock
+    {
+        Lock(BlockingQueue* q):_q(q){pthread_mutex_lock(&_q->_mutex);}
+        ~Lock(){pthread_mutex_unlock(&_q->_mutex);}
+        BlockingQueue* _q;
+    };
+
+    void dropAt(size_t i)
+    {
+        _dropped++;
+        if(_keys[i]) _droppedKeys++;
+        _items.erase(_items.begin()+i);
+        _keys.erase(_keys.begin()+i);
+    }
+
+    // called locked
+    bool waitNotEmpty(int timeoutMs)
+    {
+        if(timeoutMs<0)
+        {
+            while(_items.empty()&&!_closed)
+                pthread_cond_wait(&_notEmpty,&_mutex);
+        }
+        else if(_items.empty()&&!_closed&&timeoutMs>0)
+        {
+            struct timeval  now;
+            struct timespec deadline;
+            gettimeofday(&now,NULL);
+            long long ns=(now.tv_usec+(long long)timeoutMs*1000)*1000;
+            deadline.tv_sec =now.tv_sec+ns/1000000000;
+            deadline.tv_nsec=ns%1000000000;
+            while(_items.empty()&&!_closed)
+                if(pthread_cond_timedwait(&_notEmpty,&_mutex,&deadline)!=0) break;
+        }
+        return !_items.empty();
+    }
+
+    std::deque<T>    _items;
+    std::deque<bool> _keys;
+    size_t           _capacity;
+    Policy           _policy;
+    bool             _closed;
+    size_t           _dropped,_droppedKeys;
+    pthread_mutex_t  _mutex;
+    pthread_cond_t   _notEmpty,_notFull;
+};
+
+} // end of namespace pi
+
+#endif // BLOCKINGQUEUE_H
@@ -0,0 +1,128 @@
+#include <unistd.h>
+
+#include "ThreadBase.h"
+#include "ThreadPool.h"
+
+namespace pi {
+
+static __thread bool t_inPoolTask=false;
+
+class ThreadPool::Worker:public Thread
+{
+public:
+    Worker(ThreadPool* pool):_pool(pool){}
+    virtual void run(){_pool->workerLoop();}
+
+private:
+    ThreadPool* _pool;
+};
+
+ThreadPool::ThreadPool(int threads)
+    :_job(NULL),_generation(0),_active(0),_stop(false)
+{
+    pthread_mutex_init(&_mutex,NULL);
+    pthread_mutex_init(&_jobMutex,NULL);
+    pthread_cond_init(&_jobReady,NULL);
+    pthread_cond_init(&_jobDone,NULL);
+
+    if(threads<=0) threads=processorNum();
+    for(int i=1;i<threads;i++)
+    {
+        Worker* worker=new Worker(this);
+        _workers.push_back(worker);
+        worker->start();
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock(&_mutex);
+    _stop=true;
+    pthread_cond_broadcast(&_jobReady);
+    pthread_mutex_unlock(&_mutex);
+
+    for(size_t i=0;i<_workers.size();i++)
+    {
+        _workers[i]->join();
+        delete _workers[i];
+    }
+
+    pthread_cond_destroy(&_jobDone);
+    pthread_cond_destroy(&_jobReady);
+    pthread_mutex_destroy(&_jobMutex);
+    pthread_mutex_destroy(&_mutex);
+}
+
+int ThreadPool::processorNum()
+{
+    long num=sysconf(_SC_NPROCESSORS_ONLN);
+    return num>0?num:1;
+}
+
+void ThreadPool::work(Job* job)
+{
+    bool inPoolTask=t_inPoolTask;
+    t_inPoolTask=true;
+    for(int i=__sync_fetch_and_add(&job->next,1);i<job->n;
+        i=__sync_fetch_and_add(&job->next,1))
+        job->task->run(i);
+    t_inPoolTask=inPoolTask;
+}
+
+void ThreadPool::parallelFor(int n,ParallelTask& task)
+{
+    if(n<=0) return;
+    if(n==1||_workers.empty()||t_inPoolTask)
+    {
+        for(int i=0;i<n;i++) task.run(i);
+        return;
+    }
+
+    pthread_mutex_lock(&_jobMutex);// one loop at a time
+
+    Job job;
+    job.task=&task;
+    job.n   =n;
+    job.next=0;
+
+    pthread_mutex_lock(&_mutex);
+    _job=&job;
+    _generation++;
+    pthread_cond_broadcast(&_jobReady);
+    pthread_mutex_unlock(&_mutex);
+
+    work(&job);
+
+    // every index is taken, wait the workers still running one
+    pthread_mutex_lock(&_mutex);
+    _job=NULL;
+    while(_active) pthread_cond_wait(&_jobDone,&_mutex);
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_mutex_unlock(&_jobMutex);
+}
+
+void ThreadPool::workerLoop()
+{
+    int generation=0;
+    pthread_mutex_lock(&_mutex);
+    while(true)
+    {
+        while(!_stop&&generation==_generation)
+            pthread_cond_wait(&_jobReady,&_mutex);
+        if(_stop) break;
+
+        generation=_generation;
+        Job* job=_job;
+        if(!job) continue;// woke up too late, already finished
+
+        _active++;
+        pthread_mutex_unlock(&_mutex);
+        work(job);
+        pthread_mutex_lock(&_mutex);
+        if(--_active==0) pthread_cond_signal(&_jobDone);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+} // end of namespace pi
@@ -0,0 +1,76 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <pthread.h>
+
+namespace pi {
+
+class Thread;
+
+/// Work item of ThreadPool::parallelFor, run(i) is called once for every index
+class ParallelTask
+{
+public:
+    virtual ~ParallelTask(){}
+    virtual void run(int i)=0;
+};
+
+/** A fixed set of worker threads for fork-join loops.
+
+    parallelFor() hands the indices [0,n) out one by one to the workers and the
+    calling thread, and returns when all of them are done:
+
+        struct ApplyTask:public pi::ParallelTask
+        {
+            virtual void run(int i){...tile i...}
+        };
+        ApplyTask task;
+        pool.parallelFor(tiles,task);
+
+    Loops of different callers are run one after another. A parallelFor called
+    from inside a task runs serially in the calling worker.
+*/
+class ThreadPool
+{
+public:
+    /// threads<=0 uses one thread per online processor, the caller included
+    ThreadPool(int threads=0);
+    ~ThreadPool();
+
+    /// Threads working on a loop, the caller included
+    int  threads()const{return _workers.size()+1;}
+
+    void parallelFor(int n,ParallelTask& task);
+
+    /// Number of online processors
+    static int processorNum();
+
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    struct Job
+    {
+        ParallelTask* task;
+        int           n;
+        volatile int  next;
+    };
+
+    class Worker;
+    friend class Worker;
+
+    void workerLoop();
+    static void work(Job* job);
+
+    std::vector<Worker*> _workers;
+    Job*                 _job;
+    int                  _generation,_active;
+    bool                 _stop;
+    pthread_mutex_t      _mutex,_jobMutex;
+    pthread_cond_t       _jobReady,_jobDone;
+};
+
+} // end of namespace pi
+
+#endif // THREADPOOL_H
@@ -0,0 +1,370 @@
+#include <time.h>
+#include <string.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include "../Svar/Svar_Inc.h"
+#include "../system/thread/ThreadBase.h"
+#include "Profiler.h"
+
+namespace pi {
+
+using namespace std;
+
+std::string unitsFormat(const double val,int nDecimalDigits, bool middle_space);
+
+////////////////////////////////////////////////////////////////////////////////
+/// Histogram with 16 linear buckets per power of two of nanoseconds
+////////////////////////////////////////////////////////////////////////////////
+
+struct Profiler::Histogram
+{
+    Histogram(){clear();}
+    void clear(){memset(this,0,sizeof(Histogram));}
+
+    static inline int index(uint64_t ns)
+    {
+        if(ns<16) return (int)ns;
+        int e=63-__builtin_clzll(ns);
+        return ((e-3)<<4)|(int)((ns>>(e-4))&15);
+    }
+
+    static inline double value(int idx)
+    {
+        if(idx<16) return idx;
+        int e=(idx>>4)+3;
+        uint64_t width=1ULL<<(e-4);
+        return (double)((16+(idx&15))*width)+0.5*width;
+    }
+
+    inline void add(uint64_t ns)
+    {
+        count++;
+        total+=ns;
+        if(ns>max) max=ns;
+        buckets[index(ns)]++;
+    }
+
+    uint64_t count,total,max;
+    uint32_t buckets[HistBuckets];
+};
+
+struct TraceEvent
+{
+    int      id;
+    uint64_t begin,end;
+};
+
+/// Everything here is written only by the owner thread
+struct Profiler::ThreadData
+{
+    ThreadData(int id,int traceEvents)
+        :tid(id),generation(0),eventHead(0),events(traceEvents)
+    {
+        memset((void*)hists,0,sizeof(hists));
+        memset(counters,0,sizeof(counters));
+    }
+
+    /// Called by the owner after Profiler::reset()
+    void clear()
+    {
+        for(int i=0;i<MaxSections;i++)
+            if(hists[i]) hists[i]->clear();
+        memset(counters,0,sizeof(counters));
+        eventHead=0;
+    }
+
+    int                      tid;
+    std::string              name;
+    volatile int             generation;
+    Histogram* volatile      hists[MaxSections];
+    int64_t                  counters[MaxSections];
+    volatile uint64_t        eventHead;
+    std::vector<TraceEvent>  events;
+};
+
+static __thread void* t_threadData=NULL;
+static volatile int   s_generation=0;
+static pi::Mutex      s_mutex;
+
+Profiler& Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::Profiler()
+    :m_enabled(svar.GetInt("Profiler.Enable",1)),
+      m_trace(svar.GetInt("Profiler.Trace",0)),
+      m_traceEvents(svar.GetInt("Profiler.TraceEvents",65536)),
+      m_startNs(now()),m_sectionNum(0)
+{
+    memset(m_names,0,sizeof(m_names));
+}
+
+Profiler::~Profiler()
+{
+    string traceFile=svar.GetString("Profiler.TraceFile","");
+    if(traceFile.size()) saveChromeTrace(traceFile);
+    if(svar.GetInt("Profiler.DumpAllStats",1))
+    {
+        dumpAllStats();
+        svar.GetInt("Profiler.DumpAllStats")=0;
+    }
+    // ThreadData are leaked on purpose: threads may still record at exit
+}
+
+uint64_t Profiler::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+int Profiler::sectionId(const char* name)
+{
+    pi::ScopedMutex lock(s_mutex);
+    for(int i=0;i<m_sectionNum;i++)
+        if(strcmp(m_names[i],name)==0) return i;
+    if(m_sectionNum>=MaxSections)
+    {
+        cerr<<"Profiler::sectionId: Too many sections, "<<name<<" is merged to "
+           <<m_names[MaxSections-1]<<endl;
+        return MaxSections-1;
+    }
+    m_names[m_sectionNum]=strdup(name);
+    __sync_synchronize();
+    return m_sectionNum++;
+}
+
+Profiler::ThreadData* Profiler::threadData()
+{
+    ThreadData* td=(ThreadData*)t_threadData;
+    if(!td)
+    {
+        pi::ScopedMutex lock(s_mutex);
+        td=new ThreadData(m_threads.size(),m_trace?m_traceEvents:0);
+        td->generation=s_generation;
+        m_threads.push_back(td);
+        t_threadData=td;
+    }
+    if(td->generation!=s_generation)
+    {
+        td->clear();
+        __sync_synchronize();
+        td->generation=s_generation;
+    }
+    return td;
+}
+
+void Profiler::setThreadName(const char* name)
+{
+    ThreadData* td=threadData();
+    pi::ScopedMutex lock(s_mutex);
+    td->name=name;
+}
+
+void Profiler::do_record(int id,uint64_t beginNs,uint64_t endNs)
+{
+    ThreadData* td=threadData();
+    Histogram*  h=td->hists[id];
+    if(!h)
+    {
+        h=new Histogram();
+        __sync_synchronize();
+        td->hists[id]=h;
+    }
+    h->add(endNs-beginNs);
+
+    if(td->events.size())
+    {
+        TraceEvent& ev=td->events[td->eventHead%td->events.size()];
+        ev.id=id;ev.begin=beginNs;ev.end=endNs;
+        td->eventHead=td->eventHead+1;
+    }
+}
+
+void Profiler::do_count(int id,int64_t n)
+{
+    threadData()->counters[id]+=n;
+}
+
+Profiler::SectionStats Profiler::merge(int id) const
+{
+    SectionStats stats;
+    stats.name=m_names[id];
+
+    Histogram merged;
+    {
+        pi::ScopedMutex lock(s_mutex);
+        for(size_t i=0;i<m_threads.size();i++)
+        {
+            const ThreadData* td=m_threads[i];
+            const Histogram*  h=td->hists[id];
+            if(td->generation!=s_generation||!h) continue;
+            merged.count+=h->count;
+            merged.total+=h->total;
+            if(h->max>merged.max) merged.max=h->max;
+            for(int j=0;j<HistBuckets;j++) merged.buckets[j]+=h->buckets[j];
+        }
+    }
+    if(!merged.count) return stats;
+
+    stats.count=merged.count;
+    stats.total=merged.total*1e-9;
+    stats.mean =stats.total/merged.count;
+    stats.max  =merged.max*1e-9;
+
+    double*  percentiles[3]={&stats.p50,&stats.p90,&stats.p99};
+    uint64_t targets[3]={(uint64_t)(merged.count*0.50+0.5),
+                         (uint64_t)(merged.count*0.90+0.5),
+                         (uint64_t)(merged.count*0.99+0.5)};
+    uint64_t sum=0;
+    for(int j=0,k=0;j<HistBuckets&&k<3;j++)
+    {
+        sum+=merged.buckets[j];
+        while(k<3&&sum>=targets[k]&&sum)
+        {
+            *percentiles[k]=std::min(Histogram::value(j),(double)merged.max)*1e-9;
+            k++;
+        }
+    }
+    return stats;
+}
+
+Profiler::SectionStats Profiler::getStats(const std::string& name) const
+{
+    for(int i=0;i<m_sectionNum;i++)
+        if(name==m_names[i]) return merge(i);
+    SectionStats stats;
+    stats.name=name;
+    return stats;
+}
+
+std::vector<Profiler::SectionStats> Profiler::getAllStats() const
+{
+    std::vector<SectionStats> result;
+    for(int i=0;i<m_sectionNum;i++)
+    {
+        SectionStats stats=merge(i);
+        if(stats.count) result.push_back(stats);
+    }
+    return result;
+}
+
+int64_t Profiler::getCounter(const std::string& name) const
+{
+    int id=-1;
+    for(int i=0;i<m_sectionNum;i++)
+        if(name==m_names[i]) {id=i;break;}
+    if(id<0) return 0;
+
+    int64_t sum=0;
+    pi::ScopedMutex lock(s_mutex);
+    for(size_t i=0;i<m_threads.size();i++)
+        if(m_threads[i]->generation==s_generation)
+            sum+=m_threads[i]->counters[id];
+    return sum;
+}
+
+std::string Profiler::getStatsAsText() const
+{
+    ostringstream ost;
+    ost<<"------------------------------------ Profiler report -----------------------------------------\n";
+    ost<<"           SECTION                         #CALLS  MEAN.T   P50.T   P99.T   MAX.T   TOTAL\n";
+    ost<<"-----------------------------------------------------------------------------------------------\n";
+    std::vector<SectionStats> all=getAllStats();
+    for(size_t i=0;i<all.size();i++)
+    {
+        const SectionStats& s=all[i];
+        string name=s.name;
+        name.resize(39,' ');
+        ost<<name<<" "<<setw(8)<<setiosflags(ios::right)<<s.count<<"  "
+          <<unitsFormat(s.mean,1,false)<<"s  "<<unitsFormat(s.p50,1,false)<<"s  "
+         <<unitsFormat(s.p99,1,false)<<"s  "<<unitsFormat(s.max,1,false)<<"s  "
+        <<unitsFormat(s.total,1,false)<<"s\n";
+    }
+    for(int i=0;i<m_sectionNum;i++)
+    {
+        int64_t value=getCounter(m_names[i]);
+        if(!value) continue;
+        string name=m_names[i];
+        name.resize(39,' ');
+        ost<<name<<" "<<setw(8)<<setiosflags(ios::right)<<value<<"  (counter)\n";
+    }
+    ost<<"--------------------------------- End of Profiler report -------------------------------------\n";
+    return ost.str();
+}
+
+void Profiler::dumpAllStats() const
+{
+    if(!m_sectionNum) return;
+    cout<<endl<<getStatsAsText()<<endl;
+}
+
+static std::string jsonEscape(const std::string& str)
+{
+    string result;
+    for(size_t i=0;i<str.size();i++)
+    {
+        if(str[i]=='"'||str[i]=='\\') result+='\\';
+        result+=str[i];
+    }
+    return result;
+}
+
+bool Profiler::saveChromeTrace(const std::string& file) const
+{
+    if(!m_trace)
+    {
+        cerr<<"Profiler::saveChromeTrace: Set Profiler.Trace=1 to record events.\n";
+        return false;
+    }
+    ofstream ofs(file.c_str());
+    if(!ofs.is_open())
+    {
+        cerr<<"Profiler::saveChromeTrace: Can't open file "<<file<<endl;
+        return false;
+    }
+
+    ofs<<setiosflags(ios::fixed)<<setprecision(3);
+    ofs<<"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first=true;
+    pi::ScopedMutex lock(s_mutex);
+    for(size_t i=0;i<m_threads.size();i++)
+    {
+        const ThreadData* td=m_threads[i];
+        if(td->generation!=s_generation) continue;
+        if(td->name.size())
+        {
+            ofs<<(first?"\n":",\n")<<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":"<<td->tid
+              <<",\"args\":{\"name\":\""<<jsonEscape(td->name)<<"\"}}";
+            first=false;
+        }
+
+        // the oldest events may be overwritten while saving a running process
+        uint64_t head=td->eventHead,size=td->events.size();
+        for(uint64_t j=(head>size?head-size:0);j<head;j++)
+        {
+            const TraceEvent& ev=td->events[j%size];
+            ofs<<(first?"\n":",\n")<<"{\"name\":\""<<jsonEscape(m_names[ev.id])
+              <<"\",\"ph\":\"X\",\"pid\":0,\"tid\":"<<td->tid
+             <<",\"ts\":"<<(int64_t)(ev.begin-m_startNs)*1e-3<<",\"dur\":"<<(ev.end-ev.begin)*1e-3<<"}";
+            first=false;
+        }
+    }
+    ofs<<"\n]}\n";
+    return true;
+}
+
+void Profiler::reset()
+{
+    // every thread clears its own data at its next record
+    __sync_fetch_and_add(&s_generation,1);
+}
+
+} // end of namespace pi
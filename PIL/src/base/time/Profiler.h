@@ -0,0 +1,145 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+namespace pi {
+
+////////////////////////////////////////////////////////////////////////////////
+/// Low overhead, thread-safe replacement of pi::timer for hot paths.
+///
+/// Every thread records into its own buffers without any lock, a section is
+/// interned once per call site and referenced by an integer afterwards:
+///
+///     void Map2DCPU::renderFrame(...)
+///     {
+///         PI_PROFILE_SCOPE("Map2DCPU::renderFrame");
+///         ...
+///         PI_PROFILE_COUNT("Map2DCPU::Tiles",tiles);
+///     }
+///
+/// Durations are kept in log-linear histograms (about 3% resolution) which are
+/// merged over all threads on demand, so percentiles cost nothing while
+/// recording. With Profiler.Trace=1 the last Profiler.TraceEvents events of
+/// every thread are kept as well and can be exported as Chrome trace JSON
+/// (chrome://tracing or https://ui.perfetto.dev).
+///
+/// Settings:
+///   Profiler.Enable=1           record anything
+///   Profiler.Trace=0            keep events for saveChromeTrace
+///   Profiler.TraceEvents=65536  events kept per thread
+///   Profiler.TraceFile=         write the trace here at exit
+///   Profiler.DumpAllStats=1     print the report at exit
+////////////////////////////////////////////////////////////////////////////////
+
+class Profiler
+{
+public:
+    enum { MaxSections=512, HistBuckets=1024 };
+
+    struct SectionStats
+    {
+        SectionStats():count(0),total(0),mean(0),p50(0),p90(0),p99(0),max(0){}
+
+        std::string name;
+        uint64_t    count;              ///< calls, or the sum for counters
+        double      total,mean;         ///< seconds
+        double      p50,p90,p99,max;    ///< seconds
+    };
+
+    static Profiler& instance();
+
+    /// Intern a section name, the same name always gets the same id
+    int  sectionId(const char* name);
+
+    /// Name the calling thread in the trace
+    void setThreadName(const char* name);
+
+    /// Record a duration in nanoseconds of section id for the calling thread
+    inline void record(int id,uint64_t beginNs,uint64_t endNs)
+    {
+        if(m_enabled) do_record(id,beginNs,endNs);
+    }
+
+    /// Add n to the counter id of the calling thread
+    inline void count(int id,int64_t n=1)
+    {
+        if(m_enabled) do_count(id,n);
+    }
+
+    /// Merged statistics of a timed section, count==0 if never recorded
+    SectionStats getStats(const std::string& name) const;
+
+    /// Merged statistics of all timed sections which were recorded
+    std::vector<SectionStats> getAllStats() const;
+
+    /// Merged value of a counter
+    int64_t getCounter(const std::string& name) const;
+
+    std::string getStatsAsText() const;
+    void dumpAllStats() const;
+
+    /// Write the recorded events as Chrome trace JSON (needs Profiler.Trace=1)
+    bool saveChromeTrace(const std::string& file) const;
+
+    /// Clear histograms, counters and events of all threads
+    void reset();
+
+    void enable(bool enabled=true){m_enabled=enabled;}
+    void disable(){m_enabled=false;}
+    bool enabled()const{return m_enabled;}
+
+    /// Monotonic time in nanoseconds
+    static uint64_t now();
+
+private:
+    struct Histogram;
+    struct ThreadData;
+
+    Profiler();
+    ~Profiler();
+
+    void do_record(int id,uint64_t beginNs,uint64_t endNs);
+    void do_count(int id,int64_t n);
+    ThreadData* threadData();
+    SectionStats merge(int id) const;
+
+    volatile bool            m_enabled;
+    bool                     m_trace;
+    int                      m_traceEvents;
+    uint64_t                 m_startNs;
+    volatile int             m_sectionNum;
+    const char*              m_names[MaxSections];
+    std::vector<ThreadData*> m_threads;
+};
+
+/// Time the enclosing scope as section id
+class ProfileScope
+{
+public:
+    ProfileScope(int id):m_id(id),m_begin(Profiler::now()){}
+    ~ProfileScope(){Profiler::instance().record(m_id,m_begin,Profiler::now());}
+
+private:
+    int      m_id;
+    uint64_t m_begin;
+};
+
+} // end of namespace pi
+
+#define PI_PROFILE_CAT_(a,b) a##b
+#define PI_PROFILE_CAT(a,b)  PI_PROFILE_CAT_(a,b)
+
+/// Time from here to the end of the scope, name must be a string literal
+#define PI_PROFILE_SCOPE(name) \
+    static const int PI_PROFILE_CAT(_piProfileId,__LINE__)=pi::Profiler::instance().sectionId(name); \
+    pi::ProfileScope PI_PROFILE_CAT(_piProfileScope,__LINE__)(PI_PROFILE_CAT(_piProfileId,__LINE__))
+
+/// Add n to the counter name, name must be a string literal
+#define PI_PROFILE_COUNT(name,n) \
+    do{ static const int _piProfileCounterId=pi::Profiler::instance().sectionId(name); \
+        pi::Profiler::instance().count(_piProfileCounterId,n);}while(0)
+
+#endif // PROFILER_H
@@ -0,0 +1,5 @@
+# The kernels are compiled straight from ../../src
+CPP_FILES    = $(shell find . -name \*.cpp) ../../src/UtilCPU.cpp
+INCLUDE_PATH += $(TOPDIR)/src
+
+MODULES += PI_BASE PTHREAD
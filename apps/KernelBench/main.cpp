@@ -0,0 +1,496 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include <base/Svar/Svar.h>
+#include <base/types/types.h>
+#include <base/time/Global_Timer.h>
+
+#include "UtilCPU.h"
+
+using namespace std;
+
+/**
+  Microbenchmark of the CPU compositing kernels of UtilCPU.
+
+  Every kernel blends KernelBench.Tiles random 256x256 BGRA tiles
+  KernelBench.Repeat times, the output is checked against the reference
+  loop Map2DCPU used before and the throughput is written as JSON to
+  KernelBench.Output. The multi-band merge and feather accumulation kernels
+  are measured the same way on 256x256 Laplacian levels against the loops of
+  MultiBandMap2DCPU:
+
+    ./KernelBench KernelBench.Tiles=64 KernelBench.Repeat=50
+
+  The pyramid levels are built for a KernelBench.PyramidSize square frame
+  with KernelBench.PyramidBands bands once per SIMD level, and checked
+  against the 5x5 loops of cv::pyrDown and cv::pyrUp.
+ */
+
+typedef void (*BlendFunc)(unsigned char* ele,const unsigned char* src,int pixels);
+
+/// The per pixel loop of Map2DCPU::renderFrame before the SIMD kernels
+static void maxWeightBlendReference(unsigned char* ele,const unsigned char* src,int pixels)
+{
+    pi::Array_<pi::byte,4> *eleP=(pi::Array_<pi::byte,4>*)ele;
+    pi::Array_<pi::byte,4> *dstP=(pi::Array_<pi::byte,4>*)src;
+    for(int i=0;i<pixels;i++,dstP++,eleP++)
+    {
+        if(eleP->data[3]<dstP->data[3])
+            *eleP=*dstP;
+    }
+}
+
+/// The per pixel loop of MultiBandMap2DCPU::renderFrame before the SIMD kernels
+template <typename LapT>
+static void mergeLevelReference(LapT* dstL,float* dstW,const LapT* srcL,const float* srcW,int pixels)
+{
+    pi::Point3_<LapT>*       dL=(pi::Point3_<LapT>*)dstL;
+    const pi::Point3_<LapT>* sL=(const pi::Point3_<LapT>*)srcL;
+    for(int x=0;x<pixels;x++)
+    {
+        if(srcW[x]>=dstW[x])
+        {
+            dL[x]=sL[x];
+            dstW[x]=srcW[x];
+        }
+    }
+}
+
+/// The weighted sums of the feather mode of MultiBandMap2DCPU, one pixel at a time
+template <typename LapT>
+static void accumulateLevelReference(float* dstL,float* dstW,const LapT* srcL,const float* srcW,int pixels)
+{
+    for(int x=0;x<pixels;x++)
+    {
+        if(srcW[x]<=0) continue;
+        for(int c=0;c<3;c++)
+            dstL[3*x+c]+=srcL[3*x+c]*srcW[x];
+        dstW[x]+=srcW[x];
+    }
+}
+
+static inline int reflect101(int p,int len)
+{
+    if(len==1) return 0;
+    while(p<0||p>=len) p=p<0?-p:2*len-2-p;
+    return p;
+}
+
+static inline short saturateShort(int v){return v>32767?32767:(v<-32768?-32768:v);}
+static inline short castPyr(int v,int shift)     {return saturateShort((v+(1<<(shift-1)))>>shift);}
+static inline float castPyr(double v,int shift)  {return v/(1<<shift);}
+static inline short subtractPyr(short a,short b) {return saturateShort(a-b);}
+static inline float subtractPyr(float a,float b) {return a-b;}
+
+/// cv::pyrDown of a cn channel cols x rows level, every pixel summed over
+/// the whole 5x5 kernel
+template <typename T,typename WT>
+static void pyrDownReference(const T* src,int cols,int rows,int cn,T* dst)
+{
+    static const int k[5]={1,4,6,4,1};
+    for(int y=0;y<rows/2;y++)
+        for(int x=0;x<cols/2;x++)
+            for(int c=0;c<cn;c++)
+            {
+                WT sum=0;
+                for(int i=0;i<5;i++)
+                    for(int j=0;j<5;j++)
+                        sum+=(WT)src[(reflect101(2*y-2+i,rows)*cols+reflect101(2*x-2+j,cols))*cn+c]*(k[i]*k[j]);
+                dst[(y*(cols/2)+x)*cn+c]=castPyr(sum,8);
+            }
+}
+
+/// level-=cv::pyrUp(coarse), the 3 taps of the even and the 2 of the odd
+/// pixels reflected like pyrUp: mirrored before the level, replicated after
+template <typename T,typename WT>
+static void laplaceReference(T* level,int cols,int rows,const T* coarse)
+{
+    for(int y=0;y<rows;y++)
+        for(int x=0;x<cols;x++)
+        {
+            int ys[3],xs[3],wy[3],wx[3];
+            int cy=y/2,cx=x/2,ny=0,nx=0;
+            if(y&1){ys[0]=cy;ys[1]=cy+1;wy[0]=wy[1]=4;ny=2;}
+            else   {ys[0]=cy-1;ys[1]=cy;ys[2]=cy+1;wy[0]=1;wy[1]=6;wy[2]=1;ny=3;}
+            if(x&1){xs[0]=cx;xs[1]=cx+1;wx[0]=wx[1]=4;nx=2;}
+            else   {xs[0]=cx-1;xs[1]=cx;xs[2]=cx+1;wx[0]=1;wx[1]=6;wx[2]=1;nx=3;}
+            for(int c=0;c<3;c++)
+            {
+                WT sum=0;
+                for(int i=0;i<ny;i++)
+                    for(int j=0;j<nx;j++)
+                    {
+                        int sy=reflect101(2*ys[i],rows)/2,sx=reflect101(2*xs[j],cols)/2;
+                        sum+=(WT)coarse[(sy*(cols/2)+sx)*3+c]*(wy[i]*wx[j]);
+                    }
+                T& l=level[(y*cols+x)*3+c];
+                l=subtractPyr(l,castPyr(sum,6));
+            }
+        }
+}
+
+static void pyrDownLevel(const short* src,const float* weight,int cols,int rows,
+                         short* dst,float* dstWeight,void* buffer)
+{
+    pyrDownLevel16S(src,cols*3*sizeof(short),weight,cols*sizeof(float),cols,rows,
+                    dst,cols/2*3*sizeof(short),dstWeight,cols/2*sizeof(float),buffer);
+}
+
+static void pyrDownLevel(const float* src,const float* weight,int cols,int rows,
+                         float* dst,float* dstWeight,void* buffer)
+{
+    pyrDownLevel32F(src,cols*3*sizeof(float),weight,cols*sizeof(float),cols,rows,
+                    dst,cols/2*3*sizeof(float),dstWeight,cols/2*sizeof(float),buffer);
+}
+
+static void laplaceLevel(short* level,int cols,int rows,const short* coarse,void* buffer)
+{
+    laplaceLevel16S(level,cols*3*sizeof(short),cols,rows,coarse,cols/2*3*sizeof(short),buffer);
+}
+
+static void laplaceLevel(float* level,int cols,int rows,const float* coarse,void* buffer)
+{
+    laplaceLevel32F(level,cols*3*sizeof(float),cols,rows,coarse,cols/2*3*sizeof(float),buffer);
+}
+
+/// A level kernel, DstT is the type of the levels written: LapT for the
+/// merge, float for the accumulation
+template <typename LapT,typename DstT=LapT>
+struct MergeCase
+{
+    typedef void (*Func)(DstT* dstL,float* dstW,const LapT* srcL,const float* srcW,int pixels);
+
+    MergeCase(const string& n,Func f,SimdLevel l):name(n),func(f),level(l){}
+
+    string    name;
+    Func      func;
+    SimdLevel level;
+};
+
+struct KernelCase
+{
+    KernelCase(const string& n,BlendFunc f,SimdLevel l):name(n),func(f),level(l){}
+
+    string    name;
+    BlendFunc func;
+    SimdLevel level;
+};
+
+class KernelBench
+{
+public:
+    KernelBench()
+        :tilePixels(256*256),
+          tiles(svar.GetInt("KernelBench.Tiles",64)),
+          repeat(svar.GetInt("KernelBench.Repeat",50))
+    {
+        // half of the destination pixels are uncovered (alpha 0) like the
+        // border of a warped frame
+        srand(svar.GetInt("KernelBench.Seed",0));
+        ele.resize(tiles*tilePixels*4);
+        src.resize(tiles*tilePixels*4);
+        for(size_t i=0;i<ele.size();i++)
+        {
+            ele[i]=rand()&255;
+            src[i]=rand()&255;
+        }
+        for(size_t i=3;i<src.size();i+=4)
+            if(rand()&1) src[i]=0;
+    }
+
+    int run()
+    {
+        std::vector<KernelCase> kernels;
+        kernels.push_back(KernelCase("Reference",maxWeightBlendReference,SimdNone));
+        kernels.push_back(KernelCase("Scalar",maxWeightBlendScalar,SimdNone));
+        kernels.push_back(KernelCase("SSE4.1",maxWeightBlendSSE41,SimdSSE41));
+        kernels.push_back(KernelCase("AVX2",maxWeightBlendAVX2,SimdAVX2));
+
+        std::vector<unsigned char> expected=ele;
+        for(int t=0;t<tiles;t++)
+            maxWeightBlendReference(&expected[t*tilePixels*4],&src[t*tilePixels*4],tilePixels);
+
+        stringstream json;
+        json<<setiosflags(ios::fixed)<<setprecision(3);
+        json<<"{\n  \"cpu\":\""<<simdLevelName(cpuSimdLevel())<<"\",\"tiles\":"<<tiles
+           <<",\"repeat\":"<<repeat<<",\n  \"maxWeightBlend\":[";
+        double reference=0;
+        bool   first=true;
+        for(size_t i=0;i<kernels.size();i++)
+        {
+            const KernelCase& k=kernels[i];
+            if(k.level>cpuSimdLevel()) continue;
+
+            std::vector<unsigned char> out=ele;
+            k.func(&out[0],&src[0],tiles*tilePixels);
+            if(out!=expected)
+            {
+                cerr<<"KernelBench: "<<k.name<<" differs from the reference!\n";
+                return -1;
+            }
+
+            double seconds=timeKernel(k.func);
+            if(!reference) reference=seconds;
+            double mpixels=(double)tiles*tilePixels*repeat*1e-6;
+            json<<(first?"":",")<<"\n    {\"kernel\":\""<<k.name<<"\",\"ms_per_tile\":"
+               <<seconds*1e3/(tiles*repeat)<<",\"mpix_per_s\":"<<mpixels/seconds
+              <<",\"speedup\":"<<reference/seconds<<"}";
+            first=false;
+        }
+        json<<"\n  ]";
+
+        std::vector<MergeCase<float> > merge32F;
+        merge32F.push_back(MergeCase<float>("Reference",mergeLevelReference<float>,SimdNone));
+        merge32F.push_back(MergeCase<float>("Scalar",mergeLevel32FScalar,SimdNone));
+        merge32F.push_back(MergeCase<float>("SSE4.1",mergeLevel32FSSE41,SimdSSE41));
+        merge32F.push_back(MergeCase<float>("AVX2",mergeLevel32FAVX2,SimdAVX2));
+        if(!benchMergeLevel(json,"mergeLevel32F",merge32F)) return -1;
+
+        std::vector<MergeCase<short> > merge16S;
+        merge16S.push_back(MergeCase<short>("Reference",mergeLevelReference<short>,SimdNone));
+        merge16S.push_back(MergeCase<short>("Scalar",mergeLevel16SScalar,SimdNone));
+        merge16S.push_back(MergeCase<short>("SSE4.1",mergeLevel16SSSE41,SimdSSE41));
+        if(!benchMergeLevel(json,"mergeLevel16S",merge16S)) return -1;
+
+        std::vector<MergeCase<float,float> > accumulate32F;
+        accumulate32F.push_back(MergeCase<float,float>("Reference",accumulateLevelReference<float>,SimdNone));
+        accumulate32F.push_back(MergeCase<float,float>("Scalar",accumulateLevel32FScalar,SimdNone));
+        accumulate32F.push_back(MergeCase<float,float>("SSE4.1",accumulateLevel32FSSE41,SimdSSE41));
+        accumulate32F.push_back(MergeCase<float,float>("AVX2",accumulateLevel32FAVX2,SimdAVX2));
+        if(!benchMergeLevel(json,"accumulateLevel32F",accumulate32F)) return -1;
+
+        std::vector<MergeCase<short,float> > accumulate16S;
+        accumulate16S.push_back(MergeCase<short,float>("Reference",accumulateLevelReference<short>,SimdNone));
+        accumulate16S.push_back(MergeCase<short,float>("Scalar",accumulateLevel16SScalar,SimdNone));
+        accumulate16S.push_back(MergeCase<short,float>("SSE4.1",accumulateLevel16SSSE41,SimdSSE41));
+        accumulate16S.push_back(MergeCase<short,float>("AVX2",accumulateLevel16SAVX2,SimdAVX2));
+        if(!benchMergeLevel(json,"accumulateLevel16S",accumulate16S)) return -1;
+
+        if(!benchPyramid<short,int>(json,"pyramid16S")) return -1;
+        if(!benchPyramid<float,double>(json,"pyramid32F")) return -1;
+        json<<"\n}\n";
+
+        cout<<json.str();
+        string output=svar.GetString("KernelBench.Output","kernels.json");
+        if(output.size())
+        {
+            ofstream ofs(output.c_str());
+            ofs<<json.str();
+            cout<<"Benchmark saved to "<<output<<endl;
+        }
+        return 0;
+    }
+
+private:
+    /// Merge or accumulate random levels where half of the source is not covered (weight 0),
+    /// every kernel is checked against the first one
+    template <typename LapT,typename DstT>
+    bool benchMergeLevel(ostream& json,const string& name,const std::vector<MergeCase<LapT,DstT> >& kernels)
+    {
+        size_t pixels=(size_t)tiles*tilePixels;
+        std::vector<DstT>  dstL(3*pixels);
+        std::vector<LapT>  srcL(3*pixels);
+        std::vector<float> dstW(pixels),srcW(pixels);
+        for(size_t i=0;i<3*pixels;i++)
+        {
+            dstL[i]=(DstT)(rand()%512-256);
+            srcL[i]=(LapT)(rand()%512-256);
+        }
+        for(size_t i=0;i<pixels;i++)
+        {
+            dstW[i]=rand()%1000*1e-3f;
+            srcW[i]=(rand()&1)?rand()%1000*1e-3f:0.f;
+        }
+
+        std::vector<DstT>  expectedL=dstL;
+        std::vector<float> expectedW=dstW;
+        kernels[0].func(&expectedL[0],&expectedW[0],&srcL[0],&srcW[0],pixels);
+
+        json<<",\n  \""<<name<<"\":[";
+        double reference=0;
+        bool   first=true;
+        for(size_t i=0;i<kernels.size();i++)
+        {
+            const MergeCase<LapT,DstT>& k=kernels[i];
+            if(k.level>cpuSimdLevel()) continue;
+
+            std::vector<DstT>  outL=dstL;
+            std::vector<float> outW=dstW;
+            k.func(&outL[0],&outW[0],&srcL[0],&srcW[0],pixels);
+            if(outL!=expectedL||outW!=expectedW)
+            {
+                cerr<<"KernelBench: "<<name<<" "<<k.name<<" differs from the reference!\n";
+                return false;
+            }
+
+            double best=0;
+            for(int run=0;run<3;run++)
+            {
+                outL=dstL;outW=dstW;
+                pi::TicTac tictac;
+                tictac.Tic();
+                for(int r=0;r<repeat;r++)
+                    for(int t=0;t<tiles;t++)
+                        k.func(&outL[3*t*tilePixels],&outW[t*tilePixels],
+                               &srcL[3*t*tilePixels],&srcW[t*tilePixels],tilePixels);
+                double seconds=tictac.Tac();
+                if(!run||seconds<best) best=seconds;
+            }
+            if(!reference) reference=best;
+            double mpixels=(double)tiles*tilePixels*repeat*1e-6;
+            json<<(first?"":",")<<"\n    {\"kernel\":\""<<k.name<<"\",\"ms_per_tile\":"
+               <<best*1e3/(tiles*repeat)<<",\"mpix_per_s\":"<<mpixels/best
+              <<",\"speedup\":"<<reference/best<<"}";
+            first=false;
+        }
+        json<<"\n  ]";
+        return true;
+    }
+
+    /// The Laplacian and weight pyramids of a random frame, as renderFrame
+    /// builds them, at every SIMD level the processor has
+    template <typename T,typename WT>
+    bool benchPyramid(ostream& json,const string& name)
+    {
+        int size =svar.GetInt("KernelBench.PyramidSize",1024);
+        int bands=svar.GetInt("KernelBench.PyramidBands",5);
+        size-=size%(1<<bands);
+        if(size<=0) return true;
+
+        std::vector<std::vector<T> >     levels(bands+1);
+        std::vector<std::vector<float> > weights(bands+1);
+        levels[0].resize(size*size*3);
+        weights[0].resize(size*size);
+        for(size_t i=0;i<levels[0].size();i++) levels[0][i]=(T)(rand()&255);
+        for(size_t i=0;i<weights[0].size();i++) weights[0][i]=(rand()&1)?rand()%1000*1e-3f:0.f;
+        for(int i=1;i<=bands;i++)
+        {
+            levels[i].resize((size>>i)*(size>>i)*3);
+            weights[i].resize((size>>i)*(size>>i));
+        }
+
+        std::vector<std::vector<T> >     expected=levels;
+        std::vector<std::vector<float> > expectedW=weights;
+        for(int i=0;i<bands;i++)
+        {
+            pyrDownReference<T,WT>(&expected[i][0],size>>i,size>>i,3,&expected[i+1][0]);
+            pyrDownReference<float,double>(&expectedW[i][0],size>>i,size>>i,1,&expectedW[i+1][0]);
+        }
+        for(int i=0;i<bands;i++)
+            laplaceReference<T,WT>(&expected[i][0],size>>i,size>>i,&expected[i+1][0]);
+
+        std::vector<char> buffer(pyrLevelBufferSize(size));
+        SimdLevel         cpuLevel=cpuSimdLevel();
+        SimdLevel         simd[3]={SimdNone,SimdSSE41,SimdAVX2};
+
+        json<<",\n  \""<<name<<"\":[";
+        double reference=0;
+        for(int l=0;l<3&&simd[l]<=cpuLevel;l++)
+        {
+            setSimdLevel(simd[l]);
+            std::vector<std::vector<T> >     out=levels;
+            std::vector<std::vector<float> > outW=weights;
+            // the level 0 is overwritten by the Laplacian, its copy is not timed
+            double best=0;
+            for(int run=0;run<3;run++)
+            {
+                double seconds=0;
+                for(int r=0;r<repeat;r++)
+                {
+                    out[0]=levels[0];
+                    pi::TicTac tictac;
+                    tictac.Tic();
+                    for(int i=0;i<bands;i++)
+                        pyrDownLevel(&out[i][0],&outW[i][0],size>>i,size>>i,&out[i+1][0],&outW[i+1][0],&buffer[0]);
+                    for(int i=0;i<bands;i++)
+                        laplaceLevel(&out[i][0],size>>i,size>>i,&out[i+1][0],&buffer[0]);
+                    seconds+=tictac.Tac();
+                }
+                if(!run||seconds<best) best=seconds;
+            }
+            setSimdLevel(cpuLevel);
+
+            for(int i=0;i<=bands;i++)
+            {
+                double err=0,errW=0;
+                for(size_t j=0;j<out[i].size();j++)
+                    err=std::max(err,fabs((double)out[i][j]-expected[i][j]));
+                for(size_t j=0;j<outW[i].size();j++)
+                    errW=std::max(errW,fabs((double)outW[i][j]-expectedW[i][j]));
+                // shorts are exact, floats are summed in another order
+                if(err>(sizeof(T)==2?0:1e-3)||errW>1e-5)
+                {
+                    cerr<<"KernelBench: "<<name<<" "<<simdLevelName(simd[l])<<" level "<<i
+                       <<" differs from the reference by "<<err<<" ("<<errW<<" for the weights)!\n";
+                    return false;
+                }
+            }
+
+            if(!reference) reference=best;
+            double mpixels=(double)size*size*repeat*1e-6;
+            json<<(l?",":"")<<"\n    {\"kernel\":\""<<simdLevelName(simd[l])<<"\",\"ms_per_frame\":"
+               <<best*1e3/repeat<<",\"mpix_per_s\":"<<mpixels/best
+              <<",\"speedup\":"<<reference/best<<"}";
+        }
+        json<<"\n  ]";
+        return true;
+    }
+
+    /// Best of three runs, the tiles are restored before every run
+    double timeKernel(BlendFunc func)
+    {
+        double best=0;
+        for(int run=0;run<3;run++)
+        {
+            std::vector<unsigned char> out=ele;
+            pi::TicTac tictac;
+            tictac.Tic();
+            for(int r=0;r<repeat;r++)
+                for(int t=0;t<tiles;t++)
+                    func(&out[t*tilePixels*4],&src[t*tilePixels*4],tilePixels);
+            double seconds=tictac.Tac();
+            if(!run||seconds<best) best=seconds;
+        }
+        return best;
+    }
+
+    int                        tilePixels,tiles,repeat;
+    std::vector<unsigned char> ele,src;
+};
+
+int main(int argc,char** argv)
+{
+    svar.ParseMain(argc,argv);
+
+    KernelBench bench;
+    return bench.run();
+}
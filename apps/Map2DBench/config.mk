@@ -0,0 +1,8 @@
+# The benchmark links the fusion backends straight from ../../src,
+# objects of them are placed at $(TOPDIR)/build/src
+MAP2D_FILES = Map2D.cpp Map2DCPU.cpp Map2DGPU.cpp MultiBandMap2DCPU.cpp Map2DRender.cpp UtilCPU.cpp FrameArena.cpp FrameDecoder.cpp MissionIndex.cpp MissionPack.cpp TileStore.cpp TiledTiffWriter.cpp WebTileExporter.cpp
+
+CPP_FILES    = $(shell find . -name \*.cpp) $(addprefix ../../src/,$(MAP2D_FILES))
+INCLUDE_PATH += $(TOPDIR)/src
+
+MODULES += PI_BASE PI_GUI PI_HARDWARE OPENGL QT OPENCV QGLVIEWER PTHREAD
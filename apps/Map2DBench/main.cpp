@@ -0,0 +1,423 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <sys/resource.h>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <base/Svar/Svar.h>
+#include <base/Svar/VecParament.h>
+#include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
+#include <base/system/thread/ThreadPool.h>
+
+#include "Map2D.h"
+#include "FrameDecoder.h"
+
+using namespace std;
+
+/**
+  Headless benchmark of the Map2D backends.
+
+  The dataset (config.cfg, trajectory.txt and the rgb folder) is replayed as fast
+  as possible into every backend listed in Bench.Types, the result is
+  written as JSON to Bench.Output:
+
+    ./Map2DBench Map2D.DataPath=phantom3-village-kfs Bench.Types="1 3"
+
+  With Bench.Thread=0 (default) frames are fused synchronously by feed(),
+  so the stage latencies are measured exactly and results are reproducible.
+
+  Bench.ApplyThreads="1 4 16" runs every backend once per Map2D.ApplyThreads
+  value and reports the apply speedup relative to the first one.
+
+  With Map2D.TileWarp=1 (default) TypeCPU warps and blends every tile in one
+  pass, reported as the tile_warp stage instead of warp and apply, and the
+  apply speedup is the one of tile_warp. tile_warp is 1 in the result of such a
+  run, its stages are not comparable with the ones of Map2D.TileWarp=0.
+
+  Bench.BlendModes="0 1" runs TypeMultiBandCPU once per
+  MultiBandMap2DCPU.BlendMode, the apply speedup of the feather mode is then
+  relative to the max weight one and its mosaic is saved beside it as
+  Map2DBench_TypeMultiBandCPU_feather.png (tiles/TypeMultiBandCPU_feather for
+  the export).
+
+  Bench.Export=tiles also exports every result as a web tile pyramid to
+  tiles/<type> and times it as the export stage.
+
+  Frames are decoded ahead by FrameDecoder.Threads workers. The time the feeding
+  loop waited for decoded frames (decode_wait_s) and for the fusion (fuse_s,
+  feed() and the queue of Bench.Thread=1) tell whether the replay is
+  decode-bound or fuse-bound, reported as bound. With FrameDecoder.ScaledDecode=1
+  the frames are decoded at a reduced size where the map resolution allows it,
+  decode_mpix_mean is the mean size of the decoded frames.
+ */
+
+/// Latencies (in seconds) of a stage measured by the benchmark itself
+struct LatencySamples
+{
+    void   add(double t){samples.push_back(t);}
+
+    size_t count()const{return samples.size();}
+
+    double mean()const
+    {
+        if(samples.empty()) return 0;
+        double sum=0;
+        for(size_t i=0;i<samples.size();i++) sum+=samples[i];
+        return sum/samples.size();
+    }
+
+    double percentile(double p)const
+    {
+        if(samples.empty()) return 0;
+        std::vector<double> sorted=samples;
+        size_t idx=(size_t)(p*0.01*(sorted.size()-1)+0.5);
+        if(idx>=sorted.size()) idx=sorted.size()-1;
+        std::nth_element(sorted.begin(),sorted.begin()+idx,sorted.end());
+        return sorted[idx];
+    }
+
+    std::vector<double> samples;
+};
+
+/// Peak resident set size in KB since the last resetPeakRSS()
+static long peakRSS()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while(getline(status,line))
+    {
+        if(line.compare(0,6,"VmHWM:")==0)
+        {
+            long kb=0;
+            stringstream sst(line.substr(6));
+            sst>>kb;
+            return kb;
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;
+}
+
+/// Reset the peak RSS counter so that every backend is measured alone
+static void resetPeakRSS()
+{
+    ofstream clearRefs("/proc/self/clear_refs");
+    if(clearRefs.is_open()) clearRefs<<"5";
+}
+
+static string typeName(int type)
+{
+    switch (type) {
+    case Map2D::TypeCPU:          return "TypeCPU";
+    case Map2D::TypeGPU:          return "TypeGPU";
+    case Map2D::TypeMultiBandCPU: return "TypeMultiBandCPU";
+    case Map2D::TypeRender:       return "TypeRender";
+    default:                      return "NoType";
+    }
+}
+
+/// Prefix of the profiler sections recorded by the backend
+static string className(int type)
+{
+    switch (type) {
+    case Map2D::TypeCPU:          return "Map2DCPU";
+    case Map2D::TypeGPU:          return "Map2DGPU";
+    case Map2D::TypeMultiBandCPU: return "MultiBandMap2DCPU";
+    case Map2D::TypeRender:       return "Map2DRender";
+    default:                      return "Map2D";
+    }
+}
+
+static void writeStage(ostream& os,const string& stage,size_t count,double mean,
+                       double p50,double p90,double p99,double max,bool& first)
+{
+    if(!count) return;
+    os<<(first?"":",")<<"\n        \""<<stage<<"\":{\"count\":"<<count
+     <<",\"mean_ms\":"<<mean*1e3<<",\"p50_ms\":"<<p50*1e3<<",\"p90_ms\":"<<p90*1e3
+    <<",\"p99_ms\":"<<p99*1e3<<",\"max_ms\":"<<max*1e3<<"}";
+    first=false;
+}
+
+static void writeStage(ostream& os,const string& stage,const LatencySamples& s,bool& first)
+{
+    writeStage(os,stage,s.count(),s.mean(),s.percentile(50),s.percentile(90),
+               s.percentile(99),s.percentile(100),first);
+}
+
+/// Stages measured inside the backends by pi::Profiler
+static void writeStage(ostream& os,const string& stage,const string& section,bool& first)
+{
+    pi::Profiler::SectionStats s=pi::Profiler::instance().getStats(section);
+    writeStage(os,stage,s.count,s.mean,s.p50,s.p90,s.p99,s.max,first);
+}
+
+class Map2DBench
+{
+public:
+    Map2DBench()
+        :datapath(svar.GetString("Map2D.DataPath","")){}
+
+    int run()
+    {
+        if(!datapath.size())
+        {
+            cerr<<"Map2D.DataPath is not seted!\n";
+            return -1;
+        }
+        FrameDecoder::loadConfig(datapath);
+
+        VecParament vecP=svar.get_var("Camera.Paraments",VecParament());
+        if(vecP.size()!=6)
+        {
+            cerr<<"Invalid camera parameters!\n";
+            return -2;
+        }
+        camera=PinHoleParameters(vecP[0],vecP[1],vecP[2],vecP[3],vecP[4],vecP[5]);
+        plane =svar.get_var<pi::SE3d>("Plane",pi::SE3d());
+
+        std::vector<int> types;
+        {
+            stringstream sst(svar.GetString("Bench.Types","1 3"));
+            int type;
+            while(sst>>type) types.push_back(type);
+        }
+
+        std::vector<int> applyThreads;
+        {
+            stringstream sst(svar.GetString("Bench.ApplyThreads",""));
+            int threads;
+            while(sst>>threads) applyThreads.push_back(threads);
+            if(applyThreads.empty()) applyThreads.push_back(svar.GetInt("Map2D.ApplyThreads",0));
+        }
+
+        // only TypeMultiBandCPU is run once per blend mode
+        std::vector<int> blendModes;
+        {
+            stringstream sst(svar.GetString("Bench.BlendModes",""));
+            int mode;
+            while(sst>>mode) blendModes.push_back(mode);
+            if(blendModes.empty()) blendModes.push_back(svar.GetInt("MultiBandMap2DCPU.BlendMode",0));
+        }
+
+        stringstream json;
+        json<<setiosflags(ios::fixed)<<setprecision(3);
+        json<<"{\n  \"dataset\":\""<<datapath<<"\",\n"
+           <<"  \"config\":{\"Bench.Thread\":"<<svar.GetInt("Bench.Thread",0)
+          <<",\"Bench.MaxFrames\":"<<svar.GetInt("Bench.MaxFrames",0)
+         <<",\"PrepareFrameNum\":"<<svar.GetInt("PrepareFrameNum",10)
+        <<",\"Map2D.Scale\":"<<svar.GetDouble("Map2D.Scale",1)
+        <<",\"Map2D.FusedWarp\":"<<svar.GetInt("Map2D.FusedWarp",1)
+        <<",\"Map2D.TileWarp\":"<<svar.GetInt("Map2D.TileWarp",1)
+        <<",\"MultiBandMap2DCPU.BandNumber\":"<<svar.GetInt("MultiBandMap2DCPU.BandNumber",5)
+        <<",\"MultiBandMap2DCPU.Compact\":"<<svar.GetInt("MultiBandMap2DCPU.Compact",0)
+        <<",\"MultiBandMap2DCPU.CacheMB\":"<<svar.GetDouble("MultiBandMap2DCPU.CacheMB",0)
+        <<",\"MultiBandMap2DCPU.CollapseCacheLevel\":"<<svar.GetInt("MultiBandMap2DCPU.CollapseCacheLevel",3)
+        <<",\"MultiBandMap2DCPU.BlendMode\":"<<svar.GetInt("MultiBandMap2DCPU.BlendMode",0)
+        <<",\"MultiBandMap2DCPU.FastPyramid\":"<<svar.GetInt("MultiBandMap2DCPU.FastPyramid",1)
+        <<",\"FrameDecoder.Threads\":"<<svar.GetInt("FrameDecoder.Threads",2)
+        <<",\"FrameDecoder.ReadAhead\":"<<svar.GetInt("FrameDecoder.ReadAhead",4)
+        <<",\"FrameDecoder.ScaledDecode\":"<<svar.GetInt("FrameDecoder.ScaledDecode",0)
+        <<",\"Camera.Paraments\":\""<<vecP.toString()<<"\"},\n"
+        <<"  \"results\":[";
+        bool first=true;
+        for(size_t i=0;i<types.size();i++)
+        {
+            double baseApply=0;
+            size_t modes=types[i]==Map2D::TypeMultiBandCPU?blendModes.size():1;
+            for(size_t k=0;k<modes;k++)
+                for(size_t j=0;j<applyThreads.size();j++)
+                {
+                    if(!first) json<<",";
+                    first=false;
+                    svar.GetInt("Map2D.ApplyThreads")=applyThreads[j];
+                    if(types[i]==Map2D::TypeMultiBandCPU)
+                        svar.GetInt("MultiBandMap2DCPU.BlendMode")=blendModes[k];
+                    if(benchType(types[i],json,baseApply)<0) return -3;
+                }
+        }
+        json<<"\n  ]\n}\n";
+
+        cout<<json.str();
+        string output=svar.GetString("Bench.Output","bench.json");
+        if(output.size())
+        {
+            ofstream ofs(output.c_str());
+            ofs<<json.str();
+            cout<<"Benchmark saved to "<<output<<endl;
+        }
+        return 0;
+    }
+
+private:
+
+    /// baseApply is the apply mean of the first run of this type, 0 if none yet
+    int benchType(int type,ostream& json,double& baseApply)
+    {
+        string name=typeName(type);
+        int    blendMode=type==Map2D::TypeMultiBandCPU?svar.GetInt("MultiBandMap2DCPU.BlendMode",0):0;
+        // the results of the blend modes are kept side by side to compare them
+        string label=name+(blendMode==1?"_feather":"");
+        bool   thread=svar.GetInt("Bench.Thread",0);
+        int    maxFrames=svar.GetInt("Bench.MaxFrames",0);
+        uint   queueDepth=svar.GetInt("Bench.QueueDepth",2);
+
+        resetPeakRSS();
+        pi::Profiler::instance().reset();
+        FrameDecoder decoder(datapath);
+        if(!decoder.open()) return -1;
+        LatencySamples wait,fuse,save,exportTiles;
+        pi::TicTac     tictac;
+
+        deque<std::pair<cv::Mat,pi::SE3d> > frames;
+        for(int i=0,iend=svar.GetInt("PrepareFrameNum",10);i<iend;i++)
+        {
+            std::pair<cv::Mat,pi::SE3d> frame;
+            if(!decoder.next(frame)) break;
+            frames.push_back(frame);
+        }
+        if(!frames.size()) return -2;
+
+        SPtr<Map2D> map=Map2D::create(type,thread);
+        if(!map.get()||!map->prepare(plane,camera,frames))
+        {
+            cerr<<"Failed to prepare "<<name<<"!\n";
+            return -3;
+        }
+        frames.clear();
+        decoder.setScaledDecode(camera,plane,map->scaledFrameResolution());
+        cout<<"Benchmarking "<<name<<(thread?" with thread":"")<<"...\n";
+
+        pi::TicTac total;
+        total.Tic();
+        int    fed=0;
+        double fuseSeconds=0;// feed() and waiting the queue of the worker
+        while(maxFrames<=0||fed<maxFrames)
+        {
+            std::pair<cv::Mat,pi::SE3d> frame;
+            tictac.Tic();
+            if(!decoder.next(frame)) break;
+            wait.add(tictac.Tac());
+
+            tictac.Tic();
+            if(thread)
+                while(map->queueSize()>=queueDepth) pi::Thread::sleep(1);
+            fuseSeconds+=tictac.Tac();
+
+            tictac.Tic();
+            map->feed(frame.first,frame.second);
+            fuse.add(tictac.Tac());
+            fuseSeconds+=fuse.samples.back();
+            fed++;
+        }
+        decoder.close();
+        double waitSeconds=wait.mean()*wait.count();
+        pi::Profiler::SectionStats decodeStats=pi::Profiler::instance().getStats("FrameDecoder::Decode");
+
+        if(thread)
+        {
+            // wait the worker to finish the queued frames
+            while(map->queueSize()) pi::Thread::sleep(1);
+            pi::Thread* worker=dynamic_cast<pi::Thread*>(map.get());
+            if(worker&&worker->isRunning())
+            {
+                worker->stop();
+                worker->join();
+            }
+        }
+        double seconds=total.Tac();
+
+        if(svar.GetInt("Bench.Save",1))
+        {
+            string file=svar.GetString("Bench.SaveFolder",".")+"/Map2DBench_"+label+".png";
+            tictac.Tic();
+            map->save(file);
+            save.add(tictac.Tac());
+        }
+        string exportFolder=svar.GetString("Bench.Export","");
+        if(exportFolder.size())
+        {
+            tictac.Tic();
+            if(map->exportTiles(exportFolder+"/"+label)) exportTiles.add(tictac.Tac());
+            else cerr<<"Map2DBench: Failed to export the tiles of "<<label<<", no export stage.\n";
+        }
+        long rss=peakRSS();
+        Map2D::MemoryStats memory=map->memoryStats();
+
+        // the CPU backend warps and blends in one TileWarp stage with Map2D.TileWarp=1
+        int    applyThreads=svar.GetInt("Map2D.ApplyThreads",0);
+        bool   tileWarp=pi::Profiler::instance().getStats(className(type)+"::TileWarp").count>0;
+        double applyMean=pi::Profiler::instance().getStats(className(type)+(tileWarp?"::TileWarp":"::Apply")).mean;
+        if(baseApply<=0) baseApply=applyMean;
+
+        json<<"\n    {\"type\":\""<<name<<"\",\"blend_mode\":"<<blendMode<<",\"thread\":"<<thread
+           <<",\"apply_threads\":"<<(applyThreads>0?applyThreads:pi::ThreadPool::processorNum())
+          <<",\"tile_warp\":"<<tileWarp
+          <<",\"apply_speedup\":"<<(applyMean>0?baseApply/applyMean:0)
+          <<",\"frames\":"<<fed<<",\"seconds\":"<<seconds
+          <<",\"fps\":"<<(seconds>0?fed/seconds:0)
+         <<",\"dropped\":"<<map->droppedFrames()
+        <<",\"peak_rss_kb\":"<<rss
+        <<",\"tiles\":"<<memory.tiles<<",\"tiles_kb\":"<<memory.bytes/1024
+        <<",\"tile_kb_mean\":"<<(memory.tiles?memory.bytes/1024./memory.tiles:0)
+        <<",\"tile_kb_max\":"<<memory.maxTileBytes/1024
+        <<",\"disk_tiles\":"<<memory.diskTiles<<",\"disk_kb\":"<<memory.diskBytes/1024
+        <<",\"arena_hits\":"<<pi::Profiler::instance().getCounter("FrameArena::Hits")
+        <<",\"arena_misses\":"<<pi::Profiler::instance().getCounter("FrameArena::Misses")
+        <<",\"decode_threads\":"<<decoder.threads()
+        <<",\"decode_mpix_mean\":"<<(decodeStats.count?pi::Profiler::instance().getCounter("FrameDecoder::Pixels")*1e-6/decodeStats.count:0)
+        <<",\"decode_wait_s\":"<<waitSeconds<<",\"fuse_s\":"<<fuseSeconds
+        <<",\"bound\":\""<<(waitSeconds>fuseSeconds?"decode":"fuse")<<"\""
+        <<",\n      \"stages\":{";
+        bool first=true;
+        writeStage(json,"decode","FrameDecoder::Decode",first);
+        writeStage(json,"wait",wait,first);
+        writeStage(json,"warp",className(type)+"::Warp",first);
+        writeStage(json,"pyramid",className(type)+"::Pyramid",first);
+        writeStage(json,"apply",className(type)+"::Apply",first);
+        writeStage(json,"tile_warp",className(type)+"::TileWarp",first);
+        writeStage(json,"fuse",fuse,first);
+        writeStage(json,"save",save,first);
+        writeStage(json,"export",exportTiles,first);
+        json<<"\n      }\n    }";
+        return 0;
+    }
+
+    string            datapath;
+    PinHoleParameters camera;
+    pi::SE3d          plane;
+};
+
+int main(int argc,char** argv)
+{
+    svar.ParseMain(argc,argv);
+
+    Map2DBench bench;
+    return bench.run();
+}
@@ -0,0 +1,5 @@
+# The mission formats are compiled straight from ../../src
+CPP_FILES    = $(shell find . -name \*.cpp) ../../src/MissionIndex.cpp ../../src/MissionPack.cpp
+INCLUDE_PATH += $(TOPDIR)/src
+
+MODULES += PI_BASE PTHREAD
@@ -0,0 +1,218 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#include <base/Svar/Svar.h>
+#include <base/time/Global_Timer.h>
+
+#include "MissionIndex.h"
+#include "MissionPack.h"
+
+using namespace std;
+
+/**
+  Converts the missions to the binary formats read by FrameDecoder.
+
+    ./MissionTool Act=Index DataPath=phantom3-village-kfs
+        writes mission.idx from trajectory.txt
+    ./MissionTool Act=Pack DataPath=phantom3-village-kfs
+        writes mission.pack with the images, poses and config.cfg, the
+        "timestamp values..." lines of MissionTool.GPS and MissionTool.IMU
+        are added as sensor records. MissionTool.Append=1 only adds the
+        frames of trajectory.txt and the sensor records which are not
+        packed yet.
+    ./MissionTool Act=Info DataPath=phantom3-village-kfs
+        prints the frames and the time span of mission.pack or mission.idx
+ */
+
+/// The whole content of a file
+static bool readFile(const string& file,string& bytes)
+{
+    ifstream ifs(file.c_str(),ios::binary);
+    if(!ifs.is_open()) return false;
+    stringstream sst;
+    sst<<ifs.rdbuf();
+    bytes=sst.str();
+    return true;
+}
+
+class MissionTool
+{
+public:
+    MissionTool()
+        :datapath(svar.GetString("Map2D.DataPath","")){}
+
+    int run()
+    {
+        if(!datapath.size())
+        {
+            cerr<<"Map2D.DataPath is not seted!\n";
+            return -1;
+        }
+        string act=svar.GetString("Act","Index");
+        if(act=="Index")     return index();
+        else if(act=="Pack") return pack();
+        else if(act=="Info") return info();
+        cerr<<"No act "<<act<<"!\n";
+        return -1;
+    }
+
+private:
+    int index()
+    {
+        pi::TicTac tictac;
+        tictac.Tic();
+        if(!MissionIndex::convert(datapath+"/trajectory.txt",datapath+"/mission.idx"))
+            return -2;
+        double seconds=tictac.Tac();
+
+        MissionIndex mission;
+        if(!mission.open(datapath+"/mission.idx")) return -3;
+        cout<<"Indexed "<<mission.size()<<" frames to "<<datapath<<"/mission.idx in "
+           <<seconds<<"s.\n";
+        return 0;
+    }
+
+    bool addSensors(MissionPackWriter& writer,const string& file,int type)
+    {
+        if(file.empty()) return true;
+        ifstream in(file.c_str());
+        if(!in.is_open())
+        {
+            cerr<<"Can't open file "<<file<<endl;
+            return false;
+        }
+        // with MissionTool.Append the records packed before are kept
+        bool   packed=false;
+        double last=0;
+        for(size_t i=0;i<writer.sensors();i++)
+        {
+            const MissionPack::Sensor& sensor=writer.sensor(i);
+            if(sensor.type!=(uint32_t)type||(packed&&sensor.timestamp<=last)) continue;
+            last  =sensor.timestamp;
+            packed=true;
+        }
+
+        string line;
+        while(getline(in,line))
+        {
+            MissionPack::Sensor sensor;
+            stringstream sst(line);
+            if(!(sst>>sensor.timestamp)||(packed&&sensor.timestamp<=last)) continue;
+            sensor.type =type;
+            sensor.count=0;
+            while(sensor.count<6&&sst>>sensor.values[sensor.count]) sensor.count++;
+            for(int i=sensor.count;i<6;i++) sensor.values[i]=0;
+            writer.addSensor(sensor);
+        }
+        return true;
+    }
+
+    int pack()
+    {
+        string output=svar.GetString("MissionTool.Output",datapath+"/mission.pack");
+        bool   append=svar.GetInt("MissionTool.Append",0);
+        ifstream in((datapath+"/trajectory.txt").c_str());
+        if(!in.is_open())
+        {
+            cerr<<"Can't open file "<<(datapath+"/trajectory.txt")<<endl;
+            return -2;
+        }
+        MissionPackWriter writer;
+        if(!writer.open(output,append)) return -3;
+
+        pi::TicTac tictac;
+        tictac.Tic();
+        size_t packed=writer.frames(),added=0,bytes=0,line=0;
+        string str,name,image;
+        while(getline(in,str))
+        {
+            MissionIndex::Record record;
+            if(!MissionIndex::parseLine(str,name,record)) continue;
+            if(line++<packed) continue;// packed before
+            if(record.timestamp<0) record.timestamp=line-1;
+            if(!readFile(datapath+"/rgb/"+name+".jpg",image))
+            {
+                cerr<<"Can't read "<<datapath<<"/rgb/"<<name<<".jpg, stopped.\n";
+                break;
+            }
+            if(!writer.addFrame(name,record,image.data(),image.size())) return -4;
+            added++;
+            bytes+=image.size();
+        }
+
+        string config;
+        if(readFile(datapath+"/config.cfg",config)) writer.setConfig(config);
+        if(!addSensors(writer,svar.GetString("MissionTool.GPS",""),MissionPack::GPS)
+                ||!addSensors(writer,svar.GetString("MissionTool.IMU",""),MissionPack::IMU))
+            return -5;
+        if(!writer.close()) return -6;
+
+        cout<<"Packed "<<added<<" frames ("<<bytes/1048576.<<"MB) to "<<output<<" in "
+           <<tictac.Tac()<<"s, "<<writer.frames()<<" frames in total.\n";
+        return 0;
+    }
+
+    int info()
+    {
+        MissionIndex index;
+        MissionPack  pack;
+        pi::TicTac   tictac;
+        tictac.Tic();
+        if(pack.open(datapath+"/mission.pack"))
+        {
+            cout<<"Pack: "<<pack.sensors()<<" sensor records, "<<pack.config().size()
+               <<" bytes of config\n";
+        }
+        else if(!index.open(datapath+"/mission.idx"))
+        {
+            cerr<<"Can't open "<<datapath<<"/mission.pack or mission.idx\n";
+            return -2;
+        }
+        const MissionIndex& mission=pack.isOpen()?pack.index():index;
+        double seconds=tictac.Tac();
+
+        cout<<setiosflags(ios::fixed)<<setprecision(3);
+        cout<<"Frames: "<<mission.size()<<", opened in "<<seconds*1e3<<"ms\n";
+        if(!mission.size()) return 0;
+        size_t last=mission.size()-1;
+        cout<<"First:  "<<mission.name(0)<<" t="<<mission.record(0).timestamp
+           <<" pose="<<mission.pose(0)<<endl;
+        cout<<"Last:   "<<mission.name(last)<<" t="<<mission.record(last).timestamp
+           <<" pose="<<mission.pose(last)<<endl;
+        return 0;
+    }
+
+    string datapath;
+};
+
+int main(int argc,char** argv)
+{
+    svar.ParseMain(argc,argv);
+
+    MissionTool tool;
+    return tool.run();
+}
@@ -0,0 +1,3 @@
+CPP_FILES    = $(shell find . -name \*.cpp)
+
+MODULES += PI_BASE OPENCV PTHREAD
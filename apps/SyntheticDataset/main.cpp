@@ -0,0 +1,365 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <cstdio>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include <base/Svar/Svar.h>
+#include <base/Svar/VecParament.h>
+#include <base/types/SE3.h>
+#include <base/types/SPtr.h>
+#include <base/system/thread/ThreadBase.h>
+#include <base/system/file_path/file_path.h>
+#include <base/time/Global_Timer.h>
+
+using namespace std;
+
+/**
+  Generate an aerial sequence of a procedurally textured ground plane.
+
+  The output folder has the layout read by TestSystem::obtainFrame:
+    config.cfg      Camera.Paraments, Plane, GPS.Origin
+    trajectory.txt  "name x y z qx qy qz qw" per frame
+    rgb/name.jpg
+
+    ./SyntheticDataset Synthetic.Path=synthetic-1k Synthetic.Frames=1000 Synthetic.Pattern=Spiral
+
+  The ground is a deterministic function of the world position, so
+  overlapping frames always agree and any frame count can be regenerated.
+ */
+
+/// Integer hash of a 2D lattice point
+static inline unsigned int hash2(int x,int y,unsigned int seed)
+{
+    unsigned int h=seed^(x*0x8da6b343u)^(y*0xd8163841u);
+    h^=h>>13;h*=0x5bd1e995u;h^=h>>15;
+    return h;
+}
+
+static inline double hashUnit(int x,int y,unsigned int seed)
+{
+    return hash2(x,y,seed)*(1./4294967296.);
+}
+
+/// Smoothed value noise in [0,1)
+static inline double valueNoise(double x,double y,unsigned int seed)
+{
+    double fx=floor(x),fy=floor(y);
+    int    ix=(int)fx,iy=(int)fy;
+    double tx=x-fx,ty=y-fy;
+    tx=tx*tx*(3-2*tx);ty=ty*ty*(3-2*ty);
+    double a=hashUnit(ix,iy,seed),  b=hashUnit(ix+1,iy,seed);
+    double c=hashUnit(ix,iy+1,seed),d=hashUnit(ix+1,iy+1,seed);
+    return (a+(b-a)*tx)*(1-ty)+(c+(d-c)*tx)*ty;
+}
+
+/// The procedural ground: fields with crop rows, roads and buildings
+class SyntheticGround
+{
+public:
+    SyntheticGround(unsigned int seed)
+        :_seed(seed),
+          _fieldSize(svar.GetDouble("Synthetic.FieldSize",60)),
+          _roadSpacing(svar.GetDouble("Synthetic.RoadSpacing",300)),
+          _roadWidth(svar.GetDouble("Synthetic.RoadWidth",6)),
+          _buildingRatio(svar.GetDouble("Synthetic.BuildingRatio",0.1))
+    {
+    }
+
+    /// BGR color of the world position (x,y) in meters
+    inline void color(double x,double y,unsigned char* bgr)const
+    {
+        double detail=0.5*valueNoise(x*0.125,y*0.125,_seed+1)
+                +0.3*valueNoise(x*0.5,y*0.5,_seed+2)
+                +0.2*valueNoise(x*2,y*2,_seed+3);
+
+        // roads
+        double rx=x-_roadSpacing*floor(x/_roadSpacing);
+        double ry=y-_roadSpacing*floor(y/_roadSpacing);
+        if(rx<_roadWidth||ry<_roadWidth)
+        {
+            int v=90+(int)(60*detail);
+            bgr[0]=v;bgr[1]=v;bgr[2]=v+5;
+            return;
+        }
+
+        // buildings on a 25m lattice
+        {
+            int bx=(int)floor(x*0.04),by=(int)floor(y*0.04);
+            if(hashUnit(bx,by,_seed+4)<_buildingRatio)
+            {
+                double ox=x*0.04-bx,oy=y*0.04-by;
+                double size=0.25+0.25*hashUnit(bx,by,_seed+5);
+                if(ox>0.5-size&&ox<0.5+size&&oy>0.5-size&&oy<0.5+size)
+                {
+                    unsigned int h=hash2(bx,by,_seed+6);
+                    double shade=(ox<0.5)?0.8:1.0;// two roof sides
+                    bgr[0]=(unsigned char)(shade*(60+(h&63)));
+                    bgr[1]=(unsigned char)(shade*(60+((h>>6)&63)));
+                    bgr[2]=(unsigned char)(shade*(120+((h>>12)&127)));
+                    return;
+                }
+            }
+        }
+
+        // fields with jittered borders
+        double wx=x+20*valueNoise(x*0.01,y*0.01,_seed+7);
+        double wy=y+20*valueNoise(x*0.01,y*0.01,_seed+8);
+        int    fx=(int)floor(wx/_fieldSize),fy=(int)floor(wy/_fieldSize);
+        unsigned int h=hash2(fx,fy,_seed);
+        static const unsigned char palette[8][3]={{40,110,70},{50,140,90},{60,120,130},{70,150,160},
+                                                  {40,90,60},{90,160,170},{50,100,110},{30,130,80}};
+        const unsigned char* base=palette[h&7];
+        double rows=(h&8)?wx:wy;
+        double stripe=0.8+0.2*sin(rows*(2.5+(h>>4&3)));
+        double s=stripe*(0.7+0.6*detail);
+        for(int i=0;i<3;i++)
+        {
+            double v=base[i]*s;
+            bgr[i]=v>255?255:(unsigned char)v;
+        }
+    }
+
+private:
+    unsigned int _seed;
+    double       _fieldSize,_roadSpacing,_roadWidth,_buildingRatio;
+};
+
+class SyntheticDataset
+{
+public:
+    SyntheticDataset()
+        :path(svar.GetString("Synthetic.Path","synthetic")),
+          frameNum(svar.GetInt("Synthetic.Frames",100)),
+          seed(svar.GetInt("Synthetic.Seed",0)),
+          ground(seed)
+    {
+        vecP=svar.get_var("Synthetic.Camera",VecParament("[640 480 500 500 320 240]"));
+    }
+
+    int run()
+    {
+        if(vecP.size()!=6||vecP[0]<=0||vecP[1]<=0||vecP[2]<=0||vecP[3]<=0)
+        {
+            cerr<<"SyntheticDataset: Invalid camera parameters!\n";
+            return -1;
+        }
+        if(frameNum<=0)
+        {
+            cerr<<"SyntheticDataset: Synthetic.Frames should be positive!\n";
+            return -2;
+        }
+        if(pi::path_mkdir((path+"/rgb").c_str())!=0)
+        {
+            cerr<<"SyntheticDataset: Can't create folder "<<path<<"/rgb\n";
+            return -3;
+        }
+
+        string pattern=svar.GetString("Synthetic.Pattern","Lawnmower");
+        if(pattern=="Lawnmower") lawnmower();
+        else if(pattern=="Spiral") spiral();
+        else
+        {
+            cerr<<"SyntheticDataset: No pattern "<<pattern<<"!\n";
+            return -4;
+        }
+
+        if(!writeConfig()||!writeTrajectory()) return -5;
+
+        // render the images in parallel, frame i goes to worker i%threadNum
+        int threadNum=svar.GetInt("Synthetic.Threads",4);
+        if(threadNum<1) threadNum=1;
+        rendered=0;
+        pi::TicTac tictac;
+        tictac.Tic();
+        std::vector<SPtr<RenderThread> > threads;
+        for(int i=0;i<threadNum;i++)
+        {
+            threads.push_back(SPtr<RenderThread>(new RenderThread(this,i,threadNum)));
+            threads.back()->start();
+        }
+        while(rendered<frameNum)
+        {
+            pi::Thread::sleep(500);
+            cout<<"\rRendered "<<rendered<<"/"<<frameNum<<" frames."<<flush;
+        }
+        for(int i=0;i<threadNum;i++) threads[i]->join();
+        cout<<"\nSynthetic dataset saved to "<<path<<" in "<<tictac.Tac()<<" seconds.\n";
+        return 0;
+    }
+
+private:
+    class RenderThread:public pi::Thread
+    {
+    public:
+        RenderThread(SyntheticDataset* dataset,int start,int step)
+            :_dataset(dataset),_start(start),_step(step){}
+
+        virtual void run()
+        {
+            cv::Mat img;
+            for(int i=_start;i<_dataset->frameNum&&!shouldStop();i+=_step)
+            {
+                _dataset->render(_dataset->poses[i],img);
+                if(!cv::imwrite(_dataset->path+"/rgb/"+_dataset->frameName(i)+".jpg",img))
+                    cerr<<"SyntheticDataset: Failed to write frame "<<i<<endl;
+                __sync_fetch_and_add(&_dataset->rendered,1);
+            }
+        }
+
+    private:
+        SyntheticDataset* _dataset;
+        int               _start,_step;
+    };
+
+    /// Ground footprint of a frame along the image x and y axes
+    double footprintX()const{return svar.GetDouble("Synthetic.Altitude",100)*vecP[0]/vecP[2];}
+    double footprintY()const{return svar.GetDouble("Synthetic.Altitude",100)*vecP[1]/vecP[3];}
+
+    string frameName(int idx)const
+    {
+        char name[32];
+        sprintf(name,"%06d",idx);
+        return name;
+    }
+
+    /// Camera looking down with image x along heading, image y to the right of it
+    pi::SE3d pose(double x,double y,double heading,int idx)const
+    {
+        double altitude=svar.GetDouble("Synthetic.Altitude",100);
+        double noise   =svar.GetDouble("Synthetic.AttitudeNoise",1)*M_PI/180.;
+        double roll =noise*(2*hashUnit(idx,0,seed+10)-1);
+        double pitch=noise*(2*hashUnit(idx,1,seed+10)-1);
+        double yaw  =noise*(2*hashUnit(idx,2,seed+10)-1);
+        pi::SO3d r=pi::SO3d(pi::Point3d(0,0,1),heading+yaw)
+                *pi::SO3d(pi::Point3d(1,0,0),M_PI)
+                *pi::SO3d(pi::Point3d(1,0,0),roll)
+                *pi::SO3d(pi::Point3d(0,1,0),pitch);
+        return pi::SE3d(r,pi::Point3d(x,y,altitude));
+    }
+
+    /// Back and forth lines along x, roughly covering a square area
+    void lawnmower()
+    {
+        double step   =footprintX()*(1-svar.GetDouble("Synthetic.Overlap",0.7));
+        double spacing=footprintY()*(1-svar.GetDouble("Synthetic.SideOverlap",0.6));
+        int    lineFrames=svar.GetInt("Synthetic.LineFrames",0);
+        if(lineFrames<=0) lineFrames=ceil(sqrt(frameNum*spacing/step));
+        poses.reserve(frameNum);
+        for(int i=0;i<frameNum;i++)
+        {
+            int line=i/lineFrames,j=i%lineFrames;
+            if(line&1) j=lineFrames-1-j;
+            poses.push_back(pose(j*step,-line*spacing,(line&1)?M_PI:0,i));
+        }
+    }
+
+    /// Archimedean spiral from the origin with constant ground speed
+    void spiral()
+    {
+        double step   =footprintX()*(1-svar.GetDouble("Synthetic.Overlap",0.7));
+        double spacing=footprintY()*(1-svar.GetDouble("Synthetic.SideOverlap",0.6));
+        double b=spacing/(2*M_PI);
+        double theta=2*M_PI;
+        poses.reserve(frameNum);
+        for(int i=0;i<frameNum;i++)
+        {
+            double r=b*theta;
+            double c=cos(theta),s=sin(theta);
+            double heading=atan2(b*s+r*c,b*c-r*s);
+            poses.push_back(pose(r*c,r*s,heading,i));
+            theta+=step/sqrt(r*r+b*b);
+        }
+    }
+
+    bool writeConfig()
+    {
+        ofstream ofs((path+"/config.cfg").c_str());
+        if(!ofs.is_open())
+        {
+            cerr<<"SyntheticDataset: Can't open "<<path<<"/config.cfg\n";
+            return false;
+        }
+        ofs<<setprecision(9);
+        ofs<<"Camera.Paraments="<<vecP.toString()<<endl;
+        ofs<<"Plane="<<pi::SE3d()<<endl;
+        ofs<<"GPS.Origin="<<svar.GetString("Synthetic.GPSOrigin","108.7525 34.0336 400")<<endl;
+        return true;
+    }
+
+    bool writeTrajectory()
+    {
+        ofstream ofs((path+"/trajectory.txt").c_str());
+        if(!ofs.is_open())
+        {
+            cerr<<"SyntheticDataset: Can't open "<<path<<"/trajectory.txt\n";
+            return false;
+        }
+        ofs<<setprecision(12);
+        for(size_t i=0;i<poses.size();i++)
+            ofs<<frameName(i)<<" "<<poses[i]<<endl;
+        return true;
+    }
+
+    /// Ray cast every pixel to the plane z=0, the ray is linear along a row
+    void render(const pi::SE3d& pose,cv::Mat& img)const
+    {
+        int w=vecP[0],h=vecP[1];
+        double fxinv=1./vecP[2],fyinv=1./vecP[3],cx=vecP[4],cy=vecP[5];
+        img.create(h,w,CV_8UC3);
+        pi::SO3d          r=pose.get_rotation();
+        pi::Point3d       t=pose.get_translation();
+        pi::Point3d       dx=r*pi::Point3d(fxinv,0,0);
+        for(int v=0;v<h;v++)
+        {
+            pi::Point3d ray=r*pi::Point3d(-cx*fxinv,(v-cy)*fyinv,1);
+            unsigned char* p=img.ptr<unsigned char>(v);
+            for(int u=0;u<w;u++,p+=3,ray=ray+dx)
+            {
+                double s=t.z/ray.z;
+                ground.color(t.x-ray.x*s,t.y-ray.y*s,p);
+            }
+        }
+    }
+
+    string                 path;
+    int                    frameNum;
+    unsigned int           seed;
+    VecParament            vecP;
+    SyntheticGround        ground;
+    std::vector<pi::SE3d>  poses;
+    volatile int           rendered;
+};
+
+int main(int argc,char** argv)
+{
+    svar.ParseMain(argc,argv);
+
+    SyntheticDataset dataset;
+    return dataset.run();
+}
@@ -0,0 +1,78 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "FrameArena.h"
+
+#include <pthread.h>
+
+#include <base/time/Profiler.h>
+
+static pthread_key_t  s_arenaKey;
+static pthread_once_t s_arenaOnce=PTHREAD_ONCE_INIT;
+
+void FrameArena::destroy(void* arena)
+{
+    delete (FrameArena*)arena;
+}
+
+void FrameArena::createKey()
+{
+    pthread_key_create(&s_arenaKey,destroy);
+}
+
+FrameArena& FrameArena::thread()
+{
+    pthread_once(&s_arenaOnce,createKey);
+    FrameArena* arena=(FrameArena*)pthread_getspecific(s_arenaKey);
+    if(!arena)
+    {
+        arena=new FrameArena;
+        pthread_setspecific(s_arenaKey,arena);
+    }
+    return *arena;
+}
+
+void* FrameArena::buffer(int slot,size_t bytes)
+{
+    std::vector<unsigned char>& buf=_slots.at(slot);
+    if(buf.size()<bytes)
+    {
+        PI_PROFILE_COUNT("FrameArena::Misses",1);
+        // a quarter more, footprints vary a little from frame to frame
+        std::vector<unsigned char>(bytes+bytes/4).swap(buf);
+    }
+    else PI_PROFILE_COUNT("FrameArena::Hits",1);
+    return bytes?&buf[0]:NULL;
+}
+
+cv::Mat FrameArena::mat(int slot,int rows,int cols,int type)
+{
+    size_t elemSize=CV_ELEM_SIZE(type);
+    return cv::Mat(rows,cols,type,buffer(slot,(size_t)rows*cols*elemSize));
+}
+
+size_t FrameArena::bytes()const
+{
+    size_t sum=0;
+    for(size_t i=0;i<_slots.size();i++) sum+=_slots[i].size();
+    return sum;
+}
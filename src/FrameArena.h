@@ -0,0 +1,80 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef FRAMEARENA_H
+#define FRAMEARENA_H
+
+#include <vector>
+#include <stddef.h>
+#include <opencv2/core/core.hpp>
+
+/** Buffers of renderFrame kept from frame to frame, one arena per thread.
+
+    Every slot is a block of memory which only grows, mat() returns a view of
+    its first bytes and reallocates it only when it is too small, with some
+    room for the slightly larger footprints of the next frames:
+
+        FrameArena& arena=FrameArena::thread();
+        cv::Mat dst=arena.mat(FrameArena::Dst,rows,cols,CV_8UC4);
+
+    A view stays valid until the same slot is requested again by the thread.
+    The requests served without and with an allocation are counted by the
+    profiler as FrameArena::Hits and FrameArena::Misses.
+*/
+class FrameArena
+{
+public:
+    enum Slot
+    {
+        FrameSrc=0,     // the converted camera frame
+        ImageWarped,
+        WeightWarped,
+        Dst,            // the BGRA frame of Map2DCPU
+        PyramidRows,    // row buffers of the pyramid levels
+        PyramidLevels,  // PyramidLevels+i: Laplacian level i+1
+        PyramidWeights=PyramidLevels+16,// PyramidWeights+i: weights of level i+1
+        SlotNum=PyramidWeights+16
+    };
+
+    /// The arena of the calling thread, created at the first call
+    static FrameArena& thread();
+
+    /// A rows x cols continuous Mat in the slot, not initialized
+    cv::Mat mat(int slot,int rows,int cols,int type);
+    /// bytes of the slot
+    void*   buffer(int slot,size_t bytes);
+
+    /// Bytes held by all slots
+    size_t  bytes()const;
+
+private:
+    FrameArena():_slots(SlotNum){}
+    FrameArena(const FrameArena&);
+    FrameArena& operator=(const FrameArena&);
+
+    static void destroy(void* arena);
+    static void createKey();
+
+    std::vector<std::vector<unsigned char> > _slots;
+};
+
+#endif // FRAMEARENA_H
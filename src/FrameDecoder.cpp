@@ -0,0 +1,359 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "FrameDecoder.h"
+
+#include <cmath>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <base/Svar/Svar.h>
+#include <base/time/Profiler.h>
+#include <base/system/thread/ThreadBase.h>
+
+using namespace std;
+
+class FrameDecoder::Worker:public pi::Thread
+{
+public:
+    Worker(FrameDecoder* decoder):_decoder(decoder){}
+    virtual void run(){_decoder->workerLoop();}
+
+private:
+    FrameDecoder* _decoder;
+};
+
+FrameDecoder::FrameDecoder(const std::string& datapath)
+    :_datapath(datapath),_mission(NULL),_indexNext(0),
+     _threadNum(svar.GetInt("FrameDecoder.Threads",2)),
+     _readAhead(svar.GetInt("FrameDecoder.ReadAhead",4)),
+     _maxDenom(svar.GetInt("FrameDecoder.ScaledDecode",0)?svar.GetInt("FrameDecoder.MaxScaleDenom",8):1),
+     _claimed(0),_next(0),_end(-1),_stop(false),_lengthPixel(0),
+     _decodeSeconds(0),_waitSeconds(0)
+{
+    if(_readAhead<1) _readAhead=1;
+    _maxDenom=_maxDenom>=8?8:_maxDenom>=4?4:_maxDenom>=2?2:1;
+    pthread_mutex_init(&_mutex,NULL);
+    pthread_cond_init(&_decodedCond,NULL);
+    pthread_cond_init(&_takenCond,NULL);
+}
+
+FrameDecoder::~FrameDecoder()
+{
+    close();
+    pthread_cond_destroy(&_takenCond);
+    pthread_cond_destroy(&_decodedCond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+/// Modification time of a file, 0 if it does not exist
+static time_t fileTime(const std::string& file)
+{
+    struct stat st;
+    return stat(file.c_str(),&st)==0?st.st_mtime:0;
+}
+
+bool FrameDecoder::open()
+{
+    close();
+    int    first=svar.GetInt("FrameDecoder.FirstFrame",0);
+    string indexFile=_datapath+"/mission.idx";
+    if(svar.GetInt("FrameDecoder.Pack",1)&&_pack.open(_datapath+"/mission.pack"))
+        _mission=&_pack.index();
+    else if(svar.GetInt("FrameDecoder.Index",1)&&fileTime(indexFile))
+    {
+        if(fileTime(indexFile)<fileTime(_datapath+"/trajectory.txt"))
+            cerr<<"FrameDecoder::open: "<<indexFile<<" is older than trajectory.txt, not used.\n";
+        else if(_index.open(indexFile))
+            _mission=&_index;
+    }
+
+    if(_mission)
+    {
+        if(svar.exist("FrameDecoder.StartTime"))
+            first=_mission->find(svar.GetDouble("FrameDecoder.StartTime",0));
+        _indexNext=min((size_t)max(first,0),_mission->size());
+    }
+    else
+    {
+        _in.open((_datapath+"/trajectory.txt").c_str());
+        if(!_in.is_open())
+        {
+            cerr<<"FrameDecoder::open: Can't open file "<<(_datapath+"/trajectory.txt")<<endl;
+            return false;
+        }
+        string line;
+        for(int i=0;i<first&&getline(_in,line);i++);
+    }
+
+    _claimed=_next=0;
+    _end=-1;
+    _stop=false;
+    for(int i=0;i<_threadNum;i++)
+    {
+        Worker* worker=new Worker(this);
+        _workers.push_back(worker);
+        worker->start();
+    }
+    return true;
+}
+
+void FrameDecoder::close()
+{
+    pthread_mutex_lock(&_mutex);
+    _stop=true;
+    pthread_cond_broadcast(&_takenCond);
+    pthread_cond_broadcast(&_decodedCond);
+    pthread_mutex_unlock(&_mutex);
+
+    for(size_t i=0;i<_workers.size();i++)
+    {
+        _workers[i]->join();
+        delete _workers[i];
+    }
+    _workers.clear();
+    _decoded.clear();
+    if(_in.is_open()) _in.close();
+    _in.clear();
+    _mission=NULL;
+    _index.close();
+    _pack.close();
+}
+
+bool FrameDecoder::loadConfig(const std::string& datapath)
+{
+    if(access((datapath+"/config.cfg").c_str(),F_OK)==0)
+        return svar.ParseFile(datapath+"/config.cfg");
+
+    MissionPack pack;
+    if(!pack.open(datapath+"/mission.pack")) return false;
+    stringstream sst(pack.config());
+    return svar.ParseStream(sst);
+}
+
+bool FrameDecoder::readEntry(std::string& name,pi::SE3d& pose,
+                             const unsigned char*& image,size_t& bytes)
+{
+    image=NULL;
+    bytes=0;
+    if(_mission)
+    {
+        if(_indexNext>=_mission->size()) return false;
+        name=_mission->name(_indexNext);
+        pose=_mission->pose(_indexNext);
+        if(_pack.isOpen())
+        {
+            // the frames after the ones being decoded are read while waiting
+            image=_pack.image(_indexNext,bytes);
+            _pack.willNeed(_indexNext+1,_readAhead);
+        }
+        _indexNext++;
+        return true;
+    }
+
+    string line;
+    if(!getline(_in,line)) return false;
+    stringstream ifs(line);
+    ifs>>name>>pose;
+    return true;
+}
+
+void FrameDecoder::setScaledDecode(const PinHoleParameters& camera,const pi::SE3d& plane,
+                                   double lengthPixel)
+{
+    pthread_mutex_lock(&_mutex);
+    _camera=camera;
+    _plane =plane;
+    _lengthPixel=lengthPixel;
+    pthread_mutex_unlock(&_mutex);
+}
+
+int FrameDecoder::scaleDenom(const pi::SE3d& pose)
+{
+    if(_maxDenom<=1||_lengthPixel<=0||_camera.fx==0||_camera.fy==0) return 1;
+
+    // the ground resolution is the finest at the corner or center nearest to the plane
+    pi::SE3d    planePose=_plane.inverse()*pose;
+    pi::Point3d t=planePose.get_translation();
+    double      imgPts[5][2]={{0,0},{_camera.w,0},{0,_camera.h},
+                              {_camera.w,_camera.h},{_camera.cx,_camera.cy}};
+    double      depth=-1;
+    for(int i=0;i<5;i++)
+    {
+        pi::Point3d axis=planePose.get_rotation()*pi::Point3d((imgPts[i][0]-_camera.cx)/_camera.fx,
+                                                             (imgPts[i][1]-_camera.cy)/_camera.fy,1.);
+        if(axis.z*t.z>=0) continue;// misses the plane
+        double d=-t.z/axis.z;
+        if(depth<0||d<depth) depth=d;
+    }
+    if(depth<0) return 1;
+
+    double gsd=depth/max(fabs(_camera.fx),fabs(_camera.fy));
+    int    denom=1;
+    while(denom<_maxDenom&&gsd*denom*2<=_lengthPixel) denom*=2;
+    return denom;
+}
+
+/// The image in memory if any, else the file. libjpeg scales JPEG frames in
+/// the DCT domain, other formats are resized.
+static cv::Mat decodeScaled(const std::string& file,const unsigned char* image,size_t bytes,
+                            int denom)
+{
+#if CV_MAJOR_VERSION>3||(CV_MAJOR_VERSION==3&&CV_MINOR_VERSION>=2)
+    int flags=denom==8?cv::IMREAD_REDUCED_COLOR_8:denom==4?cv::IMREAD_REDUCED_COLOR_4:
+              denom==2?cv::IMREAD_REDUCED_COLOR_2:cv::IMREAD_COLOR;
+    if(image) return cv::imdecode(cv::Mat(1,(int)bytes,CV_8UC1,(void*)image),flags);
+    return cv::imread(file,flags);
+#else
+    // no reduced decode before OpenCV 3.2, only the warp gets cheaper
+    cv::Mat img=image?cv::imdecode(cv::Mat(1,(int)bytes,CV_8UC1,(void*)image),cv::IMREAD_COLOR)
+                     :cv::imread(file);
+    if(denom>1&&!img.empty())
+        cv::resize(img,img,cv::Size((img.cols+denom-1)/denom,(img.rows+denom-1)/denom),
+                   0,0,cv::INTER_AREA);
+    return img;
+#endif
+}
+
+bool FrameDecoder::decode(const std::string& name,const pi::SE3d& pose,
+                          const unsigned char* image,size_t bytes,
+                          std::pair<cv::Mat,pi::SE3d>& frame)
+{
+    PI_PROFILE_SCOPE("FrameDecoder::Decode");
+    frame.second=pose;
+
+    int denom;
+    pthread_mutex_lock(&_mutex);
+    denom=scaleDenom(frame.second);
+    pthread_mutex_unlock(&_mutex);
+
+    frame.first=decodeScaled(_datapath+"/rgb/"+name+".jpg",image,bytes,denom);
+    if(frame.first.empty()) return false;
+    PI_PROFILE_COUNT("FrameDecoder::Pixels",frame.first.total());
+    return true;
+}
+
+void FrameDecoder::workerLoop()
+{
+    pi::Profiler::instance().setThreadName("FrameDecoder::run");
+    pthread_mutex_lock(&_mutex);
+    while(true)
+    {
+        while(!_stop&&_end<0&&_claimed-_next>=_readAhead)
+            pthread_cond_wait(&_takenCond,&_mutex);
+        if(_stop||_end>=0) break;
+
+        // frames are claimed in order and may be decoded out of order
+        string               name;
+        pi::SE3d             pose;
+        const unsigned char* image;
+        size_t               bytes;
+        if(!readEntry(name,pose,image,bytes))
+        {
+            _end=_claimed;
+            pthread_cond_broadcast(&_decodedCond);
+            break;
+        }
+        int id=_claimed++;
+        _decoded[id];
+        pthread_mutex_unlock(&_mutex);
+
+        std::pair<cv::Mat,pi::SE3d> frame;
+        uint64_t begin=pi::Profiler::now();
+        bool     ok=decode(name,pose,image,bytes,frame);
+        double   seconds=(pi::Profiler::now()-begin)*1e-9;
+
+        pthread_mutex_lock(&_mutex);
+        _decodeSeconds+=seconds;
+        if(_stop) break;
+        Decoded& decoded=_decoded[id];
+        decoded.frame=frame;
+        decoded.ok=ok;
+        decoded.done=true;
+        if(!ok&&(_end<0||id<_end)) _end=id;
+        pthread_cond_broadcast(&_decodedCond);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool FrameDecoder::next(std::pair<cv::Mat,pi::SE3d>& frame)
+{
+    if(!isOpen()) return false;
+    if(_workers.empty())
+    {
+        string               name;
+        pi::SE3d             pose;
+        const unsigned char* image;
+        size_t               bytes;
+        if(!readEntry(name,pose,image,bytes)) return false;
+        uint64_t begin=pi::Profiler::now();
+        bool     ok=decode(name,pose,image,bytes,frame);
+        _decodeSeconds+=(pi::Profiler::now()-begin)*1e-9;
+        return ok;
+    }
+
+    PI_PROFILE_SCOPE("FrameDecoder::Wait");
+    uint64_t begin=pi::Profiler::now();
+    pthread_mutex_lock(&_mutex);
+    std::map<int,Decoded>::iterator it;
+    while(true)
+    {
+        if(_stop||(_end>=0&&_next>=_end))
+        {
+            _waitSeconds+=(pi::Profiler::now()-begin)*1e-9;
+            pthread_mutex_unlock(&_mutex);
+            return false;
+        }
+        it=_decoded.find(_next);
+        if(it!=_decoded.end()&&it->second.done) break;
+        pthread_cond_wait(&_decodedCond,&_mutex);
+    }
+    frame=it->second.frame;
+    _decoded.erase(it);
+    _next++;
+    _waitSeconds+=(pi::Profiler::now()-begin)*1e-9;
+    pthread_cond_broadcast(&_takenCond);
+    pthread_mutex_unlock(&_mutex);
+    return true;
+}
+
+double FrameDecoder::decodeSeconds()
+{
+    pthread_mutex_lock(&_mutex);
+    double seconds=_decodeSeconds;
+    pthread_mutex_unlock(&_mutex);
+    return seconds;
+}
+
+double FrameDecoder::waitSeconds()
+{
+    pthread_mutex_lock(&_mutex);
+    double seconds=_waitSeconds;
+    pthread_mutex_unlock(&_mutex);
+    return seconds;
+}
@@ -0,0 +1,150 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef FRAMEDECODER_H
+#define FRAMEDECODER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <pthread.h>
+#include <opencv2/core/core.hpp>
+
+#include <base/types/SE3.h>
+
+#include "Map2D.h"
+#include "MissionIndex.h"
+#include "MissionPack.h"
+
+/** Reads the frames of a dataset (trajectory.txt and the rgb folder) ahead
+    of the fusion.
+
+    A packed mission.pack (see MissionPack, FrameDecoder.Pack=1) is read
+    first, the images are then decoded from the mapped file. Otherwise the
+    binary mission.idx (see MissionIndex) is used instead of trajectory.txt
+    when the dataset has one and FrameDecoder.Index=1 (default). The replay
+    starts at FrameDecoder.FirstFrame, or with an index at the first frame
+    from FrameDecoder.StartTime, to fuse a part of a mission again.
+
+    The lines of trajectory.txt are taken in order by FrameDecoder.Threads
+    workers, which decode the images in parallel. next() hands the frames
+    back in the trajectory order, so the result does not depend on the
+    number of workers:
+
+        FrameDecoder decoder(datapath);
+        std::pair<cv::Mat,pi::SE3d> frame;
+        while(decoder.next(frame)) map->feed(frame.first,frame.second);
+
+    At most FrameDecoder.ReadAhead frames are decoded or being decoded
+    before next() takes them, which bounds the memory used. With
+    FrameDecoder.Threads=0 next() reads and decodes the frame itself.
+
+    With FrameDecoder.ScaledDecode=1 and a map resolution given by
+    setScaledDecode(), a JPEG is decoded at 1/2, 1/4 or 1/8 of its size in
+    the DCT domain when its finest ground resolution stays below the map
+    pixel, so the detail kept by the map is the same and the decode and warp
+    costs drop with the square of the scale. The scale is chosen per frame
+    from its pose, the backend finds it back with Map2DPrepare::frameScale().
+
+    The replay ends at the end of the file or at the first frame which can't
+    be decoded. The decode time of every frame is profiled as
+    FrameDecoder::Decode and the time next() waited for the workers as
+    FrameDecoder::Wait.
+*/
+class FrameDecoder
+{
+public:
+    FrameDecoder(const std::string& datapath);
+    ~FrameDecoder();
+
+    /// Open datapath/trajectory.txt and start the workers
+    bool open();
+    /// Stop the workers, frames not taken yet are dropped
+    void close();
+    bool isOpen()const{return _mission||_in.is_open();}
+
+    /// Parse datapath/config.cfg, or the one of datapath/mission.pack
+    static bool loadConfig(const std::string& datapath);
+
+    /// The next frame in trajectory order, false at the end
+    bool next(std::pair<cv::Mat,pi::SE3d>& frame);
+
+    /// Map resolution (meters per pixel, see Map2D::scaledFrameResolution)
+    /// the frames read from now on are decoded for, 0 decodes full frames
+    void setScaledDecode(const PinHoleParameters& camera,const pi::SE3d& plane,
+                         double lengthPixel);
+
+    /// Workers decoding ahead, 0 if next() decodes
+    int    threads()const{return _threadNum>0?_threadNum:0;}
+    int    readAhead()const{return _readAhead;}
+    /// Seconds spent decoding by all workers and next() waiting for them
+    double decodeSeconds();
+    double waitSeconds();
+
+private:
+    FrameDecoder(const FrameDecoder&);
+    FrameDecoder& operator=(const FrameDecoder&);
+
+    struct Decoded
+    {
+        Decoded():done(false),ok(false){}
+        std::pair<cv::Mat,pi::SE3d> frame;
+        bool                        done,ok;
+    };
+
+    class Worker;
+    friend class Worker;
+
+    void workerLoop();
+    /// The image name, pose and packed image (or NULL) of the next frame, called locked
+    bool readEntry(std::string& name,pi::SE3d& pose,const unsigned char*& image,size_t& bytes);
+    bool decode(const std::string& name,const pi::SE3d& pose,
+                const unsigned char* image,size_t bytes,
+                std::pair<cv::Mat,pi::SE3d>& frame);
+    /// 1, 2, 4 or 8 for a frame at pose, called locked
+    int  scaleDenom(const pi::SE3d& pose);
+
+    std::string           _datapath;
+    std::ifstream         _in;
+    MissionIndex          _index;
+    MissionPack           _pack;
+    const MissionIndex*   _mission;// of _index or _pack, NULL with _in
+    size_t                _indexNext;
+    int                   _threadNum,_readAhead,_maxDenom;
+    std::vector<Worker*>  _workers;
+
+    // below are locked by _mutex
+    std::map<int,Decoded> _decoded;// claimed frames by line number
+    int                   _claimed;// lines read by the workers
+    int                   _next;   // line returned by the next next()
+    int                   _end;    // first line not available, -1 if unknown
+    bool                  _stop;
+    PinHoleParameters     _camera;
+    pi::SE3d              _plane;
+    double                _lengthPixel;// 0: full frames
+    double                _decodeSeconds,_waitSeconds;
+    pthread_mutex_t       _mutex;
+    pthread_cond_t        _decodedCond,_takenCond;
+};
+
+#endif // FRAMEDECODER_H
@@ -25,10 +25,26 @@
 #include "Map2DRender.h"
 #include "Map2DGPU.h"
 #include "MultiBandMap2DCPU.h"
+#include "UtilCPU.h"
 #include <iostream>
+#include <cmath>
+#include <base/Svar/Svar.h>
 
 using namespace std;
 
+Map2DPrepare::Map2DPrepare()
+    :_keyFrameDistance(svar.GetDouble("Map2D.KeyFrameDistance",0.3)),
+      _lastKeyFrame(1e10,1e10,1e10)
+{
+    string policy=svar.GetString("Map2D.QueuePolicy","DropOldest");
+    if(policy=="Block")                 _frames.setPolicy(FrameQueue::Block);
+    else if(policy=="DropNewest")       _frames.setPolicy(FrameQueue::DropNewest);
+    else if(policy=="KeyFramePriority") _frames.setPolicy(FrameQueue::KeyFramePriority);
+    else if(policy!="DropOldest")
+        cerr<<"Map2DPrepare: Unknown Map2D.QueuePolicy "<<policy<<", DropOldest is used.\n";
+    _frames.setCapacity(svar.GetInt("Map2D.QueueSize",20));
+}
+
 bool Map2DPrepare::prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
                                         const std::deque<std::pair<cv::Mat,pi::SE3d> >& frames)
 {
@@ -39,17 +55,40 @@ bool Map2DPrepare::prepare(const pi::SE3d& plane,const PinHoleParameters& camera
     }
     _camera=camera;_fxinv=1./camera.fx;_fyinv=1./camera.fy;
     _plane =plane;
-    _frames=frames;
-    for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=_frames.begin();it!=_frames.end();it++)
+    std::deque<std::pair<cv::Mat,pi::SE3d> > planeFrames=frames;
+    for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=planeFrames.begin();it!=planeFrames.end();it++)
     {
         pi::SE3d& pose=it->second;
         pose=plane.inverse()*pose;//plane coordinate
     }
+    _frames.reset(planeFrames);
+    _lastKeyFrame=planeFrames.back().second.get_translation();
     return true;
 }
 
+bool Map2DPrepare::pushFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
+{
+    // a keyframe moved further than _keyFrameDistance times the height from the last one
+    const pi::Point3d& t=frame.second.get_translation();
+    bool isKeyFrame=(t-_lastKeyFrame).norm()>=_keyFrameDistance*fabs(t.z);
+    if(isKeyFrame) _lastKeyFrame=t;
+    return _frames.push(frame,isKeyFrame);
+}
+
+double Map2DPrepare::frameScale(const cv::Mat& img)const
+{
+    // libjpeg rounds the reduced size up, a resize rounds it to the nearest
+    for(int denom=1;denom<=8;denom*=2)
+        if(fabs(img.cols-_camera.w/denom)<1&&fabs(img.rows-_camera.h/denom)<1)
+            return 1./denom;
+    return 0;
+}
+
 SPtr<Map2D> Map2D::create(int type,bool thread)
 {
+    // Map2D.SIMD: 0 scalar, 1 SSE4.1, 2 AVX2, limited to what the processor supports
+    setSimdLevel((SimdLevel)svar.GetInt("Map2D.SIMD",cpuSimdLevel()));
+
     if(type==NoType) return SPtr<Map2D>();
     else if(type==TypeCPU)    return SPtr<Map2D>(new Map2DCPU(thread));
     else if(type==TypeMultiBandCPU) return SPtr<MultiBandMap2DCPU>(new MultiBandMap2DCPU(thread));
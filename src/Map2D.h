@@ -23,11 +23,14 @@
 #ifndef MAP2D_H
 #define MAP2D_H
 #include <deque>
+#include <vector>
+#include <stdint.h>
 #include <opencv2/features2d/features2d.hpp>
 
 #include <base/types/SPtr.h>
 #include <base/types/SE3.h>
 #include <base/system/thread/ThreadBase.h>
+#include <base/system/thread/BlockingQueue.h>
 #include <gui/gl/GL_Object.h>
 
 #define  ELE_PIXELS 256
@@ -42,12 +45,29 @@ struct PinHoleParameters
 
 struct Map2DPrepare//change when prepare
 {
-    uint queueSize(){pi::ReadMutex lock(mutexFrames);
-                  return _frames.size();}
+    typedef pi::BlockingQueue<std::pair<cv::Mat,pi::SE3d> > FrameQueue;
+
+    /// Queue settings: Map2D.QueueSize, Map2D.QueuePolicy and Map2D.KeyFrameDistance
+    Map2DPrepare();
+
+    uint queueSize(){return _frames.size();}
 
     bool prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
                  const std::deque<std::pair<cv::Mat,pi::SE3d> >& frames);
 
+    /// Queue a frame (plane coordinate) for the fusion thread, false if it is dropped
+    bool pushFrame(const std::pair<cv::Mat,pi::SE3d>& frame);
+
+    /// 1, 1/2, 1/4 or 1/8 if img is a camera frame decoded at that scale (see
+    /// FrameDecoder), 0 if its size does not match the camera
+    double frameScale(const cv::Mat& img)const;
+
+    /// Wait at most timeoutMs for a queued frame
+    bool popFrame(std::pair<cv::Mat,pi::SE3d>& frame,int timeoutMs)
+    {
+        return _frames.pop(frame,timeoutMs);
+    }
+
     pi::Point2d Project(const pi::Point3d& pt)
     {
         double zinv=1./pt.z;
@@ -63,15 +83,143 @@ struct Map2DPrepare//change when prepare
 
     std::deque<std::pair<cv::Mat,pi::SE3d> > getFrames()
     {
-        pi::ReadMutex lock(mutexFrames);
-        return _frames;
+        return _frames.items();
     }
 
     PinHoleParameters                        _camera;
     double                                   _fxinv,_fyinv;
     pi::SE3d                                 _plane;//all fixed
-    std::deque<std::pair<cv::Mat,pi::SE3d> > _frames;//camera coordinate
-    pi::MutexRW                              mutexFrames;
+    FrameQueue                               _frames;//camera coordinate
+    double                                   _keyFrameDistance;
+    pi::Point3d                              _lastKeyFrame;
+};
+
+/// The tiles of a map, a sparse index keyed by the integer tile coordinates.
+///
+/// Only covered tiles take memory: an open addressing hash table maps (x,y)
+/// to the tile, so a long corridor costs its length and not its bounding box.
+/// The grid is shared by all snapshots of the map data, which only differ by
+/// the window of tiles they see, thus growing the map copies nothing.
+///
+/// Readers look a tile up with at() without any lock or reference count, the
+/// pointer stays valid as long as the grid is alive. Tiles are created once by
+/// get() and published atomically. A table that is grown is kept until the
+/// grid is destroyed, as readers may still probe it.
+template <typename EleType>
+class Map2DGrid
+{
+public:
+    struct Entry
+    {
+        int      x,y;
+        EleType* ele;
+    };
+
+    Map2DGrid():_table(new Table(64)){}
+
+    ~Map2DGrid()
+    {
+        delete _table;
+        for(size_t i=0;i<_retired.size();i++) delete _retired[i];
+    }
+
+    /// Number of tiles created
+    size_t size(){pi::ScopedMutex lock(_mutex);return _owners.size();}
+
+    /// The tile at (x,y) or NULL, lock free
+    EleType* at(int x,int y)const
+    {
+        uint64_t key=makeKey(x,y);
+        const Table* table=_table;
+        for(uint i=hash(key)&table->mask;;i=(i+1)&table->mask)
+        {
+            const Slot& slot=table->slots[i];
+            EleType* ele=*(EleType* const volatile*)&slot.ele;
+            if(!ele) return NULL;
+            if(slot.key==key) return ele;
+        }
+    }
+
+    /// The tile at (x,y), created if needed
+    EleType* get(int x,int y)
+    {
+        EleType* ele=at(x,y);
+        if(ele) return ele;
+
+        pi::ScopedMutex lock(_mutex);
+        ele=at(x,y);
+        if(ele) return ele;
+
+        Table* table=_table;
+        if(2*(_owners.size()+1)>table->slots.size())// keep the load under 1/2
+        {
+            Table* grown=new Table(2*table->slots.size());
+            for(size_t i=0;i<table->slots.size();i++)
+                if(table->slots[i].ele) grown->insert(table->slots[i].key,table->slots[i].ele);
+            _retired.push_back(table);
+            __sync_synchronize();// the table is filled before it is visible
+            _table=table=grown;
+        }
+        _owners.push_back(SPtr<EleType>(new EleType()));
+        ele=_owners.back().get();
+        table->insert(makeKey(x,y),ele);
+        return ele;
+    }
+
+    /// The tiles inside the w x h window at (x0,y0), coordinates relative to it
+    void entries(std::vector<Entry>& result,int x0,int y0,int w,int h)const
+    {
+        result.clear();
+        const Table* table=_table;
+        for(size_t i=0;i<table->slots.size();i++)
+        {
+            const Slot& slot=table->slots[i];
+            EleType* ele=*(EleType* const volatile*)&slot.ele;
+            if(!ele) continue;
+            Entry entry;
+            entry.x=(int)(uint32_t)slot.key-x0;
+            entry.y=(int)(uint32_t)(slot.key>>32)-y0;
+            entry.ele=ele;
+            if(entry.x>=0&&entry.y>=0&&entry.x<w&&entry.y<h) result.push_back(entry);
+        }
+    }
+
+private:
+    Map2DGrid(const Map2DGrid&);
+    Map2DGrid& operator=(const Map2DGrid&);
+
+    struct Slot
+    {
+        Slot():key(0),ele(NULL){}
+        uint64_t key;
+        EleType* ele;// NULL: empty, written after key
+    };
+
+    struct Table
+    {
+        Table(size_t size):mask(size-1),slots(size){}
+
+        // called under _mutex, never overwrites a slot
+        void insert(uint64_t key,EleType* ele)
+        {
+            uint i=hash(key)&mask;
+            while(slots[i].ele) i=(i+1)&mask;
+            slots[i].key=key;
+            __sync_synchronize();// the key is written before the slot is visible
+            *(EleType* volatile*)&slots[i].ele=ele;
+        }
+
+        uint              mask;
+        std::vector<Slot> slots;
+    };
+
+    static uint64_t makeKey(int x,int y){return ((uint64_t)(uint32_t)y<<32)|(uint32_t)x;}
+    static uint     hash(uint64_t key){return (key*0x9E3779B97F4A7C15ULL)>>32;}
+
+    Table* volatile              _table;
+    std::vector<Table*>          _retired;
+    std::vector<SPtr<EleType> >  _owners;// written under _mutex only
+    pi::Mutex                    _mutex;
 };
 
 class Map2D:public pi::gl::GL_Object
@@ -92,7 +240,30 @@ public:
 
     virtual bool save(const std::string& filename){return false;}
 
+    /// Export the map as a web mercator tile pyramid folder/z/x/y.png, needs
+    /// GPS.Origin. Incremental only renders the tiles changed since the last
+    /// export to the same folder again.
+    virtual bool exportTiles(const std::string& folder,bool incremental=false){return false;}
+
     virtual uint queueSize(){return 0;}
+
+    /// Frames dropped by the queue policy since prepare
+    virtual uint droppedFrames(){return 0;}
+
+    /// Memory held by the tiles, bytes/tiles is the mean size of a tile.
+    /// Tiles evicted out of core are only counted by diskTiles and diskBytes.
+    struct MemoryStats
+    {
+        MemoryStats():tiles(0),bytes(0),maxTileBytes(0),diskTiles(0),diskBytes(0){}
+        size_t tiles,bytes,maxTileBytes;
+        size_t diskTiles,diskBytes;
+    };
+
+    virtual MemoryStats memoryStats(){return MemoryStats();}
+
+    /// Meters per map pixel if feed() takes frames decoded at 1/2, 1/4 or 1/8
+    /// of the camera size, 0 if it only takes full frames
+    virtual double scaledFrameResolution(){return 0;}
 };
 
 #endif // MAP2D_H
@@ -21,10 +21,14 @@
 
 *******************************************************************************/
 #include "Map2DCPU.h"
+#include "UtilCPU.h"
+#include "FrameArena.h"
+#include "WebTileExporter.h"
 #include <gui/gl/glHelper.h>
 #include <GL/gl.h>
 #include <base/Svar/Svar.h>
 #include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
 #include <gui/gl/SignalHandle.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -48,8 +52,9 @@ bool Map2DCPU::Map2DCPUData::prepare(SPtr<Map2DCPUPrepare> prepared)
     {
         _max=pi::Point3d(-1e10,-1e10,-1e10);
         _min=-_max;
-        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=prepared->_frames.begin();
-            it!=prepared->_frames.end();it++)
+        std::deque<std::pair<cv::Mat,pi::SE3d> > frames=prepared->getFrames();
+        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=frames.begin();
+            it!=frames.end();it++)
         {
             pi::SE3d& pose=it->second;
             pi::Point3d& t=pose.get_translation();
@@ -86,7 +91,6 @@ bool Map2DCPU::Map2DCPUData::prepare(SPtr<Map2DCPUPrepare> prepared)
             _h=ceil((_max.y-_min.y)/_eleSize);
             _max.x=_min.x+_eleSize*_w;
             _max.y=_min.y+_eleSize*_h;
-            _data.resize(_w*_h);
         }
     }
     return true;
@@ -97,10 +101,43 @@ Map2DCPU::Map2DCPUEle::~Map2DCPUEle()
     if(texName) pi::gl::Signal_Handle::instance().delete_texture(texName);
 }
 
+/// Blend the warped frame dst into the tile i of the covered tiles
+struct Map2DCPU::Map2DCPUApplyTask:public pi::ParallelTask
+{
+    Map2DCPUApplyTask(SPtr<Map2DCPUData> d_,const cv::Mat& dst_,int xminInt_,int yminInt_,int cols_)
+        :d(d_),dst(dst_),xminInt(xminInt_),yminInt(yminInt_),cols(cols_){}
+
+    virtual void run(int i)
+    {
+        int x=xminInt+i%cols;
+        int y=yminInt+i/cols;
+        Map2DCPUEle* ele=d->ele(y*d->w()+x);
+        {
+            pi::WriteMutex lock(ele->mutexData);
+            if(ele->img.empty())
+                ele->img=cv::Mat::zeros(ELE_PIXELS,ELE_PIXELS,dst.type());
+            for(int eleY=0;eleY<ELE_PIXELS;eleY++)
+                maxWeightBlend(ele->img.ptr(eleY),
+                               dst.ptr((y-yminInt)*ELE_PIXELS+eleY)+(x-xminInt)*ELE_PIXELS*4,
+                               ELE_PIXELS);
+            ele->Ischanged=true;
+            ele->exportDirty=true;
+        }
+    }
+
+    SPtr<Map2DCPUData>               d;
+    const cv::Mat&                   dst;
+    int                              xminInt,yminInt,cols;
+};
+
 Map2DCPU::Map2DCPU(bool thread)
     :alpha(svar.GetInt("Map2D.Alpha",0)),
      _valid(false),_thread(thread)
 {
+    // tiles are independent, blend them on Map2D.ApplyThreads threads (0: all cores)
+    int applyThreads=svar.GetInt("Map2D.ApplyThreads",0);
+    if(applyThreads<=0) applyThreads=pi::ThreadPool::processorNum();
+    if(applyThreads>1) applyPool=SPtr<pi::ThreadPool>(new pi::ThreadPool(applyThreads));
 }
 
 bool Map2DCPU::prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
@@ -114,6 +151,7 @@ bool Map2DCPU::prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
         if(d->prepare(p))
         {
             pi::WriteMutex lock(mutex);
+            if(prepared.get()) prepared->_frames.close();
             prepared=p;
             data=d;
             weightImage.release();
@@ -137,10 +175,7 @@ bool Map2DCPU::feed(cv::Mat img,const pi::SE3d& pose)
     std::pair<cv::Mat,pi::SE3d> frame(img,p->_plane.inverse()*pose);
     if(_thread)
     {
-        pi::WriteMutex lock(p->mutexFrames);
-        p->_frames.push_back(frame);
-        if(p->_frames.size()>20) p->_frames.pop_front();
-        return true;
+        return p->pushFrame(frame);
     }
     else
     {
@@ -148,6 +183,143 @@ bool Map2DCPU::feed(cv::Mat img,const pi::SE3d& pose)
     }
 }
 
+/// Warp the rows [block*BlockRows,(block+1)*BlockRows) of dst
+struct Map2DCPUWarpTask:public pi::ParallelTask
+{
+    enum{BlockRows=32};
+
+    Map2DCPUWarpTask(const cv::Mat& img_,const RadialWeight& weight_,const double* inv_,cv::Mat& dst_)
+        :img(img_),weight(weight_),inv(inv_),dst(dst_){}
+
+    int blocks()const{return (dst.rows+BlockRows-1)/BlockRows;}
+
+    virtual void run(int block)
+    {
+        int y0=block*BlockRows;
+        warpPerspectiveWeighted(img.data,img.step,weight,inv,0,y0,
+                                dst.ptr(y0),dst.step,dst.cols,std::min((int)BlockRows,dst.rows-y0));
+    }
+
+    const cv::Mat&      img;
+    const RadialWeight& weight;
+    const double*       inv;
+    cv::Mat&            dst;
+};
+
+/// Warp the frame into the tile tiles[i] of the grid, only the pixels inside
+/// the footprint of the frame are blended
+struct Map2DCPU::Map2DCPUTileWarpTask:public pi::ParallelTask
+{
+    Map2DCPUTileWarpTask(const cv::Mat& img_,const RadialWeight& weight_,const double* inv_,
+                         SPtr<Map2DCPUData> d_,const std::vector<int>& tiles_,int xminInt_,int yminInt_)
+        :img(img_),weight(weight_),inv(inv_),d(d_),tiles(tiles_),
+          xminInt(xminInt_),yminInt(yminInt_){}
+
+    virtual void run(int i)
+    {
+        int idx=tiles[i];
+        Map2DCPUEle* ele=d->ele(idx);
+        int x=idx%d->w(),y=idx/d->w();
+        {
+            pi::WriteMutex lock(ele->mutexData);
+            if(ele->img.empty())
+                ele->img=cv::Mat::zeros(ELE_PIXELS,ELE_PIXELS,CV_8UC4);
+            if(warpPerspectiveWeightedMax(img.data,img.step,weight,inv,
+                                          (x-xminInt)*ELE_PIXELS,(y-yminInt)*ELE_PIXELS,
+                                          ele->img.data,ele->img.step,ELE_PIXELS,ELE_PIXELS))
+            {
+                ele->Ischanged=true;
+                ele->exportDirty=true;
+            }
+        }
+    }
+
+    const cv::Mat&                   img;
+    const RadialWeight&              weight;
+    const double*                    inv;
+    SPtr<Map2DCPUData>               d;
+    const std::vector<int>&          tiles;
+    int                              xminInt,yminInt;
+};
+
+SPtr<RadialWeight> Map2DCPU::getRadialWeight(const cv::Mat& img)
+{
+    SPtr<RadialWeight> weight;
+    {
+        pi::ReadMutex lock(mutex);
+        weight=radialWeight;
+    }
+    if(!weight.get()||weight->cols()!=img.cols||weight->rows()!=img.rows)
+    {
+        weight=SPtr<RadialWeight>(new RadialWeight(img.cols,img.rows,
+                                                   svar.GetInt("Map2D.WeightType",0)));
+        pi::WriteMutex lock(mutex);
+        radialWeight=weight;
+    }
+    return weight;
+}
+
+void Map2DCPU::warpFused(const cv::Mat& img,const cv::Mat& transmtx,cv::Mat& dst)
+{
+    SPtr<RadialWeight> weight=getRadialWeight(img);
+    cv::Mat inv=transmtx.inv();// CV_64F as given by getPerspectiveTransform
+    Map2DCPUWarpTask task(img,*weight,(const double*)inv.data,dst);
+    if(applyPool.get()) applyPool->parallelFor(task.blocks(),task);
+    else for(int i=0,iend=task.blocks();i<iend;i++) task.run(i);
+}
+
+void Map2DCPU::warpWithWeightImage(const cv::Mat& img,const cv::Mat& transmtx,cv::Mat& dst)
+{
+    cv::Mat src;
+    if(weightImage.empty()||weightImage.cols!=img.cols||weightImage.rows!=img.rows)
+    {
+        pi::WriteMutex lock(mutex);
+        int w=img.cols;
+        int h=img.rows;
+        weightImage.create(h,w,CV_8UC4);
+        pi::byte *p=(weightImage.data);
+        float x_center=w/2;
+        float y_center=h/2;
+        float dis_max=sqrt(x_center*x_center+y_center*y_center);
+        int weightType=svar.GetInt("Map2D.WeightType",0);
+        for(int i=0;i<h;i++)
+            for(int j=0;j<w;j++)
+            {
+                float dis=(i-y_center)*(i-y_center)+(j-x_center)*(j-x_center);
+                dis=1-sqrt(dis)/dis_max;
+                p[1]=p[2]=p[0]=0;
+                if(0==weightType)
+                    p[3]=dis*254.;
+                else p[3]=dis*dis*254;
+                if(p[3]<2) p[3]=2;
+                p+=4;
+            }
+        src=weightImage.clone();
+    }
+    else
+    {
+        pi::ReadMutex lock(mutex);
+        src=weightImage.clone();
+    }
+    pi::Array_<pi::byte,4> *psrc=(pi::Array_<pi::byte,4>*)src.data;
+    pi::Array_<pi::byte,3> *pimg=(pi::Array_<pi::byte,3>*)img.data;
+//    float weight=(frame.second.get_rotation()*pi::Point3d(0,0,1)).dot(downLook);
+    for(int i=0,iend=weightImage.cols*weightImage.rows;i<iend;i++)
+    {
+        *((pi::Array_<pi::byte,3>*)psrc)=*pimg;
+//        psrc->data[3]*=weight;
+        psrc++;
+        pimg++;
+    }
+
+    if(svar.GetInt("ShowSRC",0))
+    {
+        cv::imshow("src",src);
+    }
+
+    cv::warpPerspective(src, dst, transmtx, dst.size(),cv::INTER_LINEAR);
+}
+
 bool Map2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
 {
     SPtr<Map2DCPUPrepare> p;
@@ -156,25 +328,19 @@ bool Map2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
         pi::ReadMutex lock(mutex);
         p=prepared;d=data;
     }
-    if(frame.first.cols!=p->_camera.w||frame.first.rows!=p->_camera.h||frame.first.type()!=CV_8UC3)
+    double scale=p->frameScale(frame.first);// frames may be decoded at a reduced size
+    if(scale<=0||frame.first.type()!=CV_8UC3)
     {
-        cerr<<"Map2DCPU::renderFrame: frame.first.cols!=p->_camera.w||frame.first.rows!=p->_camera.h||frame.first.type()!=CV_8UC3\n";
+        cerr<<"Map2DCPU::renderFrame: p->frameScale(frame.first)<=0||frame.first.type()!=CV_8UC3\n";
         return false;
     }
     // pose->pts
-    std::vector<pi::Point2d>          imgPts;
-    {
-        imgPts.reserve(4);
-        imgPts.push_back(pi::Point2d(0,0));
-        imgPts.push_back(pi::Point2d(p->_camera.w,0));
-        imgPts.push_back(pi::Point2d(0,p->_camera.h));
-        imgPts.push_back(pi::Point2d(p->_camera.w,p->_camera.h));
-    }
-    vector<pi::Point2d> pts;
-    pts.reserve(imgPts.size());
+    pi::Point2d imgPts[4]={pi::Point2d(0,0),pi::Point2d(p->_camera.w,0),
+                           pi::Point2d(0,p->_camera.h),pi::Point2d(p->_camera.w,p->_camera.h)};
+    pi::Point2d pts[4];
     pi::Point3d downLook(0,0,-1);
     if(frame.second.get_translation().z<0) downLook=pi::Point3d(0,0,1);
-    for(int i=0;i<imgPts.size();i++)
+    for(int i=0;i<4;i++)
     {
         pi::Point3d axis=frame.second.get_rotation()*p->UnProject(imgPts[i]);
         if(axis.dot(downLook)<0.4)
@@ -183,14 +349,14 @@ bool Map2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
         }
         axis=frame.second.get_translation()
                 -axis*(frame.second.get_translation().z/axis.z);
-        pts.push_back(pi::Point2d(axis.x,axis.y));
+        pts[i]=pi::Point2d(axis.x,axis.y);
     }
     // dest location?
     double xmin=pts[0].x;
     double xmax=xmin;
     double ymin=pts[0].y;
     double ymax=ymin;
-    for(int i=1;i<pts.size();i++)
+    for(int i=1;i<4;i++)
     {
         if(pts[i].x<xmin) xmin=pts[i].x;
         if(pts[i].y<ymin) ymin=pts[i].y;
@@ -232,106 +398,68 @@ bool Map2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
         xmax=d->min().x+d->eleSize()*xmaxInt;
         ymax=d->min().y+d->eleSize()*ymaxInt;
     }
-    // prepare dst image
-    cv::Mat src;
-    if(weightImage.empty()||weightImage.cols!=frame.first.cols||weightImage.rows!=frame.first.rows)
+    // homography from the frame to the covered tiles
+    cv::Point2f destPoints[4];
+    cv::Mat     transmtx;
     {
-        pi::WriteMutex lock(mutex);
-        int w=frame.first.cols;
-        int h=frame.first.rows;
-        weightImage.create(h,w,CV_8UC4);
-        pi::byte *p=(weightImage.data);
-        float x_center=w/2;
-        float y_center=h/2;
-        float dis_max=sqrt(x_center*x_center+y_center*y_center);
-        int weightType=svar.GetInt("Map2D.WeightType",0);
-        for(int i=0;i<h;i++)
-            for(int j=0;j<w;j++)
-            {
-                float dis=(i-y_center)*(i-y_center)+(j-x_center)*(j-x_center);
-                dis=1-sqrt(dis)/dis_max;
-                p[1]=p[2]=p[0]=0;
-                if(0==weightType)
-                    p[3]=dis*254.;
-                else p[3]=dis*dis*254;
-                if(p[3]<2) p[3]=2;
-                p+=4;
-            }
-        src=weightImage.clone();
-    }
-    else
-    {
-        pi::ReadMutex lock(mutex);
-        src=weightImage.clone();
-    }
-    pi::Array_<pi::byte,4> *psrc=(pi::Array_<pi::byte,4>*)src.data;
-    pi::Array_<pi::byte,3> *pimg=(pi::Array_<pi::byte,3>*)frame.first.data;
-//    float weight=(frame.second.get_rotation()*pi::Point3d(0,0,1)).dot(downLook);
-    for(int i=0,iend=weightImage.cols*weightImage.rows;i<iend;i++)
-    {
-        *((pi::Array_<pi::byte,3>*)psrc)=*pimg;
-//        psrc->data[3]*=weight;
-        psrc++;
-        pimg++;
+        cv::Point2f imgPtsCV[4];
+        for(int i=0;i<4;i++)
+        {
+            imgPtsCV[i]  =cv::Point2f(imgPts[i].x*scale,imgPts[i].y*scale);
+            destPoints[i]=cv::Point2f((pts[i].x-xmin)*d->lengthPixelInv(),
+                                      (pts[i].y-ymin)*d->lengthPixelInv());
+        }
+        transmtx = cv::getPerspectiveTransform(imgPtsCV, destPoints);
     }
 
-    if(svar.GetInt("ShowSRC",0))
+    if(svar.GetInt("Map2D.TileWarp",1))
     {
-        cv::imshow("src",src);
+        // warp and blend straight into the tiles touched by the footprint, not
+        // comparable with the separate Warp and Apply stages of Map2D.TileWarp=0
+        PI_PROFILE_SCOPE("Map2DCPU::TileWarp");
+        SPtr<RadialWeight> weight=getRadialWeight(frame.first);
+        cv::Mat inv=transmtx.inv();// CV_64F as given by getPerspectiveTransform
+        double  quad[8]={destPoints[0].x,destPoints[0].y,destPoints[1].x,destPoints[1].y,
+                         destPoints[3].x,destPoints[3].y,destPoints[2].x,destPoints[2].y};
+        std::vector<int> tiles;
+        for(int y=0;y<ymaxInt-yminInt;y++)
+            for(int x=0;x<xmaxInt-xminInt;x++)
+                if(quadIntersectsRect(quad,x*ELE_PIXELS,y*ELE_PIXELS,
+                                      (x+1)*ELE_PIXELS,(y+1)*ELE_PIXELS))
+                    tiles.push_back((y+yminInt)*d->w()+x+xminInt);
+
+        Map2DCPUTileWarpTask task(frame.first,*weight,(const double*)inv.data,
+                                  d,tiles,xminInt,yminInt);
+        int n=(int)tiles.size();
+        if(applyPool.get()) applyPool->parallelFor(n,task);
+        else for(int i=0;i<n;i++) task.run(i);
+        PI_PROFILE_COUNT("Map2DCPU::ApplyTiles",n);
+        return true;
     }
 
-    cv::Mat dst((ymaxInt-yminInt)*ELE_PIXELS,(xmaxInt-xminInt)*ELE_PIXELS,src.type());
-
-    std::vector<cv::Point2f>          imgPtsCV;
-    {
-        imgPtsCV.reserve(imgPts.size());
-        for(int i=0;i<imgPts.size();i++)
-            imgPtsCV.push_back(cv::Point2f(imgPts[i].x,imgPts[i].y));
-    }
-    std::vector<cv::Point2f> destPoints;
-    destPoints.reserve(imgPtsCV.size());
-    for(int i=0;i<imgPtsCV.size();i++)
+    // prepare dst image, reused by the next frames of this thread
+    cv::Mat dst;
     {
-        destPoints.push_back(cv::Point2f((pts[i].x-xmin)*d->lengthPixelInv(),
-                             (pts[i].y-ymin)*d->lengthPixelInv()));
+        PI_PROFILE_SCOPE("Map2DCPU::Warp");
+        dst=FrameArena::thread().mat(FrameArena::Dst,(ymaxInt-yminInt)*ELE_PIXELS,
+                                     (xmaxInt-xminInt)*ELE_PIXELS,CV_8UC4);
+        if(svar.GetInt("Map2D.FusedWarp",1))
+            warpFused(frame.first,transmtx,dst);
+        else
+            warpWithWeightImage(frame.first,transmtx,dst);
     }
 
-    cv::Mat transmtx = cv::getPerspectiveTransform(imgPtsCV, destPoints);
-    cv::warpPerspective(src, dst, transmtx, dst.size(),cv::INTER_LINEAR);
-
     if(svar.GetInt("ShowDST",0))
     {
         cv::imshow("dst",dst);
     }
     // apply dst to eles
-    pi::timer.enter("Apply");
-    std::vector<SPtr<Map2DCPUEle> > dataCopy=d->data();
-    for(int x=xminInt;x<xmaxInt;x++)
-        for(int y=yminInt;y<ymaxInt;y++)
-        {
-            SPtr<Map2DCPUEle> ele=dataCopy[y*d->w()+x];
-            if(!ele.get())
-            {
-                ele=d->ele(y*d->w()+x);
-            }
-            {
-                pi::WriteMutex lock(ele->mutexData);
-                if(ele->img.empty())
-                    ele->img=cv::Mat::zeros(ELE_PIXELS,ELE_PIXELS,dst.type());
-                pi::Array_<pi::byte,4> *eleP=(pi::Array_<pi::byte,4>*)ele->img.data;
-                pi::Array_<pi::byte,4> *dstP=(pi::Array_<pi::byte,4>*)dst.data;
-                dstP+=(x-xminInt)*ELE_PIXELS+(y-yminInt)*ELE_PIXELS*dst.cols;
-                int skip=dst.cols-ele->img.cols;
-                for(int eleY=0;eleY<ELE_PIXELS;eleY++,dstP+=skip)
-                    for(int eleX=0;eleX<ELE_PIXELS;eleX++,dstP++,eleP++)
-                    {
-                        if(eleP->data[3]<dstP->data[3])
-                            *eleP=*dstP;
-                    }
-                ele->Ischanged=true;
-            }
-        }
-    pi::timer.leave("Apply");
+    PI_PROFILE_SCOPE("Map2DCPU::Apply");
+    Map2DCPUApplyTask task(d,dst,xminInt,yminInt,xmaxInt-xminInt);
+    int tiles=(xmaxInt-xminInt)*(ymaxInt-yminInt);
+    if(applyPool.get()) applyPool->parallelFor(tiles,task);
+    else for(int i=0;i<tiles;i++) task.run(i);
+    PI_PROFILE_COUNT("Map2DCPU::ApplyTiles",tiles);
 
     return true;
 }
@@ -339,7 +467,7 @@ bool Map2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
 
 bool Map2DCPU::spreadMap(double xmin,double ymin,double xmax,double ymax)
 {
-    pi::timer.enter("Map2DCPU::spreadMap");
+    PI_PROFILE_SCOPE("Map2DCPU::spreadMap");
     SPtr<Map2DCPUData> d;
     {
         pi::ReadMutex lock(mutex);
@@ -360,43 +488,31 @@ bool Map2DCPU::spreadMap(double xmin,double ymin,double xmax,double ymax)
         max.x=min.x+w*d->eleSize();
         max.y=min.y+h*d->eleSize();
     }
-    std::vector<SPtr<Map2DCPUEle> > dataOld=d->data();
-    std::vector<SPtr<Map2DCPUEle> > dataCopy;
-    dataCopy.resize(w*h);
-    {
-        for(int x=0,xend=d->w();x<xend;x++)
-            for(int y=0,yend=d->h();y<yend;y++)
-            {
-                dataCopy[x-xminInt+(y-yminInt)*w]=dataOld[y*d->w()+x];
-            }
-    }
     //apply
     {
         pi::WriteMutex lock(mutex);
         data=SPtr<Map2DCPUData>(new Map2DCPUData(d->eleSize(),d->lengthPixel(),
                                                  pi::Point3d(max.x,max.y,d->max().z),
                                                  pi::Point3d(min.x,min.y,d->min().z),
-                                                 w,h,dataCopy));
+                                                 w,h,d->grid(),d->x0()+xminInt,d->y0()+yminInt));
     }
-    pi::timer.leave("Map2DCPU::spreadMap");
     return true;
 }
 
 bool Map2DCPU::getFrame(std::pair<cv::Mat,pi::SE3d>& frame)
 {
-    pi::ReadMutex lock(mutex);
-    pi::ReadMutex lock1(prepared->mutexFrames);
-    if(prepared->_frames.size())
+    SPtr<Map2DCPUPrepare> p;
     {
-        frame=prepared->_frames.front();
-        prepared->_frames.pop_front();
-        return true;
+        pi::ReadMutex lock(mutex);
+        p=prepared;
     }
-    else return false;
+    // wake up at least every 100ms to check shouldStop()
+    return p->popFrame(frame,100);
 }
 
 void Map2DCPU::run()
 {
+    pi::Profiler::instance().setThreadName("Map2DCPU::run");
     std::pair<cv::Mat,pi::SE3d> frame;
     while(!shouldStop())
     {
@@ -404,12 +520,11 @@ void Map2DCPU::run()
         {
             if(getFrame(frame))
             {
-                pi::timer.enter("Map2DCPU::renderFrame");
+                PI_PROFILE_SCOPE("Map2DCPU::renderFrame");
                 renderFrame(frame);
-                pi::timer.leave("Map2DCPU::renderFrame");
             }
         }
-        sleep(10);
+        else sleep(10);
     }
 }
 
@@ -477,46 +592,42 @@ void Map2DCPU::draw()
     }
     GLint last_texture_ID;
     glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture_ID);
-    std::vector<SPtr<Map2DCPUEle> > dataCopy=d->data();
-    int wCopy=d->w(),hCopy=d->h();
+    std::vector<Map2DGrid<Map2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
     glColor3ub(255,255,255);
-    for(int x=0;x<wCopy;x++)
-        for(int y=0;y<hCopy;y++)
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        float x0=d->min().x+tiles[i].x*d->eleSize();
+        float y0=d->min().y+tiles[i].y*d->eleSize();
+        float x1=x0+d->eleSize();
+        float y1=y0+d->eleSize();
+        Map2DCPUEle* ele=tiles[i].ele;
+        if(ele->img.empty()) continue;
+        if(ele->texName==0)
         {
-            int idxData=y*wCopy+x;
-            float x0=d->min().x+x*d->eleSize();
-            float y0=d->min().y+y*d->eleSize();
-            float x1=x0+d->eleSize();
-            float y1=y0+d->eleSize();
-            SPtr<Map2DCPUEle> ele=dataCopy[idxData];
-            if(!ele.get())  continue;
-            if(ele->img.empty()) continue;
-            if(ele->texName==0)
-            {
-                glGenTextures(1, &ele->texName);
-            }
-            if(ele->Ischanged&&ticTac.Tac()<0.02)
-            {
-                pi::timer.enter("glTexImage2D");
-                pi::ReadMutex lock1(ele->mutexData);
-                glBindTexture(GL_TEXTURE_2D,ele->texName);
-//                if(ele->img.elemSize()==1)
-                    glTexImage2D(GL_TEXTURE_2D, 0,
-                                 GL_RGBA, ele->img.cols,ele->img.rows, 0,
-                                 GL_BGRA, GL_UNSIGNED_BYTE,ele->img.data);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,  GL_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,GL_NEAREST);
-                ele->Ischanged=false;
-                pi::timer.leave("glTexImage2D");
-            }
+            glGenTextures(1, &ele->texName);
+        }
+        if(ele->Ischanged&&ticTac.Tac()<0.02)
+        {
+            PI_PROFILE_SCOPE("Map2DCPU::glTexImage2D");
+            pi::ReadMutex lock1(ele->mutexData);
             glBindTexture(GL_TEXTURE_2D,ele->texName);
-            glBegin(GL_QUADS);
-            glTexCoord2f(0.0f, 0.0f); glVertex3f(x0,y0,0);
-            glTexCoord2f(0.0f, 1.0f); glVertex3f(x0,y1,0);
-            glTexCoord2f(1.0f, 1.0f); glVertex3f(x1,y1,0);
-            glTexCoord2f(1.0f, 0.0f); glVertex3f(x1,y0,0);
-            glEnd();
+//                if(ele->img.elemSize()==1)
+                glTexImage2D(GL_TEXTURE_2D, 0,
+                             GL_RGBA, ele->img.cols,ele->img.rows, 0,
+                             GL_BGRA, GL_UNSIGNED_BYTE,ele->img.data);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,  GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+            ele->Ischanged=false;
         }
+        glBindTexture(GL_TEXTURE_2D,ele->texName);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0f, 0.0f); glVertex3f(x0,y0,0);
+        glTexCoord2f(0.0f, 1.0f); glVertex3f(x0,y1,0);
+        glTexCoord2f(1.0f, 1.0f); glVertex3f(x1,y1,0);
+        glTexCoord2f(1.0f, 0.0f); glVertex3f(x1,y0,0);
+        glEnd();
+    }
     glBindTexture(GL_TEXTURE_2D, last_texture_ID);
     glPopMatrix();
 }
@@ -532,34 +643,152 @@ bool Map2DCPU::save(const std::string& filename)
     }
     if(d->w()==0||d->h()==0) return false;
 
+    std::vector<Map2DGrid<Map2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
     pi::Point2i minInt(1e6,1e6),maxInt(-1e6,-1e6);
-    for(int x=0;x<d->w();x++)
-        for(int y=0;y<d->h();y++)
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        int x=tiles[i].x,y=tiles[i].y;
         {
-            SPtr<Map2DCPUEle> ele=d->data()[x+y*d->w()];
-            if(!ele.get()) continue;
-            {
-                pi::ReadMutex lock(ele->mutexData);
-                if(ele->img.empty()) continue;
-            }
-            minInt.x=min(minInt.x,x); minInt.y=min(minInt.y,y);
-            maxInt.x=max(maxInt.x,x); maxInt.y=max(maxInt.y,y);
+            pi::ReadMutex lock(tiles[i].ele->mutexData);
+            if(tiles[i].ele->img.empty()) continue;
         }
+        minInt.x=min(minInt.x,x); minInt.y=min(minInt.y,y);
+        maxInt.x=max(maxInt.x,x); maxInt.y=max(maxInt.y,y);
+    }
+    if(minInt.x>maxInt.x) return false;
 
     maxInt=maxInt+pi::Point2i(1,1);
     pi::Point2i wh=maxInt-minInt;
     cv::Mat result(wh.y*ELE_PIXELS,wh.x*ELE_PIXELS,CV_8UC4);
-    for(int x=minInt.x;x<maxInt.x;x++)
-        for(int y=minInt.y;y<maxInt.y;y++)
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        Map2DCPUEle* ele=tiles[i].ele;
+        int x=tiles[i].x,y=tiles[i].y;
         {
-            SPtr<Map2DCPUEle> ele=d->data()[x+y*d->w()];
-            if(!ele.get()) continue;
-            {
-                pi::ReadMutex lock(ele->mutexData);
-                ele->img.copyTo(result(cv::Rect(ELE_PIXELS*(x-minInt.x),ELE_PIXELS*(y-minInt.y),ELE_PIXELS,ELE_PIXELS)));
-            }
+            pi::ReadMutex lock(ele->mutexData);
+            if(ele->img.empty()) continue;
+            ele->img.copyTo(result(cv::Rect(ELE_PIXELS*(x-minInt.x),ELE_PIXELS*(y-minInt.y),ELE_PIXELS,ELE_PIXELS)));
         }
+    }
 
     cv::imwrite(filename,result);
     return true;
 }
+
+/// The tiles for WebTileExporter, the weight in alpha becomes opaque
+struct Map2DCPU::Map2DCPUTileSource:public MapTileSource
+{
+    Map2DCPUTileSource(SPtr<Map2DCPUData> d_):d(d_){}
+
+    virtual bool mapTile(int x,int y,cv::Mat& bgra)
+    {
+        if(x<0||y<0||x>=d->w()||y>=d->h()) return false;
+        Map2DCPUEle* ele=d->at(y*d->w()+x);
+        if(!ele) return false;
+        {
+            pi::ReadMutex lock(ele->mutexData);
+            if(ele->img.empty()) return false;
+            ele->img.copyTo(bgra);
+        }
+        for(int r=0;r<bgra.rows;r++)
+        {
+            uchar* alpha=bgra.ptr(r)+3;
+            for(int c=0;c<bgra.cols;c++,alpha+=4)
+                if(*alpha) *alpha=255;
+        }
+        return true;
+    }
+
+    SPtr<Map2DCPUData>               d;
+};
+
+bool Map2DCPU::exportTiles(const std::string& folder,bool incremental)
+{
+    if(!svar.exist("GPS.Origin"))
+    {
+        cerr<<"Map2DCPU::exportTiles: GPS.Origin is needed to export web tiles.\n";
+        return false;
+    }
+    SPtr<Map2DCPUPrepare> p;
+    SPtr<Map2DCPUData>    d;
+    {
+        pi::ReadMutex lock(mutex);
+        p=prepared;d=data;
+    }
+    if(!p.get()||d->w()==0||d->h()==0) return false;
+    incremental=incremental&&folder==_exportFolder;
+
+    // the dirty flags are taken now, frames fused meanwhile go to the next export
+    std::vector<Map2DGrid<Map2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+    std::vector<pi::Point2i> content,dirty;
+    std::vector<Map2DCPUEle*> dirtyEles;
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        Map2DCPUEle* ele=tiles[i].ele;
+        pi::WriteMutex lock(ele->mutexData);
+        if(ele->img.empty()) continue;
+        content.push_back(pi::Point2i(tiles[i].x,tiles[i].y));
+        if(ele->exportDirty)
+        {
+            dirty.push_back(content.back());
+            dirtyEles.push_back(ele);
+            ele->exportDirty=false;
+        }
+    }
+    if(content.empty()) return false;
+
+    WebTileExporter::Geometry geometry;
+    geometry.plane      =p->_plane;
+    geometry.gpsOrigin  =svar.get_var("GPS.Origin",pi::Point3d(0,0,0));
+    geometry.min        =pi::Point2d(d->min().x,d->min().y);
+    geometry.lengthPixel=d->lengthPixel();
+    geometry.tileSize   =ELE_PIXELS;
+
+    Map2DCPUTileSource source(d);
+    WebTileExporter    exporter(source,geometry);
+    if(!exporter.exportTiles(folder,content,incremental?&dirty:NULL))
+    {
+        for(size_t i=0;i<dirtyEles.size();i++)
+        {
+            pi::WriteMutex lock(dirtyEles[i]->mutexData);
+            dirtyEles[i]->exportDirty=true;
+        }
+        return false;
+    }
+    _exportFolder=folder;
+    return true;
+}
+
+double Map2DCPU::scaledFrameResolution()
+{
+    pi::ReadMutex lock(mutex);
+    return data.get()?data->lengthPixel():0;
+}
+
+Map2D::MemoryStats Map2DCPU::memoryStats()
+{
+    MemoryStats stats;
+    SPtr<Map2DCPUData> d;
+    {
+        pi::ReadMutex lock(mutex);
+        d=data;
+    }
+    if(!d.get()) return stats;
+
+    std::vector<Map2DGrid<Map2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        size_t bytes;
+        {
+            pi::ReadMutex lock(tiles[i].ele->mutexData);
+            bytes=tiles[i].ele->img.total()*tiles[i].ele->img.elemSize();
+        }
+        stats.tiles++;
+        stats.bytes+=bytes;
+        stats.maxTileBytes=std::max(stats.maxTileBytes,bytes);
+    }
+    return stats;
+}
@@ -24,6 +24,8 @@
 #define MAP2DCPU_H
 #include "Map2D.h"
 #include <base/system/thread/ThreadBase.h>
+#include <base/system/thread/ThreadPool.h>
+#include "UtilCPU.h"
 
 #define  ELE_PIXELS 256
 
@@ -33,22 +35,23 @@ class Map2DCPU:public Map2D,public pi::Thread
 
     struct Map2DCPUEle
     {
-        Map2DCPUEle():texName(0),Ischanged(false){}
+        Map2DCPUEle():texName(0),Ischanged(false),exportDirty(false){}
         ~Map2DCPUEle();
         cv::Mat img;
         uint    texName;
         bool    Ischanged;
+        bool    exportDirty;// changed since the last exportTiles
         pi::MutexRW mutexData;
     };
 
     struct Map2DCPUData//change when spread and prepare
     {
-        Map2DCPUData():_w(0),_h(0){}
+        Map2DCPUData():_w(0),_h(0),_x0(0),_y0(0),_grid(new Map2DGrid<Map2DCPUEle>()){}
         Map2DCPUData(double eleSize_,double lengthPixel_,pi::Point3d max_,pi::Point3d min_,
-                     int w_,int h_,const std::vector<SPtr<Map2DCPUEle> >& d_)
+                     int w_,int h_,SPtr<Map2DGrid<Map2DCPUEle> > grid_,int x0_,int y0_)
             :_eleSize(eleSize_),_eleSizeInv(1./eleSize_),
               _lengthPixel(lengthPixel_),_lengthPixelInv(1./lengthPixel_),
-              _min(min_),_max(max_),_w(w_),_h(h_),_data(d_){}
+              _min(min_),_max(max_),_w(w_),_h(h_),_x0(x0_),_y0(y0_),_grid(grid_){}
 
         bool   prepare(SPtr<Map2DCPUPrepare> prepared);// only done Once!
 
@@ -60,30 +63,41 @@ class Map2DCPU:public Map2D,public pi::Thread
         const pi::Point3d& max()const{return _max;}
         const int w()const{return _w;}
         const int h()const{return _h;}
+        /// Grid coordinates of the tile 0
+        const int x0()const{return _x0;}
+        const int y0()const{return _y0;}
+
+        /// The tile at idx or NULL, no lock and no copy
+        Map2DCPUEle* at(uint idx)const{
+            if(idx>=(uint)(_w*_h)) return NULL;
+            return _grid->at(_x0+idx%_w,_y0+idx/_w);
+        }
+
+        /// The tile at idx, created if needed
+        Map2DCPUEle* ele(uint idx){
+            if(idx>=(uint)(_w*_h)) return NULL;
+            return _grid->get(_x0+idx%_w,_y0+idx/_w);
+        }
 
-        std::vector<SPtr<Map2DCPUEle> > data()
-        {pi::ReadMutex lock(mutexData);return _data;}
-
-        SPtr<Map2DCPUEle> ele(uint idx)
-        {
-            pi::WriteMutex lock(mutexData);
-            if(idx>_data.size()) return SPtr<Map2DCPUEle>();
-            else if(!_data[idx].get())
-            {
-                _data[idx]=SPtr<Map2DCPUEle>(new Map2DCPUEle());
-            }
-            return _data[idx];
+        /// The created tiles of this snapshot, (x,y) relative to the tile 0
+        void tiles(std::vector<Map2DGrid<Map2DCPUEle>::Entry>& result)const{
+            _grid->entries(result,_x0,_y0,_w,_h);
         }
 
+        SPtr<Map2DGrid<Map2DCPUEle> > grid(){return _grid;}
+
     private:
         //IMPORTANT: everything should never changed after prepared!
         double      _eleSize,_lengthPixel,_eleSizeInv,_lengthPixelInv;
         pi::Point3d _max,_min;
-        int         _w,_h;
-        std::vector<SPtr<Map2DCPUEle> >  _data;
-        pi::MutexRW mutexData;
+        int         _w,_h,_x0,_y0;
+        SPtr<Map2DGrid<Map2DCPUEle> > _grid;// shared by all snapshots
     };
 
+    struct Map2DCPUApplyTask;
+    struct Map2DCPUTileWarpTask;
+    struct Map2DCPUTileSource;
+
 public:
 
     Map2DCPU(bool thread=true);
@@ -99,17 +113,32 @@ public:
 
     virtual bool save(const std::string& filename);
 
+    virtual bool exportTiles(const std::string& folder,bool incremental=false);
+
     virtual uint queueSize(){
         if(prepared.get()) return prepared->queueSize();
         else               return 0;
     }
 
+    virtual uint droppedFrames(){
+        if(prepared.get()) return prepared->_frames.dropped();
+        else               return 0;
+    }
+
+    virtual MemoryStats memoryStats();
+
+    virtual double scaledFrameResolution();
+
     virtual void run();
 
 private:
 
     bool getFrame(std::pair<cv::Mat,pi::SE3d>& frame);
     bool renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame);
+    // warp the BGR img to the BGRA dst, weighted by the distance to the image center
+    void warpFused(const cv::Mat& img,const cv::Mat& transmtx,cv::Mat& dst);
+    void warpWithWeightImage(const cv::Mat& img,const cv::Mat& transmtx,cv::Mat& dst);
+    SPtr<RadialWeight> getRadialWeight(const cv::Mat& img);
     bool spreadMap(double xmin,double ymin,double xmax,double ymax);
 
 
@@ -120,7 +149,10 @@ private:
 
     bool                              _valid,_thread,_changed;
     cv::Mat                           weightImage;
+    SPtr<RadialWeight>                radialWeight;
     int&                              alpha;
+    SPtr<pi::ThreadPool>              applyPool;// NULL: apply serially
+    std::string                       _exportFolder;// of the last exportTiles
 };
 
 #endif // MAP2DCPU_H
@@ -30,6 +30,7 @@
 
 #include <base/Svar/Svar.h>
 #include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
 #include <gui/gl/glHelper.h>
 #include <gui/gl/SignalHandle.h>
 
@@ -155,8 +156,9 @@ bool Map2DGPU::Map2DGPUData::prepare(SPtr<Map2DGPUPrepare> prepared)
     {
         _max=pi::Point3d(-1e10,-1e10,-1e10);
         _min=-_max;
-        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=prepared->_frames.begin();
-            it!=prepared->_frames.end();it++)
+        std::deque<std::pair<cv::Mat,pi::SE3d> > frames=prepared->getFrames();
+        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=frames.begin();
+            it!=frames.end();it++)
         {
             pi::SE3d& pose=it->second;
             pi::Point3d& t=pose.get_translation();
@@ -227,6 +229,7 @@ bool Map2DGPU::prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
         if(d->prepare(p))
         {
             pi::WriteMutex lock(mutex);
+            if(prepared.get()) prepared->_frames.close();
             prepared=p;
             data=d;
             weightImage.release();
@@ -250,10 +253,7 @@ bool Map2DGPU::feed(cv::Mat img,const pi::SE3d& pose)
     std::pair<cv::Mat,pi::SE3d> frame(img,p->_plane.inverse()*pose);
     if(_thread)
     {
-        pi::WriteMutex lock(p->mutexFrames);
-        p->_frames.push_back(frame);
-        if(p->_frames.size()>20) p->_frames.pop_front();
-        return true;
+        return p->pushFrame(frame);
     }
     else
     {
@@ -365,19 +365,20 @@ bool Map2DGPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
     cv::Mat inv = cv::getPerspectiveTransform( destPoints,imgPtsCV);
     inv.convertTo(inv,CV_32FC1);
     //warp and render with CUDA
-    pi::timer.enter("Map2DGPU::UploadImage");
     CudaImage<uchar3> cudaFrame(frame.first.rows,frame.first.cols);
-    checkCudaErrors(cudaMemcpy(cudaFrame.data,frame.first.data,
-               cudaFrame.cols*cudaFrame.rows*sizeof(uchar3),cudaMemcpyHostToDevice));
-    pi::timer.leave("Map2DGPU::UploadImage");
+    {
+        PI_PROFILE_SCOPE("Map2DGPU::UploadImage");
+        checkCudaErrors(cudaMemcpy(cudaFrame.data,frame.first.data,
+                   cudaFrame.cols*cudaFrame.rows*sizeof(uchar3),cudaMemcpyHostToDevice));
+    }
 
     // apply dst to eles
-    pi::timer.enter("Map2DGPU::Apply");
     std::vector<SPtr<Map2DGPUEle> > dataCopy=d->data();
     pi::Point3d translation=frame.second.get_translation();
     int cenX=(translation.x-d->min().x)*d->lengthPixelInv();
     int cenY=(translation.y-d->min().y)*d->lengthPixelInv();
     {
+        PI_PROFILE_SCOPE("Map2DGPU::Apply");
         int w=xmaxInt-xminInt;
         int h=ymaxInt-yminInt;
         int wh=w*h;
@@ -420,12 +421,13 @@ bool Map2DGPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
                 }
             }
 
-        pi::timer.enter("RenderKernal");
-        bool success=renderFramesCaller(cudaFrame,ELE_PIXELS,ELE_PIXELS,
-                                out_datas,freshs,
-                                invs,centers,wh);
-
-        pi::timer.leave("RenderKernal");
+        bool success;
+        {
+            PI_PROFILE_SCOPE("Map2DGPU::RenderKernal");
+            success=renderFramesCaller(cudaFrame,ELE_PIXELS,ELE_PIXELS,
+                                       out_datas,freshs,
+                                       invs,centers,wh);
+        }
         for(int x=xminInt,i=0;x<xmaxInt;x++,i++)
             for(int y=yminInt,j=0;y<ymaxInt;y++,j++)
             {
@@ -445,8 +447,6 @@ bool Map2DGPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
     }
 
 
-    pi::timer.leave("Map2DGPU::Apply");
-
     if(!svar.GetInt("Win3D.Enable"))//show result
     {
         cv::Mat result(ELE_PIXELS*d->h(),ELE_PIXELS*d->w(),CV_32FC4);
@@ -470,7 +470,7 @@ bool Map2DGPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
 
 bool Map2DGPU::spreadMap(double xmin,double ymin,double xmax,double ymax)
 {
-    pi::timer.enter("Map2DGPU::spreadMap");
+    PI_PROFILE_SCOPE("Map2DGPU::spreadMap");
     SPtr<Map2DGPUData> d;
     {
         pi::ReadMutex lock(mutex);
@@ -509,25 +509,23 @@ bool Map2DGPU::spreadMap(double xmin,double ymin,double xmax,double ymax)
                                                  pi::Point3d(min.x,min.y,d->min().z),
                                                  w,h,dataCopy));
     }
-    pi::timer.leave("Map2DGPU::spreadMap");
     return true;
 }
 
 bool Map2DGPU::getFrame(std::pair<cv::Mat,pi::SE3d>& frame)
 {
-    pi::ReadMutex lock(mutex);
-    pi::ReadMutex lock1(prepared->mutexFrames);
-    if(prepared->_frames.size())
+    SPtr<Map2DGPUPrepare> p;
     {
-        frame=prepared->_frames.front();
-        prepared->_frames.pop_front();
-        return true;
+        pi::ReadMutex lock(mutex);
+        p=prepared;
     }
-    else return false;
+    // wake up at least every 100ms to check shouldStop()
+    return p->popFrame(frame,100);
 }
 
 void Map2DGPU::run()
 {
+    pi::Profiler::instance().setThreadName("Map2DGPU::run");
     std::pair<cv::Mat,pi::SE3d> frame;
     while(!shouldStop())
     {
@@ -535,12 +533,11 @@ void Map2DGPU::run()
         {
             if(getFrame(frame))
             {
-                pi::timer.enter("Map2DGPU::renderFrame");
+                PI_PROFILE_SCOPE("Map2DGPU::renderFrame");
                 renderFrame(frame);
-                pi::timer.leave("Map2DGPU::renderFrame");
             }
         }
-        sleep(10);
+        else sleep(10);
     }
 }
 
@@ -632,11 +629,10 @@ void Map2DGPU::draw()
                 if(!ele->img) continue;
                 if(ele->Ischanged&&ticTac.Tac()<0.02)
                 {
-                    pi::timer.enter("glTexImage2D");
+                    PI_PROFILE_SCOPE("Map2DGPU::glTexImage2D");
                     pi::ReadMutex lock1(ele->mutexData);
 
                     ele->updateTextureGPU();
-                    pi::timer.leave("glTexImage2D");
                 }
 
                 // draw things
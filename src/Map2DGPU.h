@@ -114,6 +114,11 @@ public:
         else               return 0;
     }
 
+    virtual uint droppedFrames(){
+        if(prepared.get()) return prepared->_frames.dropped();
+        else               return 0;
+    }
+
     virtual void run();
 
 private:
@@ -27,6 +27,7 @@
 
 #include <base/Svar/Scommand.h>
 #include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
 
 #include "Map2DItem.h"
 
@@ -42,7 +43,7 @@ void Map2DItemHandle(void* ptr,std::string cmd,std::string para)
     sst>>cmd;
     if(cmd=="Map2DUpdate")
     {
-        pi::timer.enter("Map2DUpdate");
+        PI_PROFILE_SCOPE("Map2DItem::Map2DUpdate");
 //        cout<<"Map2DUpdate Handled.\n";
         sst>>cmd;//image name
         cv::Mat img=SvarWithType<cv::Mat>::instance()[cmd];
@@ -93,8 +94,6 @@ void Map2DItemHandle(void* ptr,std::string cmd,std::string para)
             item->mapwidget->ReloadMap();
             tmLastReload = tmNow;
         }
-
-        pi::timer.leave("Map2DUpdate");
     }
     else if(cmd=="SetPositionFromMap2D")
     {
@@ -120,7 +119,7 @@ Map2DItem::~Map2DItem()
 void Map2DItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
            QWidget *widget)
 {
-    pi::timer.enter("Map2DItem::paint");
+    PI_PROFILE_SCOPE("Map2DItem::paint");
     Q_UNUSED(option);
     Q_UNUSED(widget);
 //    cout<<"paint Handled.\n";
@@ -133,7 +132,6 @@ void Map2DItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
 //        painter->drawPixmap(QRect(0,0,100,100),ele.image);
 //        cout<<"painting elements:"<<ele.image.width()<<" "<<ele.image.height()<<".\n";
     }
-    pi::timer.leave("Map2DItem::paint");
 }
 
 QRectF Map2DItem::boundingRect()const
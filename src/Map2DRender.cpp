@@ -25,6 +25,7 @@
 #include <GL/gl.h>
 #include <base/Svar/Svar.h>
 #include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
 #include <gui/gl/SignalHandle.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -325,33 +326,15 @@ Map2DRender::Map2DRenderEle::~Map2DRenderEle()
     //    if(texName) pi::gl::Signal_Handle::instance().delete_texture(texName);
 }
 
-bool Map2DRender::Map2DRenderPrepare::prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
-                                              const std::deque<std::pair<cv::Mat,pi::SE3d> >& frames)
-{
-    if(frames.size()==0||camera.w<=0||camera.h<=0||camera.fx==0||camera.fy==0)
-    {
-        cerr<<"Map2DRender::Map2DRenderPrepare::prepare:Not valid prepare!\n";
-        return false;
-    }
-    _camera=camera;_fxinv=1./camera.fx;_fyinv=1./camera.fy;
-    _plane =plane;
-    _frames=frames;
-    for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=_frames.begin();it!=_frames.end();it++)
-    {
-        pi::SE3d& pose=it->second;
-        pose=plane.inverse()*pose;//plane coordinate
-    }
-    return true;
-}
-
 bool Map2DRender::Map2DRenderData::prepare(SPtr<Map2DRenderPrepare> prepared)
 {
     if(_w||_h) return false;//already prepared
     {
         _max=pi::Point3d(-1e10,-1e10,-1e10);
         _min=-_max;
-        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=prepared->_frames.begin();
-            it!=prepared->_frames.end();it++)
+        std::deque<std::pair<cv::Mat,pi::SE3d> > frames=prepared->getFrames();
+        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=frames.begin();
+            it!=frames.end();it++)
         {
             pi::SE3d& pose=it->second;
             pi::Point3d& t=pose.get_translation();
@@ -388,7 +371,6 @@ bool Map2DRender::Map2DRenderData::prepare(SPtr<Map2DRenderPrepare> prepared)
             _h=ceil((_max.y-_min.y)/_eleSize);
             _max.x=_min.x+_eleSize*_w;
             _max.y=_min.y+_eleSize*_h;
-            _data.resize(_w*_h);
         }
     }
     return true;
@@ -411,6 +393,7 @@ bool Map2DRender::prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
         if(d->prepare(p))
         {
             pi::WriteMutex lock(mutex);
+            if(prepared.get()) prepared->_frames.close();
             prepared=p;
             data=d;
             weightImage.release();
@@ -434,10 +417,7 @@ bool Map2DRender::feed(cv::Mat img,const pi::SE3d& pose)
     std::pair<cv::Mat,pi::SE3d> frame(img,p->_plane.inverse()*pose);
     if(_thread)
     {
-        pi::WriteMutex lock(p->mutexFrames);
-        p->_frames.push_back(frame);
-        if(p->_frames.size()>20) p->_frames.pop_front();
-        return true;
+        return p->pushFrame(frame);
     }
     else
     {
@@ -447,15 +427,13 @@ bool Map2DRender::feed(cv::Mat img,const pi::SE3d& pose)
 
 bool Map2DRender::getFrame(std::pair<cv::Mat,pi::SE3d>& frame)
 {
-    pi::ReadMutex lock(mutex);
-    pi::ReadMutex lock1(prepared->mutexFrames);
-    if(prepared->_frames.size())
+    SPtr<Map2DRenderPrepare> p;
     {
-        frame=prepared->_frames.front();
-        prepared->_frames.pop_front();
-        return true;
+        pi::ReadMutex lock(mutex);
+        p=prepared;
     }
-    else return false;
+    // wake up at least every 100ms to check shouldStop()
+    return p->popFrame(frame,100);
 }
 
 bool Map2DRender::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
@@ -465,15 +443,13 @@ bool Map2DRender::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
 
 bool Map2DRender::getFrames(std::deque<std::pair<cv::Mat,pi::SE3d> >& frames)
 {
-    pi::ReadMutex lock(mutex);
-    pi::ReadMutex lock1(prepared->mutexFrames);
-    if(prepared->_frames.size())
+    SPtr<Map2DRenderPrepare> p;
     {
-        frames=prepared->_frames;
-        prepared->_frames.clear();
-        return true;
+        pi::ReadMutex lock(mutex);
+        p=prepared;
     }
-    else return false;
+    // wake up at least every 100ms to check shouldStop()
+    return p->_frames.popAll(frames,100);
 }
 
 bool Map2DRender::renderFrames(std::deque<std::pair<cv::Mat,pi::SE3d> >& frames)
@@ -766,7 +742,7 @@ bool Map2DRender::renderFrames(std::deque<std::pair<cv::Mat,pi::SE3d> >& frames)
 
 bool Map2DRender::spreadMap(double xmin,double ymin,double xmax,double ymax)
 {
-    pi::timer.enter("Map2DRender::spreadMap");
+    PI_PROFILE_SCOPE("Map2DRender::spreadMap");
     SPtr<Map2DRenderData> d;
     {
         pi::ReadMutex lock(mutex);
@@ -787,30 +763,20 @@ bool Map2DRender::spreadMap(double xmin,double ymin,double xmax,double ymax)
         max.x=min.x+w*d->eleSize();
         max.y=min.y+h*d->eleSize();
     }
-    std::vector<SPtr<Map2DRenderEle> > dataOld=d->data();
-    std::vector<SPtr<Map2DRenderEle> > dataCopy;
-    dataCopy.resize(w*h);
-    {
-        for(int x=0,xend=d->w();x<xend;x++)
-            for(int y=0,yend=d->h();y<yend;y++)
-            {
-                dataCopy[x-xminInt+(y-yminInt)*w]=dataOld[y*d->w()+x];
-            }
-    }
     //apply
     {
         pi::WriteMutex lock(mutex);
         data=SPtr<Map2DRenderData>(new Map2DRenderData(d->eleSize(),d->lengthPixel(),
                                                        pi::Point3d(max.x,max.y,d->max().z),
                                                        pi::Point3d(min.x,min.y,d->min().z),
-                                                       w,h,dataCopy));
+                                                       w,h,d->grid(),d->x0()+xminInt,d->y0()+yminInt));
     }
-    pi::timer.leave("Map2DRender::spreadMap");
     return true;
 }
 
 void Map2DRender::run()
 {
+    pi::Profiler::instance().setThreadName("Map2DRender::run");
     std::deque<std::pair<cv::Mat,pi::SE3d> > frames;
     while(!shouldStop())
     {
@@ -818,12 +784,11 @@ void Map2DRender::run()
         {
             if(getFrames(frames))
             {
-                pi::timer.enter("Map2DRender::renderFrame");
+                PI_PROFILE_SCOPE("Map2DRender::renderFrame");
                 renderFrames(frames);
-                pi::timer.leave("Map2DRender::renderFrame");
             }
         }
-        sleep(10);
+        else sleep(10);
     }
     svar.GetInt("ShouldStop")=1;
 }
@@ -892,47 +857,43 @@ void Map2DRender::draw()
     }
     GLint last_texture_ID;
     glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture_ID);
-    std::vector<SPtr<Map2DRenderEle> > dataCopy=d->data();
-    int wCopy=d->w(),hCopy=d->h();
+    std::vector<Map2DGrid<Map2DRenderEle>::Entry> tiles;
+    d->tiles(tiles);
     glColor3ub(255,255,255);
-    for(int x=0;x<wCopy;x++)
-        for(int y=0;y<hCopy;y++)
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        float x0=d->min().x+tiles[i].x*d->eleSize();
+        float y0=d->min().y+tiles[i].y*d->eleSize();
+        float x1=x0+d->eleSize();
+        float y1=y0+d->eleSize();
+        Map2DRenderEle* ele=tiles[i].ele;
+        if(ele->img.empty()) continue;
+        if(ele->texName==0)
         {
-            int idxData=y*wCopy+x;
-            float x0=d->min().x+x*d->eleSize();
-            float y0=d->min().y+y*d->eleSize();
-            float x1=x0+d->eleSize();
-            float y1=y0+d->eleSize();
-            SPtr<Map2DRenderEle> ele=dataCopy[idxData];
-            if(!ele.get())  continue;
-            if(ele->img.empty()) continue;
-            if(ele->texName==0)
-            {
-                glGenTextures(1, &ele->texName);
-            }
-            if(ele->Ischanged&&ticTac.Tac()<0.02)
-            {
-                pi::timer.enter("glTexImage2D");
-                pi::ReadMutex lock1(ele->mutexData);
-                glBindTexture(GL_TEXTURE_2D,ele->texName);
-                glTexImage2D(GL_TEXTURE_2D, 0,
-                             GL_RGBA, ele->img.cols,ele->img.rows, 0,
-                             GL_BGRA, GL_UNSIGNED_BYTE,ele->img.data);
-                if(svar.GetInt("ShowTex",0))
-                    cv::imshow("tex",ele->img);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,  GL_LINEAR);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,GL_NEAREST);
-                ele->Ischanged=false;
-                pi::timer.leave("glTexImage2D");
-            }
+            glGenTextures(1, &ele->texName);
+        }
+        if(ele->Ischanged&&ticTac.Tac()<0.02)
+        {
+            PI_PROFILE_SCOPE("Map2DRender::glTexImage2D");
+            pi::ReadMutex lock1(ele->mutexData);
             glBindTexture(GL_TEXTURE_2D,ele->texName);
-            glBegin(GL_QUADS);
-            glTexCoord2f(0.0f, 0.0f); glVertex3f(x0,y0,0);
-            glTexCoord2f(0.0f, 1.0f); glVertex3f(x0,y1,0);
-            glTexCoord2f(1.0f, 1.0f); glVertex3f(x1,y1,0);
-            glTexCoord2f(1.0f, 0.0f); glVertex3f(x1,y0,0);
-            glEnd();
+            glTexImage2D(GL_TEXTURE_2D, 0,
+                         GL_RGBA, ele->img.cols,ele->img.rows, 0,
+                         GL_BGRA, GL_UNSIGNED_BYTE,ele->img.data);
+            if(svar.GetInt("ShowTex",0))
+                cv::imshow("tex",ele->img);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,  GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+            ele->Ischanged=false;
         }
+        glBindTexture(GL_TEXTURE_2D,ele->texName);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0f, 0.0f); glVertex3f(x0,y0,0);
+        glTexCoord2f(0.0f, 1.0f); glVertex3f(x0,y1,0);
+        glTexCoord2f(1.0f, 1.0f); glVertex3f(x1,y1,0);
+        glTexCoord2f(1.0f, 0.0f); glVertex3f(x1,y0,0);
+        glEnd();
+    }
     glBindTexture(GL_TEXTURE_2D, last_texture_ID);
     glPopMatrix();
 }
@@ -941,3 +902,30 @@ bool Map2DRender::save(const std::string& filename)
 {
     return false;
 }
+
+Map2D::MemoryStats Map2DRender::memoryStats()
+{
+    MemoryStats stats;
+    SPtr<Map2DRenderData> d;
+    {
+        pi::ReadMutex lock(mutex);
+        d=data;
+    }
+    if(!d.get()) return stats;
+
+    std::vector<Map2DGrid<Map2DRenderEle>::Entry> tiles;
+    d->tiles(tiles);
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        size_t bytes;
+        {
+            pi::ReadMutex lock(tiles[i].ele->mutexData);
+            bytes=tiles[i].ele->img.total()*tiles[i].ele->img.elemSize()
+                   +tiles[i].ele->mask.total()*tiles[i].ele->mask.elemSize();
+        }
+        stats.tiles++;
+        stats.bytes+=bytes;
+        stats.maxTileBytes=std::max(stats.maxTileBytes,bytes);
+    }
+    return stats;
+}
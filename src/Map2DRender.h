@@ -27,39 +27,7 @@
 
 class Map2DRender:public Map2D,public pi::Thread
 {
-    struct Map2DRenderPrepare//change when prepare
-    {
-        uint queueSize(){pi::ReadMutex lock(mutexFrames);
-                      return _frames.size();}
-
-        bool prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
-                     const std::deque<std::pair<cv::Mat,pi::SE3d> >& frames);
-
-        pi::Point2d Project(const pi::Point3d& pt)
-        {
-            double zinv=1./pt.z;
-            return pi::Point2d(_camera.fx*pt.x*zinv+_camera.cx,
-                               _camera.fy*pt.y*zinv+_camera.cy);
-        }
-
-        pi::Point3d UnProject(const pi::Point2d& pt)
-        {
-            return pi::Point3d((pt.x-_camera.cx)*_fxinv,
-                               (pt.y-_camera.cy)*_fyinv,1.);
-        }
-
-        std::deque<std::pair<cv::Mat,pi::SE3d> > getFrames()
-        {
-            pi::ReadMutex lock(mutexFrames);
-            return _frames;
-        }
-
-        PinHoleParameters                        _camera;
-        double                                   _fxinv,_fyinv;
-        pi::SE3d                                 _plane;//all fixed
-        std::deque<std::pair<cv::Mat,pi::SE3d> > _frames;//camera coordinate
-        pi::MutexRW                              mutexFrames;
-    };
+    typedef Map2DPrepare Map2DRenderPrepare;
 
     struct Map2DRenderEle
     {
@@ -74,12 +42,12 @@ class Map2DRender:public Map2D,public pi::Thread
 
     struct Map2DRenderData//change when spread and prepare
     {
-        Map2DRenderData():_w(0),_h(0){}
+        Map2DRenderData():_w(0),_h(0),_x0(0),_y0(0),_grid(new Map2DGrid<Map2DRenderEle>()){}
         Map2DRenderData(double eleSize_,double lengthPixel_,pi::Point3d max_,pi::Point3d min_,
-                     int w_,int h_,const std::vector<SPtr<Map2DRenderEle> >& d_)
+                     int w_,int h_,SPtr<Map2DGrid<Map2DRenderEle> > grid_,int x0_,int y0_)
             :_eleSize(eleSize_),_eleSizeInv(1./eleSize_),
               _lengthPixel(lengthPixel_),_lengthPixelInv(1./lengthPixel_),
-              _min(min_),_max(max_),_w(w_),_h(h_),_data(d_){}
+              _min(min_),_max(max_),_w(w_),_h(h_),_x0(x0_),_y0(y0_),_grid(grid_){}
 
         bool   prepare(SPtr<Map2DRenderPrepare> prepared);// only done Once!
 
@@ -91,28 +59,35 @@ class Map2DRender:public Map2D,public pi::Thread
         const pi::Point3d& max()const{return _max;}
         const int w()const{return _w;}
         const int h()const{return _h;}
+        /// Grid coordinates of the tile 0
+        const int x0()const{return _x0;}
+        const int y0()const{return _y0;}
+
+        /// The tile at idx or NULL, no lock and no copy
+        Map2DRenderEle* at(uint idx)const{
+            if(idx>=(uint)(_w*_h)) return NULL;
+            return _grid->at(_x0+idx%_w,_y0+idx/_w);
+        }
+
+        /// The tile at idx, created if needed
+        Map2DRenderEle* ele(uint idx){
+            if(idx>=(uint)(_w*_h)) return NULL;
+            return _grid->get(_x0+idx%_w,_y0+idx/_w);
+        }
 
-        std::vector<SPtr<Map2DRenderEle> > data()
-        {pi::ReadMutex lock(mutexData);return _data;}
-
-        SPtr<Map2DRenderEle> ele(uint idx)
-        {
-            pi::WriteMutex lock(mutexData);
-            if(idx>_data.size()) return SPtr<Map2DRenderEle>();
-            else if(!_data[idx].get())
-            {
-                _data[idx]=SPtr<Map2DRenderEle>(new Map2DRenderEle());
-            }
-            return _data[idx];
+        /// The created tiles of this snapshot, (x,y) relative to the tile 0
+        void tiles(std::vector<Map2DGrid<Map2DRenderEle>::Entry>& result)const{
+            _grid->entries(result,_x0,_y0,_w,_h);
         }
 
+        SPtr<Map2DGrid<Map2DRenderEle> > grid(){return _grid;}
+
     private:
         //IMPORTANT: everything should never changed after prepared!
         double      _eleSize,_lengthPixel,_eleSizeInv,_lengthPixelInv;
         pi::Point3d _max,_min;
-        int         _w,_h;
-        std::vector<SPtr<Map2DRenderEle> >  _data;
-        pi::MutexRW mutexData;
+        int         _w,_h,_x0,_y0;
+        SPtr<Map2DGrid<Map2DRenderEle> > _grid;// shared by all snapshots
     };
 
 public:
@@ -135,6 +110,13 @@ public:
         else               return 0;
     }
 
+    virtual uint droppedFrames(){
+        if(prepared.get()) return prepared->_frames.dropped();
+        else               return 0;
+    }
+
+    virtual MemoryStats memoryStats();
+
     virtual void run();
 
 private:
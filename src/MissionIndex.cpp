@@ -0,0 +1,224 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "MissionIndex.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+static const char     s_magic[8]={'M','2','D','I','N','D','E','X'};
+static const uint32_t s_version=1;
+
+struct RecordTimeLess
+{
+    bool operator()(const MissionIndex::Record& record,double timestamp)const
+    {
+        return record.timestamp<timestamp;
+    }
+};
+
+MissionIndex::MissionIndex()
+    :_data(NULL),_bytes(0),_records(NULL),_names(NULL),
+     _frames(0),_namesBytes(0),_sorted(false)
+{
+}
+
+MissionIndex::~MissionIndex()
+{
+    close();
+}
+
+bool MissionIndex::open(const std::string& file)
+{
+    close();
+    int fd=::open(file.c_str(),O_RDONLY);
+    if(fd<0) return false;
+
+    struct stat st;
+    if(fstat(fd,&st)!=0||st.st_size<(off_t)sizeof(Header))
+    {
+        cerr<<"MissionIndex::open: "<<file<<" is too small.\n";
+        ::close(fd);
+        return false;
+    }
+    void* data=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(data==MAP_FAILED)
+    {
+        cerr<<"MissionIndex::open: Can't map "<<file<<": "<<strerror(errno)<<endl;
+        return false;
+    }
+    if(!attach(data,st.st_size))
+    {
+        cerr<<"MissionIndex::open: "<<file<<" is not a valid mission index.\n";
+        munmap(data,st.st_size);
+        return false;
+    }
+    _data =data;
+    _bytes=st.st_size;
+    return true;
+}
+
+bool MissionIndex::attach(const void* data,size_t bytes)
+{
+    close();
+    const Header* header=(const Header*)data;
+    if(bytes<sizeof(Header)||memcmp(header->magic,s_magic,sizeof(s_magic))!=0
+            ||header->version!=s_version||header->frames>bytes/sizeof(Record)
+            ||sizeof(Header)+header->frames*sizeof(Record)+header->namesBytes>bytes)
+        return false;
+
+    _frames    =header->frames;
+    _namesBytes=header->namesBytes;
+    _sorted    =header->sorted;
+    _records   =(const Record*)((const char*)data+sizeof(Header));
+    _names     =(const char*)(_records+_frames);
+    // the names are read as C strings
+    if(_namesBytes&&_names[_namesBytes-1]!='\0') _namesBytes=0;
+    return true;
+}
+
+void MissionIndex::close()
+{
+    if(_data) munmap(_data,_bytes);
+    _data=NULL;
+    _bytes=0;
+    _records=NULL;
+    _names=NULL;
+    _frames=_namesBytes=0;
+}
+
+pi::SE3d MissionIndex::pose(size_t i)const
+{
+    const double* p=_records[i].pose;
+    return pi::SE3d(p[0],p[1],p[2],p[3],p[4],p[5],p[6]);
+}
+
+size_t MissionIndex::find(double timestamp)const
+{
+    if(_sorted)
+        return std::lower_bound(_records,_records+_frames,timestamp,RecordTimeLess())-_records;
+    for(size_t i=0;i<_frames;i++)
+        if(_records[i].timestamp>=timestamp) return i;
+    return _frames;
+}
+
+bool MissionIndex::parseLine(const std::string& line,std::string& name,Record& record)
+{
+    stringstream sst(line);
+    pi::SE3d     pose;
+    if(!(sst>>name>>pose)) return false;
+
+    memset(&record,0,sizeof(record));
+    const char* str=name.c_str();
+    char*       end=NULL;
+    double      timestamp=strtod(str,&end);
+    record.timestamp=(end!=str&&*end=='\0')?timestamp:-1;
+    const pi::Point3d& t=pose.get_translation();
+    record.pose[0]=t.x;record.pose[1]=t.y;record.pose[2]=t.z;
+    pose.get_rotation().getValue(record.pose[3],record.pose[4],record.pose[5],record.pose[6]);
+    return true;
+}
+
+void MissionIndex::serialize(const std::vector<Record>& records,const std::string& names,
+                             std::string& bytes)
+{
+    Header header;
+    memcpy(header.magic,s_magic,sizeof(s_magic));
+    header.version   =s_version;
+    header.sorted    =1;
+    header.frames    =records.size();
+    header.namesBytes=names.size();
+    for(size_t i=1;i<records.size();i++)
+        if(records[i].timestamp<records[i-1].timestamp) header.sorted=0;
+
+    bytes.assign((const char*)&header,sizeof(header));
+    if(records.size()) bytes.append((const char*)&records[0],records.size()*sizeof(Record));
+    bytes.append(names);
+}
+
+bool MissionIndex::write(const std::string& file,const std::vector<Record>& records,
+                         const std::string& names)
+{
+    string bytes;
+    serialize(records,names,bytes);
+
+    // written aside and renamed, readers never map a partial index
+    string tmpFile=file+".tmp";
+    {
+        ofstream ofs(tmpFile.c_str(),ios::binary|ios::trunc);
+        if(!ofs.is_open())
+        {
+            cerr<<"MissionIndex::write: Can't open file "<<tmpFile<<endl;
+            return false;
+        }
+        ofs.write(bytes.data(),bytes.size());
+        if(!ofs.good())
+        {
+            cerr<<"MissionIndex::write: Failed to write "<<tmpFile<<endl;
+            unlink(tmpFile.c_str());
+            return false;
+        }
+    }
+    if(rename(tmpFile.c_str(),file.c_str())!=0)
+    {
+        cerr<<"MissionIndex::write: Can't rename "<<tmpFile<<": "<<strerror(errno)<<endl;
+        unlink(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool MissionIndex::convert(const std::string& trajectoryFile,const std::string& file)
+{
+    ifstream in(trajectoryFile.c_str());
+    if(!in.is_open())
+    {
+        cerr<<"MissionIndex::convert: Can't open file "<<trajectoryFile<<endl;
+        return false;
+    }
+
+    std::vector<Record> records;
+    string              names,line,name;
+    while(getline(in,line))
+    {
+        Record record;
+        if(!parseLine(line,name,record)) continue;
+        if(record.timestamp<0) record.timestamp=records.size();
+        record.nameOffset=names.size();
+        names.append(name.c_str(),name.size()+1);
+        records.push_back(record);
+    }
+    return write(file,records,names);
+}
@@ -0,0 +1,112 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef MISSIONINDEX_H
+#define MISSIONINDEX_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <base/types/SE3.h>
+
+/** The frames of a mission in a binary file read with mmap, datapath/mission.idx.
+
+    It holds the content of trajectory.txt without any parsing: a header, one
+    fixed size Record per frame and the table of the image names, in host
+    byte order. Frames are accessed by number in O(1) and by time with a
+    binary search, opening a 100k frames mission only maps the file.
+
+    The index is written from trajectory.txt by convert(), or by the
+    MissionTool app:
+
+        ./MissionTool Act=Index DataPath=phantom3-village-kfs
+*/
+class MissionIndex
+{
+public:
+    struct Record
+    {
+        double   timestamp;  // the image name if it is a number, else the frame number
+        double   pose[7];    // x y z qx qy qz qw as in trajectory.txt
+        uint64_t imageOffset;// encoded image inside a packed mission
+        uint32_t imageBytes; // 0: the image is rgb/<name>.jpg
+        uint32_t nameOffset; // in the name table
+    };
+
+    MissionIndex();
+    ~MissionIndex();
+
+    bool open(const std::string& file);
+    /// Read an index held in memory, like the footer of a MissionPack, the
+    /// bytes must stay valid and 8 bytes aligned until close()
+    bool attach(const void* data,size_t bytes);
+    void close();
+    bool isOpen()const{return _records!=NULL;}
+
+    size_t        size()const{return _frames;}
+    const Record& record(size_t i)const{return _records[i];}
+    const char*   name(size_t i)const
+    {
+        uint32_t offset=_records[i].nameOffset;
+        return offset<_namesBytes?_names+offset:"";
+    }
+    pi::SE3d      pose(size_t i)const;
+
+    /// The first frame at or after timestamp, size() if none
+    size_t        find(double timestamp)const;
+
+    /// Write an index of the records and names (NUL terminated, in order)
+    static bool write(const std::string& file,const std::vector<Record>& records,
+                      const std::string& names);
+    /// The bytes of an index as written by write()
+    static void serialize(const std::vector<Record>& records,const std::string& names,
+                          std::string& bytes);
+    /// Write an index of a trajectory.txt
+    static bool convert(const std::string& trajectoryFile,const std::string& file);
+
+    /// Parse a line of trajectory.txt, the timestamp is the name if it is a number, else -1
+    static bool parseLine(const std::string& line,std::string& name,Record& record);
+
+private:
+    MissionIndex(const MissionIndex&);
+    MissionIndex& operator=(const MissionIndex&);
+
+    struct Header
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t sorted;    // 1 if the timestamps never decrease
+        uint64_t frames;
+        uint64_t namesBytes;
+    };
+
+    void*         _data;// mapped by open()
+    size_t        _bytes;
+    const Record* _records;
+    const char*   _names;
+    size_t        _frames,_namesBytes;
+    bool          _sorted;
+};
+
+#endif // MISSIONINDEX_H
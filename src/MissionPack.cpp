@@ -0,0 +1,283 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "MissionPack.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+
+using namespace std;
+
+static const char s_magic[8]={'M','2','D','P','A','C','K','1'};
+
+MissionPack::MissionPack()
+    :_data(NULL),_bytes(0),_sensors(NULL),_sensorNum(0)
+{
+}
+
+MissionPack::~MissionPack()
+{
+    close();
+}
+
+bool MissionPack::open(const std::string& file)
+{
+    close();
+    int fd=::open(file.c_str(),O_RDONLY);
+    if(fd<0) return false;
+
+    struct stat st;
+    if(fstat(fd,&st)!=0||st.st_size<(off_t)(sizeof(Header)+sizeof(Trailer)))
+    {
+        cerr<<"MissionPack::open: "<<file<<" is too small.\n";
+        ::close(fd);
+        return false;
+    }
+    void* data=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if(data==MAP_FAILED)
+    {
+        cerr<<"MissionPack::open: Can't map "<<file<<": "<<strerror(errno)<<endl;
+        return false;
+    }
+    _data =(unsigned char*)data;
+    _bytes=st.st_size;
+    madvise(_data,_bytes,MADV_SEQUENTIAL);
+
+    // bytes after the end in the header are of an interrupted append
+    Header header;
+    memcpy(&header,_data,sizeof(header));
+    uint64_t end=header.end?header.end:_bytes;
+    bool     valid=memcmp(header.magic,s_magic,sizeof(s_magic))==0
+            &&end>=sizeof(Header)+sizeof(Trailer)&&end<=_bytes;
+
+    Trailer trailer;
+    if(valid)
+    {
+        memcpy(&trailer,_data+end-sizeof(Trailer),sizeof(Trailer));
+        end-=sizeof(Trailer);
+    }
+    if(!valid||memcmp(trailer.magic,s_magic,sizeof(s_magic))!=0
+            ||trailer.indexOffset>end||trailer.indexBytes>end-trailer.indexOffset
+            ||trailer.sensorOffset>end||trailer.sensorNum>(end-trailer.sensorOffset)/sizeof(Sensor)
+            ||trailer.configOffset>end||trailer.configBytes>end-trailer.configOffset
+            ||(trailer.indexOffset|trailer.sensorOffset)%8
+            ||!_index.attach(_data+trailer.indexOffset,trailer.indexBytes))
+    {
+        cerr<<"MissionPack::open: "<<file<<" is not a valid mission pack.\n";
+        close();
+        return false;
+    }
+    _sensors  =(const Sensor*)(_data+trailer.sensorOffset);
+    _sensorNum=trailer.sensorNum;
+    _config.assign((const char*)_data+trailer.configOffset,trailer.configBytes);
+    return true;
+}
+
+void MissionPack::close()
+{
+    _index.close();
+    if(_data) munmap(_data,_bytes);
+    _data=NULL;
+    _bytes=0;
+    _sensors=NULL;
+    _sensorNum=0;
+    _config.clear();
+}
+
+const unsigned char* MissionPack::image(size_t i,size_t& bytes)const
+{
+    const MissionIndex::Record& record=_index.record(i);
+    bytes=record.imageBytes;
+    if(!bytes||record.imageOffset>_bytes||bytes>_bytes-record.imageOffset)
+    {
+        bytes=0;
+        return NULL;
+    }
+    return _data+record.imageOffset;
+}
+
+void MissionPack::willNeed(size_t first,size_t frames)const
+{
+    if(!_data||first>=_index.size()) return;
+    size_t last=min(first+frames,_index.size());
+    uint64_t begin=_bytes,end=0;
+    for(size_t i=first;i<last;i++)
+    {
+        const MissionIndex::Record& record=_index.record(i);
+        begin=min(begin,record.imageOffset);
+        end  =max(end,record.imageOffset+record.imageBytes);
+    }
+    if(begin>=end||end>_bytes) return;
+    uint64_t page=sysconf(_SC_PAGESIZE);
+    begin-=begin%page;
+    madvise(_data+begin,end-begin,MADV_WILLNEED);
+}
+
+MissionPackWriter::MissionPackWriter()
+    :_fd(-1),_end(0)
+{
+}
+
+MissionPackWriter::~MissionPackWriter()
+{
+    if(isOpen()) close();
+}
+
+bool MissionPackWriter::open(const std::string& file,bool append)
+{
+    if(isOpen()) close();
+    _records.clear();
+    _names.clear();
+    _sensors.clear();
+    _config.clear();
+
+    MissionPack old;
+    if(append&&access(file.c_str(),F_OK)==0)
+    {
+        if(!old.open(file))
+        {
+            cerr<<"MissionPackWriter::open: Can't append to "<<file<<", pack it again.\n";
+            return false;
+        }
+        MissionPack::Header header;
+        memcpy(&header,old._data,sizeof(header));
+        _end=header.end?header.end:old._bytes;// after the old footer
+
+        const MissionIndex& index=old.index();
+        for(size_t i=0;i<index.size();i++)
+        {
+            MissionIndex::Record record=index.record(i);
+            record.nameOffset=_names.size();
+            _names.append(index.name(i));
+            _names.push_back('\0');
+            _records.push_back(record);
+        }
+        for(size_t i=0;i<old.sensors();i++) _sensors.push_back(old.sensor(i));
+        _config=old.config();
+        old.close();
+
+        // drop what an interrupted append left after it
+        _fd=::open(file.c_str(),O_WRONLY);
+        if(_fd<0||ftruncate(_fd,_end)!=0)
+        {
+            cerr<<"MissionPackWriter::open: Can't open "<<file<<": "<<strerror(errno)<<endl;
+            if(_fd>=0) ::close(_fd);
+            _fd=-1;
+            return false;
+        }
+        return true;
+    }
+
+    _fd=::open(file.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(_fd<0)
+    {
+        cerr<<"MissionPackWriter::open: Can't create "<<file<<": "<<strerror(errno)<<endl;
+        return false;
+    }
+    _end=0;
+    MissionPack::Header header;
+    memcpy(header.magic,s_magic,sizeof(s_magic));
+    header.end=0;
+    if(appendBytes(&header,sizeof(header))<0)
+    {
+        ::close(_fd);
+        _fd=-1;
+        return false;
+    }
+    return true;
+}
+
+int64_t MissionPackWriter::appendBytes(const void* data,size_t bytes)
+{
+    static const char padding[8]={0};
+    size_t pad=(8-_end%8)%8;
+    for(size_t step=0;step<2;step++)
+    {
+        const char* p=step?(const char*)data:padding;
+        size_t      n=step?bytes:pad;
+        for(size_t done=0;done<n;)
+        {
+            ssize_t written=pwrite(_fd,p+done,n-done,_end);
+            if(written<0&&errno==EINTR) continue;
+            if(written<=0)
+            {
+                cerr<<"MissionPackWriter::appendBytes: "<<strerror(errno)<<endl;
+                return -1;
+            }
+            done+=written;
+            _end+=written;
+        }
+    }
+    return _end-bytes;
+}
+
+bool MissionPackWriter::addFrame(const std::string& name,const MissionIndex::Record& record,
+                                 const void* image,size_t bytes)
+{
+    if(!isOpen()) return false;
+    int64_t offset=appendBytes(image,bytes);
+    if(offset<0) return false;
+
+    MissionIndex::Record added=record;
+    added.imageOffset=offset;
+    added.imageBytes =bytes;
+    added.nameOffset =_names.size();
+    _names.append(name.c_str(),name.size()+1);
+    _records.push_back(added);
+    return true;
+}
+
+bool MissionPackWriter::close()
+{
+    if(!isOpen()) return false;
+
+    string index;
+    MissionIndex::serialize(_records,_names,index);
+    MissionPack::Trailer trailer;
+    trailer.indexBytes  =index.size();
+    trailer.indexOffset =appendBytes(index.data(),index.size());
+    trailer.sensorNum   =_sensors.size();
+    trailer.sensorOffset=appendBytes(_sensors.size()?&_sensors[0]:NULL,_sensors.size()*sizeof(MissionPack::Sensor));
+    trailer.configBytes =_config.size();
+    trailer.configOffset=appendBytes(_config.data(),_config.size());
+    memcpy(trailer.magic,s_magic,sizeof(s_magic));
+    bool ok=(int64_t)trailer.indexOffset>=0&&(int64_t)trailer.sensorOffset>=0
+            &&(int64_t)trailer.configOffset>=0&&appendBytes(&trailer,sizeof(trailer))>=0;
+
+    // the footer is complete on disk before the header points to it
+    uint64_t end=_end;
+    if(ok&&(fdatasync(_fd)!=0||pwrite(_fd,&end,sizeof(end),offsetof(MissionPack::Header,end))!=sizeof(end)))
+    {
+        cerr<<"MissionPackWriter::close: "<<strerror(errno)<<endl;
+        ok=false;
+    }
+
+    ::close(_fd);
+    _fd=-1;
+    return ok;
+}
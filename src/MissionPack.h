@@ -0,0 +1,156 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef MISSIONPACK_H
+#define MISSIONPACK_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "MissionIndex.h"
+
+/** A whole mission in one file, datapath/mission.pack.
+
+    The encoded frames are appended one after the other, followed by a
+    footer with the MissionIndex of the frames (whose records point to the
+    images), the optional GPS and IMU records, the text of config.cfg and a
+    fixed size trailer at the very end of the file:
+
+        header | image 0 | image 1 | ... | index | sensors | config | trailer
+
+    The file is only appended to: adding frames writes them after the old
+    trailer and ends with a new footer, the old one is left as garbage. The
+    header holds the end of the last complete footer and is updated once the
+    new footer is on disk, so a pack whose append was interrupted still
+    opens with the frames of the previous footer.
+
+    The reader maps the whole file, reading frames in order is a large
+    sequential read helped by willNeed(), which asks the kernel to read the
+    next images ahead. Packs are written by the MissionTool app:
+
+        ./MissionTool Act=Pack DataPath=phantom3-village-kfs
+*/
+class MissionPack
+{
+public:
+    enum SensorType{GPS=1,IMU=2};
+
+    struct Sensor
+    {
+        double   timestamp;
+        uint32_t type;      // SensorType
+        uint32_t count;     // values used
+        double   values[6]; // GPS: lat lng alt..., IMU: ax ay az gx gy gz
+    };
+
+    MissionPack();
+    ~MissionPack();
+
+    bool open(const std::string& file);
+    void close();
+    bool isOpen()const{return _data!=NULL;}
+
+    /// The frames, their records locate the images
+    const MissionIndex& index()const{return _index;}
+
+    /// The encoded image of frame i, valid while the pack is open
+    const unsigned char* image(size_t i,size_t& bytes)const;
+
+    /// Ask the kernel to read the images of frames [first,first+frames)
+    void willNeed(size_t first,size_t frames)const;
+
+    size_t        sensors()const{return _sensorNum;}
+    const Sensor& sensor(size_t i)const{return _sensors[i];}
+
+    const std::string& config()const{return _config;}
+
+private:
+    MissionPack(const MissionPack&);
+    MissionPack& operator=(const MissionPack&);
+
+    friend class MissionPackWriter;
+
+    struct Header
+    {
+        char     magic[8];
+        uint64_t end;       // end of the last complete trailer, 0: the file end
+    };
+
+    struct Trailer
+    {
+        uint64_t indexOffset,indexBytes;
+        uint64_t sensorOffset,sensorNum;
+        uint64_t configOffset,configBytes;
+        char     magic[8];
+    };
+
+    unsigned char* _data;
+    size_t         _bytes;
+    MissionIndex   _index;
+    const Sensor*  _sensors;
+    size_t         _sensorNum;
+    std::string    _config;
+};
+
+/// Creates or appends to a MissionPack, nothing is readable before close()
+class MissionPackWriter
+{
+public:
+    MissionPackWriter();
+    ~MissionPackWriter();
+
+    /// Create the file, or keep the frames of an existing pack with append,
+    /// which fails if the file exists but is not a valid pack
+    bool open(const std::string& file,bool append=false);
+    /// Write the footer
+    bool close();
+    bool isOpen()const{return _fd>=0;}
+
+    /// Add a frame, the timestamp and pose of record are kept
+    bool addFrame(const std::string& name,const MissionIndex::Record& record,
+                  const void* image,size_t bytes);
+    void addSensor(const MissionPack::Sensor& sensor){_sensors.push_back(sensor);}
+    void setConfig(const std::string& config){_config=config;}
+
+    size_t frames()const{return _records.size();}
+    /// The sensor records, the ones of the pack appended to come first
+    size_t sensors()const{return _sensors.size();}
+    const MissionPack::Sensor& sensor(size_t i)const{return _sensors[i];}
+
+private:
+    MissionPackWriter(const MissionPackWriter&);
+    MissionPackWriter& operator=(const MissionPackWriter&);
+
+    /// Append bytes aligned to 8 bytes, return their offset or -1
+    int64_t appendBytes(const void* data,size_t bytes);
+
+    int                                 _fd;
+    int64_t                             _end;
+    std::vector<MissionIndex::Record>   _records;
+    std::string                         _names;
+    std::vector<MissionPack::Sensor>    _sensors;
+    std::string                         _config;
+};
+
+#endif // MISSIONPACK_H
@@ -21,11 +21,20 @@
 
 *******************************************************************************/
 #include "MultiBandMap2DCPU.h"
+#include "UtilCPU.h"
+#include "TiledTiffWriter.h"
+#include "WebTileExporter.h"
+#include "FrameArena.h"
+
+#include <string.h>
+#include <algorithm>
 
 #include <gui/gl/glHelper.h>
 #include <GL/gl.h>
 #include <base/Svar/Svar.h>
 #include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
+#include <base/system/thread/ThreadPool.h>
 #include <gui/gl/SignalHandle.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -74,124 +83,323 @@ bool MultiBandMap2DCPU::MultiBandMap2DCPUEle::mulWeightMap(const cv::Mat& weight
     return true;
 }
 
-cv::Mat MultiBandMap2DCPU::MultiBandMap2DCPUEle::blend(const std::vector<SPtr<MultiBandMap2DCPUEle> >& neighbors)
+cv::Mat MultiBandMap2DCPU::MultiBandMap2DCPUEle::laplace(int i,const cv::Rect& roi)const
 {
-    if(!pyr_laplace.size()) return cv::Mat();
-    if(neighbors.size()==9)
+    int     size=ELE_PIXELS>>i;
+    cv::Rect rect=roi.area()?roi:cv::Rect(0,0,size,size);
+    const cv::Mat& level=pyr_laplace[i];
+    cv::Mat result;
+    if(level.empty())
+        result=cv::Mat::zeros(rect.height,rect.width,type);
+    else if(feather)
     {
-        //blend with neighbors, this obtains better visualization
-        int flag=0;
-        for(int i=0;i<neighbors.size();i++)
+        cv::Mat weight=weights[i](rect);
+        level(rect).copyTo(result);
+        normalizeUsingWeightMap(weight.isContinuous()?weight:weight.clone(),result);
+        if(type!=CV_32FC3) result.convertTo(result,type);
+    }
+    else if(level.depth()==CV_8S)
+        level(rect).convertTo(result,type,2);
+    else if(level.type()!=type)
+        level(rect).convertTo(result,type);
+    else
+        level(rect).copyTo(result);
+    return result;
+}
+
+cv::Mat MultiBandMap2DCPU::MultiBandMap2DCPUEle::weight(int i)const
+{
+    int     size=ELE_PIXELS>>i;
+    const cv::Mat& level=weights[i];
+    cv::Mat result;
+    if(level.empty())
+        result=cv::Mat::zeros(size,size,CV_32FC1);
+    else if(level.depth()==CV_8U)
+        level.convertTo(result,CV_32F,1./255);
+    else if(level.depth()==CV_16U)
+        level.convertTo(result,CV_32F,1./65535);
+    else
+        level.copyTo(result);
+    return result;
+}
+
+size_t MultiBandMap2DCPU::MultiBandMap2DCPUEle::memory()const
+{
+    size_t bytes=0;
+    for(size_t i=0;i<pyr_laplace.size();i++)
+        bytes+=pyr_laplace[i].total()*pyr_laplace[i].elemSize();
+    for(size_t i=0;i<weights.size();i++)
+        bytes+=weights[i].total()*weights[i].elemSize();
+    return bytes;
+}
+
+bool MultiBandMap2DCPU::MultiBandMap2DCPUEle::evict(TileStore& store)
+{
+    if(onDisk||!pyr_laplace.size()) return false;
+
+    // levels, then for each level the types of the laplace and the weights
+    // (-1 when not allocated) and their pixels
+    size_t bytes=sizeof(int32_t)*(1+2*pyr_laplace.size())+memory();
+    std::vector<char> buf(bytes);
+    char* p=&buf[0];
+    int32_t levels=pyr_laplace.size();
+    memcpy(p,&levels,sizeof(levels));p+=sizeof(levels);
+    for(int i=0;i<levels;i++)
+    {
+        const cv::Mat* mats[2]={&pyr_laplace[i],&weights[i]};
+        for(int j=0;j<2;j++)
         {
-            flag<<=1;
-            if(neighbors[i].get()&&neighbors[i]->pyr_laplace.size())
-                flag|=1;
+            cv::Mat m=mats[j]->isContinuous()?*mats[j]:mats[j]->clone();
+            int32_t t=m.empty()?-1:m.type();
+            memcpy(p,&t,sizeof(t));p+=sizeof(t);
+            if(m.empty()) continue;
+            memcpy(p,m.data,m.total()*m.elemSize());
+            p+=m.total()*m.elemSize();
         }
-        switch (flag) {
-        case 0X01FF:
-        {
-            vector<cv::Mat> pyr_laplaceClone(pyr_laplace.size());
-            for(int i=0;i<pyr_laplace.size();i++)
-            {
-                int borderSize=1<<(pyr_laplace.size()-i-1);
-                int srcrows=pyr_laplace[i].rows;
-                int dstrows=srcrows+(borderSize<<1);
-                pyr_laplaceClone[i]=cv::Mat(dstrows,dstrows,pyr_laplace[i].type());
-
-                for(int y=0;y<3;y++)
-                    for(int x=0;x<3;x++)
-                {
-                    const SPtr<MultiBandMap2DCPUEle>& ele=neighbors[3*y+x];
-                    pi::ReadMutex lock(ele->mutexData);
-                    if(ele->pyr_laplace[i].empty())
-                        continue;
-                    cv::Rect      src,dst;
-                    src.width =dst.width =(x==1)?srcrows:borderSize;
-                    src.height=dst.height=(y==1)?srcrows:borderSize;
-                    src.x=(x==0)?(srcrows-borderSize):0;
-                    src.y=(y==0)?(srcrows-borderSize):0;
-                    dst.x=(x==0)?0:((x==1)?borderSize:(dstrows-borderSize));
-                    dst.y=(y==0)?0:((y==1)?borderSize:(dstrows-borderSize));
-                    ele->pyr_laplace[i](src).copyTo(pyr_laplaceClone[i](dst));
-                }
-            }
+    }
 
-            cv::detail::restoreImageFromLaplacePyr(pyr_laplaceClone);
+    int64_t offset=store.write(&buf[0],bytes,diskOffset,diskCapacity);
+    if(offset<0) return false;
+    if(offset!=diskOffset)
+    {
+        diskOffset  =offset;
+        diskCapacity=bytes;
+    }
+    diskBytes=bytes;
+    pyr_laplace.clear();
+    weights.clear();
+    onDisk=true;
+    return true;
+}
 
+bool MultiBandMap2DCPU::MultiBandMap2DCPUEle::read(const TileStore& store,std::vector<cv::Mat>& laplace,
+                                                   std::vector<cv::Mat>& weights)const
+{
+    if(!onDisk) return false;
+    std::vector<char> buf(diskBytes);
+    if(!store.read(diskOffset,&buf[0],diskBytes)) return false;
+
+    const char* p=&buf[0];
+    int32_t levels;
+    memcpy(&levels,p,sizeof(levels));p+=sizeof(levels);
+    laplace.resize(levels);
+    weights.resize(levels);
+    for(int i=0;i<levels;i++)
+    {
+        cv::Mat* mats[2]={&laplace[i],&weights[i]};
+        for(int j=0;j<2;j++)
+        {
+            int32_t t;
+            memcpy(&t,p,sizeof(t));p+=sizeof(t);
+            if(t<0)
             {
-                cv::Mat result;
-                int borderSize=1<<(pyr_laplace.size()-1);
-                pyr_laplaceClone[0](cv::Rect(borderSize,borderSize,ELE_PIXELS,ELE_PIXELS)).copyTo(result);
-                return  result.setTo(cv::Scalar::all(0),weights[0]==0);
+                mats[j]->release();
+                continue;
             }
+            mats[j]->create(ELE_PIXELS>>i,ELE_PIXELS>>i,t);
+            memcpy(mats[j]->data,p,mats[j]->total()*mats[j]->elemSize());
+            p+=mats[j]->total()*mats[j]->elemSize();
         }
-            break;
-        default:
-            break;
+    }
+    return true;
+}
+
+bool MultiBandMap2DCPU::MultiBandMap2DCPUEle::restore(const TileStore& store)
+{
+    if(!read(store,pyr_laplace,weights)) return false;
+    onDisk=false;
+    return true;
+}
+
+/// Quantize weights in [0,1] to CV_8UC1 or CV_16UC1, a positive weight stays positive
+template <typename WeightT>
+static void quantizeWeights(const cv::Mat& src,cv::Mat& dst,float scale)
+{
+    for(int y=0;y<src.rows;y++)
+    {
+        const float* s=src.ptr<float>(y);
+        WeightT*     d=dst.ptr<WeightT>(y);
+        for(int x=0;x<src.cols;x++)
+        {
+            if(s[x]<=0) d[x]=0;
+            else d[x]=(WeightT)std::max(1.f,std::min(scale,s[x]*scale+0.5f));
         }
     }
+}
 
+static void quantizeWeights(const cv::Mat& src,cv::Mat& dst,int depth)
+{
+    cv::Mat result(src.rows,src.cols,CV_MAKETYPE(depth,1));
+    if(depth==CV_8U) quantizeWeights<uchar>(src,result,255);
+    else quantizeWeights<ushort>(src,result,65535);
+    dst=result;
+}
+
+/// Keep the pixels of src inside rect where their weight is not less than dst
+template <typename LapT,typename WeightT>
+static void mergeLevel(const cv::Mat& srcL,const cv::Mat& srcW,const cv::Rect& rect,
+                       cv::Mat& dstL,cv::Mat& dstW)
+{
+    for(int y=0;y<rect.height;y++)
     {
-        //blend by self
-        vector<cv::Mat> pyr_laplaceClone(pyr_laplace.size());
-        for(int i=0;i<pyr_laplace.size();i++)
+        const pi::Point3_<LapT>* sL=srcL.ptr<pi::Point3_<LapT> >(rect.y+y)+rect.x;
+        const WeightT*           sW=srcW.ptr<WeightT>(rect.y+y)+rect.x;
+        pi::Point3_<LapT>*       dL=dstL.ptr<pi::Point3_<LapT> >(y);
+        WeightT*                 dW=dstW.ptr<WeightT>(y);
+        for(int x=0;x<rect.width;x++)
         {
-            pyr_laplaceClone[i]=pyr_laplace[i].clone();
+            if(sW[x]>=dW[x])
+            {
+                dL[x]=sL[x];
+                dW[x]=sW[x];
+            }
         }
+    }
+}
+
+/// The full precision pyramids go through the SIMD kernels of UtilCPU
+template <>
+void mergeLevel<float,float>(const cv::Mat& srcL,const cv::Mat& srcW,const cv::Rect& rect,
+                             cv::Mat& dstL,cv::Mat& dstW)
+{
+    for(int y=0;y<rect.height;y++)
+        mergeLevel32F(dstL.ptr<float>(y),dstW.ptr<float>(y),
+                      srcL.ptr<float>(rect.y+y)+3*rect.x,srcW.ptr<float>(rect.y+y)+rect.x,
+                      rect.width);
+}
 
-        cv::detail::restoreImageFromLaplacePyr(pyr_laplaceClone);
+template <>
+void mergeLevel<short,float>(const cv::Mat& srcL,const cv::Mat& srcW,const cv::Rect& rect,
+                             cv::Mat& dstL,cv::Mat& dstW)
+{
+    for(int y=0;y<rect.height;y++)
+        mergeLevel16S(dstL.ptr<short>(y),dstW.ptr<float>(y),
+                      srcL.ptr<short>(rect.y+y)+3*rect.x,srcW.ptr<float>(rect.y+y)+rect.x,
+                      rect.width);
+}
 
-        return  pyr_laplaceClone[0].setTo(cv::Scalar::all(0),weights[0]==0);
+template <typename WeightT>
+static void mergeLevel(const cv::Mat& srcL,const cv::Mat& srcW,const cv::Rect& rect,
+                       cv::Mat& dstL,cv::Mat& dstW)
+{
+    switch(srcL.depth())
+    {
+    case CV_32F: mergeLevel<float,WeightT>(srcL,srcW,rect,dstL,dstW);break;
+    case CV_16S: mergeLevel<short,WeightT>(srcL,srcW,rect,dstL,dstW);break;
+    case CV_8S:  mergeLevel<signed char,WeightT>(srcL,srcW,rect,dstL,dstW);break;
+    case CV_8U:  mergeLevel<uchar,WeightT>(srcL,srcW,rect,dstL,dstW);break;
+    default:break;
     }
 }
 
-// this is a bad idea, just for test
-bool MultiBandMap2DCPU::MultiBandMap2DCPUEle::updateTexture(const std::vector<SPtr<MultiBandMap2DCPUEle> >& neighbors)
+static void mergeLevel(const cv::Mat& srcL,const cv::Mat& srcW,const cv::Rect& rect,
+                       cv::Mat& dstL,cv::Mat& dstW)
 {
-    cv::Mat tmp=blend(neighbors);
-    uint type=0;
-    if(tmp.empty()) return false;
-    else if(tmp.type()==CV_16SC3)
+    switch(srcW.depth())
     {
-        tmp.convertTo(tmp,CV_8UC3);
-        type=GL_UNSIGNED_BYTE;
+    case CV_32F: mergeLevel<float>(srcL,srcW,rect,dstL,dstW);break;
+    case CV_16U: mergeLevel<ushort>(srcL,srcW,rect,dstL,dstW);break;
+    case CV_8U:  mergeLevel<uchar>(srcL,srcW,rect,dstL,dstW);break;
+    default:break;
     }
-    else if(tmp.type()==CV_32FC3)
-        type=GL_FLOAT;
-    if(!type) return false;
+}
 
+/// Add the pixels of src inside rect times their weight to the CV_32FC3 sums
+/// of dst, and their weight to the CV_32FC1 sums. The weights are CV_32F.
+static void accumulateLevel(const cv::Mat& srcL,const cv::Mat& srcW,const cv::Rect& rect,
+                            cv::Mat& dstL,cv::Mat& dstW)
+{
+    for(int y=0;y<rect.height;y++)
     {
-        if(texName==0)// create texture
-        {
-            glGenTextures(1, &texName);
-            glBindTexture(GL_TEXTURE_2D,texName);
-            glTexImage2D(GL_TEXTURE_2D, 0,
-                         GL_RGB,tmp.cols,tmp.rows, 0,
-                         GL_BGR, type,tmp.data);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,GL_NEAREST);
-        }
+        const float* sW=srcW.ptr<float>(rect.y+y)+rect.x;
+        if(srcL.depth()==CV_16S)
+            accumulateLevel16S(dstL.ptr<float>(y),dstW.ptr<float>(y),
+                               srcL.ptr<short>(rect.y+y)+3*rect.x,sW,rect.width);
         else
-        {
-            glBindTexture(GL_TEXTURE_2D,texName);
-            glTexImage2D(GL_TEXTURE_2D, 0,
-                         GL_RGB,tmp.cols,tmp.rows, 0,
-                         GL_BGR, type,tmp.data);
-        }
+            accumulateLevel32F(dstL.ptr<float>(y),dstW.ptr<float>(y),
+                               srcL.ptr<float>(rect.y+y)+3*rect.x,sW,rect.width);
     }
+}
 
-    SvarWithType<cv::Mat>::instance()["LastTexMat"]=tmp;
-    SvarWithType<cv::Mat>::instance()["LastTexMatWeight"]=weights[0].clone();
+/// cv::detail::createLaplacePyr of image and the cv::pyrDown pyramid of weight,
+/// both reduced in the same pass over every level by the kernels of UtilCPU.
+/// image becomes the level 0 as with createLaplacePyr, the coarser levels stay
+/// in the FrameArena of the calling thread until its next frame. False when
+/// the types are not supported or the sizes are not multiples of 1<<levels.
+static bool buildPyramids(cv::Mat& image,const cv::Mat& weight,int levels,
+                          std::vector<cv::Mat>& pyrLaplace,std::vector<cv::Mat>& pyrWeights)
+{
+    int type=image.type();
+    if((type!=CV_16SC3&&type!=CV_32FC3)||weight.type()!=CV_32FC1
+            ||weight.cols!=image.cols||weight.rows!=image.rows
+            ||image.cols%(1<<levels)||image.rows%(1<<levels)
+            ||levels>FrameArena::PyramidWeights-FrameArena::PyramidLevels) return false;
+
+    FrameArena& arena=FrameArena::thread();
+    void*       rows=arena.buffer(FrameArena::PyramidRows,pyrLevelBufferSize(image.cols));
+
+    pyrLaplace.resize(levels+1);
+    pyrWeights.resize(levels+1);
+    pyrLaplace[0]=image;
+    pyrWeights[0]=weight;
+    for(int i=0;i<levels;i++)
+    {
+        const cv::Mat &src=pyrLaplace[i],&srcW=pyrWeights[i];
+        cv::Mat& dst =pyrLaplace[i+1]=arena.mat(FrameArena::PyramidLevels+i,src.rows/2,src.cols/2,type);
+        cv::Mat& dstW=pyrWeights[i+1]=arena.mat(FrameArena::PyramidWeights+i,src.rows/2,src.cols/2,CV_32FC1);
+        if(type==CV_16SC3)
+            pyrDownLevel16S(src.ptr<short>(),src.step,srcW.ptr<float>(),srcW.step,src.cols,src.rows,
+                            dst.ptr<short>(),dst.step,dstW.ptr<float>(),dstW.step,rows);
+        else
+            pyrDownLevel32F(src.ptr<float>(),src.step,srcW.ptr<float>(),srcW.step,src.cols,src.rows,
+                            dst.ptr<float>(),dst.step,dstW.ptr<float>(),dstW.step,rows);
+    }
+    for(int i=0;i<levels;i++)
+    {
+        cv::Mat& level=pyrLaplace[i];
+        const cv::Mat& coarse=pyrLaplace[i+1];
+        if(type==CV_16SC3)
+            laplaceLevel16S(level.ptr<short>(),level.step,level.cols,level.rows,
+                            coarse.ptr<short>(),coarse.step,rows);
+        else
+            laplaceLevel32F(level.ptr<float>(),level.step,level.cols,level.rows,
+                            coarse.ptr<float>(),coarse.step,rows);
+    }
+    return true;
+}
+
+bool MultiBandMap2DCPU::MultiBandMap2DCPUEle::updateTexture(const cv::Mat& image)
+{
+    if(image.empty()||image.type()!=CV_8UC3) return false;
+
+    if(texName==0)// create texture
+    {
+        glGenTextures(1, &texName);
+        glBindTexture(GL_TEXTURE_2D,texName);
+        glTexImage2D(GL_TEXTURE_2D, 0,
+                     GL_RGB,image.cols,image.rows, 0,
+                     GL_BGR, GL_UNSIGNED_BYTE,image.data);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+    }
+    else
+    {
+        glBindTexture(GL_TEXTURE_2D,texName);
+        glTexImage2D(GL_TEXTURE_2D, 0,
+                     GL_RGB,image.cols,image.rows, 0,
+                     GL_BGR, GL_UNSIGNED_BYTE,image.data);
+    }
 
-    Ischanged=false;
+    SvarWithType<cv::Mat>::instance()["LastTexMat"]=image;
     return true;
 }
 
 MultiBandMap2DCPU::MultiBandMap2DCPUData::MultiBandMap2DCPUData(double eleSize_,double lengthPixel_,pi::Point3d max_,pi::Point3d min_,
-             int w_,int h_,const std::vector<SPtr<MultiBandMap2DCPUEle> >& d_)
+             int w_,int h_,SPtr<Map2DGrid<MultiBandMap2DCPUEle> > grid_,int x0_,int y0_,
+             SPtr<TileStore> store_)
     :_eleSize(eleSize_),_eleSizeInv(1./eleSize_),
       _lengthPixel(lengthPixel_),_lengthPixelInv(1./lengthPixel_),
-      _min(min_),_max(max_),_w(w_),_h(h_),_data(d_)
+      _min(min_),_max(max_),_w(w_),_h(h_),_x0(x0_),_y0(y0_),_grid(grid_),_store(store_)
 {
     _gpsOrigin=svar.get_var("GPS.Origin",_gpsOrigin);
 }
@@ -202,8 +410,9 @@ bool MultiBandMap2DCPU::MultiBandMap2DCPUData::prepare(SPtr<MultiBandMap2DCPUPre
     {
         _max=pi::Point3d(-1e10,-1e10,-1e10);
         _min=-_max;
-        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=prepared->_frames.begin();
-            it!=prepared->_frames.end();it++)
+        std::deque<std::pair<cv::Mat,pi::SE3d> > frames=prepared->getFrames();
+        for(std::deque<std::pair<cv::Mat,pi::SE3d> >::iterator it=frames.begin();
+            it!=frames.end();it++)
         {
             pi::SE3d& pose=it->second;
             pi::Point3d& t=pose.get_translation();
@@ -247,20 +456,62 @@ bool MultiBandMap2DCPU::MultiBandMap2DCPUData::prepare(SPtr<MultiBandMap2DCPUPre
             _h=ceil((_max.y-_min.y)/_eleSize);
             _max.x=_min.x+_eleSize*_w;
             _max.y=_min.y+_eleSize*_h;
-            _data.resize(_w*_h);
         }
     }
     _gpsOrigin=svar.get_var("GPS.Origin",_gpsOrigin);
+    if(svar.GetDouble("MultiBandMap2DCPU.CacheMB",0)>0)
+    {
+        _store=SPtr<TileStore>(new TileStore());
+        if(!_store->open(svar.GetString("MultiBandMap2DCPU.CacheFolder","/tmp")))
+            _store=SPtr<TileStore>();
+    }
     return true;
 }
 
+/// Collapses the changed tiles queued by draw, so the GL thread only uploads them
+class MultiBandMap2DCPU::MultiBandMap2DCPUBlender:public pi::Thread
+{
+public:
+    MultiBandMap2DCPUBlender(MultiBandMap2DCPU* map):_map(map){}
+    virtual void run(){_map->blendLoop();}
+
+private:
+    MultiBandMap2DCPU* _map;
+};
+
 MultiBandMap2DCPU::MultiBandMap2DCPU(bool thread)
     :alpha(svar.GetInt("Map2D.Alpha",0)),
      _valid(false),_thread(thread),
      _bandNum(svar.GetInt("MultiBandMap2DCPU.BandNumber",5)),
-     _highQualityShow(svar.GetInt("MultiBandMap2DCPU.HighQualityShow",1))
+     _highQualityShow(svar.GetInt("MultiBandMap2DCPU.HighQualityShow",1)),
+     _compact(svar.GetInt("MultiBandMap2DCPU.Compact",0)),
+     _weightDepth(svar.GetInt("MultiBandMap2DCPU.WeightBits",8)==16?CV_16U:CV_8U),
+     _compact8BitLevel(svar.GetInt("MultiBandMap2DCPU.Compact8BitLevel",1)),
+     _feather(svar.GetInt("MultiBandMap2DCPU.BlendMode",0)==1),
+     _cacheBytes(svar.GetDouble("MultiBandMap2DCPU.CacheMB",0)*1024*1024),
+     _cacheKeepFrames(svar.GetInt("MultiBandMap2DCPU.CacheKeepFrames",10)),
+     _residentBytes(0),_frameId(0),
+     _blendThreads(svar.GetInt("MultiBandMap2DCPU.BlendThreads",2)),
+     _uploadSeconds(svar.GetDouble("MultiBandMap2DCPU.UploadMs",8)*1e-3)
 {
     _bandNum=min(_bandNum, static_cast<int>(ceil(log(ELE_PIXELS) / log(2.0))));
+    _collapseCacheLevel=max(0,min(svar.GetInt("MultiBandMap2DCPU.CollapseCacheLevel",3),_bandNum));
+    if(_feather&&_compact)
+    {
+        cerr<<"MultiBandMap2DCPU::MultiBandMap2DCPU: Compact is not supported by the feather blend mode, disabled.\n";
+        _compact=0;
+    }
+}
+
+MultiBandMap2DCPU::~MultiBandMap2DCPU()
+{
+    _valid=false;
+    _blendQueue.close();
+    for(size_t i=0;i<_blenders.size();i++)
+    {
+        _blenders[i]->join();
+        delete _blenders[i];
+    }
 }
 
 bool MultiBandMap2DCPU::prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
@@ -274,9 +525,11 @@ bool MultiBandMap2DCPU::prepare(const pi::SE3d& plane,const PinHoleParameters& c
         if(d->prepare(p))
         {
             pi::WriteMutex lock(mutex);
+            if(prepared.get()) prepared->_frames.close();
             prepared=p;
             data=d;
             weightImage.release();
+            _residentBytes=0;
             if(_thread&&!isRunning())
                 start();
             _valid=true;
@@ -297,10 +550,7 @@ bool MultiBandMap2DCPU::feed(cv::Mat img,const pi::SE3d& pose)
     std::pair<cv::Mat,pi::SE3d> frame(img,p->_plane.inverse()*pose);
     if(_thread)
     {
-        pi::WriteMutex lock(p->mutexFrames);
-        p->_frames.push_back(frame);
-        if(p->_frames.size()>20) p->_frames.pop_front();
-        return true;
+        return p->pushFrame(frame);
     }
     else
     {
@@ -316,25 +566,21 @@ bool MultiBandMap2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
         pi::ReadMutex lock(mutex);
         p=prepared;d=data;
     }
-    if(frame.first.cols!=p->_camera.w||frame.first.rows!=p->_camera.h||frame.first.type()!=CV_8UC3)
+    double scale=p->frameScale(frame.first);// frames may be decoded at a reduced size
+    if(scale<=0||frame.first.type()!=CV_8UC3)
     {
-        cerr<<"MultiBandMap2DCPU::renderFrame: frame.first.cols!=p->_camera.w||frame.first.rows!=p->_camera.h||frame.first.type()!=CV_8UC3\n";
+        cerr<<"MultiBandMap2DCPU::renderFrame: p->frameScale(frame.first)<=0||frame.first.type()!=CV_8UC3\n";
         return false;
     }
+    // buffers of this thread reused by every frame
+    FrameArena& arena=FrameArena::thread();
     // 1. pose->pts
-    std::vector<pi::Point2d>          imgPts;
-    {
-        imgPts.reserve(4);
-        imgPts.push_back(pi::Point2d(0,0));
-        imgPts.push_back(pi::Point2d(p->_camera.w,0));
-        imgPts.push_back(pi::Point2d(0,p->_camera.h));
-        imgPts.push_back(pi::Point2d(p->_camera.w,p->_camera.h));
-    }
-    vector<pi::Point2d> pts;
-    pts.reserve(imgPts.size());
+    pi::Point2d imgPts[4]={pi::Point2d(0,0),pi::Point2d(p->_camera.w,0),
+                           pi::Point2d(0,p->_camera.h),pi::Point2d(p->_camera.w,p->_camera.h)};
+    pi::Point2d pts[4];
     pi::Point3d downLook(0,0,-1);
     if(frame.second.get_translation().z<0) downLook=pi::Point3d(0,0,1);
-    for(int i=0;i<imgPts.size();i++)
+    for(int i=0;i<4;i++)
     {
         pi::Point3d axis=frame.second.get_rotation()*p->UnProject(imgPts[i]);
         if(axis.dot(downLook)<0.4)
@@ -343,14 +589,14 @@ bool MultiBandMap2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
         }
         axis=frame.second.get_translation()
                 -axis*(frame.second.get_translation().z/axis.z);
-        pts.push_back(pi::Point2d(axis.x,axis.y));
+        pts[i]=pi::Point2d(axis.x,axis.y);
     }
     // 2. dest location?
     double xmin=pts[0].x;
     double xmax=xmin;
     double ymin=pts[0].y;
     double ymax=ymin;
-    for(int i=1;i<pts.size();i++)
+    for(int i=1;i<4;i++)
     {
         if(pts[i].x<xmin) xmin=pts[i].x;
         if(pts[i].y<ymin) ymin=pts[i].y;
@@ -393,63 +639,73 @@ bool MultiBandMap2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
         ymax=d->min().y+d->eleSize()*ymaxInt;
     }
     // 3.prepare weight and warp images
-    cv::Mat weight_src;
-    if(weightImage.empty()||weightImage.cols!=frame.first.cols||weightImage.rows!=frame.first.rows)
-    {
-        pi::WriteMutex lock(mutex);
-        int w=frame.first.cols;
-        int h=frame.first.rows;
-        weightImage.create(h,w,CV_32FC1);
-        float *p=(float*)weightImage.data;
-        float x_center=w/2;
-        float y_center=h/2;
-        float dis_max=sqrt(x_center*x_center+y_center*y_center);
-        int weightType=svar.GetInt("Map2D.WeightType",0);
-        for(int i=0;i<h;i++)
-            for(int j=0;j<w;j++)
-            {
-                float dis=(i-y_center)*(i-y_center)+(j-x_center)*(j-x_center);
-                dis=1-sqrt(dis)/dis_max;
-                if(0==weightType)
-                    *p=dis;
-                else *p=dis*dis;
-                if(*p<=1e-5) *p=1e-5;
-                p++;
-            }
-        weight_src=weightImage.clone();
-    }
-    else
+    cv::Mat weight_warped,image_warped;
+    double  quad[8];// footprint of the frame in image_warped
     {
-        pi::ReadMutex lock(mutex);
-        weight_src=weightImage.clone();
-    }
-
-    std::vector<cv::Point2f>          imgPtsCV;
-    {
-        imgPtsCV.reserve(imgPts.size());
-        for(int i=0;i<imgPts.size();i++)
-            imgPtsCV.push_back(cv::Point2f(imgPts[i].x,imgPts[i].y));
-    }
-    std::vector<cv::Point2f> destPoints;
-    destPoints.reserve(imgPtsCV.size());
-    for(int i=0;i<imgPtsCV.size();i++)
-    {
-        destPoints.push_back(cv::Point2f((pts[i].x-xmin)*d->lengthPixelInv(),
-                             (pts[i].y-ymin)*d->lengthPixelInv()));
-    }
+        PI_PROFILE_SCOPE("MultiBandMap2DCPU::Warp");
+        cv::Mat weight_src;
+        if(weightImage.empty()||weightImage.cols!=frame.first.cols||weightImage.rows!=frame.first.rows)
+        {
+            pi::WriteMutex lock(mutex);
+            int w=frame.first.cols;
+            int h=frame.first.rows;
+            weightImage.create(h,w,CV_32FC1);
+            float *p=(float*)weightImage.data;
+            float x_center=w/2;
+            float y_center=h/2;
+            float dis_max=sqrt(x_center*x_center+y_center*y_center);
+            int weightType=svar.GetInt("Map2D.WeightType",0);
+            for(int i=0;i<h;i++)
+                for(int j=0;j<w;j++)
+                {
+                    float dis=(i-y_center)*(i-y_center)+(j-x_center)*(j-x_center);
+                    dis=1-sqrt(dis)/dis_max;
+                    if(0==weightType)
+                        *p=dis;
+                    else *p=dis*dis;
+                    if(*p<=1e-5) *p=1e-5;
+                    p++;
+                }
+            weight_src=weightImage;
+        }
+        else
+        {
+            // read only, a new weightImage is allocated when the size changes
+            pi::ReadMutex lock(mutex);
+            weight_src=weightImage;
+        }
 
-    cv::Mat transmtx = cv::getPerspectiveTransform(imgPtsCV, destPoints);
+        cv::Point2f imgPtsCV[4],destPoints[4];
+        for(int i=0;i<4;i++)
+        {
+            imgPtsCV[i]  =cv::Point2f(imgPts[i].x*scale,imgPts[i].y*scale);
+            destPoints[i]=cv::Point2f((pts[i].x-xmin)*d->lengthPixelInv(),
+                                      (pts[i].y-ymin)*d->lengthPixelInv());
+        }
 
-    cv::Mat img_src;
-    if(svar.GetInt("MultiBandMap2DCPU.ForceFloat",0))
-        frame.first.convertTo(img_src,CV_32FC3,1./255.);
-    else
-        frame.first.convertTo(img_src,CV_16SC3);
+        cv::Mat transmtx = cv::getPerspectiveTransform(imgPtsCV, destPoints);
+        int     order[4]={0,1,3,2};
+        for(int i=0;i<4;i++)
+        {
+            quad[2*i]  =destPoints[order[i]].x;
+            quad[2*i+1]=destPoints[order[i]].y;
+        }
 
-    cv::Mat weight_warped((ymaxInt-yminInt)*ELE_PIXELS,(xmaxInt-xminInt)*ELE_PIXELS,CV_32FC1);
-    cv::Mat image_warped((ymaxInt-yminInt)*ELE_PIXELS,(xmaxInt-xminInt)*ELE_PIXELS,img_src.type());
-    cv::warpPerspective(img_src, image_warped, transmtx, image_warped.size(),cv::INTER_LINEAR,cv::BORDER_REFLECT);
-    cv::warpPerspective(weight_src, weight_warped, transmtx, weight_warped.size(),cv::INTER_NEAREST);
+        bool    forceFloat=svar.GetInt("MultiBandMap2DCPU.ForceFloat",0);
+        cv::Mat img_src=arena.mat(FrameArena::FrameSrc,frame.first.rows,frame.first.cols,
+                                  forceFloat?CV_32FC3:CV_16SC3);
+        if(forceFloat)
+            frame.first.convertTo(img_src,CV_32FC3,1./255.);
+        else
+            frame.first.convertTo(img_src,CV_16SC3);
+
+        weight_warped=arena.mat(FrameArena::WeightWarped,(ymaxInt-yminInt)*ELE_PIXELS,
+                                (xmaxInt-xminInt)*ELE_PIXELS,CV_32FC1);
+        image_warped =arena.mat(FrameArena::ImageWarped,(ymaxInt-yminInt)*ELE_PIXELS,
+                                (xmaxInt-xminInt)*ELE_PIXELS,img_src.type());
+        cv::warpPerspective(img_src, image_warped, transmtx, image_warped.size(),cv::INTER_LINEAR,cv::BORDER_REFLECT);
+        cv::warpPerspective(weight_src, weight_warped, transmtx, weight_warped.size(),cv::INTER_NEAREST);
+    }
 
     if(svar.GetInt("ShowWarped",0))
     {
@@ -466,101 +722,148 @@ bool MultiBandMap2DCPU::renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame)
 
     // 4. blender dst to eles
     std::vector<cv::Mat> pyr_laplace;
-    cv::detail::createLaplacePyr(image_warped, _bandNum, pyr_laplace);
-
     std::vector<cv::Mat> pyr_weights(_bandNum+1);
-    pyr_weights[0]=weight_warped;
-    for (int i = 0; i < _bandNum; ++i)
-        cv::pyrDown(pyr_weights[i], pyr_weights[i + 1]);
+    {
+        PI_PROFILE_SCOPE("MultiBandMap2DCPU::Pyramid");
+        if(!svar.GetInt("MultiBandMap2DCPU.FastPyramid",1)||
+                !buildPyramids(image_warped,weight_warped,_bandNum,pyr_laplace,pyr_weights))
+        {
+            cv::detail::createLaplacePyr(image_warped, _bandNum, pyr_laplace);
 
-    pi::timer.enter("MultiBandMap2DCPU::Apply");
-    std::vector<SPtr<MultiBandMap2DCPUEle> > dataCopy=d->data();
+            pyr_weights[0]=weight_warped;
+            for (int i = 0; i < _bandNum; ++i)
+                cv::pyrDown(pyr_weights[i], pyr_weights[i + 1]);
+        }
+    }
+    int pyrType=pyr_laplace[0].type();
+    if(_compact)
+    {
+        PI_PROFILE_SCOPE("MultiBandMap2DCPU::Compact");
+        for (int i = 0; i <= _bandNum; ++i)
+        {
+            quantizeWeights(pyr_weights[i],pyr_weights[i],_weightDepth);
+            if(pyrType!=CV_16SC3||i<_compact8BitLevel) continue;
+            if(i==_bandNum) pyr_laplace[i].convertTo(pyr_laplace[i],CV_8UC3);
+            else            pyr_laplace[i].convertTo(pyr_laplace[i],CV_8SC3,0.5);
+        }
+    }
+
+    PI_PROFILE_SCOPE("MultiBandMap2DCPU::Apply");
+    // weights are zero further than the pyramid filters reach from the footprint
+    bool tileWarp=svar.GetInt("Map2D.TileWarp",1);
+    int  margin=4<<_bandNum;
     for(int x=xminInt;x<xmaxInt;x++)
         for(int y=yminInt;y<ymaxInt;y++)
         {
-            SPtr<MultiBandMap2DCPUEle> ele=dataCopy[y*d->w()+x];
-            if(!ele.get())
+            if(tileWarp&&!quadIntersectsRect(quad,(x-xminInt)*ELE_PIXELS-margin,(y-yminInt)*ELE_PIXELS-margin,
+                                             (x-xminInt+1)*ELE_PIXELS+margin,(y-yminInt+1)*ELE_PIXELS+margin))
+                continue;
+            PI_PROFILE_COUNT("MultiBandMap2DCPU::ApplyTiles",1);
+
+            MultiBandMap2DCPUEle* ele=d->at(y*d->w()+x);
+            if(!ele)
             {
                 ele=d->ele(y*d->w()+x);
             }
             {
                 pi::WriteMutex lock(ele->mutexData);
+                size_t bytes=ele->memory();
+                if(ele->onDisk&&d->store().get()&&ele->restore(*d->store()))
+                    PI_PROFILE_COUNT("MultiBandMap2DCPU::RestoredTiles",1);
                 if(!ele->pyr_laplace.size())
                 {
                     ele->pyr_laplace.resize(_bandNum+1);
                     ele->weights.resize(_bandNum+1);
                 }
 
+                ele->type=pyrType;
+                ele->feather=_feather;
+
                 int width=ELE_PIXELS,height=ELE_PIXELS;
 
                 for (int i = 0; i <= _bandNum; ++i)
                 {
+                    cv::Rect rect(width*(x-xminInt),height*(y-yminInt),width,height);
                     if(ele->pyr_laplace[i].empty())
                     {
-                        //fresh
-                        cv::Rect rect(width*(x-xminInt),height*(y-yminInt),width,height);
-                        pyr_laplace[i](rect).copyTo(ele->pyr_laplace[i]);
-                        pyr_weights[i](rect).copyTo(ele->weights[i]);
-                    }
-                    else
-                    {
-                        if(pyr_laplace[i].type()==CV_32FC3)
-                        {
-                            int org =(x-xminInt)*width+(y-yminInt)*height*pyr_laplace[i].cols;
-                            int skip=pyr_laplace[i].cols-ele->pyr_laplace[i].cols;
-
-                            pi::Point3f *srcL=((pi::Point3f*)pyr_laplace[i].data)+org;
-                            float       *srcW=((float*)pyr_weights[i].data)+org;
-
-                            pi::Point3f *dstL=(pi::Point3f*)ele->pyr_laplace[i].data;
-                            float       *dstW=(float*)ele->weights[i].data;
-
-                            for(int eleY=0;eleY<height;eleY++,srcL+=skip,srcW+=skip)
-                                for(int eleX=0;eleX<width;eleX++,srcL++,dstL++,srcW++,dstW++)
-                                {
-                                    if((*srcW)>=(*dstW))
-                                    {
-                                        *dstL=(*srcL);
-                                        *dstW=*srcW;
-                                    }
-                                }
-                        }
-                        else if(pyr_laplace[i].type()==CV_16SC3)
+                        //fresh, levels without weights are not allocated
+                        if(cv::countNonZero(pyr_weights[i](rect)))
                         {
-                            int org =(x-xminInt)*width+(y-yminInt)*height*pyr_laplace[i].cols;
-                            int skip=pyr_laplace[i].cols-ele->pyr_laplace[i].cols;
-
-                            pi::Point3_<short> *srcL=((pi::Point3_<short>*)pyr_laplace[i].data)+org;
-                            float       *srcW=((float*)pyr_weights[i].data)+org;
-
-                            pi::Point3_<short> *dstL=(pi::Point3_<short>*)ele->pyr_laplace[i].data;
-                            float       *dstW=(float*)ele->weights[i].data;
-
-                            for(int eleY=0;eleY<height;eleY++,srcL+=skip,srcW+=skip)
-                                for(int eleX=0;eleX<width;eleX++,srcL++,dstL++,srcW++,dstW++)
-                                {
-                                    if((*srcW)>=(*dstW))
-                                    {
-                                        *dstL=(*srcL);
-                                        *dstW=*srcW;
-                                    }
-                                }
+                            if(_feather)
+                            {
+                                ele->pyr_laplace[i]=cv::Mat::zeros(height,width,CV_32FC3);
+                                ele->weights[i]=cv::Mat::zeros(height,width,CV_32FC1);
+                                accumulateLevel(pyr_laplace[i],pyr_weights[i],rect,
+                                                ele->pyr_laplace[i],ele->weights[i]);
+                            }
+                            else
+                            {
+                                pyr_laplace[i](rect).copyTo(ele->pyr_laplace[i]);
+                                pyr_weights[i](rect).copyTo(ele->weights[i]);
+                            }
                         }
                     }
+                    else if(_feather)
+                        accumulateLevel(pyr_laplace[i],pyr_weights[i],rect,
+                                        ele->pyr_laplace[i],ele->weights[i]);
+                    else
+                        mergeLevel(pyr_laplace[i],pyr_weights[i],rect,
+                                   ele->pyr_laplace[i],ele->weights[i]);
                     width/=2;height/=2;
                 }
                 ele->Ischanged=true;
+                ele->exportDirty=true;
+                ele->version++;
+                ele->lastUse=_frameId;
+                __sync_fetch_and_add(&_residentBytes,(int64_t)ele->memory()-(int64_t)bytes);
             }
         }
-    pi::timer.leave("MultiBandMap2DCPU::Apply");
+    _frameId++;
 
+    evictTiles(d);
     return true;
 }
 
+void MultiBandMap2DCPU::evictTiles(SPtr<MultiBandMap2DCPUData> d)
+{
+    if(!_cacheBytes||_residentBytes<=_cacheBytes||!d->store().get()) return;
+    PI_PROFILE_SCOPE("MultiBandMap2DCPU::Evict");
+
+    // tiles not used in the last CacheKeepFrames frames, least recently used first
+    std::vector<Map2DGrid<MultiBandMap2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+    std::vector<std::pair<int,MultiBandMap2DCPUEle*> > cold;
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        MultiBandMap2DCPUEle* ele=tiles[i].ele;
+        if(!ele->onDisk&&ele->lastUse+_cacheKeepFrames<_frameId)
+            cold.push_back(std::make_pair((int)ele->lastUse,ele));
+    }
+    std::sort(cold.begin(),cold.end());
+
+    int64_t target=_cacheBytes*9/10;// some room before the next eviction
+    int     evicted=0;
+    for(size_t i=0;i<cold.size()&&_residentBytes>target;i++)
+    {
+        MultiBandMap2DCPUEle* ele=cold[i].second;
+        pi::WriteMutex lock(ele->mutexData);
+        if(ele->onDisk||ele->lastUse+_cacheKeepFrames>=_frameId) continue;
+        size_t bytes=ele->memory();
+        if(!ele->evict(*d->store())) continue;
+        {
+            pi::ScopedMutex lockCoarse(ele->mutexCoarse);
+            ele->coarse.release();
+        }
+        __sync_fetch_and_sub(&_residentBytes,(int64_t)bytes);
+        evicted++;
+    }
+    PI_PROFILE_COUNT("MultiBandMap2DCPU::EvictedTiles",evicted);
+}
+
 
 bool MultiBandMap2DCPU::spreadMap(double xmin,double ymin,double xmax,double ymax)
 {
-    pi::timer.enter("MultiBandMap2DCPU::spreadMap");
+    PI_PROFILE_SCOPE("MultiBandMap2DCPU::spreadMap");
     SPtr<MultiBandMap2DCPUData> d;
     {
         pi::ReadMutex lock(mutex);
@@ -581,43 +884,32 @@ bool MultiBandMap2DCPU::spreadMap(double xmin,double ymin,double xmax,double yma
         max.x=min.x+w*d->eleSize();
         max.y=min.y+h*d->eleSize();
     }
-    std::vector<SPtr<MultiBandMap2DCPUEle> > dataOld=d->data();
-    std::vector<SPtr<MultiBandMap2DCPUEle> > dataCopy;
-    dataCopy.resize(w*h);
-    {
-        for(int x=0,xend=d->w();x<xend;x++)
-            for(int y=0,yend=d->h();y<yend;y++)
-            {
-                dataCopy[x-xminInt+(y-yminInt)*w]=dataOld[y*d->w()+x];
-            }
-    }
     //apply
     {
         pi::WriteMutex lock(mutex);
         data=SPtr<MultiBandMap2DCPUData>(new MultiBandMap2DCPUData(d->eleSize(),d->lengthPixel(),
                                                  pi::Point3d(max.x,max.y,d->max().z),
                                                  pi::Point3d(min.x,min.y,d->min().z),
-                                                 w,h,dataCopy));
+                                                 w,h,d->grid(),d->x0()+xminInt,d->y0()+yminInt,
+                                                 d->store()));
     }
-    pi::timer.leave("MultiBandMap2DCPU::spreadMap");
     return true;
 }
 
 bool MultiBandMap2DCPU::getFrame(std::pair<cv::Mat,pi::SE3d>& frame)
 {
-    pi::ReadMutex lock(mutex);
-    pi::ReadMutex lock1(prepared->mutexFrames);
-    if(prepared->_frames.size())
+    SPtr<MultiBandMap2DCPUPrepare> p;
     {
-        frame=prepared->_frames.front();
-        prepared->_frames.pop_front();
-        return true;
+        pi::ReadMutex lock(mutex);
+        p=prepared;
     }
-    else return false;
+    // wake up at least every 100ms to check shouldStop()
+    return p->popFrame(frame,100);
 }
 
 void MultiBandMap2DCPU::run()
 {
+    pi::Profiler::instance().setThreadName("MultiBandMap2DCPU::run");
     std::pair<cv::Mat,pi::SE3d> frame;
     while(!shouldStop())
     {
@@ -625,12 +917,95 @@ void MultiBandMap2DCPU::run()
         {
             if(getFrame(frame))
             {
-                pi::timer.enter("MultiBandMap2DCPU::renderFrame");
+                PI_PROFILE_SCOPE("MultiBandMap2DCPU::renderFrame");
                 renderFrame(frame);
-                pi::timer.leave("MultiBandMap2DCPU::renderFrame");
             }
         }
-        sleep(10);
+        else sleep(10);
+    }
+}
+
+/// Projection times modelview of the current GL state, column major
+static void viewProjection(double* mvp)
+{
+    double projection[16],modelview[16];
+    glGetDoublev(GL_PROJECTION_MATRIX,projection);
+    glGetDoublev(GL_MODELVIEW_MATRIX,modelview);
+    for(int c=0;c<4;c++)
+        for(int r=0;r<4;r++)
+        {
+            double sum=0;
+            for(int k=0;k<4;k++) sum+=projection[k*4+r]*modelview[c*4+k];
+            mvp[c*4+r]=sum;
+        }
+}
+
+/// False if the rectangle of the plane z=0 is outside the view frustum
+static bool rectInView(const double* mvp,double x0,double y0,double x1,double y1)
+{
+    double xs[4]={x0,x1,x1,x0},ys[4]={y0,y0,y1,y1};
+    int    outside[6]={0,0,0,0,0,0};
+    for(int i=0;i<4;i++)
+    {
+        double clip[4];
+        for(int r=0;r<4;r++) clip[r]=mvp[r]*xs[i]+mvp[4+r]*ys[i]+mvp[12+r];
+        for(int axis=0;axis<3;axis++)
+        {
+            if(clip[axis]<-clip[3]) outside[2*axis]++;
+            if(clip[axis]> clip[3]) outside[2*axis+1]++;
+        }
+    }
+    for(int i=0;i<6;i++)
+        if(outside[i]==4) return false;
+    return true;
+}
+
+void MultiBandMap2DCPU::blendTile(SPtr<MultiBandMap2DCPUData> d,int x,int y)
+{
+    MultiBandMap2DCPUEle* ele=d->at(y*d->w()+x);
+    if(!ele) return;
+    {
+        // taken once, a frame fused meanwhile marks it again
+        pi::WriteMutex lock(ele->mutexData);
+        if(!ele->Ischanged) return;
+        ele->Ischanged=false;
+    }
+
+    PI_PROFILE_SCOPE("MultiBandMap2DCPU::Blend");
+    cv::Mat image;
+    if(!collapseTile(d,x,y,image,NULL,_highQualityShow))
+    {
+        // like a tile of the TileStore failing to load, retried by the next
+        // draws a few times, then left stale until a frame changes it again
+        static const int maxFailures=3;
+        pi::WriteMutex lock(ele->mutexData);
+        if(ele->failedVersion!=ele->version)
+        {
+            ele->failedVersion=ele->version;
+            ele->blendFailures=0;
+        }
+        if(++ele->blendFailures<maxFailures) ele->Ischanged=true;
+        else if(ele->blendFailures==maxFailures)
+            cerr<<"MultiBandMap2DCPU::blendTile: Can't collapse tile ("<<x<<","<<y
+               <<"), its texture is stale until it is fused again.\n";
+        return;
+    }
+    pi::ScopedMutex lock(ele->mutexTexture);
+    ele->texture=image;
+    ele->textureReady=true;
+}
+
+void MultiBandMap2DCPU::blendLoop()
+{
+    pi::Profiler::instance().setThreadName("MultiBandMap2DCPU::blend");
+    BlendJob job;
+    while(!_blendQueue.closed())
+    {
+        if(_blendQueue.pop(job))// woken up by close()
+        {
+            blendTile(job.d,job.x,job.y);
+            job.d=SPtr<MultiBandMap2DCPUData>();
+        }
     }
 }
 
@@ -699,85 +1074,434 @@ void MultiBandMap2DCPU::draw()
     }
     GLint last_texture_ID;
     glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture_ID);
-    std::vector<SPtr<MultiBandMap2DCPUEle> > dataCopy=d->data();
+    double mvp[16];
+    viewProjection(mvp);
     int wCopy=d->w(),hCopy=d->h();
-    glColor3ub(255,255,255);
-    for(int x=0;x<wCopy;x++)
-        for(int y=0;y<hCopy;y++)
-        {
-            int idxData=y*wCopy+x;
-            float x0=d->min().x+x*d->eleSize();
-            float y0=d->min().y+y*d->eleSize();
-            float x1=x0+d->eleSize();
-            float y1=y0+d->eleSize();
-            SPtr<MultiBandMap2DCPUEle> ele=dataCopy[idxData];
-            if(!ele.get())  continue;
+    std::vector<Map2DGrid<MultiBandMap2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+
+    // the changed tiles are collapsed by the blend workers, the ones in view first
+    std::vector<char>    visible(tiles.size());
+    std::deque<BlendJob> jobs,jobsOutOfView;
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        int x=tiles[i].x,y=tiles[i].y;
+        float x0=d->min().x+x*d->eleSize();
+        float y0=d->min().y+y*d->eleSize();
+        visible[i]=rectInView(mvp,x0,y0,x0+d->eleSize(),y0+d->eleSize());
+        if(!tiles[i].ele->Ischanged) continue;
+        BlendJob job={d,x,y};
+        if(visible[i]) jobs.push_back(job);
+        else           jobsOutOfView.push_back(job);
+    }
+    jobs.insert(jobs.end(),jobsOutOfView.begin(),jobsOutOfView.end());
+    if(_blendThreads>0)
+    {
+        // started by the first draw, nothing is collapsed for display without one
+        while((int)_blenders.size()<_blendThreads)
+        {
+            MultiBandMap2DCPUBlender* blender=new MultiBandMap2DCPUBlender(this);
+            _blenders.push_back(blender);
+            blender->start();
+        }
+        if(jobs.size()) _blendQueue.reset(jobs);
+    }
+    else
+    {
+        for(size_t i=0;i<jobs.size()&&ticTac.Tac()<_uploadSeconds;i++)
+            blendTile(jobs[i].d,jobs[i].x,jobs[i].y);
+    }
+
+    // only the uploads are left to the GL thread, within the time budget
+    int deferred=0;
+    for(int pass=0;pass<2;pass++)
+        for(size_t i=0;i<tiles.size();i++)
+        {
+            MultiBandMap2DCPUEle* ele=tiles[i].ele;
+            if(visible[i]!=(pass==0)||!ele->textureReady) continue;
+            if(ticTac.Tac()>=_uploadSeconds)
             {
-                {
-                    pi::ReadMutex lock(ele->mutexData);
-                    if(!(ele->pyr_laplace.size()&&ele->weights.size()
-                         &&ele->pyr_laplace.size()==ele->weights.size())) continue;
-                    if(ele->Ischanged)
-                    {
-                        pi::timer.enter("MultiBandMap2DCPU::updateTexture");
-                        bool updated=false,inborder=false;
-                        if(_highQualityShow)
-                        {
-                            vector<SPtr<MultiBandMap2DCPUEle> > neighbors;
-                            neighbors.reserve(9);
-                            for(int yi=y-1;yi<=y+1;yi++)
-                                for(int xi=x-1;xi<=x+1;xi++)
-                                {
-                                    if(yi<0||yi>=hCopy||xi<0||xi>=wCopy)
-                                    {
-                                        neighbors.push_back(SPtr<MultiBandMap2DCPUEle>());
-                                        inborder=true;
-                                    }
-                                    else neighbors.push_back(dataCopy[yi*wCopy+xi]);
-                                }
-                            updated=ele->updateTexture(neighbors);
-                        }
-                        else
-                            updated=ele->updateTexture();
-                        pi::timer.leave("MultiBandMap2DCPU::updateTexture");
+                deferred++;
+                continue;
+            }
 
-                        if(updated&&!inborder&&svar.GetInt("Fuse2Google"))
-                        {
-                            pi::timer.enter("MultiBandMap2DCPU::fuseGoogle");
-                            stringstream cmd;
-                            pi::Point3d  worldTl=p->_plane*pi::Point3d(x0,y0,0);
-                            pi::Point3d  worldBr=p->_plane*pi::Point3d(x1,y1,0);
-                            pi::Point3d  gpsTl,gpsBr;
-                            pi::calcLngLatFromDistance(d->gpsOrigin().x,d->gpsOrigin().y,worldTl.x,worldTl.y,gpsTl.x,gpsTl.y);
-                            pi::calcLngLatFromDistance(d->gpsOrigin().x,d->gpsOrigin().y,worldBr.x,worldBr.y,gpsBr.x,gpsBr.y);
-//                            cout<<"world:"<<worldBr<<"origin:"<<d->gpsOrigin()<<endl;
-                            cmd<<"Map2DUpdate LastTexMat "<< setiosflags(ios::fixed)
-                              << setprecision(9)<<gpsTl<<" "<<gpsBr;
-//                            cout<<cmd.str()<<endl;
-                            scommand.Call("MapWidget",cmd.str());
-                            pi::timer.leave("MultiBandMap2DCPU::fuseGoogle");
+            cv::Mat image;
+            {
+                pi::ScopedMutex lock(ele->mutexTexture);
+                image=ele->texture;
+                ele->texture.release();
+                ele->textureReady=false;
+            }
+            bool updated;
+            {
+                PI_PROFILE_SCOPE("MultiBandMap2DCPU::updateTexture");
+                updated=ele->updateTexture(image);
+            }
 
-                        }
-                    }
-                }
-                if(ele->texName)
-                {
-                    glBindTexture(GL_TEXTURE_2D,ele->texName);
-                    glBegin(GL_QUADS);
-                    glTexCoord2f(0.0f, 0.0f); glVertex3f(x0,y0,0);
-                    glTexCoord2f(0.0f, 1.0f); glVertex3f(x0,y1,0);
-                    glTexCoord2f(1.0f, 1.0f); glVertex3f(x1,y1,0);
-                    glTexCoord2f(1.0f, 0.0f); glVertex3f(x1,y0,0);
-                    glEnd();
-                }
+            int  x=tiles[i].x,y=tiles[i].y;
+            bool inborder=_highQualityShow&&(x==0||y==0||x==wCopy-1||y==hCopy-1);
+            if(updated&&!inborder&&svar.GetInt("Fuse2Google"))
+            {
+                PI_PROFILE_SCOPE("MultiBandMap2DCPU::fuseGoogle");
+                float x0=d->min().x+x*d->eleSize();
+                float y0=d->min().y+y*d->eleSize();
+                float x1=x0+d->eleSize();
+                float y1=y0+d->eleSize();
+                stringstream cmd;
+                pi::Point3d  worldTl=p->_plane*pi::Point3d(x0,y0,0);
+                pi::Point3d  worldBr=p->_plane*pi::Point3d(x1,y1,0);
+                pi::Point3d  gpsTl,gpsBr;
+                pi::calcLngLatFromDistance(d->gpsOrigin().x,d->gpsOrigin().y,worldTl.x,worldTl.y,gpsTl.x,gpsTl.y);
+                pi::calcLngLatFromDistance(d->gpsOrigin().x,d->gpsOrigin().y,worldBr.x,worldBr.y,gpsBr.x,gpsBr.y);
+                cmd<<"Map2DUpdate LastTexMat "<< setiosflags(ios::fixed)
+                  << setprecision(9)<<gpsTl<<" "<<gpsBr;
+                scommand.Call("MapWidget",cmd.str());
             }
         }
+    if(deferred) PI_PROFILE_COUNT("MultiBandMap2DCPU::DeferredUploads",deferred);
+
+    glColor3ub(255,255,255);
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        MultiBandMap2DCPUEle* ele=tiles[i].ele;
+        if(!visible[i]||!ele->texName) continue;
+        int   x=tiles[i].x,y=tiles[i].y;
+        float x0=d->min().x+x*d->eleSize();
+        float y0=d->min().y+y*d->eleSize();
+        float x1=x0+d->eleSize();
+        float y1=y0+d->eleSize();
+        glBindTexture(GL_TEXTURE_2D,ele->texName);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0f, 0.0f); glVertex3f(x0,y0,0);
+        glTexCoord2f(0.0f, 1.0f); glVertex3f(x0,y1,0);
+        glTexCoord2f(1.0f, 1.0f); glVertex3f(x1,y1,0);
+        glTexCoord2f(1.0f, 0.0f); glVertex3f(x1,y0,0);
+        glEnd();
+    }
     glBindTexture(GL_TEXTURE_2D, last_texture_ID);
     glPopMatrix();
 }
 
+/// Collapse the tiles of a batch to RGB
+struct MultiBandMap2DCPU::MultiBandMap2DCPUCollapseTask:public pi::ParallelTask
+{
+    MultiBandMap2DCPUCollapseTask(MultiBandMap2DCPU* map_,SPtr<MultiBandMap2DCPUData> d_)
+        :map(map_),d(d_){}
+
+    virtual void run(int i)
+    {
+        cv::Mat& result=results[i];
+        if(map->collapseTile(d,tiles[i].second,tiles[i].first,result))
+            cv::cvtColor(result,result,CV_BGR2RGB);
+        else
+            result.release();
+    }
+
+    MultiBandMap2DCPU*                 map;
+    SPtr<MultiBandMap2DCPUData>        d;
+    std::vector<std::pair<int,int> >   tiles;// (y,x)
+    std::vector<cv::Mat>               results;
+};
+
+/// Where the part of a neighbor (dx,dy) seen within border goes in the bordered tile
+static void neighborRects(int dx,int dy,int size,int border,cv::Rect& src,cv::Rect& dst)
+{
+    src.width =dst.width =dx?border:size;
+    src.height=dst.height=dy?border:size;
+    src.x=(dx<0)?(size-border):0;
+    src.y=(dy<0)?(size-border):0;
+    dst.x=(dx<0)?0:((dx==0)?border:(border+size));
+    dst.y=(dy<0)?0:((dy==0)?border:(border+size));
+}
+
+bool MultiBandMap2DCPU::gatherLevels(SPtr<MultiBandMap2DCPUData> d,int x,int y,int first,int last,
+                                     const std::vector<int>& borders,std::vector<cv::Mat>& pyr,
+                                     cv::Mat* weight)
+{
+    int  levels=_bandNum+1;
+    int  radius=borders[first]?1:0;
+    bool content=false;
+    pyr.assign(last-first,cv::Mat());
+    for(int dy=-radius;dy<=radius;dy++)
+        for(int dx=-radius;dx<=radius;dx++)
+        {
+            if(x+dx<0||y+dy<0||x+dx>=d->w()||y+dy>=d->h()) continue;
+            MultiBandMap2DCPUEle* ele=d->at((y+dy)*d->w()+x+dx);
+            if(!ele) continue;
+
+            pi::ReadMutex lock(ele->mutexData);
+            MultiBandMap2DCPUEle loaded;
+            if(ele->onDisk)
+            {
+                if(!d->store().get()||!ele->read(*d->store(),loaded.pyr_laplace,loaded.weights)) continue;
+                loaded.type=ele->type;
+                loaded.feather=ele->feather;
+                ele=&loaded;
+            }
+            if((int)ele->pyr_laplace.size()!=levels) continue;
+
+            if(pyr[0].empty())
+                for(int i=first;i<last;i++)
+                {
+                    int size=(ELE_PIXELS>>i)+2*borders[i];
+                    pyr[i-first]=cv::Mat::zeros(size,size,ele->type);
+                }
+            if(dx==0&&dy==0)
+            {
+                content=true;
+                if(weight) *weight=ele->weight(0);
+            }
+
+            for(int i=first;i<last;i++)
+            {
+                cv::Rect src,dst;
+                neighborRects(dx,dy,ELE_PIXELS>>i,borders[i],src,dst);
+                ele->laplace(i,src).copyTo(pyr[i-first](dst));
+            }
+        }
+    return content;
+}
+
+bool MultiBandMap2DCPU::coarseLevel(SPtr<MultiBandMap2DCPUData> d,int x,int y,cv::Mat& result)
+{
+    MultiBandMap2DCPUEle* ele=d->at(y*d->w()+x);
+    if(!ele) return false;
+
+    // taken before collapsing, a frame fused meanwhile makes the result stale
+    uint32_t versions[9];
+    for(int dy=-1,k=0;dy<=1;dy++)
+        for(int dx=-1;dx<=1;dx++,k++)
+        {
+            MultiBandMap2DCPUEle* neighbor=NULL;
+            if(x+dx>=0&&y+dy>=0&&x+dx<d->w()&&y+dy<d->h())
+                neighbor=d->at((y+dy)*d->w()+x+dx);
+            versions[k]=neighbor?neighbor->version:0;
+        }
+    {
+        pi::ScopedMutex lock(ele->mutexCoarse);
+        if(!ele->coarse.empty()&&memcmp(versions,ele->coarseVersions,sizeof(versions))==0)
+        {
+            result=ele->coarse;
+            return true;
+        }
+    }
+
+    PI_PROFILE_SCOPE("MultiBandMap2DCPU::CollapseCoarse");
+    int levels=_bandNum+1,first=_collapseCacheLevel;
+    std::vector<int>     borders(levels);
+    std::vector<cv::Mat> pyr;
+    for(int i=0;i<levels;i++)
+        borders[i]=std::min(2<<(levels-1-i),ELE_PIXELS>>i);
+    if(!gatherLevels(d,x,y,first,levels,borders,pyr,NULL)) return false;
+
+    cv::detail::restoreImageFromLaplacePyr(pyr);
+    int size=ELE_PIXELS>>first;
+    pyr[0](cv::Rect(borders[first],borders[first],size,size)).copyTo(result);
+
+    pi::ScopedMutex lock(ele->mutexCoarse);
+    ele->coarse=result;
+    memcpy(ele->coarseVersions,versions,sizeof(versions));
+    return true;
+}
+
+bool MultiBandMap2DCPU::collapseTile(SPtr<MultiBandMap2DCPUData> d,int x,int y,cv::Mat& result,
+                                     cv::Mat* mask,bool withNeighbors)
+{
+    int levels=_bandNum+1;
+    int cached=withNeighbors?_collapseCacheLevel:0;
+    std::vector<int>     borders(levels,0);
+    std::vector<cv::Mat> pyr;
+    cv::Mat              weight;
+    if(cached)
+    {
+        // the finer levels start from the exact restored level of the 3x3 tiles,
+        // a pyrUp only reaches 2 pixels of it
+        for(int i=0;i<=cached;i++) borders[i]=2<<(cached-i);
+        if(!gatherLevels(d,x,y,0,cached,borders,pyr,&weight)) return false;
+
+        int     size=ELE_PIXELS>>cached,border=borders[cached];
+        cv::Mat top=cv::Mat::zeros(size+2*border,size+2*border,pyr[0].type());
+        for(int dy=-1;dy<=1;dy++)
+            for(int dx=-1;dx<=1;dx++)
+            {
+                if(x+dx<0||y+dy<0||x+dx>=d->w()||y+dy>=d->h()) continue;
+                cv::Mat  coarse;
+                cv::Rect src,dst;
+                if(!coarseLevel(d,x+dx,y+dy,coarse)) continue;
+                neighborRects(dx,dy,size,border,src,dst);
+                coarse(src).copyTo(top(dst));
+            }
+        pyr.push_back(top);
+    }
+    else
+    {
+        for(int i=0;i<levels&&withNeighbors;i++)
+            borders[i]=std::min(2<<(levels-1-i),ELE_PIXELS>>i);
+        if(!gatherLevels(d,x,y,0,levels,borders,pyr,&weight)) return false;
+    }
+    if(weight.empty()) return false;
+
+    cv::detail::restoreImageFromLaplacePyr(pyr);
+
+    cv::Mat center=pyr[0](cv::Rect(borders[0],borders[0],ELE_PIXELS,ELE_PIXELS));
+    if(center.depth()==CV_32F) center.convertTo(result,CV_8UC3,255);
+    else center.convertTo(result,CV_8UC3);
+    result.setTo(cv::Scalar::all(svar.GetInt("Result.BackGroundColor")),weight==0);
+    if(mask) *mask=weight!=0;
+    return true;
+}
+
+/// The collapsed tiles as BGRA for WebTileExporter
+struct MultiBandMap2DCPU::MultiBandMap2DCPUTileSource:public MapTileSource
+{
+    MultiBandMap2DCPUTileSource(MultiBandMap2DCPU* map_,SPtr<MultiBandMap2DCPUData> d_)
+        :map(map_),d(d_){}
+
+    virtual bool mapTile(int x,int y,cv::Mat& bgra)
+    {
+        cv::Mat bgr,mask;
+        if(!map->collapseTile(d,x,y,bgr,&mask)) return false;
+        std::vector<cv::Mat> channels;
+        cv::split(bgr,channels);
+        channels.push_back(mask);
+        cv::merge(channels,bgra);
+        return true;
+    }
+
+    MultiBandMap2DCPU*                 map;
+    SPtr<MultiBandMap2DCPUData>        d;
+};
+
+bool MultiBandMap2DCPU::exportTiles(const std::string& folder,bool incremental)
+{
+    if(!svar.exist("GPS.Origin"))
+    {
+        cerr<<"MultiBandMap2DCPU::exportTiles: GPS.Origin is needed to export web tiles.\n";
+        return false;
+    }
+    SPtr<MultiBandMap2DCPUPrepare> p;
+    SPtr<MultiBandMap2DCPUData>    d;
+    {
+        pi::ReadMutex lock(mutex);
+        p=prepared;d=data;
+    }
+    if(!p.get()||d->w()==0||d->h()==0) return false;
+    incremental=incremental&&folder==_exportFolder;
+
+    // the dirty flags are taken now, frames fused meanwhile go to the next export
+    std::vector<Map2DGrid<MultiBandMap2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+    std::vector<pi::Point2i> content,dirty;
+    std::vector<MultiBandMap2DCPUEle*> dirtyEles;
+    for(size_t t=0;t<tiles.size();t++)
+    {
+        MultiBandMap2DCPUEle* ele=tiles[t].ele;
+        pi::WriteMutex lock(ele->mutexData);
+        if(!ele->onDisk&&!ele->pyr_laplace.size()) continue;
+        content.push_back(pi::Point2i(tiles[t].x,tiles[t].y));
+        if(ele->exportDirty)
+        {
+            dirty.push_back(content.back());
+            dirtyEles.push_back(ele);
+            ele->exportDirty=false;
+        }
+    }
+    if(content.empty()) return false;
+
+    WebTileExporter::Geometry geometry;
+    geometry.plane      =p->_plane;
+    geometry.gpsOrigin  =d->gpsOrigin();
+    geometry.min        =pi::Point2d(d->min().x,d->min().y);
+    geometry.lengthPixel=d->lengthPixel();
+    geometry.tileSize   =ELE_PIXELS;
+
+    MultiBandMap2DCPUTileSource source(this,d);
+    WebTileExporter exporter(source,geometry);
+    if(!exporter.exportTiles(folder,content,incremental?&dirty:NULL))
+    {
+        for(size_t i=0;i<dirtyEles.size();i++)
+        {
+            pi::WriteMutex lock(dirtyEles[i]->mutexData);
+            dirtyEles[i]->exportDirty=true;
+        }
+        return false;
+    }
+    _exportFolder=folder;
+    return true;
+}
+
+bool MultiBandMap2DCPU::saveTiled(const std::string& filename)
+{
+    PI_PROFILE_SCOPE("MultiBandMap2DCPU::SaveTiled");
+    SPtr<MultiBandMap2DCPUData> d;
+    {
+        pi::ReadMutex lock(mutex);
+        d=data;
+    }
+    if(d->w()==0||d->h()==0) return false;
+
+    // the tiles with content, row by row
+    std::vector<Map2DGrid<MultiBandMap2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+    std::vector<std::pair<int,int> > content;
+    pi::Point2i minInt(1e6,1e6),maxInt(-1e6,-1e6);
+    for(size_t t=0;t<tiles.size();t++)
+    {
+        MultiBandMap2DCPUEle* ele=tiles[t].ele;
+        int x=tiles[t].x,y=tiles[t].y;
+        {
+            pi::ReadMutex lock(ele->mutexData);
+            if(!ele->onDisk&&!ele->pyr_laplace.size()) continue;
+        }
+        content.push_back(std::make_pair(y,x));
+        minInt.x=min(minInt.x,x); minInt.y=min(minInt.y,y);
+        maxInt.x=max(maxInt.x,x); maxInt.y=max(maxInt.y,y);
+    }
+    if(content.empty()) return false;
+    std::sort(content.begin(),content.end());
+
+    pi::Point2i wh=maxInt+pi::Point2i(1,1)-minInt;
+    TiledTiffWriter writer;
+    if(!writer.open(filename,wh.x*ELE_PIXELS,wh.y*ELE_PIXELS,ELE_PIXELS,
+                    svar.GetInt("Result.BackGroundColor")))
+        return false;
+
+    // a few tiles per thread at once, the memory does not depend on the mosaic size
+    pi::ThreadPool pool(svar.GetInt("Map2D.ApplyThreads",0));
+    MultiBandMap2DCPUCollapseTask task(this,d);
+    size_t batch=4*pool.threads();
+    for(size_t begin=0;begin<content.size();begin+=batch)
+    {
+        size_t n=min(batch,content.size()-begin);
+        task.tiles.assign(content.begin()+begin,content.begin()+begin+n);
+        task.results.assign(n,cv::Mat());
+        pool.parallelFor(n,task);
+        for(size_t i=0;i<n;i++)
+        {
+            const cv::Mat& tile=task.results[i];
+            if(tile.empty()) continue;
+            if(!writer.writeTile(task.tiles[i].second-minInt.x,task.tiles[i].first-minInt.y,
+                                 tile.data,tile.step))
+                return false;
+        }
+    }
+    if(!writer.close()) return false;
+
+    cout<<"Resolution:["<<wh.x*ELE_PIXELS<<" "<<wh.y*ELE_PIXELS<<"]";
+    if(svar.exist("GPS.Origin"))
+          cout<<",_lengthPixel:"<<d->lengthPixel()
+       <<",Area:"<<content.size()*d->eleSize()*d->eleSize();
+    cout<<endl;
+    return true;
+}
+
 bool MultiBandMap2DCPU::save(const std::string& filename)
 {
+    // big mosaics are streamed tile by tile
+    string ext=filename.substr(filename.find_last_of('.')+1);
+    std::transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+    if(ext=="tif"||ext=="tiff") return saveTiled(filename);
+
     // determin minmax
     SPtr<MultiBandMap2DCPUPrepare> p;
     SPtr<MultiBandMap2DCPUData>    d;
@@ -789,19 +1513,21 @@ bool MultiBandMap2DCPU::save(const std::string& filename)
 
     pi::Point2i minInt(1e6,1e6),maxInt(-1e6,-1e6);
     int contentCount=0;
-    for(int x=0;x<d->w();x++)
-        for(int y=0;y<d->h();y++)
+    std::vector<Map2DGrid<MultiBandMap2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+    for(size_t t=0;t<tiles.size();t++)
+    {
+        MultiBandMap2DCPUEle* ele=tiles[t].ele;
+        int x=tiles[t].x,y=tiles[t].y;
         {
-            SPtr<MultiBandMap2DCPUEle> ele=d->data()[x+y*d->w()];
-            if(!ele.get()) continue;
-            {
-                pi::ReadMutex lock(ele->mutexData);
-                if(!ele->pyr_laplace.size()) continue;
-            }
-            contentCount++;
-            minInt.x=min(minInt.x,x); minInt.y=min(minInt.y,y);
-            maxInt.x=max(maxInt.x,x); maxInt.y=max(maxInt.y,y);
+            pi::ReadMutex lock(ele->mutexData);
+            if(!ele->onDisk&&!ele->pyr_laplace.size()) continue;
         }
+        contentCount++;
+        minInt.x=min(minInt.x,x); minInt.y=min(minInt.y,y);
+        maxInt.x=max(maxInt.x,x); maxInt.y=max(maxInt.y,y);
+    }
+    if(!contentCount) return false;
 
     maxInt=maxInt+pi::Point2i(1,1);
     pi::Point2i wh=maxInt-minInt;
@@ -810,28 +1536,36 @@ bool MultiBandMap2DCPU::save(const std::string& filename)
     for(int i=0;i<=0;i++)
         pyr_weights[i]=cv::Mat::zeros(wh.y*ELE_PIXELS,wh.x*ELE_PIXELS,CV_32FC1);
 
-    for(int x=minInt.x;x<maxInt.x;x++)
-        for(int y=minInt.y;y<maxInt.y;y++)
+    for(size_t t=0;t<tiles.size();t++)
+    {
+        MultiBandMap2DCPUEle* ele=tiles[t].ele;
+        int x=tiles[t].x,y=tiles[t].y;
         {
-            SPtr<MultiBandMap2DCPUEle> ele=d->data()[x+y*d->w()];
-            if(!ele.get()) continue;
+            pi::ReadMutex lock(ele->mutexData);
+            // an evicted tile is read back without being made resident
+            MultiBandMap2DCPUEle loaded;
+            if(ele->onDisk)
             {
-                pi::ReadMutex lock(ele->mutexData);
-                if(!ele->pyr_laplace.size()) continue;
-                int width=ELE_PIXELS,height=ELE_PIXELS;
+                if(!d->store().get()||!ele->read(*d->store(),loaded.pyr_laplace,loaded.weights)) continue;
+                loaded.type=ele->type;
+                loaded.feather=ele->feather;
+                ele=&loaded;
+            }
+            if(!ele->pyr_laplace.size()) continue;
+            int width=ELE_PIXELS,height=ELE_PIXELS;
 
-                for (int i = 0; i <= _bandNum; ++i)
-                {
-                    cv::Rect rect(width*(x-minInt.x),height*(y-minInt.y),width,height);
-                    if(pyr_laplace[i].empty())
-                        pyr_laplace[i]=cv::Mat::zeros(wh.y*height,wh.x*width,ele->pyr_laplace[i].type());
-                    ele->pyr_laplace[i].copyTo(pyr_laplace[i](rect));
-                    if(i==0)
-                        ele->weights[i].copyTo(pyr_weights[i](rect));
-                    height>>=1;width>>=1;
-                }
+            for (int i = 0; i <= _bandNum; ++i)
+            {
+                cv::Rect rect(width*(x-minInt.x),height*(y-minInt.y),width,height);
+                if(pyr_laplace[i].empty())
+                    pyr_laplace[i]=cv::Mat::zeros(wh.y*height,wh.x*width,ele->type);
+                ele->laplace(i).copyTo(pyr_laplace[i](rect));
+                if(i==0)
+                    ele->weight(i).copyTo(pyr_weights[i](rect));
+                height>>=1;width>>=1;
             }
         }
+    }
 
     cv::detail::restoreImageFromLaplacePyr(pyr_laplace);
 
@@ -845,3 +1579,41 @@ bool MultiBandMap2DCPU::save(const std::string& filename)
        <<",Area:"<<contentCount*d->eleSize()*d->eleSize()<<endl;
     return true;
 }
+
+double MultiBandMap2DCPU::scaledFrameResolution()
+{
+    pi::ReadMutex lock(mutex);
+    return data.get()?data->lengthPixel():0;
+}
+
+Map2D::MemoryStats MultiBandMap2DCPU::memoryStats()
+{
+    MemoryStats stats;
+    SPtr<MultiBandMap2DCPUData> d;
+    {
+        pi::ReadMutex lock(mutex);
+        d=data;
+    }
+    if(!d.get()) return stats;
+
+    std::vector<Map2DGrid<MultiBandMap2DCPUEle>::Entry> tiles;
+    d->tiles(tiles);
+    for(size_t i=0;i<tiles.size();i++)
+    {
+        size_t bytes;
+        {
+            pi::ReadMutex lock(tiles[i].ele->mutexData);
+            if(tiles[i].ele->onDisk)
+            {
+                stats.diskTiles++;
+                stats.diskBytes+=tiles[i].ele->diskBytes;
+                continue;
+            }
+            bytes=tiles[i].ele->memory();
+        }
+        stats.tiles++;
+        stats.bytes+=bytes;
+        stats.maxTileBytes=std::max(stats.maxTileBytes,bytes);
+    }
+    return stats;
+}
@@ -24,6 +24,7 @@
 #define MultiBandMap2DCPU_H
 #include "Map2D.h"
 #include <base/system/thread/ThreadBase.h>
+#include "TileStore.h"
 
 class MultiBandMap2DCPU:public Map2D,public pi::Thread
 {
@@ -31,30 +32,74 @@ class MultiBandMap2DCPU:public Map2D,public pi::Thread
 
     struct MultiBandMap2DCPUEle
     {
-        MultiBandMap2DCPUEle():texName(0),Ischanged(false){}
+        MultiBandMap2DCPUEle():type(-1),feather(false),diskOffset(-1),diskBytes(0),diskCapacity(0),
+            onDisk(false),lastUse(0),version(0),textureReady(false),blendFailures(0),
+            failedVersion(0),texName(0),Ischanged(false),exportDirty(false){}
         ~MultiBandMap2DCPUEle();
 
         static bool normalizeUsingWeightMap(const cv::Mat& weight, cv::Mat& src);
         static bool mulWeightMap(const cv::Mat& weight, cv::Mat& src);
 
-        cv::Mat blend(const std::vector<SPtr<MultiBandMap2DCPUEle> >& neighbors
-                      =std::vector<SPtr<MultiBandMap2DCPUEle> >());
-        bool updateTexture(const std::vector<SPtr<MultiBandMap2DCPUEle> >& neighbors
-                =std::vector<SPtr<MultiBandMap2DCPUEle> >());
-
+        /// Upload the collapsed CV_8UC3 image, GL thread only
+        bool updateTexture(const cv::Mat& image);
+
+        /// Level i in the pyramid type, zeros where no frame was fused. The
+        /// sums of the feather mode are normalized here, not when fused.
+        cv::Mat laplace(int i,const cv::Rect& roi=cv::Rect())const;
+        /// Weights of level i as CV_32FC1, their sums in the feather mode
+        cv::Mat weight(int i)const;
+        /// Bytes held by the pyramids
+        size_t  memory()const;
+
+        // out of core, called with mutexData locked for writing
+        bool    evict(TileStore& store);
+        bool    restore(const TileStore& store);
+        /// Read the evicted pyramids without restoring them
+        bool    read(const TileStore& store,std::vector<cv::Mat>& laplace,
+                     std::vector<cv::Mat>& weights)const;
+
+        // A level is only allocated once a frame has weights in it. In compact
+        // mode the weights are quantized to CV_8UC1 or CV_16UC1 and the levels
+        // from Compact8BitLevel of a CV_16SC3 pyramid are stored on 8 bits:
+        // CV_8SC3 holding the half of the detail, CV_8UC3 for the last level.
+        // In feather mode the levels are CV_32FC3 sums of the Laplacian times
+        // the weights and the weights are CV_32FC1 sums.
         std::vector<cv::Mat> pyr_laplace;
         std::vector<cv::Mat> weights;
+        int     type;// of the full pyramid, -1 before the first frame
+        bool    feather;// the levels hold weighted sums
+
+        int64_t  diskOffset;// slot in the TileStore, -1 before the first eviction
+        uint32_t diskBytes,diskCapacity;
+        bool     onDisk;// the pyramids are evicted
+        volatile int lastUse;// frame of the last apply
+        volatile uint32_t version;// incremented by every apply, 0 before the first
+
+        // restored level CollapseCacheLevel of the tile, valid as long as the
+        // tile and its 8 neighbors keep the versions it was collapsed from
+        cv::Mat   coarse;
+        uint32_t  coarseVersions[9];
+        pi::Mutex mutexCoarse;
+
+        // collapsed by a blend worker, waiting for the GL thread to upload it
+        cv::Mat       texture;
+        volatile bool textureReady;
+        pi::Mutex     mutexTexture;
+        int           blendFailures;// collapses failed since version failedVersion
+        uint32_t      failedVersion;
 
         uint    texName;
-        bool    Ischanged;
+        bool    Ischanged;// the pyramids changed since the tile was last collapsed
+        bool    exportDirty;// changed since the last exportTiles
         pi::MutexRW mutexData;
     };
 
     struct MultiBandMap2DCPUData//change when spread and prepare
     {
-        MultiBandMap2DCPUData():_w(0),_h(0){}
+        MultiBandMap2DCPUData():_w(0),_h(0),_x0(0),_y0(0),_grid(new Map2DGrid<MultiBandMap2DCPUEle>()){}
         MultiBandMap2DCPUData(double eleSize_,double lengthPixel_,pi::Point3d max_,pi::Point3d min_,
-                     int w_,int h_,const std::vector<SPtr<MultiBandMap2DCPUEle> >& d_);
+                     int w_,int h_,SPtr<Map2DGrid<MultiBandMap2DCPUEle> > grid_,int x0_,int y0_,
+                     SPtr<TileStore> store_);
 
         bool   prepare(SPtr<MultiBandMap2DCPUPrepare> prepared);// only done Once!
 
@@ -67,36 +112,51 @@ class MultiBandMap2DCPU:public Map2D,public pi::Thread
         const pi::Point3d& max()const{return _max;}
         const int w()const{return _w;}
         const int h()const{return _h;}
+        /// Grid coordinates of the tile 0
+        const int x0()const{return _x0;}
+        const int y0()const{return _y0;}
+
+        /// The tile at idx or NULL, no lock and no copy
+        MultiBandMap2DCPUEle* at(uint idx)const{
+            if(idx>=(uint)(_w*_h)) return NULL;
+            return _grid->at(_x0+idx%_w,_y0+idx/_w);
+        }
+
+        /// The tile at idx, created if needed
+        MultiBandMap2DCPUEle* ele(uint idx){
+            if(idx>=(uint)(_w*_h)) return NULL;
+            return _grid->get(_x0+idx%_w,_y0+idx/_w);
+        }
 
-        std::vector<SPtr<MultiBandMap2DCPUEle> > data()
-        {pi::ReadMutex lock(mutexData);return _data;}
-
-        SPtr<MultiBandMap2DCPUEle> ele(uint idx)
-        {
-            pi::WriteMutex lock(mutexData);
-            if(idx>_data.size()) return SPtr<MultiBandMap2DCPUEle>();
-            else if(!_data[idx].get())
-            {
-                _data[idx]=SPtr<MultiBandMap2DCPUEle>(new MultiBandMap2DCPUEle());
-            }
-            return _data[idx];
+        /// The created tiles of this snapshot, (x,y) relative to the tile 0
+        void tiles(std::vector<Map2DGrid<MultiBandMap2DCPUEle>::Entry>& result)const{
+            _grid->entries(result,_x0,_y0,_w,_h);
         }
 
+        SPtr<Map2DGrid<MultiBandMap2DCPUEle> > grid(){return _grid;}
+
+        /// Where cold tiles are evicted, NULL when all tiles stay in memory
+        SPtr<TileStore> store(){return _store;}
+
     private:
         //IMPORTANT: everything should never changed after prepared!
         double      _eleSize,_lengthPixel,_eleSizeInv,_lengthPixelInv;
         pi::Point3d _gpsOrigin;
         pi::Point3d _max,_min;
-        int         _w,_h;
-        std::vector<SPtr<MultiBandMap2DCPUEle> >  _data;
-        pi::MutexRW mutexData;
+        int         _w,_h,_x0,_y0;
+        SPtr<Map2DGrid<MultiBandMap2DCPUEle> > _grid;// shared by all snapshots
+        SPtr<TileStore> _store;
     };
 
+    struct MultiBandMap2DCPUCollapseTask;
+    class  MultiBandMap2DCPUBlender;
+    struct MultiBandMap2DCPUTileSource;
+
 public:
 
     MultiBandMap2DCPU(bool thread=true);
 
-    virtual ~MultiBandMap2DCPU(){_valid=false;}
+    virtual ~MultiBandMap2DCPU();
 
     virtual bool prepare(const pi::SE3d& plane,const PinHoleParameters& camera,
                     const std::deque<std::pair<cv::Mat,pi::SE3d> >& frames);
@@ -107,11 +167,22 @@ public:
 
     virtual bool save(const std::string& filename);
 
+    virtual bool exportTiles(const std::string& folder,bool incremental=false);
+
     virtual uint queueSize(){
         if(prepared.get()) return prepared->queueSize();
         else               return 0;
     }
 
+    virtual uint droppedFrames(){
+        if(prepared.get()) return prepared->_frames.dropped();
+        else               return 0;
+    }
+
+    virtual MemoryStats memoryStats();
+
+    virtual double scaledFrameResolution();
+
     virtual void run();
 
 private:
@@ -119,6 +190,22 @@ private:
     bool getFrame(std::pair<cv::Mat,pi::SE3d>& frame);
     bool renderFrame(const std::pair<cv::Mat,pi::SE3d>& frame);
     bool spreadMap(double xmin,double ymin,double xmax,double ymax);
+    // write the least recently used tiles to the store until under the budget
+    void evictTiles(SPtr<MultiBandMap2DCPUData> d);
+    // collapse the pyramid of tile (x,y) with the borders of its 8 neighbors to CV_8UC3,
+    // mask is set to 255 where frames were fused
+    bool collapseTile(SPtr<MultiBandMap2DCPUData> d,int x,int y,cv::Mat& result,
+                      cv::Mat* mask=NULL,bool withNeighbors=true);
+    // copy levels [first,last) of tile (x,y) with borders[i] pixels of its neighbors,
+    // false if the tile has no content
+    bool gatherLevels(SPtr<MultiBandMap2DCPUData> d,int x,int y,int first,int last,
+                      const std::vector<int>& borders,std::vector<cv::Mat>& pyr,cv::Mat* weight);
+    // the restored level _collapseCacheLevel of tile (x,y), cached
+    bool coarseLevel(SPtr<MultiBandMap2DCPUData> d,int x,int y,cv::Mat& result);
+    // collapse a changed tile for display, by the blend workers or draw
+    void blendTile(SPtr<MultiBandMap2DCPUData> d,int x,int y);
+    void blendLoop();
+    bool saveTiled(const std::string& filename);
 
 
     //source
@@ -129,5 +216,24 @@ private:
     bool                              _valid,_thread,_changed;
     cv::Mat                           weightImage;
     int                               &alpha,_bandNum,&_highQualityShow;
+    int                               _compact,_weightDepth,_compact8BitLevel;
+    bool                              _feather;// BlendMode 1: weighted average of the frames
+    int                               _collapseCacheLevel;// 0: no cache
+    int64_t                           _cacheBytes;// 0: no budget
+    int                               _cacheKeepFrames;
+    volatile int64_t                  _residentBytes;
+    volatile int                      _frameId;
+    std::string                       _exportFolder;// of the last exportTiles
+
+    // changed tiles to collapse for display, the ones in view first
+    struct BlendJob
+    {
+        SPtr<MultiBandMap2DCPUData>   d;
+        int                           x,y;
+    };
+    pi::BlockingQueue<BlendJob>             _blendQueue;
+    std::vector<MultiBandMap2DCPUBlender*>  _blenders;// started by the first draw
+    int                                     _blendThreads;
+    double                                  _uploadSeconds;// per draw
 };
 #endif // MULTIBANDMap2DCPU_H
@@ -0,0 +1,105 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "TileStore.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+
+using namespace std;
+
+TileStore::TileStore()
+    :_fd(-1),_end(0)
+{
+}
+
+TileStore::~TileStore()
+{
+    close();
+}
+
+bool TileStore::open(const std::string& folder)
+{
+    close();
+    string path=folder+"/Map2DTiles_XXXXXX";
+    char*  name=strdup(path.c_str());
+    _fd=mkstemp(name);
+    if(_fd<0)
+    {
+        cerr<<"TileStore::open: Can't create "<<path<<": "<<strerror(errno)<<endl;
+        free(name);
+        return false;
+    }
+    unlink(name);
+    free(name);
+    _end=0;
+    return true;
+}
+
+void TileStore::close()
+{
+    if(_fd>=0) ::close(_fd);
+    _fd=-1;
+    _end=0;
+}
+
+int64_t TileStore::write(const void* data,size_t bytes,int64_t offset,size_t capacity)
+{
+    if(_fd<0) return -1;
+    if(offset<0||capacity<bytes)
+        offset=__sync_fetch_and_add(&_end,(int64_t)bytes);
+
+    const char* p=(const char*)data;
+    for(size_t done=0;done<bytes;)
+    {
+        ssize_t n=pwrite(_fd,p+done,bytes-done,offset+done);
+        if(n<0&&errno==EINTR) continue;
+        if(n<=0)
+        {
+            cerr<<"TileStore::write: "<<strerror(errno)<<endl;
+            return -1;
+        }
+        done+=n;
+    }
+    return offset;
+}
+
+bool TileStore::read(int64_t offset,void* data,size_t bytes)const
+{
+    if(_fd<0) return false;
+    char* p=(char*)data;
+    for(size_t done=0;done<bytes;)
+    {
+        ssize_t n=pread(_fd,p+done,bytes-done,offset+done);
+        if(n<0&&errno==EINTR) continue;
+        if(n<=0)
+        {
+            cerr<<"TileStore::read: "<<(n?strerror(errno):"Unexpected end of file")<<endl;
+            return false;
+        }
+        done+=n;
+    }
+    return true;
+}
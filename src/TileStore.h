@@ -0,0 +1,64 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+
+/** An append-only file of tile blobs, used to move cold tiles out of memory.
+
+    The file is created in a folder and unlinked at once, it vanishes when the
+    store is closed or the process dies. A blob is written at the end of the
+    file unless the slot it had before is large enough, space is not reclaimed
+    otherwise. Reads and writes of different slots may run concurrently.
+*/
+class TileStore
+{
+public:
+    TileStore();
+    ~TileStore();
+
+    bool open(const std::string& folder);
+    void close();
+    bool isOpen()const{return _fd>=0;}
+
+    /// Write bytes into the slot at offset if it holds capacity>=bytes,
+    /// otherwise to a new slot. Return the offset written or -1.
+    int64_t write(const void* data,size_t bytes,int64_t offset=-1,size_t capacity=0);
+
+    bool    read(int64_t offset,void* data,size_t bytes)const;
+
+    /// Bytes of the file, freed slots included
+    int64_t size()const{return _end;}
+
+private:
+    TileStore(const TileStore&);
+    TileStore& operator=(const TileStore&);
+
+    int              _fd;
+    volatile int64_t _end;
+};
+
+#endif // TILESTORE_H
@@ -0,0 +1,194 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "TiledTiffWriter.h"
+
+#include <string.h>
+#include <iostream>
+
+using namespace std;
+
+enum TiffType{TiffShort=3,TiffLong=4,TiffLong8=16};
+
+TiledTiffWriter::TiledTiffWriter()
+    :_file(NULL),_big(false),_width(0),_height(0),_tileSize(0),_tilesX(0),_tilesY(0),
+      _background(0),_pos(0)
+{
+}
+
+TiledTiffWriter::~TiledTiffWriter()
+{
+    if(_file) close();
+}
+
+bool TiledTiffWriter::open(const std::string& file,int width,int height,int tileSize,
+                           unsigned char background)
+{
+    if(_file) close();
+    if(width<=0||height<=0||tileSize<=0||tileSize%16)
+    {
+        cerr<<"TiledTiffWriter::open: Invalid size "<<width<<"x"<<height
+           <<", tiles must be a multiple of 16.\n";
+        return false;
+    }
+    _file=fopen(file.c_str(),"wb");
+    if(!_file)
+    {
+        cerr<<"TiledTiffWriter::open: Can't open file "<<file<<endl;
+        return false;
+    }
+    _fileName  =file;
+    _width     =width;
+    _height    =height;
+    _tileSize  =tileSize;
+    _tilesX    =(width+tileSize-1)/tileSize;
+    _tilesY    =(height+tileSize-1)/tileSize;
+    _background=background;
+    _offsets.assign((size_t)_tilesX*_tilesY,0);
+
+    uint64_t bytes=(uint64_t)_tilesX*_tilesY*tileSize*tileSize*3;
+    _big=bytes+((uint64_t)_tilesX*_tilesY+1)*16+(1<<20)>0xFFFFFFFFULL;
+
+    // header, the directory offset is written by close()
+    vector<unsigned char> header;
+    header.push_back('I');header.push_back('I');
+    if(_big)
+    {
+        put16(header,43);put16(header,8);put16(header,0);put64(header,0);
+    }
+    else
+    {
+        put16(header,42);put32(header,0);
+    }
+    _pos=0;
+    return write(&header[0],header.size());
+}
+
+bool TiledTiffWriter::write(const void* data,size_t bytes)
+{
+    if(fwrite(data,1,bytes,_file)!=bytes)
+    {
+        cerr<<"TiledTiffWriter::write: Failed to write "<<_fileName<<endl;
+        return false;
+    }
+    _pos+=bytes;
+    return true;
+}
+
+bool TiledTiffWriter::writeTile(int tx,int ty,const unsigned char* rgb,size_t stride)
+{
+    if(!_file||tx<0||ty<0||tx>=_tilesX||ty>=_tilesY) return false;
+    _offsets[(size_t)ty*_tilesX+tx]=_pos;
+    for(int y=0;y<_tileSize;y++)
+        if(!write(rgb+y*stride,_tileSize*3)) return false;
+    return true;
+}
+
+void TiledTiffWriter::put16(std::vector<unsigned char>& buf,uint16_t v)
+{
+    for(int i=0;i<2;i++) buf.push_back((v>>(8*i))&0xFF);
+}
+
+void TiledTiffWriter::put32(std::vector<unsigned char>& buf,uint32_t v)
+{
+    for(int i=0;i<4;i++) buf.push_back((v>>(8*i))&0xFF);
+}
+
+void TiledTiffWriter::put64(std::vector<unsigned char>& buf,uint64_t v)
+{
+    for(int i=0;i<8;i++) buf.push_back((v>>(8*i))&0xFF);
+}
+
+void TiledTiffWriter::putEntry(std::vector<unsigned char>& ifd,uint16_t tag,uint16_t type,
+                               uint64_t count,uint64_t value)
+{
+    put16(ifd,tag);put16(ifd,type);
+    if(_big)
+    {
+        put64(ifd,count);put64(ifd,value);
+    }
+    else
+    {
+        // a single SHORT value is stored in the first bytes of the field
+        put32(ifd,count);
+        if(type==TiffShort&&count==1) {put16(ifd,value);put16(ifd,0);}
+        else put32(ifd,value);
+    }
+}
+
+bool TiledTiffWriter::close()
+{
+    if(!_file) return false;
+    bool ok=true;
+    size_t tiles=_offsets.size();
+    size_t tileBytes=(size_t)_tileSize*_tileSize*3;
+
+    // tiles never written share one background tile
+    for(size_t i=0;i<tiles&&ok;i++)
+    {
+        if(_offsets[i]) continue;
+        uint64_t background=_pos;
+        vector<unsigned char> tile(tileBytes,_background);
+        ok=write(&tile[0],tileBytes);
+        for(size_t j=i;j<tiles;j++)
+            if(!_offsets[j]) _offsets[j]=background;
+    }
+
+    // out of line values: BitsPerSample, TileOffsets and TileByteCounts
+    uint64_t bitsOffset=_pos;
+    vector<unsigned char> buf;
+    put16(buf,8);put16(buf,8);put16(buf,8);put16(buf,0);
+    uint64_t offsetsOffset=bitsOffset+buf.size();
+    for(size_t i=0;i<tiles;i++)
+        if(_big) put64(buf,_offsets[i]); else put32(buf,_offsets[i]);
+    uint64_t countsOffset=bitsOffset+buf.size();
+    for(size_t i=0;i<tiles;i++)
+        if(_big) put64(buf,tileBytes); else put32(buf,tileBytes);
+    if(ok) ok=write(&buf[0],buf.size());
+
+    uint64_t ifdOffset=_pos;
+    uint16_t offsetType=_big?TiffLong8:TiffLong;
+    vector<unsigned char> ifd;
+    if(_big) put64(ifd,11); else put16(ifd,11);
+    putEntry(ifd,256,TiffLong,1,_width);        // ImageWidth
+    putEntry(ifd,257,TiffLong,1,_height);       // ImageLength
+    putEntry(ifd,258,TiffShort,3,_big?0x0000000800080008ULL:bitsOffset);// BitsPerSample, inline in a BigTIFF
+    putEntry(ifd,259,TiffShort,1,1);            // Compression: none
+    putEntry(ifd,262,TiffShort,1,2);            // PhotometricInterpretation: RGB
+    putEntry(ifd,277,TiffShort,1,3);            // SamplesPerPixel
+    putEntry(ifd,284,TiffShort,1,1);            // PlanarConfiguration: contiguous
+    putEntry(ifd,322,TiffLong,1,_tileSize);     // TileWidth
+    putEntry(ifd,323,TiffLong,1,_tileSize);     // TileLength
+    putEntry(ifd,324,offsetType,tiles,tiles==1?_offsets[0]:offsetsOffset);// TileOffsets
+    putEntry(ifd,325,offsetType,tiles,tiles==1?tileBytes:countsOffset);   // TileByteCounts
+    if(_big) put64(ifd,0); else put32(ifd,0);
+    if(ok) ok=write(&ifd[0],ifd.size());
+
+    // directory offset in the header
+    vector<unsigned char> header;
+    if(_big) put64(header,ifdOffset); else put32(header,ifdOffset);
+    if(ok) ok=fseek(_file,_big?8:4,SEEK_SET)==0&&fwrite(&header[0],1,header.size(),_file)==header.size();
+    if(fclose(_file)!=0) ok=false;
+    _file=NULL;
+    if(!ok) cerr<<"TiledTiffWriter::close: Failed to write "<<_fileName<<endl;
+    return ok;
+}
@@ -0,0 +1,76 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef TILEDTIFFWRITER_H
+#define TILEDTIFFWRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Writes an uncompressed 8 bit RGB TIFF tile by tile, in any order.
+
+    Only the tile offsets are kept in memory, so images far larger than the
+    memory can be written. Tiles never written point to one tile filled with
+    the background value. A BigTIFF is written when the image may not fit in
+    the 4GB of a classic TIFF.
+*/
+class TiledTiffWriter
+{
+public:
+    TiledTiffWriter();
+    ~TiledTiffWriter();
+
+    bool open(const std::string& file,int width,int height,int tileSize=256,
+              unsigned char background=0);
+
+    /// tileSize rows of tileSize RGB pixels, stride bytes apart
+    bool writeTile(int tx,int ty,const unsigned char* rgb,size_t stride);
+
+    /// Write the directory, must be called to get a valid file
+    bool close();
+
+    int  tilesX()const{return _tilesX;}
+    int  tilesY()const{return _tilesY;}
+
+private:
+    TiledTiffWriter(const TiledTiffWriter&);
+    TiledTiffWriter& operator=(const TiledTiffWriter&);
+
+    bool write(const void* data,size_t bytes);
+    void put16(std::vector<unsigned char>& buf,uint16_t v);
+    void put32(std::vector<unsigned char>& buf,uint32_t v);
+    void put64(std::vector<unsigned char>& buf,uint64_t v);
+    void putEntry(std::vector<unsigned char>& ifd,uint16_t tag,uint16_t type,
+                  uint64_t count,uint64_t value);
+
+    FILE*                 _file;
+    std::string           _fileName;
+    bool                  _big;
+    int                   _width,_height,_tileSize,_tilesX,_tilesY;
+    unsigned char         _background;
+    uint64_t              _pos;
+    std::vector<uint64_t> _offsets;// 0: not written
+};
+
+#endif // TILEDTIFFWRITER_H
@@ -0,0 +1,1088 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "UtilCPU.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <algorithm>
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#define UTILCPU_X86
+#include <immintrin.h>
+#endif
+
+static SimdLevel detectSimdLevel()
+{
+#ifdef UTILCPU_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))   return SimdAVX2;
+    if(__builtin_cpu_supports("sse4.1")) return SimdSSE41;
+#endif
+    return SimdNone;
+}
+
+typedef void (*MaxWeightBlendFunc)(unsigned char*,const unsigned char*,int);
+typedef void (*MergeLevel32FFunc)(float*,float*,const float*,const float*,int);
+typedef void (*MergeLevel16SFunc)(short*,float*,const short*,const float*,int);
+typedef void (*AccumulateLevel32FFunc)(float*,float*,const float*,const float*,int);
+typedef void (*AccumulateLevel16SFunc)(float*,float*,const short*,const float*,int);
+
+static SimdLevel          s_cpuLevel=detectSimdLevel();
+static SimdLevel          s_level=s_cpuLevel;
+static MaxWeightBlendFunc s_maxWeightBlend=
+        s_cpuLevel==SimdAVX2?maxWeightBlendAVX2:
+        (s_cpuLevel==SimdSSE41?maxWeightBlendSSE41:maxWeightBlendScalar);
+static MergeLevel32FFunc  s_mergeLevel32F=
+        s_cpuLevel==SimdAVX2?mergeLevel32FAVX2:
+        (s_cpuLevel==SimdSSE41?mergeLevel32FSSE41:mergeLevel32FScalar);
+static MergeLevel16SFunc  s_mergeLevel16S=
+        s_cpuLevel>=SimdSSE41?mergeLevel16SSSE41:mergeLevel16SScalar;
+static AccumulateLevel32FFunc s_accumulateLevel32F=
+        s_cpuLevel==SimdAVX2?accumulateLevel32FAVX2:
+        (s_cpuLevel==SimdSSE41?accumulateLevel32FSSE41:accumulateLevel32FScalar);
+static AccumulateLevel16SFunc s_accumulateLevel16S=
+        s_cpuLevel==SimdAVX2?accumulateLevel16SAVX2:
+        (s_cpuLevel==SimdSSE41?accumulateLevel16SSSE41:accumulateLevel16SScalar);
+
+SimdLevel cpuSimdLevel(){return s_cpuLevel;}
+
+SimdLevel simdLevel(){return s_level;}
+
+void setSimdLevel(SimdLevel level)
+{
+    if(level>s_cpuLevel) level=s_cpuLevel;
+    s_level=level;
+    switch (level) {
+    case SimdAVX2:  s_maxWeightBlend=maxWeightBlendAVX2;  break;
+    case SimdSSE41: s_maxWeightBlend=maxWeightBlendSSE41; break;
+    default:        s_maxWeightBlend=maxWeightBlendScalar;break;
+    }
+    switch (level) {
+    case SimdAVX2:  s_mergeLevel32F=mergeLevel32FAVX2;  break;
+    case SimdSSE41: s_mergeLevel32F=mergeLevel32FSSE41; break;
+    default:        s_mergeLevel32F=mergeLevel32FScalar;break;
+    }
+    s_mergeLevel16S=level>=SimdSSE41?mergeLevel16SSSE41:mergeLevel16SScalar;
+    switch (level) {
+    case SimdAVX2:
+        s_accumulateLevel32F=accumulateLevel32FAVX2;
+        s_accumulateLevel16S=accumulateLevel16SAVX2;
+        break;
+    case SimdSSE41:
+        s_accumulateLevel32F=accumulateLevel32FSSE41;
+        s_accumulateLevel16S=accumulateLevel16SSSE41;
+        break;
+    default:
+        s_accumulateLevel32F=accumulateLevel32FScalar;
+        s_accumulateLevel16S=accumulateLevel16SScalar;
+        break;
+    }
+}
+
+const char* simdLevelName(SimdLevel level)
+{
+    switch (level) {
+    case SimdAVX2:  return "AVX2";
+    case SimdSSE41: return "SSE4.1";
+    default:        return "Scalar";
+    }
+}
+
+void maxWeightBlend(unsigned char* ele,const unsigned char* src,int pixels)
+{
+    s_maxWeightBlend(ele,src,pixels);
+}
+
+void mergeLevel32F(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    s_mergeLevel32F(dstL,dstW,srcL,srcW,pixels);
+}
+
+void mergeLevel16S(short* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    s_mergeLevel16S(dstL,dstW,srcL,srcW,pixels);
+}
+
+void accumulateLevel32F(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    s_accumulateLevel32F(dstL,dstW,srcL,srcW,pixels);
+}
+
+void accumulateLevel16S(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    s_accumulateLevel16S(dstL,dstW,srcL,srcW,pixels);
+}
+
+void maxWeightBlendScalar(unsigned char* ele,const unsigned char* src,int pixels)
+{
+    // whole pixels are moved as 32 bit words, the alpha is the fourth byte
+    uint32_t* e=(uint32_t*)ele;
+    const uint32_t* s=(const uint32_t*)src;
+    for(int i=0;i<pixels;i++)
+    {
+        if(ele[4*i+3]<src[4*i+3]) e[i]=s[i];
+    }
+}
+
+template <typename LapT>
+static inline void mergeLevelScalar(LapT* dstL,float* dstW,const LapT* srcL,const float* srcW,int pixels)
+{
+    for(int i=0;i<pixels;i++)
+    {
+        if(srcW[i]>=dstW[i])
+        {
+            dstL[3*i]  =srcL[3*i];
+            dstL[3*i+1]=srcL[3*i+1];
+            dstL[3*i+2]=srcL[3*i+2];
+            dstW[i]=srcW[i];
+        }
+    }
+}
+
+void mergeLevel32FScalar(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    mergeLevelScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void mergeLevel16SScalar(short* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    mergeLevelScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+template <typename LapT>
+static inline void accumulateLevelScalar(float* dstL,float* dstW,const LapT* srcL,const float* srcW,int pixels)
+{
+    for(int i=0;i<pixels;i++)
+    {
+        float w=srcW[i];
+        if(w<=0) continue;
+        dstL[3*i]  +=srcL[3*i]*w;
+        dstL[3*i+1]+=srcL[3*i+1]*w;
+        dstL[3*i+2]+=srcL[3*i+2]*w;
+        dstW[i]+=w;
+    }
+}
+
+void accumulateLevel32FScalar(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    accumulateLevelScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void accumulateLevel16SScalar(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    accumulateLevelScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+#ifdef UTILCPU_X86
+
+// the alpha of every pixel is moved to the low byte of its 32 bit lane, so a
+// signed 32 bit compare is an unsigned compare of the alphas
+__attribute__((target("sse4.1")))
+void maxWeightBlendSSE41(unsigned char* ele,const unsigned char* src,int pixels)
+{
+    int i=0;
+    for(;i+4<=pixels;i+=4)
+    {
+        __m128i e=_mm_loadu_si128((const __m128i*)(ele+4*i));
+        __m128i s=_mm_loadu_si128((const __m128i*)(src+4*i));
+        __m128i greater=_mm_cmpgt_epi32(_mm_srli_epi32(s,24),_mm_srli_epi32(e,24));
+        _mm_storeu_si128((__m128i*)(ele+4*i),_mm_blendv_epi8(e,s,greater));
+    }
+    if(i<pixels) maxWeightBlendScalar(ele+4*i,src+4*i,pixels-i);
+}
+
+__attribute__((target("avx2")))
+void maxWeightBlendAVX2(unsigned char* ele,const unsigned char* src,int pixels)
+{
+    int i=0;
+    for(;i+8<=pixels;i+=8)
+    {
+        __m256i e=_mm256_loadu_si256((const __m256i*)(ele+4*i));
+        __m256i s=_mm256_loadu_si256((const __m256i*)(src+4*i));
+        __m256i greater=_mm256_cmpgt_epi32(_mm256_srli_epi32(s,24),_mm256_srli_epi32(e,24));
+        _mm256_storeu_si256((__m256i*)(ele+4*i),_mm256_blendv_epi8(e,s,greater));
+    }
+    if(i<pixels) maxWeightBlendSSE41(ele+4*i,src+4*i,pixels-i);
+}
+
+// The weights give one mask lane per pixel, it is spread over the 3 channels
+// of the pixel in the interleaved Laplacian before the blend. Blocks where no
+// pixel is taken are skipped, which is most of a level away from the frame.
+__attribute__((target("sse4.1")))
+void mergeLevel32FSSE41(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    int i=0;
+    for(;i+4<=pixels;i+=4)
+    {
+        __m128 sw=_mm_loadu_ps(srcW+i),dw=_mm_loadu_ps(dstW+i);
+        __m128 m=_mm_cmpge_ps(sw,dw);
+        if(!_mm_movemask_ps(m)) continue;
+        _mm_storeu_ps(dstW+i,_mm_blendv_ps(dw,sw,m));
+
+        float*       d=dstL+3*i;
+        const float* s=srcL+3*i;
+        __m128 m0=_mm_shuffle_ps(m,m,_MM_SHUFFLE(1,0,0,0));
+        __m128 m1=_mm_shuffle_ps(m,m,_MM_SHUFFLE(2,2,1,1));
+        __m128 m2=_mm_shuffle_ps(m,m,_MM_SHUFFLE(3,3,3,2));
+        _mm_storeu_ps(d,  _mm_blendv_ps(_mm_loadu_ps(d),  _mm_loadu_ps(s),  m0));
+        _mm_storeu_ps(d+4,_mm_blendv_ps(_mm_loadu_ps(d+4),_mm_loadu_ps(s+4),m1));
+        _mm_storeu_ps(d+8,_mm_blendv_ps(_mm_loadu_ps(d+8),_mm_loadu_ps(s+8),m2));
+    }
+    if(i<pixels) mergeLevel32FScalar(dstL+3*i,dstW+i,srcL+3*i,srcW+i,pixels-i);
+}
+
+__attribute__((target("avx2")))
+void mergeLevel32FAVX2(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    const __m256i spread0=_mm256_setr_epi32(0,0,0,1,1,1,2,2);
+    const __m256i spread1=_mm256_setr_epi32(2,3,3,3,4,4,4,5);
+    const __m256i spread2=_mm256_setr_epi32(5,5,6,6,6,7,7,7);
+    int i=0;
+    for(;i+8<=pixels;i+=8)
+    {
+        __m256 sw=_mm256_loadu_ps(srcW+i),dw=_mm256_loadu_ps(dstW+i);
+        __m256 m=_mm256_cmp_ps(sw,dw,_CMP_GE_OQ);
+        if(!_mm256_movemask_ps(m)) continue;
+        _mm256_storeu_ps(dstW+i,_mm256_blendv_ps(dw,sw,m));
+
+        float*       d=dstL+3*i;
+        const float* s=srcL+3*i;
+        __m256 m0=_mm256_permutevar8x32_ps(m,spread0);
+        __m256 m1=_mm256_permutevar8x32_ps(m,spread1);
+        __m256 m2=_mm256_permutevar8x32_ps(m,spread2);
+        _mm256_storeu_ps(d,   _mm256_blendv_ps(_mm256_loadu_ps(d),   _mm256_loadu_ps(s),   m0));
+        _mm256_storeu_ps(d+8, _mm256_blendv_ps(_mm256_loadu_ps(d+8), _mm256_loadu_ps(s+8), m1));
+        _mm256_storeu_ps(d+16,_mm256_blendv_ps(_mm256_loadu_ps(d+16),_mm256_loadu_ps(s+16),m2));
+    }
+    if(i<pixels) mergeLevel32FSSE41(dstL+3*i,dstW+i,srcL+3*i,srcW+i,pixels-i);
+}
+
+// 8 pixels at once, the 32 bit masks of the weights are packed to 16 bits
+// and spread over the 24 shorts by byte shuffles
+__attribute__((target("sse4.1")))
+void mergeLevel16SSSE41(short* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    const __m128i spread0=_mm_setr_epi8(0,1,0,1,0,1,2,3,2,3,2,3,4,5,4,5);
+    const __m128i spread1=_mm_setr_epi8(4,5,6,7,6,7,6,7,8,9,8,9,8,9,10,11);
+    const __m128i spread2=_mm_setr_epi8(10,11,10,11,12,13,12,13,12,13,14,15,14,15,14,15);
+    int i=0;
+    for(;i+8<=pixels;i+=8)
+    {
+        __m128 sw0=_mm_loadu_ps(srcW+i),  dw0=_mm_loadu_ps(dstW+i);
+        __m128 sw1=_mm_loadu_ps(srcW+i+4),dw1=_mm_loadu_ps(dstW+i+4);
+        __m128 m0=_mm_cmpge_ps(sw0,dw0),m1=_mm_cmpge_ps(sw1,dw1);
+        __m128i m=_mm_packs_epi32(_mm_castps_si128(m0),_mm_castps_si128(m1));
+        if(!_mm_movemask_epi8(m)) continue;
+        _mm_storeu_ps(dstW+i,  _mm_blendv_ps(dw0,sw0,m0));
+        _mm_storeu_ps(dstW+i+4,_mm_blendv_ps(dw1,sw1,m1));
+
+        __m128i*       d=(__m128i*)(dstL+3*i);
+        const __m128i* s=(const __m128i*)(srcL+3*i);
+        _mm_storeu_si128(d,  _mm_blendv_epi8(_mm_loadu_si128(d),  _mm_loadu_si128(s),
+                                             _mm_shuffle_epi8(m,spread0)));
+        _mm_storeu_si128(d+1,_mm_blendv_epi8(_mm_loadu_si128(d+1),_mm_loadu_si128(s+1),
+                                             _mm_shuffle_epi8(m,spread1)));
+        _mm_storeu_si128(d+2,_mm_blendv_epi8(_mm_loadu_si128(d+2),_mm_loadu_si128(s+2),
+                                             _mm_shuffle_epi8(m,spread2)));
+    }
+    if(i<pixels) mergeLevel16SScalar(dstL+3*i,dstW+i,srcL+3*i,srcW+i,pixels-i);
+}
+
+// No compare and no blend: the weights are spread over the channels as in
+// the merge and multiplied in, only blocks without any weight are skipped.
+// Multiply then add, not fused, so the sums match the scalar loop exactly.
+__attribute__((target("sse4.1")))
+void accumulateLevel32FSSE41(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    const __m128 zero=_mm_setzero_ps();
+    int i=0;
+    for(;i+4<=pixels;i+=4)
+    {
+        __m128 w=_mm_loadu_ps(srcW+i);
+        if(!_mm_movemask_ps(_mm_cmpgt_ps(w,zero))) continue;
+        _mm_storeu_ps(dstW+i,_mm_add_ps(_mm_loadu_ps(dstW+i),w));
+
+        float*       d=dstL+3*i;
+        const float* s=srcL+3*i;
+        __m128 w0=_mm_shuffle_ps(w,w,_MM_SHUFFLE(1,0,0,0));
+        __m128 w1=_mm_shuffle_ps(w,w,_MM_SHUFFLE(2,2,1,1));
+        __m128 w2=_mm_shuffle_ps(w,w,_MM_SHUFFLE(3,3,3,2));
+        _mm_storeu_ps(d,  _mm_add_ps(_mm_loadu_ps(d),  _mm_mul_ps(_mm_loadu_ps(s),  w0)));
+        _mm_storeu_ps(d+4,_mm_add_ps(_mm_loadu_ps(d+4),_mm_mul_ps(_mm_loadu_ps(s+4),w1)));
+        _mm_storeu_ps(d+8,_mm_add_ps(_mm_loadu_ps(d+8),_mm_mul_ps(_mm_loadu_ps(s+8),w2)));
+    }
+    if(i<pixels) accumulateLevel32FScalar(dstL+3*i,dstW+i,srcL+3*i,srcW+i,pixels-i);
+}
+
+__attribute__((target("avx2")))
+void accumulateLevel32FAVX2(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    const __m256i spread0=_mm256_setr_epi32(0,0,0,1,1,1,2,2);
+    const __m256i spread1=_mm256_setr_epi32(2,3,3,3,4,4,4,5);
+    const __m256i spread2=_mm256_setr_epi32(5,5,6,6,6,7,7,7);
+    const __m256  zero=_mm256_setzero_ps();
+    int i=0;
+    for(;i+8<=pixels;i+=8)
+    {
+        __m256 w=_mm256_loadu_ps(srcW+i);
+        if(!_mm256_movemask_ps(_mm256_cmp_ps(w,zero,_CMP_GT_OQ))) continue;
+        _mm256_storeu_ps(dstW+i,_mm256_add_ps(_mm256_loadu_ps(dstW+i),w));
+
+        float*       d=dstL+3*i;
+        const float* s=srcL+3*i;
+        __m256 w0=_mm256_permutevar8x32_ps(w,spread0);
+        __m256 w1=_mm256_permutevar8x32_ps(w,spread1);
+        __m256 w2=_mm256_permutevar8x32_ps(w,spread2);
+        _mm256_storeu_ps(d,   _mm256_add_ps(_mm256_loadu_ps(d),   _mm256_mul_ps(_mm256_loadu_ps(s),   w0)));
+        _mm256_storeu_ps(d+8, _mm256_add_ps(_mm256_loadu_ps(d+8), _mm256_mul_ps(_mm256_loadu_ps(s+8), w1)));
+        _mm256_storeu_ps(d+16,_mm256_add_ps(_mm256_loadu_ps(d+16),_mm256_mul_ps(_mm256_loadu_ps(s+16),w2)));
+    }
+    if(i<pixels) accumulateLevel32FSSE41(dstL+3*i,dstW+i,srcL+3*i,srcW+i,pixels-i);
+}
+
+// 8 pixels at once, the 24 shorts are widened to 6 vectors of floats
+__attribute__((target("sse4.1")))
+void accumulateLevel16SSSE41(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    const __m128 zero=_mm_setzero_ps();
+    int i=0;
+    for(;i+8<=pixels;i+=8)
+    {
+        __m128 wa=_mm_loadu_ps(srcW+i),wb=_mm_loadu_ps(srcW+i+4);
+        if(!_mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(wa,zero),_mm_cmpgt_ps(wb,zero)))) continue;
+        _mm_storeu_ps(dstW+i,  _mm_add_ps(_mm_loadu_ps(dstW+i),  wa));
+        _mm_storeu_ps(dstW+i+4,_mm_add_ps(_mm_loadu_ps(dstW+i+4),wb));
+
+        __m128 w[6];
+        w[0]=_mm_shuffle_ps(wa,wa,_MM_SHUFFLE(1,0,0,0));
+        w[1]=_mm_shuffle_ps(wa,wa,_MM_SHUFFLE(2,2,1,1));
+        w[2]=_mm_shuffle_ps(wa,wa,_MM_SHUFFLE(3,3,3,2));
+        w[3]=_mm_shuffle_ps(wb,wb,_MM_SHUFFLE(1,0,0,0));
+        w[4]=_mm_shuffle_ps(wb,wb,_MM_SHUFFLE(2,2,1,1));
+        w[5]=_mm_shuffle_ps(wb,wb,_MM_SHUFFLE(3,3,3,2));
+
+        float*         d=dstL+3*i;
+        const __m128i* s=(const __m128i*)(srcL+3*i);
+        for(int j=0;j<3;j++)
+        {
+            __m128i v=_mm_loadu_si128(s+j);
+            __m128  lo=_mm_cvtepi32_ps(_mm_cvtepi16_epi32(v));
+            __m128  hi=_mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(v,8)));
+            _mm_storeu_ps(d+8*j,  _mm_add_ps(_mm_loadu_ps(d+8*j),  _mm_mul_ps(lo,w[2*j])));
+            _mm_storeu_ps(d+8*j+4,_mm_add_ps(_mm_loadu_ps(d+8*j+4),_mm_mul_ps(hi,w[2*j+1])));
+        }
+    }
+    if(i<pixels) accumulateLevel16SScalar(dstL+3*i,dstW+i,srcL+3*i,srcW+i,pixels-i);
+}
+
+__attribute__((target("avx2")))
+void accumulateLevel16SAVX2(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    const __m256i spread[3]={_mm256_setr_epi32(0,0,0,1,1,1,2,2),
+                             _mm256_setr_epi32(2,3,3,3,4,4,4,5),
+                             _mm256_setr_epi32(5,5,6,6,6,7,7,7)};
+    const __m256  zero=_mm256_setzero_ps();
+    int i=0;
+    for(;i+8<=pixels;i+=8)
+    {
+        __m256 w=_mm256_loadu_ps(srcW+i);
+        if(!_mm256_movemask_ps(_mm256_cmp_ps(w,zero,_CMP_GT_OQ))) continue;
+        _mm256_storeu_ps(dstW+i,_mm256_add_ps(_mm256_loadu_ps(dstW+i),w));
+
+        float*         d=dstL+3*i;
+        const __m128i* s=(const __m128i*)(srcL+3*i);
+        for(int j=0;j<3;j++)
+        {
+            __m256 l=_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128(s+j)));
+            _mm256_storeu_ps(d+8*j,_mm256_add_ps(_mm256_loadu_ps(d+8*j),
+                                                 _mm256_mul_ps(l,_mm256_permutevar8x32_ps(w,spread[j]))));
+        }
+    }
+    if(i<pixels) accumulateLevel16SSSE41(dstL+3*i,dstW+i,srcL+3*i,srcW+i,pixels-i);
+}
+
+#else
+
+void maxWeightBlendSSE41(unsigned char* ele,const unsigned char* src,int pixels)
+{
+    maxWeightBlendScalar(ele,src,pixels);
+}
+
+void maxWeightBlendAVX2(unsigned char* ele,const unsigned char* src,int pixels)
+{
+    maxWeightBlendScalar(ele,src,pixels);
+}
+
+void mergeLevel32FSSE41(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    mergeLevel32FScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void mergeLevel32FAVX2(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    mergeLevel32FScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void mergeLevel16SSSE41(short* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    mergeLevel16SScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void accumulateLevel32FSSE41(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    accumulateLevel32FScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void accumulateLevel32FAVX2(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels)
+{
+    accumulateLevel32FScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void accumulateLevel16SSSE41(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    accumulateLevel16SScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+void accumulateLevel16SAVX2(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels)
+{
+    accumulateLevel16SScalar(dstL,dstW,srcL,srcW,pixels);
+}
+
+#endif
+
+RadialWeight::RadialWeight(int cols,int rows,int weightType)
+    :_cols(cols),_rows(rows),_cx(cols/2),_cy(rows/2)
+{
+    float dis_max=sqrt(_cx*_cx+_cy*_cy);
+    _lutScale=LutSize/(dis_max*dis_max);
+    for(int i=0;i<=LutSize;i++)
+    {
+        float dis=1-sqrt((i+0.5f)/LutSize);// center of the bin
+        float w=(0==weightType)?dis*254.:dis*dis*254;
+        _lut[i]=w<2?2:(unsigned char)w;
+    }
+}
+
+/// Columns [xs,xe) of the row y of the block which may sample inside the camera,
+/// every condition of u=X/W in [0,umax) and v=Y/W in [0,vmax) is linear in x
+static inline void footprintSpan(const double* inv,double umax,double vmax,
+                                 int x0,int y,int cols,int& xs,int& xe)
+{
+    // a*x+b>=0 for (X,Y,umax*W-X,vmax*W-Y,W)
+    double a[5]={inv[0],inv[3],umax*inv[6]-inv[0],vmax*inv[6]-inv[3],inv[6]};
+    double b[5]={inv[1]*y+inv[2],inv[4]*y+inv[5],
+                 umax*(inv[7]*y+inv[8])-(inv[1]*y+inv[2]),
+                 vmax*(inv[7]*y+inv[8])-(inv[4]*y+inv[5]),inv[7]*y+inv[8]};
+    double lo=x0,hi=x0+cols-1;
+    for(int i=0;i<5;i++)
+    {
+        if(a[i]>0)      lo=std::max(lo,-b[i]/a[i]);
+        else if(a[i]<0) hi=std::min(hi,-b[i]/a[i]);
+        else if(b[i]<0) {xs=xe=0;return;}
+    }
+    if(lo>hi) {xs=xe=0;return;}
+    xs=(int)ceil(lo)-x0;
+    xe=(int)floor(hi)-x0+1;
+    if(xs<0) xs=0;
+    if(xe>cols) xe=cols;
+    if(xe<xs) xe=xs;
+}
+
+/// Bilinear sample of the BGR camera at (u,v) with 8 bit fixed point weights
+static inline void sampleBGR(const unsigned char* bgr,size_t bgrStep,float u,float v,unsigned char* d)
+{
+    int ui=(int)u,vi=(int)v;
+    int ax=(int)((u-ui)*256),ay=(int)((v-vi)*256);
+    int w00=(256-ax)*(256-ay),w01=ax*(256-ay),w10=(256-ax)*ay,w11=ax*ay;
+    const unsigned char* p0=bgr+vi*bgrStep+ui*3;
+    const unsigned char* p1=p0+bgrStep;
+    d[0]=(p0[0]*w00+p0[3]*w01+p1[0]*w10+p1[3]*w11+32768)>>16;
+    d[1]=(p0[1]*w00+p0[4]*w01+p1[1]*w10+p1[4]*w11+32768)>>16;
+    d[2]=(p0[2]*w00+p0[5]*w01+p1[2]*w10+p1[5]*w11+32768)>>16;
+}
+
+void warpPerspectiveWeighted(const unsigned char* bgr,size_t bgrStep,const RadialWeight& weight,
+                             const double* inv,int x0,int y0,
+                             unsigned char* dst,size_t dstStep,int cols,int rows)
+{
+    const float umax=weight.cols()-1,vmax=weight.rows()-1;
+    for(int y=0;y<rows;y++,dst+=dstStep)
+    {
+        int xs,xe;
+        footprintSpan(inv,umax,vmax,x0,y0+y,cols,xs,xe);
+        memset(dst,0,xs*4);
+        memset(dst+xe*4,0,(cols-xe)*4);
+
+        // homogeneous source position, incremented along the row
+        double X=inv[0]*(x0+xs)+inv[1]*(y0+y)+inv[2];
+        double Y=inv[3]*(x0+xs)+inv[4]*(y0+y)+inv[5];
+        double W=inv[6]*(x0+xs)+inv[7]*(y0+y)+inv[8];
+        unsigned char* d=dst+xs*4;
+        for(int x=xs;x<xe;x++,d+=4,X+=inv[0],Y+=inv[3],W+=inv[6])
+        {
+            double winv=W?1./W:0;
+            float  u=X*winv,v=Y*winv;
+            if(!(u>=0&&v>=0&&u<umax&&v<vmax))
+            {
+                *(uint32_t*)d=0;
+                continue;
+            }
+            sampleBGR(bgr,bgrStep,u,v,d);
+            d[3]=weight(u,v);
+        }
+    }
+}
+
+int warpPerspectiveWeightedMax(const unsigned char* bgr,size_t bgrStep,const RadialWeight& weight,
+                               const double* inv,int x0,int y0,
+                               unsigned char* dst,size_t dstStep,int cols,int rows)
+{
+    const float umax=weight.cols()-1,vmax=weight.rows()-1;
+    int covered=0;
+    for(int y=0;y<rows;y++,dst+=dstStep)
+    {
+        int xs,xe;
+        footprintSpan(inv,umax,vmax,x0,y0+y,cols,xs,xe);
+
+        double X=inv[0]*(x0+xs)+inv[1]*(y0+y)+inv[2];
+        double Y=inv[3]*(x0+xs)+inv[4]*(y0+y)+inv[5];
+        double W=inv[6]*(x0+xs)+inv[7]*(y0+y)+inv[8];
+        unsigned char* d=dst+xs*4;
+        for(int x=xs;x<xe;x++,d+=4,X+=inv[0],Y+=inv[3],W+=inv[6])
+        {
+            double winv=W?1./W:0;
+            float  u=X*winv,v=Y*winv;
+            if(!(u>=0&&v>=0&&u<umax&&v<vmax)) continue;
+            covered++;
+
+            // the weight is cheaper than the color, only sample pixels which win
+            unsigned char alpha=weight(u,v);
+            if(alpha<=d[3]) continue;
+            sampleBGR(bgr,bgrStep,u,v,d);
+            d[3]=alpha;
+        }
+    }
+    return covered;
+}
+
+bool quadIntersectsRect(const double* quad,double x0,double y0,double x1,double y1)
+{
+    // separating axis test: the rectangle axes, then the quad edge normals
+    double qxmin=quad[0],qxmax=quad[0],qymin=quad[1],qymax=quad[1];
+    for(int i=1;i<4;i++)
+    {
+        qxmin=std::min(qxmin,quad[2*i]);qxmax=std::max(qxmax,quad[2*i]);
+        qymin=std::min(qymin,quad[2*i+1]);qymax=std::max(qymax,quad[2*i+1]);
+    }
+    if(qxmax<x0||qxmin>x1||qymax<y0||qymin>y1) return false;
+
+    double rect[8]={x0,y0,x1,y0,x1,y1,x0,y1};
+    for(int i=0;i<4;i++)
+    {
+        int j=(i+1)%4;
+        double nx=quad[2*j+1]-quad[2*i+1],ny=quad[2*i]-quad[2*j];
+        double qmin=0,qmax=0,rmin=0,rmax=0;
+        for(int k=0;k<4;k++)
+        {
+            double q=nx*quad[2*k]+ny*quad[2*k+1];
+            double r=nx*rect[2*k]+ny*rect[2*k+1];
+            if(!k||q<qmin) qmin=q;
+            if(!k||q>qmax) qmax=q;
+            if(!k||r<rmin) rmin=r;
+            if(!k||r>rmax) rmax=r;
+        }
+        if(rmax<qmin||rmin>qmax) return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Pyramid levels: the 5x5 Gaussian is applied to the rows first, on the full
+/// width, then to the columns of that row, so both passes are plain vector
+/// loops over the interleaved channels. Every row kernel has a scalar, an
+/// SSE4.1 and an AVX2 variant computing the same sums in the same order.
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T,typename WT>
+struct PyramidKernels
+{
+    /// d[j]=s0+s4+4*(s1+s3)+6*s2 of the 5 rows s
+    void (*downRows)(const T* const* s,WT* d,int n);
+    /// d[j]=v[j-2cn]+v[j+2cn]+4*(v[j-cn]+v[j+cn])+6*v[j]
+    void (*downCols)(const WT* v,WT* d,int n,int cn);
+    /// g0-=cast(r0+6*r1+r2), g1-=cast(4*(r1+r2)) where r are expanded rows
+    void (*upRows)(T* g0,T* g1,const WT* r0,const WT* r1,const WT* r2,int n);
+};
+
+static inline short castDown(int v)  {v=(v+128)>>8;return v>32767?32767:(v<-32768?-32768:v);}
+static inline float castDown(float v){return v*(1.f/256);}
+static inline short subUp(short g,int v)
+{
+    v=(v+32)>>6;
+    v=g-(v>32767?32767:(v<-32768?-32768:v));
+    return v>32767?32767:(v<-32768?-32768:v);
+}
+static inline float subUp(float g,float v){return g-v*(1.f/64);}
+
+template <typename T,typename WT>
+static void pyrDownRowsScalar(const T* const* s,WT* d,int n)
+{
+    for(int j=0;j<n;j++)
+        d[j]=((WT)s[0][j]+s[4][j])+((WT)s[1][j]+s[3][j])*4+(WT)s[2][j]*6;
+}
+
+template <typename WT>
+static void pyrDownColsScalar(const WT* v,WT* d,int n,int cn)
+{
+    for(int j=0;j<n;j++)
+        d[j]=(v[j-2*cn]+v[j+2*cn])+(v[j-cn]+v[j+cn])*4+v[j]*6;
+}
+
+template <typename T,typename WT>
+static void pyrUpRowsScalar(T* g0,T* g1,const WT* r0,const WT* r1,const WT* r2,int n)
+{
+    for(int j=0;j<n;j++)
+    {
+        g0[j]=subUp(g0[j],(r0[j]+r2[j])+r1[j]*6);
+        g1[j]=subUp(g1[j],(r1[j]+r2[j])*4);
+    }
+}
+
+#ifdef UTILCPU_X86
+
+__attribute__((target("sse4.1")))
+static void pyrDownRows16SSSE41(const short* const* s,int* d,int n)
+{
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        __m128i v[5];
+        for(int i=0;i<5;i++) v[i]=_mm_loadu_si128((const __m128i*)(s[i]+j));
+        for(int h=0;h<2;h++)
+        {
+            __m128i a=_mm_cvtepi16_epi32(v[0]),b=_mm_cvtepi16_epi32(v[1]),c=_mm_cvtepi16_epi32(v[2]),
+                    e=_mm_cvtepi16_epi32(v[3]),f=_mm_cvtepi16_epi32(v[4]);
+            __m128i r=_mm_add_epi32(_mm_add_epi32(a,f),_mm_slli_epi32(_mm_add_epi32(b,e),2));
+            r=_mm_add_epi32(r,_mm_add_epi32(_mm_slli_epi32(c,2),_mm_slli_epi32(c,1)));
+            _mm_storeu_si128((__m128i*)(d+j+4*h),r);
+            for(int i=0;i<5;i++) v[i]=_mm_srli_si128(v[i],8);
+        }
+    }
+    if(j<n)
+    {
+        const short* t[5]={s[0]+j,s[1]+j,s[2]+j,s[3]+j,s[4]+j};
+        pyrDownRowsScalar(t,d+j,n-j);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void pyrDownRows32FSSE41(const float* const* s,float* d,int n)
+{
+    const __m128 four=_mm_set1_ps(4),six=_mm_set1_ps(6);
+    int j=0;
+    for(;j+4<=n;j+=4)
+    {
+        __m128 r=_mm_add_ps(_mm_loadu_ps(s[0]+j),_mm_loadu_ps(s[4]+j));
+        r=_mm_add_ps(r,_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(s[1]+j),_mm_loadu_ps(s[3]+j)),four));
+        _mm_storeu_ps(d+j,_mm_add_ps(r,_mm_mul_ps(_mm_loadu_ps(s[2]+j),six)));
+    }
+    if(j<n)
+    {
+        const float* t[5]={s[0]+j,s[1]+j,s[2]+j,s[3]+j,s[4]+j};
+        pyrDownRowsScalar(t,d+j,n-j);
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void pyrDownCols32SSSE41(const int* v,int* d,int n,int cn)
+{
+    int j=0;
+    for(;j+4<=n;j+=4)
+    {
+        const int* p=v+j;
+        __m128i c=_mm_loadu_si128((const __m128i*)p);
+        __m128i r=_mm_add_epi32(_mm_loadu_si128((const __m128i*)(p-2*cn)),_mm_loadu_si128((const __m128i*)(p+2*cn)));
+        r=_mm_add_epi32(r,_mm_slli_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)(p-cn)),
+                                                       _mm_loadu_si128((const __m128i*)(p+cn))),2));
+        r=_mm_add_epi32(r,_mm_add_epi32(_mm_slli_epi32(c,2),_mm_slli_epi32(c,1)));
+        _mm_storeu_si128((__m128i*)(d+j),r);
+    }
+    if(j<n) pyrDownColsScalar(v+j,d+j,n-j,cn);
+}
+
+__attribute__((target("sse4.1")))
+static void pyrDownCols32FSSE41(const float* v,float* d,int n,int cn)
+{
+    const __m128 four=_mm_set1_ps(4),six=_mm_set1_ps(6);
+    int j=0;
+    for(;j+4<=n;j+=4)
+    {
+        const float* p=v+j;
+        __m128 r=_mm_add_ps(_mm_loadu_ps(p-2*cn),_mm_loadu_ps(p+2*cn));
+        r=_mm_add_ps(r,_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(p-cn),_mm_loadu_ps(p+cn)),four));
+        _mm_storeu_ps(d+j,_mm_add_ps(r,_mm_mul_ps(_mm_loadu_ps(p),six)));
+    }
+    if(j<n) pyrDownColsScalar(v+j,d+j,n-j,cn);
+}
+
+// the casts saturate like cv::pyrUp to shorts and cv::subtract does
+__attribute__((target("sse4.1")))
+static void pyrUpRows16SSSE41(short* g0,short* g1,const int* r0,const int* r1,const int* r2,int n)
+{
+    const __m128i round=_mm_set1_epi32(32);
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        __m128i t0[2],t1[2];
+        for(int h=0;h<2;h++)
+        {
+            __m128i a=_mm_loadu_si128((const __m128i*)(r0+j+4*h));
+            __m128i b=_mm_loadu_si128((const __m128i*)(r1+j+4*h));
+            __m128i c=_mm_loadu_si128((const __m128i*)(r2+j+4*h));
+            __m128i s0=_mm_add_epi32(_mm_add_epi32(a,c),_mm_add_epi32(_mm_slli_epi32(b,2),_mm_slli_epi32(b,1)));
+            __m128i s1=_mm_slli_epi32(_mm_add_epi32(b,c),2);
+            t0[h]=_mm_srai_epi32(_mm_add_epi32(s0,round),6);
+            t1[h]=_mm_srai_epi32(_mm_add_epi32(s1,round),6);
+        }
+        _mm_storeu_si128((__m128i*)(g0+j),_mm_subs_epi16(_mm_loadu_si128((const __m128i*)(g0+j)),
+                                                         _mm_packs_epi32(t0[0],t0[1])));
+        _mm_storeu_si128((__m128i*)(g1+j),_mm_subs_epi16(_mm_loadu_si128((const __m128i*)(g1+j)),
+                                                         _mm_packs_epi32(t1[0],t1[1])));
+    }
+    if(j<n) pyrUpRowsScalar(g0+j,g1+j,r0+j,r1+j,r2+j,n-j);
+}
+
+__attribute__((target("sse4.1")))
+static void pyrUpRows32FSSE41(float* g0,float* g1,const float* r0,const float* r1,const float* r2,int n)
+{
+    const __m128 four=_mm_set1_ps(4),six=_mm_set1_ps(6),scale=_mm_set1_ps(1.f/64);
+    int j=0;
+    for(;j+4<=n;j+=4)
+    {
+        __m128 a=_mm_loadu_ps(r0+j),b=_mm_loadu_ps(r1+j),c=_mm_loadu_ps(r2+j);
+        __m128 s0=_mm_add_ps(_mm_add_ps(a,c),_mm_mul_ps(b,six));
+        __m128 s1=_mm_mul_ps(_mm_add_ps(b,c),four);
+        _mm_storeu_ps(g0+j,_mm_sub_ps(_mm_loadu_ps(g0+j),_mm_mul_ps(s0,scale)));
+        _mm_storeu_ps(g1+j,_mm_sub_ps(_mm_loadu_ps(g1+j),_mm_mul_ps(s1,scale)));
+    }
+    if(j<n) pyrUpRowsScalar(g0+j,g1+j,r0+j,r1+j,r2+j,n-j);
+}
+
+__attribute__((target("avx2")))
+static void pyrDownRows16SAVX2(const short* const* s,int* d,int n)
+{
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        __m256i v[5];
+        for(int i=0;i<5;i++) v[i]=_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(s[i]+j)));
+        __m256i r=_mm256_add_epi32(_mm256_add_epi32(v[0],v[4]),_mm256_slli_epi32(_mm256_add_epi32(v[1],v[3]),2));
+        r=_mm256_add_epi32(r,_mm256_add_epi32(_mm256_slli_epi32(v[2],2),_mm256_slli_epi32(v[2],1)));
+        _mm256_storeu_si256((__m256i*)(d+j),r);
+    }
+    if(j<n)
+    {
+        const short* t[5]={s[0]+j,s[1]+j,s[2]+j,s[3]+j,s[4]+j};
+        pyrDownRowsScalar(t,d+j,n-j);
+    }
+}
+
+__attribute__((target("avx2")))
+static void pyrDownRows32FAVX2(const float* const* s,float* d,int n)
+{
+    const __m256 four=_mm256_set1_ps(4),six=_mm256_set1_ps(6);
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        __m256 r=_mm256_add_ps(_mm256_loadu_ps(s[0]+j),_mm256_loadu_ps(s[4]+j));
+        r=_mm256_add_ps(r,_mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(s[1]+j),_mm256_loadu_ps(s[3]+j)),four));
+        _mm256_storeu_ps(d+j,_mm256_add_ps(r,_mm256_mul_ps(_mm256_loadu_ps(s[2]+j),six)));
+    }
+    if(j<n)
+    {
+        const float* t[5]={s[0]+j,s[1]+j,s[2]+j,s[3]+j,s[4]+j};
+        pyrDownRowsScalar(t,d+j,n-j);
+    }
+}
+
+__attribute__((target("avx2")))
+static void pyrDownCols32SAVX2(const int* v,int* d,int n,int cn)
+{
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        const int* p=v+j;
+        __m256i c=_mm256_loadu_si256((const __m256i*)p);
+        __m256i r=_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(p-2*cn)),
+                                   _mm256_loadu_si256((const __m256i*)(p+2*cn)));
+        r=_mm256_add_epi32(r,_mm256_slli_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(p-cn)),
+                                                                _mm256_loadu_si256((const __m256i*)(p+cn))),2));
+        r=_mm256_add_epi32(r,_mm256_add_epi32(_mm256_slli_epi32(c,2),_mm256_slli_epi32(c,1)));
+        _mm256_storeu_si256((__m256i*)(d+j),r);
+    }
+    if(j<n) pyrDownColsScalar(v+j,d+j,n-j,cn);
+}
+
+__attribute__((target("avx2")))
+static void pyrDownCols32FAVX2(const float* v,float* d,int n,int cn)
+{
+    const __m256 four=_mm256_set1_ps(4),six=_mm256_set1_ps(6);
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        const float* p=v+j;
+        __m256 r=_mm256_add_ps(_mm256_loadu_ps(p-2*cn),_mm256_loadu_ps(p+2*cn));
+        r=_mm256_add_ps(r,_mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(p-cn),_mm256_loadu_ps(p+cn)),four));
+        _mm256_storeu_ps(d+j,_mm256_add_ps(r,_mm256_mul_ps(_mm256_loadu_ps(p),six)));
+    }
+    if(j<n) pyrDownColsScalar(v+j,d+j,n-j,cn);
+}
+
+__attribute__((target("avx2")))
+static void pyrUpRows16SAVX2(short* g0,short* g1,const int* r0,const int* r1,const int* r2,int n)
+{
+    const __m256i round=_mm256_set1_epi32(32);
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        __m256i a=_mm256_loadu_si256((const __m256i*)(r0+j));
+        __m256i b=_mm256_loadu_si256((const __m256i*)(r1+j));
+        __m256i c=_mm256_loadu_si256((const __m256i*)(r2+j));
+        __m256i s0=_mm256_add_epi32(_mm256_add_epi32(a,c),
+                                    _mm256_add_epi32(_mm256_slli_epi32(b,2),_mm256_slli_epi32(b,1)));
+        __m256i s1=_mm256_slli_epi32(_mm256_add_epi32(b,c),2);
+        __m256i t0=_mm256_srai_epi32(_mm256_add_epi32(s0,round),6);
+        __m256i t1=_mm256_srai_epi32(_mm256_add_epi32(s1,round),6);
+        // the packs work per 128 bit lane, the halves of t are packed together
+        __m128i p0=_mm_packs_epi32(_mm256_castsi256_si128(t0),_mm256_extracti128_si256(t0,1));
+        __m128i p1=_mm_packs_epi32(_mm256_castsi256_si128(t1),_mm256_extracti128_si256(t1,1));
+        _mm_storeu_si128((__m128i*)(g0+j),_mm_subs_epi16(_mm_loadu_si128((const __m128i*)(g0+j)),p0));
+        _mm_storeu_si128((__m128i*)(g1+j),_mm_subs_epi16(_mm_loadu_si128((const __m128i*)(g1+j)),p1));
+    }
+    if(j<n) pyrUpRowsScalar(g0+j,g1+j,r0+j,r1+j,r2+j,n-j);
+}
+
+__attribute__((target("avx2")))
+static void pyrUpRows32FAVX2(float* g0,float* g1,const float* r0,const float* r1,const float* r2,int n)
+{
+    const __m256 four=_mm256_set1_ps(4),six=_mm256_set1_ps(6),scale=_mm256_set1_ps(1.f/64);
+    int j=0;
+    for(;j+8<=n;j+=8)
+    {
+        __m256 a=_mm256_loadu_ps(r0+j),b=_mm256_loadu_ps(r1+j),c=_mm256_loadu_ps(r2+j);
+        __m256 s0=_mm256_add_ps(_mm256_add_ps(a,c),_mm256_mul_ps(b,six));
+        __m256 s1=_mm256_mul_ps(_mm256_add_ps(b,c),four);
+        _mm256_storeu_ps(g0+j,_mm256_sub_ps(_mm256_loadu_ps(g0+j),_mm256_mul_ps(s0,scale)));
+        _mm256_storeu_ps(g1+j,_mm256_sub_ps(_mm256_loadu_ps(g1+j),_mm256_mul_ps(s1,scale)));
+    }
+    if(j<n) pyrUpRowsScalar(g0+j,g1+j,r0+j,r1+j,r2+j,n-j);
+}
+
+#endif
+
+static void pyramidKernels(PyramidKernels<short,int>& k)
+{
+    k.downRows=pyrDownRowsScalar<short,int>;
+    k.downCols=pyrDownColsScalar<int>;
+    k.upRows  =pyrUpRowsScalar<short,int>;
+#ifdef UTILCPU_X86
+    if(s_level==SimdAVX2)
+    {
+        k.downRows=pyrDownRows16SAVX2;
+        k.downCols=pyrDownCols32SAVX2;
+        k.upRows  =pyrUpRows16SAVX2;
+    }
+    else if(s_level==SimdSSE41)
+    {
+        k.downRows=pyrDownRows16SSSE41;
+        k.downCols=pyrDownCols32SSSE41;
+        k.upRows  =pyrUpRows16SSSE41;
+    }
+#endif
+}
+
+static void pyramidKernels(PyramidKernels<float,float>& k)
+{
+    k.downRows=pyrDownRowsScalar<float,float>;
+    k.downCols=pyrDownColsScalar<float>;
+    k.upRows  =pyrUpRowsScalar<float,float>;
+#ifdef UTILCPU_X86
+    if(s_level==SimdAVX2)
+    {
+        k.downRows=pyrDownRows32FAVX2;
+        k.downCols=pyrDownCols32FAVX2;
+        k.upRows  =pyrUpRows32FAVX2;
+    }
+    else if(s_level==SimdSSE41)
+    {
+        k.downRows=pyrDownRows32FSSE41;
+        k.downCols=pyrDownCols32FSSE41;
+        k.upRows  =pyrUpRows32FSSE41;
+    }
+#endif
+}
+
+/// BORDER_REFLECT_101 as cv::borderInterpolate
+static inline int reflect101(int p,int len)
+{
+    if(len==1) return 0;
+    while(p<0||p>=len) p=p<0?-p:2*len-2-p;
+    return p;
+}
+
+/// Fill the 2 pixels of border on both sides of a row of cols pixels
+template <typename WT>
+static inline void padRow(WT* v,int cols,int cn)
+{
+    const int pads[4]={-2,-1,cols,cols+1};
+    for(int i=0;i<4;i++)
+    {
+        int src=reflect101(pads[i],cols);
+        for(int c=0;c<cn;c++) v[pads[i]*cn+c]=v[src*cn+c];
+    }
+}
+
+size_t pyrLevelBufferSize(int cols)
+{
+    return sizeof(float)*(9*(size_t)cols+16);
+}
+
+template <typename T,typename WT>
+static void pyrDownLevel(const T* src,size_t srcStep,const float* weight,size_t weightStep,
+                         int cols,int rows,T* dst,size_t dstStep,float* dstWeight,size_t dstWeightStep,
+                         void* buffer)
+{
+    PyramidKernels<T,WT>        k;
+    PyramidKernels<float,float> kw;
+    pyramidKernels(k);
+    pyramidKernels(kw);
+
+    // rows filtered with 2 pixels of border, then their columns
+    WT*    v =(WT*)buffer+6;
+    WT*    h =v+3*cols+6;
+    float* vw=(float*)(h+3*cols)+2;
+    float* hw=vw+cols+2;
+    for(int y=0;y<rows/2;y++)
+    {
+        const T*     s[5];
+        const float* sw[5];
+        for(int i=0;i<5;i++)
+        {
+            int r=reflect101(2*y-2+i,rows);
+            s[i] =(const T*)((const char*)src+r*srcStep);
+            sw[i]=weight?(const float*)((const char*)weight+r*weightStep):NULL;
+        }
+
+        k.downRows(s,v,3*cols);
+        padRow(v,cols,3);
+        k.downCols(v,h,3*cols,3);
+        T* d=(T*)((char*)dst+y*dstStep);
+        for(int x=0;x<cols/2;x++)
+        {
+            d[3*x]  =castDown(h[6*x]);
+            d[3*x+1]=castDown(h[6*x+1]);
+            d[3*x+2]=castDown(h[6*x+2]);
+        }
+
+        if(!weight) continue;
+        kw.downRows(sw,vw,cols);
+        padRow(vw,cols,1);
+        kw.downCols(vw,hw,cols,1);
+        float* dw=(float*)((char*)dstWeight+y*dstWeightStep);
+        for(int x=0;x<cols/2;x++) dw[x]=castDown(hw[2*x]);
+    }
+}
+
+/// A row of the coarse level upsampled horizontally as cv::pyrUp: reflected
+/// on the left, replicated on the right
+template <typename T,typename WT>
+static void expandRow(const T* s,WT* d,int ccols)
+{
+    for(int x=0;x<ccols;x++)
+    {
+        int l=x>0?x-1:(ccols>1?1:0),r=x<ccols-1?x+1:x;
+        for(int c=0;c<3;c++)
+        {
+            WT a=s[3*l+c],b=s[3*x+c],e=s[3*r+c];
+            d[6*x+c]  =a+b*6+e;
+            d[6*x+3+c]=(b+e)*4;
+        }
+    }
+}
+
+template <typename T,typename WT>
+static void laplaceLevel(T* level,size_t step,int cols,int rows,const T* coarse,size_t coarseStep,
+                         void* buffer)
+{
+    PyramidKernels<T,WT> k;
+    pyramidKernels(k);
+
+    // the expanded rows of the coarse level, slot row%3 holds the row tags[slot]
+    int ccols=cols/2,crows=rows/2;
+    WT* up[3]={(WT*)buffer,(WT*)buffer+3*cols,(WT*)buffer+6*cols};
+    int tags[3]={-1,-1,-1};
+    for(int y=0;y<crows;y++)
+    {
+        int sy[3]={y>0?y-1:(crows>1?1:0),y,y<crows-1?y+1:y};
+        const WT* r[3];
+        for(int i=0;i<3;i++)
+        {
+            int slot=sy[i]%3;
+            if(tags[slot]!=sy[i])
+            {
+                expandRow((const T*)((const char*)coarse+sy[i]*coarseStep),up[slot],ccols);
+                tags[slot]=sy[i];
+            }
+            r[i]=up[slot];
+        }
+        k.upRows((T*)((char*)level+2*y*step),(T*)((char*)level+(2*y+1)*step),r[0],r[1],r[2],3*cols);
+    }
+}
+
+void pyrDownLevel16S(const short* src,size_t srcStep,const float* weight,size_t weightStep,
+                     int cols,int rows,short* dst,size_t dstStep,float* dstWeight,size_t dstWeightStep,
+                     void* buffer)
+{
+    pyrDownLevel<short,int>(src,srcStep,weight,weightStep,cols,rows,dst,dstStep,dstWeight,dstWeightStep,buffer);
+}
+
+void pyrDownLevel32F(const float* src,size_t srcStep,const float* weight,size_t weightStep,
+                     int cols,int rows,float* dst,size_t dstStep,float* dstWeight,size_t dstWeightStep,
+                     void* buffer)
+{
+    pyrDownLevel<float,float>(src,srcStep,weight,weightStep,cols,rows,dst,dstStep,dstWeight,dstWeightStep,buffer);
+}
+
+void laplaceLevel16S(short* level,size_t step,int cols,int rows,const short* coarse,size_t coarseStep,
+                     void* buffer)
+{
+    laplaceLevel<short,int>(level,step,cols,rows,coarse,coarseStep,buffer);
+}
+
+void laplaceLevel32F(float* level,size_t step,int cols,int rows,const float* coarse,size_t coarseStep,
+                     void* buffer)
+{
+    laplaceLevel<float,float>(level,step,cols,rows,coarse,coarseStep,buffer);
+}
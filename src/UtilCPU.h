@@ -0,0 +1,146 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef UTILCPU_H
+#define UTILCPU_H
+
+#include <stddef.h>
+
+/// Instruction sets the CPU kernels may use, detected at runtime
+enum SimdLevel
+{
+    SimdNone=0,
+    SimdSSE41=1,
+    SimdAVX2=2
+};
+
+/// Best level supported by the running processor
+SimdLevel cpuSimdLevel();
+
+/// Level used by the dispatched kernels, at most cpuSimdLevel()
+SimdLevel simdLevel();
+void      setSimdLevel(SimdLevel level);
+
+const char* simdLevelName(SimdLevel level);
+
+/// Max weight compositing of BGRA pixels: ele[i]=src[i] where src[i].a>ele[i].a
+void maxWeightBlend(unsigned char* ele,const unsigned char* src,int pixels);
+
+/// The implementations behind maxWeightBlend, the SIMD ones fall back to the
+/// scalar one when they are not compiled in
+void maxWeightBlendScalar(unsigned char* ele,const unsigned char* src,int pixels);
+void maxWeightBlendSSE41 (unsigned char* ele,const unsigned char* src,int pixels);
+void maxWeightBlendAVX2  (unsigned char* ele,const unsigned char* src,int pixels);
+
+/// Multi-band merge of a row of 3 channel Laplacian pixels, where
+/// srcW[i]>=dstW[i] the pixel and its weight are copied to dst
+void mergeLevel32F(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void mergeLevel16S(short* dstL,float* dstW,const short* srcL,const float* srcW,int pixels);
+
+/// The implementations behind mergeLevel32F and mergeLevel16S, the 16 bit one
+/// has no AVX2 variant: it is bound by the 3 channel shuffles, not the width
+void mergeLevel32FScalar(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void mergeLevel32FSSE41 (float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void mergeLevel32FAVX2  (float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void mergeLevel16SScalar(short* dstL,float* dstW,const short* srcL,const float* srcW,int pixels);
+void mergeLevel16SSSE41 (short* dstL,float* dstW,const short* srcL,const float* srcW,int pixels);
+
+/// Feather accumulation of a row of 3 channel Laplacian pixels into running
+/// sums: dstL[i]+=srcL[i]*srcW[i] and dstW[i]+=srcW[i]
+void accumulateLevel32F(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void accumulateLevel16S(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels);
+
+/// The implementations behind accumulateLevel32F and accumulateLevel16S
+void accumulateLevel32FScalar(float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void accumulateLevel32FSSE41 (float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void accumulateLevel32FAVX2  (float* dstL,float* dstW,const float* srcL,const float* srcW,int pixels);
+void accumulateLevel16SScalar(float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels);
+void accumulateLevel16SSSE41 (float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels);
+void accumulateLevel16SAVX2  (float* dstL,float* dstW,const short* srcL,const float* srcW,int pixels);
+
+/// One step of the Laplacian pyramid of a 3 channel image and the Gaussian
+/// pyramid of its weights, as cv::detail::createLaplacePyr and cv::pyrDown
+/// compute them, for cols and rows even (tile aligned levels always are).
+/// The results are the same bit for bit for 16 bit levels and up to the float
+/// rounding otherwise. Steps are in bytes, buffer holds pyrLevelBufferSize(cols).
+size_t pyrLevelBufferSize(int cols);
+
+/// Reduce the cols x rows level src and its CV_32FC1 weights (skipped if NULL)
+/// with the 5x5 Gaussian to the cols/2 x rows/2 dst and dstWeight
+void pyrDownLevel16S(const short* src,size_t srcStep,const float* weight,size_t weightStep,
+                     int cols,int rows,short* dst,size_t dstStep,float* dstWeight,size_t dstWeightStep,
+                     void* buffer);
+void pyrDownLevel32F(const float* src,size_t srcStep,const float* weight,size_t weightStep,
+                     int cols,int rows,float* dst,size_t dstStep,float* dstWeight,size_t dstWeightStep,
+                     void* buffer);
+
+/// level-=pyrUp(coarse) where coarse is the reduced level, cols/2 x rows/2
+void laplaceLevel16S(short* level,size_t step,int cols,int rows,const short* coarse,size_t coarseStep,
+                     void* buffer);
+void laplaceLevel32F(float* level,size_t step,int cols,int rows,const float* coarse,size_t coarseStep,
+                     void* buffer);
+
+/// Radial weight of the camera pixels, 254 at the center down to 2 at the
+/// corners (squared with weightType=1), looked up by squared distance
+class RadialWeight
+{
+public:
+    RadialWeight(int cols,int rows,int weightType=0);
+
+    int cols()const{return _cols;}
+    int rows()const{return _rows;}
+
+    inline unsigned char operator()(float x,float y)const
+    {
+        int idx=(int)(((x-_cx)*(x-_cx)+(y-_cy)*(y-_cy))*_lutScale);
+        return _lut[idx<LutSize?idx:LutSize];
+    }
+
+private:
+    enum{LutSize=16384};
+
+    int           _cols,_rows;
+    float         _cx,_cy,_lutScale;
+    unsigned char _lut[LutSize+1];
+};
+
+/// Warp a BGR camera frame to BGRA in one pass, the alpha is the radial weight
+/// at the sampled position. inv maps the destination pixel (x0+x,y0+y) to the
+/// camera (row major 3x3, w>0 over the camera as given by the inverse of
+/// getPerspectiveTransform), the cols x rows block at dst is written, pixels
+/// sampled outside of the camera are set to 0.
+void warpPerspectiveWeighted(const unsigned char* bgr,size_t bgrStep,const RadialWeight& weight,
+                             const double* inv,int x0,int y0,
+                             unsigned char* dst,size_t dstStep,int cols,int rows);
+
+/// As warpPerspectiveWeighted but blended into dst with maxWeightBlend, pixels
+/// outside of the camera footprint are not touched. Returns the number of
+/// pixels inside of the footprint.
+int  warpPerspectiveWeightedMax(const unsigned char* bgr,size_t bgrStep,const RadialWeight& weight,
+                                const double* inv,int x0,int y0,
+                                unsigned char* dst,size_t dstStep,int cols,int rows);
+
+/// Whether the convex quad (4 points x,y in order around it) and the
+/// rectangle [x0,x1]x[y0,y1] overlap
+bool quadIntersectsRect(const double* quad,double x0,double y0,double x1,double y1);
+
+#endif // UTILCPU_H
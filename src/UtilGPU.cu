@@ -24,7 +24,7 @@
 
 #include "UtilGPU.cuh"
 #include <stdio.h>
-#include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
 
 __global__ void pyrDown(float4* in_data,int in_rows,int in_cols,float4* out_data,int out_rows,int out_cols)
 {
@@ -137,11 +137,12 @@ bool operate<T>::warpPerspectiveCaller(int in_rows,int in_cols,T* in_data,
         dim3 grid(divUp(out_cols, threads.x), divUp(out_rows, threads.y));
 //        dim3 grid(20,20);
 
-    pi::timer.enter("warpPerspectiveKernel");
-    warpPerspectiveKernel<T><<<grid,threads>>>(in_rows,in_cols,in_dataGPU,
-                                               out_rows,out_cols,out_dataGPU,
-                                               invGPU,defVar);
-    pi::timer.leave("warpPerspectiveKernel");
+    {
+        PI_PROFILE_SCOPE("warpPerspectiveKernel");
+        warpPerspectiveKernel<T><<<grid,threads>>>(in_rows,in_cols,in_dataGPU,
+                                                   out_rows,out_cols,out_dataGPU,
+                                                   invGPU,defVar);
+    }
 
     cudaMemcpy(out_data,out_dataGPU,out_cols*out_rows*sizeof(T),cudaMemcpyDeviceToHost);
     cudaFree(in_dataGPU);cudaFree(out_dataGPU);cudaFree(invGPU);
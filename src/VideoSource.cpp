@@ -0,0 +1,248 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "VideoSource.h"
+
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <base/Svar/Svar.h>
+#include <base/time/Profiler.h>
+#include <base/system/thread/ThreadBase.h>
+
+#include "MissionIndex.h"
+#include "MissionPack.h"
+
+using namespace std;
+
+#if CV_MAJOR_VERSION>=3
+static const int s_propPosMsec=cv::CAP_PROP_POS_MSEC;
+static const int s_propFps    =cv::CAP_PROP_FPS;
+#else
+static const int s_propPosMsec=CV_CAP_PROP_POS_MSEC;
+static const int s_propFps    =CV_CAP_PROP_FPS;
+#endif
+
+class VideoSource::Worker:public pi::Thread
+{
+public:
+    Worker(VideoSource* source):_source(source){}
+    virtual void run(){_source->workerLoop();}
+
+private:
+    VideoSource* _source;
+};
+
+VideoSource::VideoSource(const std::string& datapath)
+    :_datapath(datapath),_startTime(0),
+     _maxGap(svar.GetDouble("VideoSource.MaxGap",2)),
+     _maxOverlap(svar.GetDouble("VideoSource.MaxOverlap",0.8)),
+     _minDistance(svar.GetDouble("VideoSource.MinDistance",0)),
+     _hasLast(false),_worker(NULL),_grabbed(0),_selected(0),
+     _frames(max(svar.GetInt("VideoSource.ReadAhead",4),1),
+             pi::BlockingQueue<std::pair<cv::Mat,pi::SE3d> >::Block)
+{
+}
+
+VideoSource::~VideoSource()
+{
+    close();
+}
+
+std::string VideoSource::videoFile(const std::string& datapath)
+{
+    string file=svar.GetString("VideoSource.File","");
+    if(file.empty()||file[0]=='/') return file;
+    return datapath+"/"+file;
+}
+
+struct PoseTimeLess
+{
+    bool operator()(const pair<double,pi::SE3d>& a,const pair<double,pi::SE3d>& b)const
+    {
+        return a.first<b.first;
+    }
+};
+
+bool VideoSource::loadPoses()
+{
+    vector<pair<double,pi::SE3d> > poses;
+    ifstream in((_datapath+"/trajectory.txt").c_str());
+    MissionPack pack;
+    if(in.is_open())
+    {
+        string line,name;
+        while(getline(in,line))
+        {
+            MissionIndex::Record record;
+            if(!MissionIndex::parseLine(line,name,record)||record.timestamp<0) continue;
+            poses.push_back(make_pair(record.timestamp,
+                                      pi::SE3d(record.pose[0],record.pose[1],record.pose[2],
+                                               record.pose[3],record.pose[4],record.pose[5],
+                                               record.pose[6])));
+        }
+    }
+    else if(pack.open(_datapath+"/mission.pack"))
+    {
+        const MissionIndex& index=pack.index();
+        for(size_t i=0;i<index.size();i++)
+            poses.push_back(make_pair(index.record(i).timestamp,index.pose(i)));
+    }
+    else
+    {
+        cerr<<"VideoSource::open: Can't open file "<<(_datapath+"/trajectory.txt")<<endl;
+        return false;
+    }
+    if(poses.size()<2)
+    {
+        cerr<<"VideoSource::open: The trajectory needs two timestamped poses at least.\n";
+        return false;
+    }
+
+    stable_sort(poses.begin(),poses.end(),PoseTimeLess());
+    _times.resize(poses.size());
+    _poses.resize(poses.size());
+    for(size_t i=0;i<poses.size();i++)
+    {
+        _times[i]=poses[i].first;
+        _poses[i]=poses[i].second;
+    }
+    return true;
+}
+
+bool VideoSource::open(const PinHoleParameters& camera,const pi::SE3d& plane)
+{
+    close();
+    string file=videoFile(_datapath);
+    if(!loadPoses()) return false;
+    if(!_video.open(file)||!_video.isOpened())
+    {
+        cerr<<"VideoSource::open: Can't open video "<<file<<endl;
+        return false;
+    }
+
+    _camera   =camera;
+    _plane    =plane;
+    _startTime=svar.GetDouble("VideoSource.StartTime",_times.front());
+    _hasLast  =false;
+    _grabbed  =_selected=0;
+    _frames.reset(std::deque<std::pair<cv::Mat,pi::SE3d> >());
+    _worker=new Worker(this);
+    _worker->start();
+    return true;
+}
+
+void VideoSource::close()
+{
+    if(!_worker) return;
+    _frames.close();// the worker gives up at its next push
+    _worker->join();
+    delete _worker;
+    _worker=NULL;
+    _frames.clear();
+    _video.release();
+}
+
+bool VideoSource::poseAt(double time,pi::SE3d& pose)const
+{
+    if(time<_times.front()||time>_times.back()) return false;
+    size_t i=upper_bound(_times.begin(),_times.end(),time)-_times.begin();
+    if(i>=_times.size())
+    {
+        pose=_poses.back();
+        return true;
+    }
+
+    double t0=_times[i-1],t1=_times[i];
+    if(t1-t0>_maxGap) return false;
+    double a=t1>t0?(time-t0)/(t1-t0):0;
+    const pi::SE3d& p0=_poses[i-1];
+    const pi::SE3d& p1=_poses[i];
+    pi::SO3d delta=p0.get_rotation().inv()*p1.get_rotation();
+    if(delta.w<0) delta=pi::SO3d(-delta.x,-delta.y,-delta.z,-delta.w);// the shortest arc
+    pose=pi::SE3d(p0.get_rotation()*pi::SO3d::exp(delta.ln()*a),
+                  p0.get_translation()*(1-a)+p1.get_translation()*a);
+    return true;
+}
+
+bool VideoSource::select(const pi::SE3d& pose)const
+{
+    bool useOverlap=_maxOverlap<1&&_camera.fx!=0&&_camera.fy!=0;
+    if(!_hasLast||(!useOverlap&&_minDistance<=0)) return true;
+
+    pi::Point3d t0=_lastPose.get_translation();
+    pi::Point3d t1=pose.get_translation();
+    double      travel=sqrt((t1.x-t0.x)*(t1.x-t0.x)+(t1.y-t0.y)*(t1.y-t0.y));
+    if(_minDistance>0&&travel>=_minDistance) return true;
+    if(!useOverlap) return false;
+
+    // the footprint along its shorter side, looking down from the lower camera
+    double depth =min(fabs(t0.z),fabs(t1.z));
+    double extent=depth*min(_camera.w/fabs(_camera.fx),_camera.h/fabs(_camera.fy));
+    return extent<=0||1-travel/extent<=_maxOverlap;
+}
+
+void VideoSource::workerLoop()
+{
+    pi::Profiler::instance().setThreadName("VideoSource::run");
+    double fps=_video.get(s_propFps);
+    for(int index=0;!_frames.closed();index++)
+    {
+        {
+            PI_PROFILE_SCOPE("VideoSource::Grab");
+            if(!_video.grab()) break;
+        }
+        __sync_fetch_and_add(&_grabbed,1);
+
+        // the container time, the frame rate if the backend does not give it
+        double seconds=_video.get(s_propPosMsec)*1e-3;
+        if(seconds<=0&&index>0&&fps>0) seconds=index/fps;
+        double time=_startTime+seconds;
+        if(time>_times.back()) break;
+
+        pi::SE3d pose;
+        if(!poseAt(time,pose)) continue;
+        pi::SE3d planePose=_plane.inverse()*pose;
+        if(!select(planePose)) continue;
+
+        std::pair<cv::Mat,pi::SE3d> frame;
+        {
+            PI_PROFILE_SCOPE("VideoSource::Retrieve");
+            if(!_video.retrieve(frame.first)||frame.first.empty()) continue;
+        }
+        frame.second=pose;
+        _lastPose=planePose;
+        _hasLast =true;
+        __sync_fetch_and_add(&_selected,1);
+        if(!_frames.push(frame)) break;
+    }
+    _frames.close();// next() returns false once the queue is empty
+}
+
+bool VideoSource::next(std::pair<cv::Mat,pi::SE3d>& frame)
+{
+    if(!isOpen()) return false;
+    PI_PROFILE_SCOPE("VideoSource::Wait");
+    return _frames.pop(frame);
+}
@@ -0,0 +1,118 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef VIDEOSOURCE_H
+#define VIDEOSOURCE_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <base/types/SE3.h>
+#include <base/system/thread/BlockingQueue.h>
+
+#include "Map2D.h"
+
+/** Frames of the drone video of a mission, without extracting JPEG files.
+
+    The video VideoSource.File (relative to the datapath unless absolute) is
+    decoded by a worker thread. The time of a frame is VideoSource.StartTime
+    (default the first timestamp of the trajectory) plus its position in the
+    video, its pose is interpolated between the two trajectory frames around
+    that time: the translation linearly and the rotation along the shortest
+    arc. Frames before or after the trajectory, or inside a gap longer than
+    VideoSource.MaxGap seconds, have no pose and are skipped.
+
+    The poses come from the timestamped lines of datapath/trajectory.txt, or
+    from the index of datapath/mission.pack when there is no trajectory.txt.
+
+    A video holds far more frames than the fusion needs, so only the frames
+    whose ground footprint overlaps the last selected one by less than
+    VideoSource.MaxOverlap (default 0.8), or which moved the camera by
+    VideoSource.MinDistance along the plane, are handed to next(). The others
+    are only grabbed, which skips their color conversion and copy:
+
+        VideoSource video(datapath);
+        video.open(camera,plane);
+        std::pair<cv::Mat,pi::SE3d> frame;
+        while(video.next(frame)) map->feed(frame.first,frame.second);
+
+    At most VideoSource.ReadAhead selected frames wait for next(). The time
+    spent is profiled as VideoSource::Grab, VideoSource::Retrieve and
+    VideoSource::Wait.
+*/
+class VideoSource
+{
+public:
+    VideoSource(const std::string& datapath);
+    ~VideoSource();
+
+    /// The video set by VideoSource.File, empty if the mission is read from images
+    static std::string videoFile(const std::string& datapath);
+
+    /// Load the poses, open the video and start the worker, the camera and
+    /// plane give the footprints compared by VideoSource.MaxOverlap
+    bool open(const PinHoleParameters& camera,const pi::SE3d& plane);
+    /// Stop the worker, frames not taken yet are dropped
+    void close();
+    bool isOpen()const{return _worker!=NULL;}
+
+    /// The next selected frame, false at the end of the video or the trajectory
+    bool next(std::pair<cv::Mat,pi::SE3d>& frame);
+
+    /// Video frames decoded and handed to next() so far
+    int  grabbed()const{return _grabbed;}
+    int  selected()const{return _selected;}
+
+private:
+    VideoSource(const VideoSource&);
+    VideoSource& operator=(const VideoSource&);
+
+    class Worker;
+    friend class Worker;
+
+    void workerLoop();
+    bool loadPoses();
+    /// The pose at time interpolated from the trajectory, false if unknown
+    bool poseAt(double time,pi::SE3d& pose)const;
+    /// Whether the frame at pose adds enough to the last selected one
+    bool select(const pi::SE3d& pose)const;
+
+    std::string           _datapath;
+    std::vector<double>   _times;// sorted
+    std::vector<pi::SE3d> _poses;
+    double                _startTime,_maxGap,_maxOverlap,_minDistance;
+    PinHoleParameters     _camera;
+    pi::SE3d              _plane;
+
+    // used by the worker only
+    cv::VideoCapture      _video;
+    pi::SE3d              _lastPose;// plane coordinates of the last selected frame
+    bool                  _hasLast;
+
+    Worker*               _worker;
+    volatile int          _grabbed,_selected;
+    pi::BlockingQueue<std::pair<cv::Mat,pi::SE3d> > _frames;
+};
+
+#endif // VIDEOSOURCE_H
@@ -0,0 +1,439 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#include "WebTileExporter.h"
+
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <set>
+#include <map>
+#include <list>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <base/Svar/Svar.h>
+#include <base/time/Profiler.h>
+#include <base/system/thread/ThreadBase.h>
+#include <base/system/thread/ThreadPool.h>
+#include <base/system/file_path/file_path.h>
+#include <hardware/Gps/utils_GPS.h>
+
+using namespace std;
+
+#define WEB_TILE_PIXELS 256
+
+/// The map tiles recently given by the source, shared by the render threads
+class WebTileExporter::MapTileCache
+{
+public:
+    MapTileCache(MapTileSource& source,size_t capacity)
+        :_source(source),_capacity(std::max<size_t>(capacity,1)){}
+
+    /// An empty Mat if the tile has no content
+    cv::Mat get(int x,int y)
+    {
+        Key key(x,y);
+        {
+            pi::ScopedMutex lock(_mutex);
+            std::map<Key,Iterator>::iterator it=_index.find(key);
+            if(it!=_index.end())
+            {
+                _lru.splice(_lru.begin(),_lru,it->second);
+                return it->second->second;
+            }
+        }
+
+        // two threads may collapse the same tile, the second result is dropped
+        cv::Mat tile;
+        if(!_source.mapTile(x,y,tile)) tile.release();
+
+        pi::ScopedMutex lock(_mutex);
+        if(_index.count(key)) return tile;
+        _lru.push_front(std::make_pair(key,tile));
+        _index[key]=_lru.begin();
+        while(_lru.size()>_capacity)
+        {
+            _index.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+        return tile;
+    }
+
+private:
+    typedef std::pair<int,int> Key;
+    typedef std::list<std::pair<Key,cv::Mat> >::iterator Iterator;
+
+    MapTileSource&                      _source;
+    size_t                              _capacity;
+    std::list<std::pair<Key,cv::Mat> >  _lru;// most recent first
+    std::map<Key,Iterator>              _index;
+    pi::Mutex                           _mutex;
+};
+
+/// Resample the web tiles of the finest zoom from the map tiles
+struct WebTileExporter::RenderTask:public pi::ParallelTask
+{
+    RenderTask(const WebTileExporter& exporter_,MapTileCache& cache_,const std::string& folder_)
+        :exporter(exporter_),cache(cache_),folder(folder_),failed(0),written(0),tooCoarse(0){}
+
+    virtual void run(int i)
+    {
+        cv::Mat bgra;
+        bool    coarse=false;
+        if(!exporter.renderTile(tiles[i],cache,bgra,coarse))
+        {
+            if(coarse) __sync_fetch_and_add(&tooCoarse,1);
+            return;
+        }
+        if(!cv::imwrite(exporter.tileFile(folder,tiles[i]),bgra))
+            __sync_fetch_and_add(&failed,1);
+        else
+            __sync_fetch_and_add(&written,1);
+    }
+
+    const WebTileExporter&   exporter;
+    MapTileCache&            cache;
+    const std::string&       folder;
+    std::vector<WebTile>     tiles;
+    volatile int             failed,written,tooCoarse;
+};
+
+/// Downsample the four tiles of the finer zoom, read back from the folder
+struct WebTileExporter::OverviewTask:public pi::ParallelTask
+{
+    OverviewTask(const WebTileExporter& exporter_,const std::string& folder_)
+        :exporter(exporter_),folder(folder_),failed(0),written(0){}
+
+    virtual void run(int i)
+    {
+        const WebTile& tile=tiles[i];
+        cv::Mat children=cv::Mat::zeros(2*WEB_TILE_PIXELS,2*WEB_TILE_PIXELS,CV_8UC4);
+        bool    content=false;
+        for(int j=0;j<4;j++)
+        {
+            WebTile child={tile.z+1,2*tile.x+(j&1),2*tile.y+(j>>1)};
+            cv::Mat img=cv::imread(exporter.tileFile(folder,child),-1);
+            if(img.empty()||img.type()!=CV_8UC4) continue;
+            img.copyTo(children(cv::Rect((j&1)*WEB_TILE_PIXELS,(j>>1)*WEB_TILE_PIXELS,
+                                         WEB_TILE_PIXELS,WEB_TILE_PIXELS)));
+            content=true;
+        }
+        if(!content) return;
+
+        cv::Mat result;
+        cv::resize(children,result,cv::Size(WEB_TILE_PIXELS,WEB_TILE_PIXELS),0,0,cv::INTER_AREA);
+        if(!cv::imwrite(exporter.tileFile(folder,tile),result))
+            __sync_fetch_and_add(&failed,1);
+        else
+            __sync_fetch_and_add(&written,1);
+    }
+
+    const WebTileExporter&   exporter;
+    const std::string&       folder;
+    std::vector<WebTile>     tiles;
+    volatile int             failed,written;
+};
+
+WebTileExporter::WebTileExporter(MapTileSource& source,const Geometry& geometry)
+    :_source(source),_geometry(geometry),
+      _tms(svar.GetString("Export.Scheme","XYZ")=="TMS")
+{
+    _origin=_geometry.plane*pi::Point3d(0,0,0);
+    _axisX =_geometry.plane*pi::Point3d(1,0,0)-_origin;
+    _axisY =_geometry.plane*pi::Point3d(0,1,0)-_origin;
+
+    // calcLngLatFromDistance is linear in the distance
+    double lng,lat;
+    pi::calcLngLatFromDistance(_geometry.gpsOrigin.x,_geometry.gpsOrigin.y,1,1,lng,lat);
+    _lngUnit=1./(lng-_geometry.gpsOrigin.x);
+    _latUnit=1./(lat-_geometry.gpsOrigin.y);
+}
+
+pi::Point2d WebTileExporter::planeToLngLat(const pi::Point2d& p)const
+{
+    pi::Point3d world=_geometry.plane*pi::Point3d(p.x,p.y,0);
+    return pi::Point2d(_geometry.gpsOrigin.x+world.x/_lngUnit,
+                       _geometry.gpsOrigin.y+world.y/_latUnit);
+}
+
+pi::Point2d WebTileExporter::lngLatToPlane(const pi::Point2d& lngLat)const
+{
+    // world x,y relative to the plane origin, the height is dropped
+    double wx=(lngLat.x-_geometry.gpsOrigin.x)*_lngUnit-_origin.x;
+    double wy=(lngLat.y-_geometry.gpsOrigin.y)*_latUnit-_origin.y;
+    double det=_axisX.x*_axisY.y-_axisY.x*_axisX.y;
+    return pi::Point2d((wx*_axisY.y-wy*_axisY.x)/det,
+                       (wy*_axisX.x-wx*_axisX.y)/det);
+}
+
+pi::Point2d WebTileExporter::lngLatToWeb(const pi::Point2d& lngLat,int z)const
+{
+    double size=WEB_TILE_PIXELS*(double)(1<<z);
+    double lat =lngLat.y*M_PI/180.;
+    return pi::Point2d((lngLat.x+180.)/360.*size,
+                       (1.-log(tan(lat)+1./cos(lat))/M_PI)*0.5*size);
+}
+
+pi::Point2d WebTileExporter::webToLngLat(const pi::Point2d& web,int z)const
+{
+    double size=WEB_TILE_PIXELS*(double)(1<<z);
+    return pi::Point2d(web.x/size*360.-180.,
+                       atan(sinh(M_PI*(1.-2.*web.y/size)))*180./M_PI);
+}
+
+pi::Point2d WebTileExporter::webToMap(const WebTile& tile,double u,double v)const
+{
+    pi::Point2d plane=lngLatToPlane(webToLngLat(pi::Point2d(tile.x*WEB_TILE_PIXELS+u,
+                                                            tile.y*WEB_TILE_PIXELS+v),tile.z));
+    return pi::Point2d((plane.x-_geometry.min.x)/_geometry.lengthPixel,
+                       (plane.y-_geometry.min.y)/_geometry.lengthPixel);
+}
+
+int WebTileExporter::autoMaxZoom()const
+{
+    // meters of a web pixel at zoom 0 on the equator
+    double groundResolution=156543.03392*cos(_geometry.gpsOrigin.y*M_PI/180.);
+    int    z=ceil(log(groundResolution/_geometry.lengthPixel)/log(2.));
+    return std::max(0,std::min(z,22));
+}
+
+std::string WebTileExporter::tileFile(const std::string& folder,const WebTile& tile)const
+{
+    int y=tile.y;
+    if(_tms) y=(1<<tile.z)-1-y;
+    stringstream sst;
+    sst<<folder<<"/"<<tile.z<<"/"<<tile.x<<"/"<<y<<".png";
+    return sst.str();
+}
+
+bool WebTileExporter::renderTile(const WebTile& tile,MapTileCache& cache,cv::Mat& bgra,
+                                 bool& tooCoarse)const
+{
+    tooCoarse=false;
+    PI_PROFILE_SCOPE("WebTileExporter::Render");
+    // the projection is close to a homography over a single web tile
+    cv::Point2f web[4],map[4];
+    double      corners[4][2]={{0,0},{WEB_TILE_PIXELS,0},
+                               {WEB_TILE_PIXELS,WEB_TILE_PIXELS},{0,WEB_TILE_PIXELS}};
+    double      xmin=1e30,ymin=1e30,xmax=-1e30,ymax=-1e30;
+    for(int i=0;i<4;i++)
+    {
+        pi::Point2d pt=webToMap(tile,corners[i][0],corners[i][1]);
+        web[i]=cv::Point2f(corners[i][0],corners[i][1]);
+        map[i]=cv::Point2f(pt.x,pt.y);
+        xmin=std::min(xmin,pt.x);ymin=std::min(ymin,pt.y);
+        xmax=std::max(xmax,pt.x);ymax=std::max(ymax,pt.y);
+    }
+
+    // the map tiles covered, with a pixel more for the interpolation
+    int tileSize=_geometry.tileSize;
+    int x0=floor((xmin-1)/tileSize),y0=floor((ymin-1)/tileSize);
+    int x1=floor((xmax+1)/tileSize),y1=floor((ymax+1)/tileSize);
+    if((x1-x0+1)*(y1-y0+1)>64)
+    {
+        tooCoarse=true;
+        return false;
+    }
+
+    cv::Mat patch=cv::Mat::zeros((y1-y0+1)*tileSize,(x1-x0+1)*tileSize,CV_8UC4);
+    bool    content=false;
+    for(int y=y0;y<=y1;y++)
+        for(int x=x0;x<=x1;x++)
+        {
+            cv::Mat mapTile=cache.get(x,y);
+            if(mapTile.empty()) continue;
+            mapTile.copyTo(patch(cv::Rect((x-x0)*tileSize,(y-y0)*tileSize,tileSize,tileSize)));
+            content=true;
+        }
+    if(!content) return false;
+
+    for(int i=0;i<4;i++)
+    {
+        map[i].x-=x0*tileSize;
+        map[i].y-=y0*tileSize;
+    }
+    cv::Mat H=cv::getPerspectiveTransform(web,map);
+    cv::warpPerspective(patch,bgra,H,cv::Size(WEB_TILE_PIXELS,WEB_TILE_PIXELS),
+                        cv::INTER_LINEAR|cv::WARP_INVERSE_MAP,cv::BORDER_CONSTANT,cv::Scalar::all(0));
+
+    std::vector<cv::Mat> channels;
+    cv::split(bgra,channels);
+    return cv::countNonZero(channels[3])>0;
+}
+
+bool WebTileExporter::writeMetadata(const std::string& folder,const std::vector<pi::Point2i>& tiles,
+                                    int minZoom,int maxZoom)const
+{
+    double west=1e30,south=1e30,east=-1e30,north=-1e30;
+    double tileMeters=_geometry.tileSize*_geometry.lengthPixel;
+    for(size_t i=0;i<tiles.size();i++)
+        for(int j=0;j<4;j++)
+        {
+            pi::Point2d lngLat=planeToLngLat(pi::Point2d(_geometry.min.x+(tiles[i].x+(j&1))*tileMeters,
+                                                         _geometry.min.y+(tiles[i].y+(j>>1))*tileMeters));
+            west =std::min(west,lngLat.x); east =std::max(east,lngLat.x);
+            south=std::min(south,lngLat.y);north=std::max(north,lngLat.y);
+        }
+
+    string        file=folder+"/metadata.json";
+    ofstream      ofs(file.c_str());
+    if(!ofs.is_open())
+    {
+        cerr<<"WebTileExporter::writeMetadata: Can't open file "<<file<<endl;
+        return false;
+    }
+    ofs<<setiosflags(ios::fixed)<<setprecision(9)
+      <<"{\n  \"format\":\"png\",\n  \"tileSize\":"<<WEB_TILE_PIXELS
+     <<",\n  \"scheme\":\""<<(_tms?"tms":"xyz")
+    <<"\",\n  \"minzoom\":"<<minZoom<<",\n  \"maxzoom\":"<<maxZoom
+    <<",\n  \"bounds\":["<<west<<","<<south<<","<<east<<","<<north
+    <<"],\n  \"center\":["<<(west+east)*0.5<<","<<(south+north)*0.5<<","<<maxZoom<<"]\n}\n";
+    return ofs.good();
+}
+
+static bool makeFolder(const std::string& folder)
+{
+    if(mkdir(folder.c_str(),0775)==0||errno==EEXIST) return true;
+    cerr<<"WebTileExporter::exportTiles: Can't create folder "<<folder<<endl;
+    return false;
+}
+
+bool WebTileExporter::exportTiles(const std::string& folder,const std::vector<pi::Point2i>& tiles,
+                                  const std::vector<pi::Point2i>* dirty)
+{
+    PI_PROFILE_SCOPE("WebTileExporter::Export");
+    if(tiles.empty()) return false;
+    if(_geometry.lengthPixel<=0||_geometry.tileSize<=0)
+    {
+        cerr<<"WebTileExporter::exportTiles: Invalid map geometry.\n";
+        return false;
+    }
+
+    int maxZoom=svar.GetInt("Export.MaxZoom",0);
+    if(maxZoom<=0) maxZoom=autoMaxZoom();
+    maxZoom=std::min(maxZoom,22);
+    int minZoom=std::max(0,std::min(svar.GetInt("Export.MinZoom",0),maxZoom));
+
+    // the web tiles of the finest zoom touched by the map tiles
+    const std::vector<pi::Point2i>& changed=dirty?*dirty:tiles;
+    double tileMeters=_geometry.tileSize*_geometry.lengthPixel;
+    std::set<WebTile> level;
+    for(size_t i=0;i<changed.size();i++)
+    {
+        double xmin=1e30,ymin=1e30,xmax=-1e30,ymax=-1e30;
+        for(int j=0;j<4;j++)
+        {
+            pi::Point2d web=lngLatToWeb(planeToLngLat(pi::Point2d(
+                                        _geometry.min.x+(changed[i].x+(j&1))*tileMeters,
+                                        _geometry.min.y+(changed[i].y+(j>>1))*tileMeters)),maxZoom);
+            xmin=std::min(xmin,web.x);ymin=std::min(ymin,web.y);
+            xmax=std::max(xmax,web.x);ymax=std::max(ymax,web.y);
+        }
+        int last=(1<<maxZoom)-1;
+        int x0=std::max(0,(int)floor((xmin-1)/WEB_TILE_PIXELS)),x1=std::min(last,(int)floor((xmax+1)/WEB_TILE_PIXELS));
+        int y0=std::max(0,(int)floor((ymin-1)/WEB_TILE_PIXELS)),y1=std::min(last,(int)floor((ymax+1)/WEB_TILE_PIXELS));
+        for(int y=y0;y<=y1;y++)
+            for(int x=x0;x<=x1;x++)
+            {
+                WebTile tile={maxZoom,x,y};
+                level.insert(tile);
+            }
+    }
+    if(level.empty()) return true;
+
+    int threads=svar.GetInt("Export.Threads",svar.GetInt("Map2D.ApplyThreads",0));
+    pi::ThreadPool pool(threads);
+    MapTileCache   cache(_source,svar.GetInt("Export.CacheTiles",256));
+    if(pi::path_mkdir(folder.c_str())!=0)
+    {
+        cerr<<"WebTileExporter::exportTiles: Can't create folder "<<folder<<endl;
+        return false;
+    }
+
+    int written=0;
+    for(int z=maxZoom;z>=minZoom;z--)
+    {
+        if(z<maxZoom)
+        {
+            std::set<WebTile> parents;
+            for(std::set<WebTile>::iterator it=level.begin();it!=level.end();it++)
+            {
+                WebTile parent={z,it->x>>1,it->y>>1};
+                parents.insert(parent);
+            }
+            level.swap(parents);
+        }
+
+        // the folders are created before the threads write into them
+        stringstream zFolder;
+        zFolder<<folder<<"/"<<z;
+        if(!makeFolder(zFolder.str())) return false;
+        int lastX=-1;
+        for(std::set<WebTile>::iterator it=level.begin();it!=level.end();it++)
+        {
+            if(it->x==lastX) continue;
+            stringstream xFolder;
+            xFolder<<zFolder.str()<<"/"<<it->x;
+            if(!makeFolder(xFolder.str())) return false;
+            lastX=it->x;
+        }
+
+        int failed;
+        if(z==maxZoom)
+        {
+            RenderTask task(*this,cache,folder);
+            task.tiles.assign(level.begin(),level.end());
+            pool.parallelFor(task.tiles.size(),task);
+            failed=task.failed;written+=task.written;
+            if(task.tooCoarse)
+            {
+                cerr<<"WebTileExporter::exportTiles: Zoom "<<z<<" is too coarse for the map, "
+                   <<"raise Export.MaxZoom.\n";
+                return false;
+            }
+        }
+        else
+        {
+            OverviewTask task(*this,folder);
+            task.tiles.assign(level.begin(),level.end());
+            pool.parallelFor(task.tiles.size(),task);
+            failed=task.failed;written+=task.written;
+        }
+        if(failed)
+        {
+            cerr<<"WebTileExporter::exportTiles: Failed to write "<<failed
+               <<" tiles of zoom "<<z<<" to "<<folder<<endl;
+            return false;
+        }
+    }
+
+    PI_PROFILE_COUNT("WebTileExporter::Tiles",written);
+    cout<<"Exported "<<written<<" web tiles of zoom "<<minZoom<<"-"<<maxZoom<<" to "<<folder<<endl;
+    return writeMetadata(folder,tiles,minZoom,maxZoom);
+}
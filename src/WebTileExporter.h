@@ -0,0 +1,116 @@
+/******************************************************************************
+
+  This file is part of Map2DFusion.
+
+  Copyright 2016 (c)  Yong Zhao <zd5945@126.com> http://www.zhaoyong.adv-ci.com
+
+  ----------------------------------------------------------------------------
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+#ifndef WEBTILEEXPORTER_H
+#define WEBTILEEXPORTER_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include <base/types/SE3.h>
+
+/// Gives the map tiles to WebTileExporter, implemented by the backends
+class MapTileSource
+{
+public:
+    virtual ~MapTileSource(){}
+
+    /// The CV_8UC4 BGRA image of the map tile (x,y), alpha 0 where nothing
+    /// was fused. False if the tile has no content. Called from many threads.
+    virtual bool mapTile(int x,int y,cv::Mat& bgra)=0;
+};
+
+/** Exports a fused map as a web mercator tile pyramid: folder/z/x/y.png.
+
+    The finest zoom is the first one at least as sharp as the map, its tiles
+    are resampled from the map tiles. Every coarser zoom down to
+    Export.MinZoom is built by downsampling the four tiles of the finer one.
+    The tiles of a zoom are rendered in parallel on Export.Threads threads.
+
+    When dirty map tiles are given, only the web tiles overlapping them and
+    their parents are rendered again, the others are left as they are.
+
+    Settings: Export.MinZoom(0), Export.MaxZoom(0: auto), Export.Scheme(XYZ or
+    TMS), Export.Threads(Map2D.ApplyThreads), Export.CacheTiles(256).
+*/
+class WebTileExporter
+{
+public:
+    /// How map tiles relate to the earth
+    struct Geometry
+    {
+        pi::SE3d     plane;      // map plane to world, world x is east and y north in meters
+        pi::Point3d  gpsOrigin;  // longitude and latitude of the world origin
+        pi::Point2d  min;        // plane coordinates of the corner of the map tile (0,0)
+        double       lengthPixel;// meters of a map pixel
+        int          tileSize;   // pixels of a map tile
+    };
+
+    WebTileExporter(MapTileSource& source,const Geometry& geometry);
+
+    /// tiles are the map tiles with content, dirty==NULL exports everything
+    bool exportTiles(const std::string& folder,const std::vector<pi::Point2i>& tiles,
+                     const std::vector<pi::Point2i>* dirty=NULL);
+
+    /// Zoom whose resolution first reaches the map resolution
+    int  autoMaxZoom()const;
+
+private:
+    struct WebTile
+    {
+        int z,x,y;
+        bool operator<(const WebTile& r)const
+        {
+            if(z!=r.z) return z<r.z;
+            if(y!=r.y) return y<r.y;
+            return x<r.x;
+        }
+    };
+
+    class MapTileCache;
+    struct RenderTask;
+    struct OverviewTask;
+
+    // plane <-> longitude, latitude <-> global web mercator pixels at zoom z
+    pi::Point2d planeToLngLat(const pi::Point2d& p)const;
+    pi::Point2d lngLatToPlane(const pi::Point2d& lngLat)const;
+    pi::Point2d lngLatToWeb(const pi::Point2d& lngLat,int z)const;
+    pi::Point2d webToLngLat(const pi::Point2d& web,int z)const;
+    /// Map pixel of the pixel (u,v) of a web tile
+    pi::Point2d webToMap(const WebTile& tile,double u,double v)const;
+
+    std::string tileFile(const std::string& folder,const WebTile& tile)const;
+    /// false without content, or with tooCoarse when the tile covers too many map tiles
+    bool        renderTile(const WebTile& tile,MapTileCache& cache,cv::Mat& bgra,
+                           bool& tooCoarse)const;
+    bool        writeMetadata(const std::string& folder,const std::vector<pi::Point2i>& tiles,
+                              int minZoom,int maxZoom)const;
+
+    MapTileSource& _source;
+    Geometry       _geometry;
+    pi::Point3d    _origin,_axisX,_axisY;// plane to world
+    double         _lngUnit,_latUnit;    // meters per degree at the origin
+    bool           _tms;                 // y counted from the south
+};
+
+#endif // WEBTILEEXPORTER_H
@@ -6,9 +6,12 @@
 #include <base/Svar/Svar.h>
 #include <base/Svar/VecParament.h>
 #include <base/time/Global_Timer.h>
+#include <base/time/Profiler.h>
 #include "MainWindow.h"
 
 #include "Map2D.h"
+#include "FrameDecoder.h"
+#include "VideoSource.h"
 
 using namespace std;
 
@@ -57,7 +60,11 @@ public:
         stop();
         while(this->isRunning()) sleep(10);
         if(map.get())
+        {
             map->save(svar.GetString("Map.File2Save","result.png"));
+            if(svar.GetString("Map.TilesFolder","").size())
+                map->exportTiles(svar.GetString("Map.TilesFolder",""),true);
+        }
         map=SPtr<Map2D>();
         mainwindow=SPtr<MainWindow>();
     }
@@ -71,17 +78,23 @@ public:
             std::pair<cv::Mat,pi::SE3d> frame;
             if(obtainFrame(frame))
             {
-                pi::timer.enter("Map2D::feed");
+                PI_PROFILE_SCOPE("Map2D::feed");
                 map->feed(frame.first,frame.second);
                 if(mainwindow.get()&&tictac.Tac()>0.033)
                 {
                     tictac.Tic();
                     mainwindow->update();
                 }
-                pi::timer.leave("Map2D::feed");
             }
         }
             break;
+        case Qt::Key_E:
+        {
+            // refresh the web tiles changed since the last export
+            if(map.get()&&svar.GetString("Map.TilesFolder","").size())
+                map->exportTiles(svar.GetString("Map.TilesFolder",""),true);
+        }
+            break;
         case Qt::Key_P:
         {
             int& pause=svar.GetInt("Pause");
@@ -121,17 +134,11 @@ public:
 
     bool obtainFrame(std::pair<cv::Mat,pi::SE3d>& frame)
     {
-        string line;
-        if(!getline(*in,line)) return false;
-        stringstream ifs(line);
-        string imgfile;
-        ifs>>imgfile;
-        imgfile=datapath+"/rgb/"+imgfile+".jpg";
-        pi::timer.enter("obtainFrame");
-        frame.first=cv::imread(imgfile);
-        pi::timer.leave("obtainFrame");
-        if(frame.first.empty()) return false;
-        ifs>>frame.second;
+        {
+            // only waits when the decoder falls behind
+            PI_PROFILE_SCOPE("obtainFrame");
+            if(video.get()?!video->next(frame):!decoder->next(frame)) return false;
+        }
         if(svar.exist("GPS.Origin"))
         {
             if(!lengthCalculator.get()) lengthCalculator=SPtr<TrajectoryLengthCalculator>(
@@ -150,20 +157,36 @@ public:
             cerr<<"Map2D.DataPath is not seted!\n";
             return -1;
         }
-        svar.ParseFile(datapath+"/config.cfg");
+        FrameDecoder::loadConfig(datapath);
         if(!svar.exist("Plane"));
         {
 //            cerr<<"Plane is not defined!\n";
 //            return -2;
         }
 
-        if(!in.get())
-            in=SPtr<ifstream>(new ifstream((datapath+"/trajectory.txt").c_str()));
+        VecParament vecP=svar.get_var("Camera.Paraments",VecParament());
+        if(vecP.size()!=6)
+        {
+            cerr<<"Invalid camera parameters!\n";
+            return -5;
+        }
+        PinHoleParameters camera(vecP[0],vecP[1],vecP[2],vecP[3],vecP[4],vecP[5]);
+        pi::SE3d          plane=svar.get_var<pi::SE3d>("Plane",pi::SE3d());
 
-        if(!in->is_open())
+        if(VideoSource::videoFile(datapath).size())
         {
-            cerr<<"Can't open file "<<(datapath+"/trajectory.txt")<<endl;
-            return -3;
+            if(!video.get()) video=SPtr<VideoSource>(new VideoSource(datapath));
+            if(!video->isOpen()&&!video->open(camera,plane)) return -3;
+        }
+        else
+        {
+            if(!decoder.get())
+                decoder=SPtr<FrameDecoder>(new FrameDecoder(datapath));
+
+            if(!decoder->isOpen()&&!decoder->open())
+            {
+                return -3;
+            }
         }
         deque<std::pair<cv::Mat,pi::SE3d> > frames;
         for(int i=0,iend=svar.GetInt("PrepareFrameNum",10);i<iend;i++)
@@ -183,15 +206,9 @@ public:
             cerr<<"No map2d created!\n";
             return -5;
         }
-        VecParament vecP=svar.get_var("Camera.Paraments",VecParament());
-        if(vecP.size()!=6)
-        {
-            cerr<<"Invalid camera parameters!\n";
-            return -5;
-        }
-        map->prepare(svar.get_var<pi::SE3d>("Plane",pi::SE3d()),
-                     PinHoleParameters(vecP[0],vecP[1],vecP[2],vecP[3],vecP[4],vecP[5]),
-                    frames);
+        map->prepare(plane,camera,frames);
+        if(decoder.get())
+            decoder->setScaledDecode(camera,plane,map->scaledFrameResolution());
 
         if(mainwindow.get())
         {
@@ -243,7 +260,8 @@ public:
     string        datapath;
     pi::TicTac    tictac;
     SPtr<MainWindow>  mainwindow;
-    SPtr<ifstream>      in;
+    SPtr<FrameDecoder>  decoder;
+    SPtr<VideoSource>   video;
     SPtr<Map2D>       map;
     SPtr<TrajectoryLengthCalculator> lengthCalculator;
 };